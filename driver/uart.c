@@ -14,6 +14,8 @@
 #include "driver/uart.h"
 #include "osapi.h"
 #include "driver/uart_register.h"
+#include "user_interface.h"
+#include "intlevel.h"
 //#include "ssc.h"
 
 
@@ -23,6 +25,24 @@ extern UartDevice    UartDev;
 
 LOCAL void uart0_rx_intr_handler(void *para);
 
+/* UART0 transmit ring. head and tail run freely and wrap at 64k, the ring
+ * index is taken modulo UART_TX_RING_SIZE. Written from task context (and
+ * os_printf in interrupts) with interrupts masked, read by uart_tx_fill. */
+LOCAL uint8 uart_tx_ring[UART_TX_RING_SIZE];
+LOCAL volatile uint16 uart_tx_head = 0, uart_tx_tail = 0;
+LOCAL volatile uint32 uart_tx_drop_count = 0;
+
+#define UART_TX_USED()      ((uint16)(uart_tx_head - uart_tx_tail))
+#define UART_TX_FIFO_MAX    126
+
+/* UART0 receive ring, same scheme. Written by the interrupt handler, read
+ * by the task attached with uart0_rx_attach. */
+LOCAL uint8 uart_rx_ring[UART_RX_RING_SIZE];
+LOCAL volatile uint16 uart_rx_head = 0, uart_rx_tail = 0;
+LOCAL volatile uint8 uart_rx_posted = 0;
+LOCAL uint8 uart_rx_task_prio = UART_RX_NO_TASK;
+LOCAL volatile uint32 uart_rx_drop_count = 0, uart_rx_overruns = 0, uart_rx_frame_errors = 0;
+
 /******************************************************************************
  * FunctionName : uart_config
  * Description  : Internal used function
@@ -67,13 +87,14 @@ uart_config(uint8 uart_no)
   {
     //set rx fifo trigger
     WRITE_PERI_REG(UART_CONF1(uart_no),
-                   ((0x10 & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+                   ((UART_RX_FULL_THRHD & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
                    ((0x10 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
+                   ((UART_TX_EMPTY_THRHD & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S) |
                    UART_RX_FLOW_EN |
                    (0x02 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
                    UART_RX_TOUT_EN);
     SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_TOUT_INT_ENA |
-                      UART_FRM_ERR_INT_ENA);
+                      UART_RXFIFO_OVF_INT_ENA | UART_FRM_ERR_INT_ENA);
   }
   else
   {
@@ -109,6 +130,89 @@ uart_tx_one_char(uint8 uart, uint8 TxChar)
     return OK;
 }
 
+/******************************************************************************
+ * FunctionName : uart_tx_fill
+ * Description  : Internal used function, runs from the interrupt handler
+ *                Move as much of the tx ring into the uart0 tx fifo as it
+ *                can take and keep the fifo empty interrupt enabled while
+ *                anything is left. Call with interrupts masked.
+ * Parameters   : NONE
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void
+uart_tx_fill(void)
+{
+  uint32 fifo_cnt = READ_PERI_REG(UART_STATUS(UART0)) >> UART_TXFIFO_CNT_S & UART_TXFIFO_CNT;
+  uint16 tail = uart_tx_tail, head = uart_tx_head;
+
+  while (fifo_cnt < UART_TX_FIFO_MAX && tail != head)
+  {
+    WRITE_PERI_REG(UART_FIFO(UART0), uart_tx_ring[tail & (UART_TX_RING_SIZE - 1)]);
+    tail++;
+    fifo_cnt++;
+  }
+  uart_tx_tail = tail;
+
+  if (tail == head)
+  {
+    CLEAR_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+  }
+  else
+  {
+    SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+  }
+}
+
+/******************************************************************************
+ * FunctionName : uart_tx_put
+ * Description  : Internal used function
+ *                Queue bytes for uart0 and start the fifo. On a full ring
+ *                the rest is dropped (UART_TX_DROP) or fed to the fifo as
+ *                it drains (UART_TX_BLOCK). Also reached from interrupt
+ *                handlers through os_printf, so it only ever raises the
+ *                interrupt level and puts the caller's back.
+ * Parameters   : const uint8 *buf - bytes to send
+ *                uint16 len - number of bytes
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void ICACHE_FLASH_ATTR
+uart_tx_put(const uint8 *buf, uint16 len)
+{
+  uint16 room, n, i;
+  uint32 ps;
+
+  ps = xt_rsil(15);
+  while (len)
+  {
+    room = UART_TX_RING_SIZE - UART_TX_USED();
+    if (room == 0)
+    {
+#if UART_TX_POLICY == UART_TX_BLOCK
+      // the fifo is drained by polling, the empty interrupt may be masked.
+      // Between polls a task lets interrupts in, a handler stays at its level
+      uart_tx_fill();
+      xt_wsr_ps(ps);
+      ps = xt_rsil(15);
+      continue;
+#else
+      uart_tx_drop_count += len;
+      break;
+#endif
+    }
+
+    n = len < room ? len : room;
+    for (i = 0; i < n; i++)
+    {
+      uart_tx_ring[(uint16)(uart_tx_head + i) & (UART_TX_RING_SIZE - 1)] = buf[i];
+    }
+    uart_tx_head += n;
+    buf += n;
+    len -= n;
+  }
+  uart_tx_fill();
+  xt_wsr_ps(ps);
+}
+
 /******************************************************************************
  * FunctionName : uart1_write_char
  * Description  : Internal used function
@@ -138,15 +242,14 @@ uart0_write_char(char c)
 {
   if (c == '\n')
   {
-    uart_tx_one_char(UART0, '\r');
-    uart_tx_one_char(UART0, '\n');
+    uart_tx_put((const uint8 *)"\r\n", 2);
   }
   else if (c == '\r')
   {
   }
   else
   {
-    uart_tx_one_char(UART0, c);
+    uart_tx_put((uint8 *)&c, 1);
   }
 }
 /******************************************************************************
@@ -159,12 +262,32 @@ uart0_write_char(char c)
 void ICACHE_FLASH_ATTR
 uart0_tx_buffer(uint8 *buf, uint16 len)
 {
-  uint16 i;
+  uart_tx_put(buf, len);
+}
 
-  for (i = 0; i < len; i++)
-  {
-    uart_tx_one_char(UART0, buf[i]);
-  }
+/******************************************************************************
+ * FunctionName : uart0_tx_room
+ * Description  : free space in the uart0 tx ring, that many bytes can be
+ *                written without dropping or waiting
+ * Parameters   : NONE
+ * Returns      : number of free bytes
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart0_tx_room(void)
+{
+  return UART_TX_RING_SIZE - UART_TX_USED();
+}
+
+/******************************************************************************
+ * FunctionName : uart0_tx_dropped
+ * Description  : bytes dropped because the uart0 tx ring was full
+ * Parameters   : NONE
+ * Returns      : dropped byte count since boot
+*******************************************************************************/
+uint32 ICACHE_FLASH_ATTR
+uart0_tx_dropped(void)
+{
+  return uart_tx_drop_count;
 }
 
 /******************************************************************************
@@ -177,104 +300,143 @@ uart0_tx_buffer(uint8 *buf, uint16 len)
 void ICACHE_FLASH_ATTR
 uart0_sendStr(const char *str)
 {
-	while(*str)
-	{
-		uart_tx_one_char(UART0, *str++);
-	}
+	uart_tx_put((const uint8 *)str, os_strlen(str));
+}
+
+/******************************************************************************
+ * FunctionName : uart_rx_drain
+ * Description  : Internal used function, runs from the interrupt handler
+ *                Move everything in the uart0 rx fifo into the rx ring and
+ *                wake the reader task once per batch
+ * Parameters   : NONE
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void
+uart_rx_drain(void)
+{
+  uint32 fifo_cnt = READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S & UART_RXFIFO_CNT;
+  uint16 head = uart_rx_head;
+  uint8 RcvChar;
+
+  while (fifo_cnt--)
+  {
+    RcvChar = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
+    if ((uint16)(head - uart_rx_tail) >= UART_RX_RING_SIZE)
+    {
+      uart_rx_drop_count++;
+      continue;
+    }
+    uart_rx_ring[head & (UART_RX_RING_SIZE - 1)] = RcvChar;
+    head++;
+  }
+
+  if (head != uart_rx_head)
+  {
+    uart_rx_head = head;
+    if (uart_rx_task_prio != UART_RX_NO_TASK && !uart_rx_posted)
+    {
+      uart_rx_posted = 1;
+      system_os_post(uart_rx_task_prio, 0, 0);
+    }
+  }
 }
 
 /******************************************************************************
  * FunctionName : uart0_rx_intr_handler
  * Description  : Internal used function
- *                UART0 interrupt handler, add self handle code inside
+ *                UART0 interrupt handler, refills the tx fifo and empties
+ *                the rx fifo on the full threshold or the rx timeout
  * Parameters   : void *para - point to ETS_UART_INTR_ATTACH's arg
  * Returns      : NONE
 *******************************************************************************/
-//extern void at_recvTask(void);
-
 LOCAL void
 uart0_rx_intr_handler(void *para)
 {
   /* uart0 and uart1 intr combine togther, when interrupt occur, see reg 0x3ff20020, bit2, bit0 represents
     * uart1 and uart0 respectively
     */
-//  RcvMsgBuff *pRxBuff = (RcvMsgBuff *)para;
-  uint8 RcvChar;
-  uint8 uart_no = UART0;//UartDev.buff_uart_no;
-
-//  if (UART_RXFIFO_FULL_INT_ST != (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST))
-//  {
-//    return;
-//  }
-//  if (UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST))
-//  {
-////    at_recvTask();
-//    RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//    system_os_post(at_recvTaskPrio, NULL, RcvChar);
-//    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-//  }
-  if(UART_FRM_ERR_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_FRM_ERR_INT_ST))
+  uint8 uart_no = UART0;
+  uint32 status = READ_PERI_REG(UART_INT_ST(uart_no));
+
+  if (status & UART_TXFIFO_EMPTY_INT_ST)
+  {
+    uart_tx_fill();
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_TXFIFO_EMPTY_INT_CLR);
+  }
+
+  if (status & UART_FRM_ERR_INT_ST)
   {
-    os_printf("FRM_ERR\r\n");
+    uart_rx_frame_errors++;
     WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_FRM_ERR_INT_CLR);
   }
 
-  if(UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST))
+  if (status & UART_RXFIFO_OVF_INT_ST)
   {
-//    os_printf("fifo full\r\n");
-    ETS_UART_INTR_DISABLE();/////////
-
-    //system_os_post(at_recvTaskPrio, 0, 0);
-
-//    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-//    while (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//    {
-////      at_recvTask();
-//      RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//      system_os_post(at_recvTaskPrio, NULL, RcvChar);
-//    }
+    // the fifo filled up before the interrupt got to it, bytes are lost
+    uart_rx_overruns++;
   }
-  else if(UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST))
+
+  if (status & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST | UART_RXFIFO_OVF_INT_ST))
   {
-    ETS_UART_INTR_DISABLE();/////////
-
-    //system_os_post(at_recvTaskPrio, 0, 0);
-
-//    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_TOUT_INT_CLR);
-////    os_printf("rx time over\r\n");
-//    while (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//    {
-////      os_printf("process recv\r\n");
-////      at_recvTask();
-//      RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//      system_os_post(at_recvTaskPrio, NULL, RcvChar);
-//    }
+    uart_rx_drain();
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR | UART_RXFIFO_OVF_INT_CLR);
   }
 
-//  WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-
-//  if (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//  {
-//    RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//    at_recvTask();
-//    *(pRxBuff->pWritePos) = RcvChar;
-
-//    system_os_post(at_recvTaskPrio, NULL, RcvChar);
-
-//    //insert here for get one command line from uart
-//    if (RcvChar == '\r')
-//    {
-//      pRxBuff->BuffState = WRITE_OVER;
-//    }
-//
-//    pRxBuff->pWritePos++;
-//
-//    if (pRxBuff->pWritePos == (pRxBuff->pRcvMsgBuff + RX_BUFF_SIZE))
-//    {
-//      // overflow ...we may need more error handle here.
-//      pRxBuff->pWritePos = pRxBuff->pRcvMsgBuff ;
-//    }
-//  }
+  // uart1 only transmits, drop whatever it raised
+  WRITE_PERI_REG(UART_INT_CLR(UART1), 0xffff);
+}
+
+/******************************************************************************
+ * FunctionName : uart0_rx_attach
+ * Description  : post an event to a task whenever new bytes arrive on uart0,
+ *                once until the task calls uart0_rx_read
+ * Parameters   : uint8 prio - task priority, UART_RX_NO_TASK to stop
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_rx_attach(uint8 prio)
+{
+  uart_rx_task_prio = prio;
+  uart_rx_posted = 0;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_rx_read
+ * Description  : take received bytes out of the uart0 rx ring
+ * Parameters   : uint8 *buf - destination
+ *                uint16 len - size of buf
+ * Returns      : number of bytes copied, 0 when the ring is empty
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart0_rx_read(uint8 *buf, uint16 len)
+{
+  uint16 tail = uart_rx_tail, n = 0;
+
+  // re-arm the notification first, bytes arriving from here on post again
+  uart_rx_posted = 0;
+  while (n < len && tail != uart_rx_head)
+  {
+    buf[n++] = uart_rx_ring[tail & (UART_RX_RING_SIZE - 1)];
+    tail++;
+  }
+  uart_rx_tail = tail;
+  return n;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_rx_errors
+ * Description  : uart0 receive error counters since boot
+ * Parameters   : uint32 *dropped - bytes lost to a full rx ring
+ *                uint32 *overruns - rx fifo overflows
+ *                uint32 *frame_errors - framing errors
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_rx_errors(uint32 *dropped, uint32 *overruns, uint32 *frame_errors)
+{
+  *dropped = uart_rx_drop_count;
+  *overruns = uart_rx_overruns;
+  *frame_errors = uart_rx_frame_errors;
 }
 
 /******************************************************************************
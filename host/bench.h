@@ -0,0 +1,106 @@
+/*
+ * bench.h
+ *
+ * Minimal timing helpers for the host benchmarks.
+ */
+#ifndef HOST_BENCH_H_
+#define HOST_BENCH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifndef BENCH_ITERATIONS
+#define BENCH_ITERATIONS	1000000
+#endif
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Keep the compiler from dropping results that are otherwise unused */
+static inline void bench_use(const void *p)
+{
+	__asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+static inline void bench_report(const char *name, uint64_t ns, uint32_t iterations, uint32_t bytes)
+{
+	double per = (double)ns / iterations;
+
+	if(bytes)
+		printf("%-32s %10.1f ns/op %10.1f MB/s\n", name, per, bytes * 1000.0 / per);
+	else
+		printf("%-32s %10.1f ns/op\n", name, per);
+}
+
+/* Run body iterations times and report ns per iteration */
+#define BENCH(name, iterations, bytes, body) do { \
+		uint32_t bench_i_; \
+		uint64_t bench_t_ = bench_now_ns(); \
+		for(bench_i_ = 0; bench_i_ < (iterations); bench_i_++){ body; } \
+		bench_report((name), bench_now_ns() - bench_t_, (iterations), (bytes)); \
+	} while(0)
+
+/* Rounds of a stable measurement, and the spread that passes as stable */
+#ifndef BENCH_ROUNDS
+#define BENCH_ROUNDS		7
+#endif
+#define BENCH_ATTEMPTS		3
+#define BENCH_SPREAD_PCT	5.0
+
+typedef struct {
+	double round[BENCH_ROUNDS];	// ns/op, sorted once settled
+	double median;
+	double spread;				// middle rounds around the median, in %
+	int attempts;
+} bench_result_t;
+
+static inline int bench_settle(bench_result_t *r)
+{
+	double t;
+	int i, j;
+
+	for(i = 1; i < BENCH_ROUNDS; i++){
+		for(j = i; j > 0 && r->round[j - 1] > r->round[j]; j--){
+			t = r->round[j];
+			r->round[j] = r->round[j - 1];
+			r->round[j - 1] = t;
+		}
+	}
+	r->median = r->round[BENCH_ROUNDS / 2];
+	r->spread = (r->round[BENCH_ROUNDS - 2] - r->round[1]) * 100.0 / r->median;
+	return r->spread <= BENCH_SPREAD_PCT;
+}
+
+/*
+ * Warm up with a tenth of the iterations, then time BENCH_ROUNDS rounds
+ * of at least the iterations and at least BENCH_ROUND_NS each, and keep
+ * the median. The spread leaves out the fastest and the slowest round;
+ * above BENCH_SPREAD_PCT the whole thing is repeated, up to BENCH_ATTEMPTS
+ * times.
+ */
+#define BENCH_ROUND_NS		2000000
+
+#define BENCH_STABLE(result, iterations, body) do { \
+		uint32_t bench_i_, bench_r_, bench_n_; \
+		uint64_t bench_t_; \
+		(result)->attempts = 0; \
+		do { \
+			bench_n_ = (iterations) / 10 + 1; \
+			bench_t_ = bench_now_ns(); \
+			for(bench_i_ = 0; bench_i_ < bench_n_; bench_i_++){ body; } \
+			bench_t_ = (bench_now_ns() - bench_t_) / bench_n_ + 1; \
+			bench_n_ = BENCH_ROUND_NS / bench_t_ > (iterations) ? BENCH_ROUND_NS / bench_t_ : (iterations); \
+			for(bench_r_ = 0; bench_r_ < BENCH_ROUNDS; bench_r_++){ \
+				bench_t_ = bench_now_ns(); \
+				for(bench_i_ = 0; bench_i_ < bench_n_; bench_i_++){ body; } \
+				(result)->round[bench_r_] = (double)(bench_now_ns() - bench_t_) / bench_n_; \
+			} \
+		} while(!bench_settle(result) && ++(result)->attempts < BENCH_ATTEMPTS); \
+	} while(0)
+
+#endif /* HOST_BENCH_H_ */
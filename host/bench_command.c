@@ -0,0 +1,126 @@
+/*
+ * bench_command.c
+ *
+ * Parse-to-actuate time of an MQTT command: the old mqtt_data_cb path
+ * (copy topic and payload to the heap, strcoll against "on"/"off" and the
+ * three topics) against CHANNEL_ByTopic + CHANNEL_Command, which work in
+ * place on the receive buffer.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <locale.h>
+#include "bench.h"
+#include "osapi.h"
+#include "mem.h"
+#include "gpio.h"
+#include "config.h"
+#include "channel.h"
+
+static int oldStatus[CHANNEL_COUNT] = { 3, 3, 3 };
+
+static void old_set_switch(int index, int gpio, int status)
+{
+	if(status != oldStatus[index]){
+		GPIO_OUTPUT_SET(gpio, status);
+		oldStatus[index] = status;
+	}
+}
+
+/* mqtt_data_cb as it was, minus logging */
+static void old_data_cb(const char *topic, uint32_t topic_len, const char *data, uint32_t data_len)
+{
+	char *topic_buf = (char*)os_zalloc(topic_len+1),
+		 *data_buf  = (char*)os_zalloc(data_len+1);
+
+	os_memcpy(topic_buf, topic, topic_len);
+	topic_buf[topic_len] = 0;
+
+	os_memcpy(data_buf, data, data_len);
+	data_buf[data_len] = 0;
+
+	char strData[data_len + 1];
+	os_memcpy(strData, data, data_len);
+	strData[data_len] = '\0';
+
+	int statusCommand = -1;
+
+	if (!strcoll(strData, "on"))
+		statusCommand = 1;
+	else if (!strcoll(strData, "off"))
+		statusCommand = 0;
+
+	if (statusCommand != -1) {
+		if (!strcoll(topic_buf, (char *)config.mqtt_topic_s01))
+			old_set_switch(0, SWITCH01_GPIO, statusCommand);
+		else if (!strcoll(topic_buf, (char *)config.mqtt_topic_s02))
+			old_set_switch(1, SWITCH02_GPIO, statusCommand);
+		else if (!strcoll(topic_buf, (char *)config.mqtt_topic_s03))
+			old_set_switch(2, SWITCH03_GPIO, statusCommand);
+	}
+
+	os_free(topic_buf);
+	os_free(data_buf);
+}
+
+static void new_data_cb(const char *topic, uint32_t topic_len, const char *data, uint32_t data_len)
+{
+	CHANNEL *channel = CHANNEL_ByTopic(topic, topic_len);
+
+	if(channel != NULL)
+		CHANNEL_Command(channel, data, data_len);
+}
+
+static const char *payloads[] = { "on", "off", "{\"state\":\"ON\",\"transition\":2}", "{\"state\":\"OFF\"}" };
+
+int main(void)
+{
+	/* Receive buffer as MQTT hands it over: payloads are not terminated */
+	char rx[128];
+	const char *topic = "/0000ABCD/s03";
+	uint32_t topic_len = strlen(topic);
+	const char *data[4];
+	uint32_t len[4];
+	uint32_t pos = 0;
+	int i;
+
+	for(i = 0; i < 4; i++){
+		len[i] = strlen(payloads[i]);
+		memcpy(rx + pos, payloads[i], len[i]);
+		data[i] = rx + pos;
+		pos += len[i];
+	}
+
+	setlocale(LC_ALL, "");
+
+	os_sprintf((char *)config.mqtt_topic_s01, "/%08X/s01", 0xABCD);
+	os_sprintf((char *)config.mqtt_topic_s02, "/%08X/s02", 0xABCD);
+	os_sprintf((char *)config.mqtt_topic_s03, "/%08X/s03", 0xABCD);
+
+	/* both paths must actually switch the relay */
+	new_data_cb(topic, topic_len, data[2], len[2]);
+	if(!(host_gpio_out & BIT(SWITCH03_GPIO))){
+		printf("new path did not switch on\n");
+		return 1;
+	}
+	new_data_cb(topic, topic_len, data[3], len[3]);
+	old_data_cb(topic, topic_len, data[0], len[0]);
+	if(!(host_gpio_out & BIT(SWITCH03_GPIO))){
+		printf("old path did not switch on\n");
+		return 1;
+	}
+
+	BENCH("old on/off (copy + strcoll)", BENCH_ITERATIONS, 0, {
+		old_data_cb(topic, topic_len, data[0], len[0]);
+		old_data_cb(topic, topic_len, data[1], len[1]);
+	});
+	BENCH("new on/off (in place)", BENCH_ITERATIONS, 0, {
+		new_data_cb(topic, topic_len, data[0], len[0]);
+		new_data_cb(topic, topic_len, data[1], len[1]);
+	});
+	BENCH("new JSON schema (in place)", BENCH_ITERATIONS, 0, {
+		new_data_cb(topic, topic_len, data[2], len[2]);
+		new_data_cb(topic, topic_len, data[3], len[3]);
+	});
+
+	return 0;
+}
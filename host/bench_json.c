@@ -0,0 +1,63 @@
+/*
+ * bench_json.c
+ *
+ * Parse and emit throughput of the allocation free JSON helpers on
+ * typical Home Assistant light and switch payloads.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "bench.h"
+#include "json_lite.h"
+
+static const char *payloads[] = {
+	"{\"state\":\"ON\"}",
+	"{\"state\":\"OFF\",\"transition\":2}",
+	"{\"state\":\"ON\",\"brightness\":180,\"color_temp\":370,\"transition\":0.5}",
+	"{\"state\":\"ON\",\"brightness\":255,\"color\":{\"r\":255,\"g\":128,\"b\":0},\"effect\":\"colorloop\",\"transition\":1.5}",
+};
+
+static const char *names[] = { "switch", "switch+transition", "light", "light+color" };
+
+int main(void)
+{
+	json_tokenizer_t parser;
+	json_token_t tokens[JSON_HA_MAX_TOKENS];
+	json_ha_cmd_t cmd;
+	char out[128];
+	char label[64];
+	unsigned i;
+	int r;
+
+	for(i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++){
+		const char *js = payloads[i];
+		uint16 len = strlen(js);
+
+		/* sanity: what goes in must come back out */
+		if(json_ha_parse(js, len, &cmd) != 0 || json_ha_write(out, sizeof(out), &cmd, js) < 0){
+			printf("%s: failed to parse\n", names[i]);
+			return 1;
+		}
+		printf("%s: %s -> %s\n", names[i], js, out);
+
+		snprintf(label, sizeof(label), "tokenize %s", names[i]);
+		BENCH(label, BENCH_ITERATIONS, len, {
+			json_tok_init(&parser);
+			r = json_tokenize(&parser, js, len, tokens, JSON_HA_MAX_TOKENS);
+			bench_use(&r);
+		});
+
+		snprintf(label, sizeof(label), "parse %s", names[i]);
+		BENCH(label, BENCH_ITERATIONS, len, {
+			r = json_ha_parse(js, len, &cmd);
+			bench_use(&cmd);
+		});
+
+		snprintf(label, sizeof(label), "emit %s", names[i]);
+		BENCH(label, BENCH_ITERATIONS, 0, {
+			r = json_ha_write(out, sizeof(out), &cmd, js);
+			bench_use(out);
+		});
+	}
+
+	return 0;
+}
@@ -0,0 +1,443 @@
+/*
+ * bench_mqtt.c
+ *
+ * Cost of the MQTT codec (mqtt/mqtt_msg.c): the encoders across topic
+ * lengths, payloads from 0 to 16 KB and the three QoS levels, and the
+ * decoders the receive path runs on every packet. fini_message() is
+ * static; PINGREQ and PUBACK are nothing but it, so they stand in for it.
+ *
+ *   bench_mqtt [-f filter] [-c results.csv] [-b baseline.csv] [-t pct]
+ *
+ *   -f  only the cases whose name contains this
+ *   -c  write the results as CSV
+ *   -b  compare with an earlier -c file, exit with 1 if a case that is
+ *       stable in both got slower by more than -t percent (default 10)
+ *
+ * Every encoded message is decoded again before it is timed, so a codec
+ * that is fast but wrong fails here too.
+ *
+ * bench_mqtt5 is the same built for MQTT 5 (PROTOCOL_NAMEv5). It adds the
+ * topic alias rewrite of a state report, with its size on the wire with
+ * and without the alias, and the property iterator on a CONNACK.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+#include "mqtt_msg.h"
+
+#define MQTT_BENCH_ITERATIONS	1000		// at least, see BENCH_STABLE
+#define MQTT_BENCH_BUF			(16 * 1024 + 512)
+#define MQTT_BENCH_BASELINES	512
+#define MQTT_BENCH_NAME			48
+
+static const uint16_t topicLengths[] = { 8, 32, 128 };
+static const uint16_t payloadSizes[] = { 0, 16, 256, 1024, 4096, 16384 };
+
+typedef struct {
+	char name[MQTT_BENCH_NAME];
+	double ns;
+	bool stable;
+} MQTT_BENCH_BASE;
+
+static uint8_t buf[MQTT_BENCH_BUF];
+static char payload[16384];
+static char topic[129];
+static const char *filter = NULL;
+static FILE *csv = NULL;
+static MQTT_BENCH_BASE baseline[MQTT_BENCH_BASELINES];
+static int baselines = 0;
+static double threshold = 10.0;
+static int regressions = 0;
+
+static bool mqtt_bench_wanted(const char *name)
+{
+	return filter == NULL || strstr(name, filter) != NULL;
+}
+
+/* bytes is the message; the decoders only read its headers, no MB/s for them */
+static void mqtt_bench_report(const char *name, const char *op, int topicLen, int payloadLen, int qos,
+		bench_result_t *r, uint32_t bytes, bool encoder)
+{
+	bool stable = r->spread <= BENCH_SPREAD_PCT;
+	int i;
+
+	printf("%-32s %10.1f ns/op %8u B/op", name, r->median, bytes);
+	if(encoder)
+		printf(" %10.1f MB/s", bytes * 1000.0 / r->median);
+	else
+		printf(" %15s", "");
+	printf("  +-%.1f%%%s\n", r->spread, stable ? "" : " unstable");
+
+	if(csv)
+		fprintf(csv, "%s,%s,%d,%d,%d,%.2f,%u,%.2f,%d\n", name, op, topicLen, payloadLen, qos,
+				r->median, bytes, r->spread, stable);
+
+	for(i = 0; i < baselines; i++){
+		if(strcmp(baseline[i].name, name) != 0)
+			continue;
+		if(stable && baseline[i].stable && r->median > baseline[i].ns * (1 + threshold / 100)){
+			printf("  REGRESSION %s: %.1f -> %.1f ns/op (+%.0f%%)\n", name, baseline[i].ns, r->median,
+					(r->median / baseline[i].ns - 1) * 100);
+			regressions++;
+		}
+		break;
+	}
+}
+
+static bool mqtt_bench_load(const char *path)
+{
+	char line[256];
+	FILE *f = fopen(path, "r");
+	int stable;
+
+	if(f == NULL)
+		return FALSE;
+	while(fgets(line, sizeof(line), f) && baselines < MQTT_BENCH_BASELINES){
+		// name,op,topic,payload,qos,ns_op,bytes_op,spread_pct,stable
+		if(sscanf(line, "%47[^,],%*[^,],%*d,%*d,%*d,%lf,%*u,%*f,%d", baseline[baselines].name,
+				&baseline[baselines].ns, &stable) == 3){
+			baseline[baselines].stable = stable;
+			baselines++;
+		}
+	}
+	fclose(f);
+	return TRUE;
+}
+
+/* What was encoded must decode to what went in */
+static bool mqtt_bench_verify(mqtt_message_t *m, int topicLen, int payloadLen, int qos, uint16_t id)
+{
+	uint16_t len;
+	const char *p;
+
+	if(m->length == 0 || mqtt_get_total_length(m->data, m->length) != m->length)
+		return FALSE;
+	len = m->length;
+	p = mqtt_get_publish_topic(m->data, &len);
+	if(p == NULL || len != topicLen || memcmp(p, topic, len) != 0)
+		return FALSE;
+	len = m->length;
+	p = mqtt_get_publish_data(m->data, &len);
+	if(p == NULL || len != payloadLen || memcmp(p, payload, len) != 0)
+		return FALSE;
+	return mqtt_get_qos(m->data) == qos && mqtt_get_id(m->data, m->length) == id;
+}
+
+/* Next string of a CONNECT, FALSE if it is not str */
+static bool mqtt_bench_string(const uint8_t *data, int length, int *pos, const char *str)
+{
+	int len;
+
+	if(*pos + 2 > length)
+		return FALSE;
+	len = (data[*pos] << 8) | data[*pos + 1];
+	*pos += 2;
+	if(*pos + len > length || len != (int)strlen(str) || memcmp(data + *pos, str, len) != 0)
+		return FALSE;
+	*pos += len;
+	return TRUE;
+}
+
+/* A CONNECT must carry the fields of info in the order of the protocol */
+static bool mqtt_bench_verify_connect(mqtt_message_t *m, mqtt_connect_info_t *info)
+{
+	const uint8_t *d = m->data;
+	int pos, flags;
+
+	if(m->length == 0 || mqtt_get_type(m->data) != MQTT_MSG_TYPE_CONNECT ||
+			mqtt_get_total_length(m->data, m->length) != m->length)
+		return FALSE;
+	for(pos = 1; d[pos] & 0x80; pos++)
+		;
+	pos++;
+	pos += 2 + ((d[pos] << 8) | d[pos + 1]);		// protocol name
+	pos++;											// level
+	flags = d[pos++];
+	pos += 2;										// keepalive
+#if defined(PROTOCOL_NAMEv5)
+	if(d[pos++] != 0)								// properties
+		return FALSE;
+#endif
+	if(!mqtt_bench_string(d, m->length, &pos, info->client_id))
+		return FALSE;
+	if(info->will_topic){
+		if(!(flags & 0x04))
+			return FALSE;
+#if defined(PROTOCOL_NAMEv5)
+		if(pos >= m->length || d[pos++] != 0)		// will properties
+			return FALSE;
+#endif
+		if(!mqtt_bench_string(d, m->length, &pos, info->will_topic) ||
+				!mqtt_bench_string(d, m->length, &pos, info->will_message))
+			return FALSE;
+	}
+	if(info->username && ((flags & 0x80) == 0 || !mqtt_bench_string(d, m->length, &pos, info->username)))
+		return FALSE;
+	if(info->password && ((flags & 0x40) == 0 || !mqtt_bench_string(d, m->length, &pos, info->password)))
+		return FALSE;
+	return pos == m->length;
+}
+
+static int mqtt_bench_connect(mqtt_connection_t *conn)
+{
+	mqtt_connect_info_t plain = { "esp8266_00C0FFEE", NULL, NULL, NULL, NULL, 120, 0, 0, 1 };
+	mqtt_connect_info_t full = { "esp8266_00C0FFEE", "homeassistant", "secret-password", "/lwt", "offline", 120, 1, 1, 1 };
+	mqtt_message_t *m;
+	bench_result_t r;
+
+	if(mqtt_bench_wanted("connect")){
+		m = mqtt_msg_connect(conn, &plain);
+		if(!mqtt_bench_verify_connect(m, &plain)){
+			printf("connect: does not decode\n");
+			return 1;
+		}
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			m = mqtt_msg_connect(conn, &plain);
+			bench_use(m);
+		});
+		mqtt_bench_report("connect", "connect", 0, 0, 0, &r, m->length, TRUE);
+	}
+	if(mqtt_bench_wanted("connect lwt+auth")){
+		m = mqtt_msg_connect(conn, &full);
+		if(!mqtt_bench_verify_connect(m, &full)){
+			printf("connect lwt+auth: does not decode\n");
+			return 1;
+		}
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			m = mqtt_msg_connect(conn, &full);
+			bench_use(m);
+		});
+		mqtt_bench_report("connect lwt+auth", "connect", 0, 0, 0, &r, m->length, TRUE);
+	}
+	if(mqtt_bench_wanted("fini pingreq")){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			m = mqtt_msg_pingreq(conn);
+			bench_use(m);
+		});
+		mqtt_bench_report("fini pingreq", "pingreq", 0, 0, 0, &r, m->length, TRUE);
+	}
+	if(mqtt_bench_wanted("fini puback")){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			m = mqtt_msg_puback(conn, 0x1234);
+			bench_use(m);
+		});
+		mqtt_bench_report("fini puback", "puback", 0, 0, 0, &r, m->length, TRUE);
+	}
+	return 0;
+}
+
+static int mqtt_bench_publish(mqtt_connection_t *conn, int topicLen, int payloadLen, int qos)
+{
+	static uint8_t packet[MQTT_BENCH_BUF];
+	char name[MQTT_BENCH_NAME];
+	mqtt_message_t *m;
+	bench_result_t r;
+	uint16_t id, len, plen;
+	const char *p;
+	int total;
+
+	topic[topicLen] = 0;
+	m = mqtt_msg_publish(conn, topic, payload, payloadLen, qos, 0, &id);
+	if(!mqtt_bench_verify(m, topicLen, payloadLen, qos, id)){
+		printf("publish t%d p%d q%d: does not decode\n", topicLen, payloadLen, qos);
+		topic[topicLen] = 'a';
+		return 1;
+	}
+	// decode from a copy, as from the receive buffer
+	memcpy(packet, m->data, m->length);
+	plen = m->length;
+
+	snprintf(name, sizeof(name), "publish t%d p%d q%d", topicLen, payloadLen, qos);
+	if(mqtt_bench_wanted(name)){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			m = mqtt_msg_publish(conn, topic, payload, payloadLen, qos, 0, &id);
+			bench_use(m);
+		});
+		mqtt_bench_report(name, "publish", topicLen, payloadLen, qos, &r, m->length, TRUE);
+	}
+
+	snprintf(name, sizeof(name), "total_length t%d p%d q%d", topicLen, payloadLen, qos);
+	if(mqtt_bench_wanted(name)){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			total = mqtt_get_total_length(packet, plen);
+			bench_use(&total);
+		});
+		mqtt_bench_report(name, "get_total_length", topicLen, payloadLen, qos, &r, plen, FALSE);
+	}
+	snprintf(name, sizeof(name), "publish_topic t%d p%d q%d", topicLen, payloadLen, qos);
+	if(mqtt_bench_wanted(name)){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			len = plen;
+			p = mqtt_get_publish_topic(packet, &len);
+			bench_use(p);
+		});
+		mqtt_bench_report(name, "get_publish_topic", topicLen, payloadLen, qos, &r, plen, FALSE);
+	}
+	snprintf(name, sizeof(name), "publish_data t%d p%d q%d", topicLen, payloadLen, qos);
+	if(mqtt_bench_wanted(name)){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			len = plen;
+			p = mqtt_get_publish_data(packet, &len);
+			bench_use(p);
+		});
+		mqtt_bench_report(name, "get_publish_data", topicLen, payloadLen, qos, &r, plen, FALSE);
+	}
+	snprintf(name, sizeof(name), "get_id t%d p%d q%d", topicLen, payloadLen, qos);
+	if(qos && mqtt_bench_wanted(name)){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			id = mqtt_get_id(packet, plen);
+			bench_use(&id);
+		});
+		mqtt_bench_report(name, "get_id", topicLen, payloadLen, qos, &r, plen, FALSE);
+	}
+	topic[topicLen] = 'a';
+	return 0;
+}
+
+static int mqtt_bench_subscribe(mqtt_connection_t *conn, int topicLen, int qos)
+{
+	char name[MQTT_BENCH_NAME];
+	mqtt_message_t *m;
+	bench_result_t r;
+	uint16_t id;
+
+	snprintf(name, sizeof(name), "subscribe t%d q%d", topicLen, qos);
+	if(!mqtt_bench_wanted(name))
+		return 0;
+	topic[topicLen] = 0;
+	BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+		id = 0;
+		m = mqtt_msg_subscribe(conn, topic, qos, &id);
+		bench_use(m);
+	});
+	topic[topicLen] = 'a';
+	if(m->length == 0){
+		printf("%s: failed\n", name);
+		return 1;
+	}
+	mqtt_bench_report(name, "subscribe", topicLen, 0, qos, &r, m->length, TRUE);
+	return 0;
+}
+
+#if defined(PROTOCOL_NAMEv5)
+static int mqtt_bench_alias(mqtt_connection_t *conn)
+{
+	static const char stateTopic[] = "/00C0FFEE/state";
+	static const char state[] = "{\"seq\":12,\"mask\":1,\"changed\":1}";
+	static uint8_t connack[] = { 0x20, 0x09, 0x00, 0x00, 0x06, 0x22, 0x00, 0x0a, 0x21, 0x00, 0x14 };
+	static uint8_t packet[256];
+	mqtt_property_iter_t iter;
+	mqtt_property_t prop;
+	mqtt_message_t *m;
+	bench_result_t r;
+	uint16_t id, len, alias = 0;
+	const char *p;
+	int n;
+
+	m = mqtt_msg_publish(conn, stateTopic, state, sizeof(state) - 1, 0, 1, &id);
+	memcpy(packet, m->data, m->length);
+	n = mqtt_msg_publish_alias(packet, m->length, sizeof(packet), 1, 0);
+	// an empty topic, alias 1 and the payload as it was
+	len = n;
+	p = mqtt_get_publish_data(packet, &len);
+	if(n > 0 && mqtt_get_properties(packet, n, &iter) >= 0){
+		while(mqtt_property_next(&iter, &prop) > 0){
+			if(prop.id == MQTT_PROP_TOPIC_ALIAS)
+				alias = prop.value;
+		}
+	}
+	if(n < 0 || alias != 1 || p == NULL || len != sizeof(state) - 1 || memcmp(p, state, len) != 0){
+		printf("publish_alias: does not decode\n");
+		return 1;
+	}
+	printf("state report %u B, %d B with a topic alias\n", m->length, n);
+
+	if(mqtt_bench_wanted("publish_alias")){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			memcpy(packet, m->data, m->length);
+			n = mqtt_msg_publish_alias(packet, m->length, sizeof(packet), 1, 0);
+			bench_use(&n);
+		});
+		mqtt_bench_report("publish_alias", "publish_alias", sizeof(stateTopic) - 1, sizeof(state) - 1, 0, &r, n, TRUE);
+	}
+	if(mqtt_bench_wanted("properties connack")){
+		BENCH_STABLE(&r, MQTT_BENCH_ITERATIONS, {
+			n = 0;
+			if(mqtt_get_properties(connack, sizeof(connack), &iter) >= 0){
+				while(mqtt_property_next(&iter, &prop) > 0)
+					n += prop.value;
+			}
+			bench_use(&n);
+		});
+		if(n != 10 + 20){
+			printf("properties connack: does not decode\n");
+			return 1;
+		}
+		mqtt_bench_report("properties connack", "property_next", 0, 0, 0, &r, sizeof(connack), FALSE);
+	}
+	return 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	mqtt_connection_t conn;
+	unsigned t, p;
+	int opt, qos, failed = 0;
+
+	while((opt = getopt(argc, argv, "f:c:b:t:")) != -1){
+		switch(opt){
+		case 'f':
+			filter = optarg;
+			break;
+		case 'c':
+			csv = fopen(optarg, "w");
+			if(csv == NULL){
+				perror(optarg);
+				return 2;
+			}
+			fprintf(csv, "name,op,topic,payload,qos,ns_op,bytes_op,spread_pct,stable\n");
+			break;
+		case 'b':
+			if(!mqtt_bench_load(optarg)){
+				perror(optarg);
+				return 2;
+			}
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-f filter] [-c results.csv] [-b baseline.csv] [-t pct]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	memset(topic, 'a', sizeof(topic) - 1);
+	for(p = 0; p < sizeof(payload); p++)
+		payload[p] = p * 31 + 7;
+	mqtt_msg_init(&conn, buf, sizeof(buf));
+
+	failed += mqtt_bench_connect(&conn);
+#if defined(PROTOCOL_NAMEv5)
+	failed += mqtt_bench_alias(&conn);
+#endif
+	for(t = 0; t < sizeof(topicLengths) / sizeof(topicLengths[0]); t++){
+		for(qos = 0; qos <= 2; qos++)
+			failed += mqtt_bench_subscribe(&conn, topicLengths[t], qos);
+	}
+	for(t = 0; t < sizeof(topicLengths) / sizeof(topicLengths[0]); t++){
+		for(p = 0; p < sizeof(payloadSizes) / sizeof(payloadSizes[0]); p++){
+			for(qos = 0; qos <= 2; qos++)
+				failed += mqtt_bench_publish(&conn, topicLengths[t], payloadSizes[p], qos);
+		}
+	}
+
+	if(csv)
+		fclose(csv);
+	if(regressions)
+		printf("%d regressions over %.0f%%\n", regressions, threshold);
+	return failed || regressions ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * bench_proto.c
+ *
+ * Throughput of the PROTO framing (mqtt/proto.c) on random binary data,
+ * where about one byte in 85 needs escaping, and on JSON text, where only
+ * the closing braces do. The byte at a time versions the word scanning
+ * replaced are kept here as the baseline and as the reference output.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "proto.h"
+#include "ringbuf.h"
+
+#define PROTO_BENCH_ITERATIONS	(BENCH_ITERATIONS / 50)
+#define PROTO_BENCH_SIZE		1024
+#define PROTO_BENCH_CHECKS		20000
+
+static const char *json =
+	"{\"name\":\"Kitchen light\",\"unique_id\":\"esp_1a2b3c_s01\",\"cmd_t\":\"~/s01/set\","
+	"\"stat_t\":\"~/s01/state\",\"schema\":\"json\",\"brightness\":true,\"avty_t\":\"~/status\","
+	"\"dev\":{\"ids\":[\"esp_1a2b3c\"],\"name\":\"esp_1a2b3c\",\"mf\":\"Espressif\",\"mdl\":\"ESP8266\","
+	"\"sw\":\"1.0\"},\"~\":\"home/esp_1a2b3c\",\"state\":\"ON\",\"transition\":2,\"color\":{\"r\":255,"
+	"\"g\":128,\"b\":0},\"effect\":\"colorloop\",\"brightness_scale\":255,\"qos\":1,\"retain\":true}";
+
+/* Byte at a time reference implementations */
+static I16 ref_add(U8 *buf, const U8 *packet, I16 bufSize)
+{
+	U16 i = 2;
+	U16 len = *(U16 *)packet;
+
+	if(bufSize < 1) return -1;
+	*buf++ = 0x7E;
+	bufSize--;
+	while(len--){
+		if(*packet >= 0x7D && *packet <= 0x7F){
+			if(bufSize < 2) return -1;
+			*buf++ = 0x7D;
+			*buf++ = *packet++ ^ 0x20;
+			i += 2;
+			bufSize -= 2;
+		}
+		else {
+			if(bufSize < 1) return -1;
+			*buf++ = *packet++;
+			i++;
+			bufSize--;
+		}
+	}
+	if(bufSize < 1) return -1;
+	*buf++ = 0x7F;
+	return i;
+}
+
+static I16 ref_add_rb(RINGBUF *rb, const U8 *packet, I16 len)
+{
+	U16 i = 2;
+
+	if(RINGBUF_Put(rb, 0x7E) == -1) return -1;
+	while(len--){
+		if(*packet >= 0x7D && *packet <= 0x7F){
+			if(RINGBUF_Put(rb, 0x7D) == -1) return -1;
+			if(RINGBUF_Put(rb, *packet++ ^ 0x20) == -1) return -1;
+			i += 2;
+		}
+		else {
+			if(RINGBUF_Put(rb, *packet++) == -1) return -1;
+			i++;
+		}
+	}
+	if(RINGBUF_Put(rb, 0x7F) == -1) return -1;
+	return i;
+}
+
+static void ref_parse(PROTO_PARSER *parser, U8 *buf, U16 len)
+{
+	while(len--)
+		PROTO_ParseByte(parser, *buf++);
+}
+
+static U16 frames;
+static void on_frame(void)
+{
+	frames++;
+}
+
+/* Payload with the length in front, as PROTO_Add expects it */
+static U16 payload_buf[(PROTO_BENCH_SIZE + 1) / 2];
+static U8 *payload = (U8 *)payload_buf;
+static U8 encoded[PROTO_BENCH_SIZE * 2 + 2], expected[PROTO_BENCH_SIZE * 2 + 2];
+static U8 decoded[PROTO_BENCH_SIZE];
+static U8 ringMem[PROTO_BENCH_SIZE * 2 + 2];
+
+static int fail(const char *what)
+{
+	printf("FAIL: %s\n", what);
+	return 1;
+}
+
+/* Encode and decode random payloads of every shape against the reference */
+static int check(void)
+{
+	PROTO_PARSER parser, refParser;
+	U8 refDecoded[PROTO_BENCH_SIZE];
+	RINGBUF rb;
+	U16 len, j, off, split;
+	I16 n, refN, bufSize;
+	U32 i;
+
+	for(i = 0; i < PROTO_BENCH_CHECKS; i++){
+		len = 2 + rand() % (PROTO_BENCH_SIZE - 2);
+		off = rand() % 4;
+		payload_buf[0] = len;
+		for(j = 2; j < len; j++)
+			payload[j] = (i & 1) ? 0x7C + rand() % 5 : rand();
+
+		// output buffer too small about every fourth time
+		bufSize = (rand() & 3) ? sizeof(encoded) - off : rand() % (len * 2);
+		n = PROTO_Add(encoded + off, payload, bufSize);
+		refN = ref_add(expected, payload, bufSize);
+		if(n != refN || (n > 0 && memcmp(encoded + off, expected, n)))
+			return fail("PROTO_Add differs from the reference");
+		if(n < 0)
+			continue;
+
+		RINGBUF_Init(&rb, ringMem, sizeof(ringMem));
+		for(j = rand() % 64; j; j--){	// move the ring pointers around
+			RINGBUF_Put(&rb, 0);
+			RINGBUF_Get(&rb, decoded);
+		}
+		if(PROTO_AddRb(&rb, payload, len) != n)
+			return fail("PROTO_AddRb length");
+		for(j = 0; j < n; j++){
+			RINGBUF_Get(&rb, decoded);
+			if(decoded[0] != expected[j])
+				return fail("PROTO_AddRb differs from the reference");
+		}
+
+		// decode in two pieces, starting with some noise before the frame
+		memmove(encoded + 3, encoded + off, n);
+		encoded[0] = 0x41; encoded[1] = 0x7D; encoded[2] = 0x42;
+		n += 3;
+		split = rand() % (n + 1);
+		PROTO_Init(&parser, on_frame, decoded, (i & 2) ? sizeof(decoded) : len / 2);
+		PROTO_Init(&refParser, on_frame, refDecoded, (i & 2) ? sizeof(decoded) : len / 2);
+		PROTO_Parse(&parser, encoded, split);
+		PROTO_Parse(&parser, encoded + split, n - split);
+		ref_parse(&refParser, encoded, n);
+		if(parser.dataLen != refParser.dataLen || memcmp(decoded, refDecoded, parser.dataLen))
+			return fail("PROTO_Parse differs from the reference");
+		if((i & 2) && (parser.dataLen != len || memcmp(decoded, payload, len)))
+			return fail("round trip");
+	}
+	printf("%u random frames match the reference\n", PROTO_BENCH_CHECKS);
+	return 0;
+}
+
+static void bench(const char *name, U16 len)
+{
+	PROTO_PARSER parser;
+	RINGBUF rb;
+	char label[64];
+	I16 n = 0;
+
+	payload_buf[0] = len;
+	n = PROTO_Add(encoded, payload, sizeof(encoded));
+	PROTO_Init(&parser, on_frame, decoded, sizeof(decoded));
+
+	snprintf(label, sizeof(label), "add bytewise %s", name);
+	BENCH(label, PROTO_BENCH_ITERATIONS, len, {
+		n = ref_add(encoded, payload, sizeof(encoded));
+		bench_use(encoded);
+	});
+	snprintf(label, sizeof(label), "add %s", name);
+	BENCH(label, PROTO_BENCH_ITERATIONS, len, {
+		n = PROTO_Add(encoded, payload, sizeof(encoded));
+		bench_use(encoded);
+	});
+
+	snprintf(label, sizeof(label), "add ring bytewise %s", name);
+	BENCH(label, PROTO_BENCH_ITERATIONS, len, {
+		RINGBUF_Init(&rb, ringMem, sizeof(ringMem));
+		ref_add_rb(&rb, payload, len);
+		bench_use(ringMem);
+	});
+	snprintf(label, sizeof(label), "add ring %s", name);
+	BENCH(label, PROTO_BENCH_ITERATIONS, len, {
+		RINGBUF_Init(&rb, ringMem, sizeof(ringMem));
+		PROTO_AddRb(&rb, payload, len);
+		bench_use(ringMem);
+	});
+
+	snprintf(label, sizeof(label), "parse bytewise %s", name);
+	BENCH(label, PROTO_BENCH_ITERATIONS, len, {
+		ref_parse(&parser, encoded, n);
+		bench_use(decoded);
+	});
+	snprintf(label, sizeof(label), "parse %s", name);
+	BENCH(label, PROTO_BENCH_ITERATIONS, len, {
+		PROTO_Parse(&parser, encoded, n);
+		bench_use(decoded);
+	});
+}
+
+int main(void)
+{
+	U16 j, len;
+
+	srand(1);
+	if(check())
+		return 1;
+
+	for(j = 2; j < PROTO_BENCH_SIZE; j++)
+		payload[j] = rand();
+	bench("binary", PROTO_BENCH_SIZE);
+
+	len = strlen(json);
+	memcpy(payload + 2, json, len);
+	bench("json", len + 2);
+
+	return 0;
+}
@@ -0,0 +1,533 @@
+/*
+ * bench_replay.c
+ *
+ * Replays captured TCP segments (capture.h) into the MQTT client's
+ * receive path, mqtt_tcpclient_recv as registered with espconn, and
+ * measures what broker side bursts cost it and what they lose.
+ *
+ *   bench_replay [-n passes] [capture ...]
+ *   bench_replay -g retained|coalesced|large -o capture
+ *
+ * Without captures it replays the built in scenarios:
+ *
+ *   retained   a flood of retained discovery configs after SUBSCRIBE,
+ *              packets split across full sized segments
+ *   coalesced  many small commands, up to 40 whole packets a segment,
+ *              with the odd PUBACK and PINGRESP among them
+ *   large      a PUBLISH longer than MQTT_BUF_SIZE
+ *
+ * -g writes one of them to a file instead; the simulator records real
+ * ones with sim -r.
+ *
+ * Each capture is first replayed once to check the delivered messages
+ * against the PUBLISHes found by reassembling the stream: delivered
+ * intact, dropped, or delivered garbled. Then it is replayed -n times
+ * (5) for the time mqtt_tcpclient_recv takes per segment and the time
+ * the MQTT task then takes to answer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bench.h"
+#include "capture.h"
+#include "c_types.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "mqtt.h"
+#include "mqtt_msg.h"
+
+#define REPLAY_PASSES		5
+#define REPLAY_WINDOW		64		// expected messages searched for a delivered one
+#define REPLAY_BUSY_US		10000	// window for the busiest stretch of a capture
+#define REPLAY_MSS			1460
+#define REPLAY_GEN_MAX		(512 * 1024)
+
+typedef struct {
+	const uint8_t *topic;
+	const uint8_t *data;
+	uint16_t topicLen;
+	uint16_t dataLen;
+} REPLAY_MESSAGE;
+
+typedef struct {
+	const uint8_t *base;
+	size_t size;
+	uint32_t records;
+	uint32_t segments;
+	uint32_t connections;
+	uint32_t packets;		// in the reassembled stream
+	uint32_t bytes;
+	uint32_t durationUs;
+	uint32_t busySegments;	// most segments within REPLAY_BUSY_US
+	REPLAY_MESSAGE *expected;
+	uint32_t publishes;
+	uint8_t *stream;		// reassembled, the expected messages point into it
+} REPLAY_CAPTURE;
+
+static MQTT_Client client;
+static os_task_t mqttTask;
+static BOOL posted = FALSE, sentPending = FALSE;
+static uint32_t now = 0;
+static espconn_connect_callback connectCb, disconCb;
+static espconn_recv_callback recvCb;
+static espconn_sent_callback sentCb;
+
+/* Delivery bookkeeping of the checking pass */
+static REPLAY_CAPTURE *checking = NULL;
+static uint32_t nextExpected, delivered, intact, garbled, dropped;
+
+/* SDK stubs */
+uint32 system_get_time(void) { return now += 1000; }
+uint32 system_get_chip_id(void) { return 0x00ABCDEF; }
+uint32 system_get_free_heap_size(void) { return 40000; }
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen) { mqttTask = task; return true; }
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par) { posted = TRUE; return true; }
+void os_timer_disarm(ETSTimer *timer) {}
+void os_timer_setfn(ETSTimer *timer, ETSTimerFunc *fn, void *arg) {}
+void os_timer_arm(ETSTimer *timer, uint32_t ms, bool repeat) {}
+
+sint8 espconn_connect(struct espconn *c) { return 0; }
+sint8 espconn_disconnect(struct espconn *c) { return 0; }
+sint8 espconn_delete(struct espconn *c) { return 0; }
+sint8 espconn_sent(struct espconn *c, uint8 *data, uint16 len) { sentPending = TRUE; return 0; }
+uint32 espconn_port(void) { return 1024; }
+sint8 espconn_regist_connectcb(struct espconn *c, espconn_connect_callback cb) { connectCb = cb; return 0; }
+sint8 espconn_regist_reconcb(struct espconn *c, espconn_reconnect_callback cb) { return 0; }
+sint8 espconn_regist_disconcb(struct espconn *c, espconn_connect_callback cb) { disconCb = cb; return 0; }
+sint8 espconn_regist_recvcb(struct espconn *c, espconn_recv_callback cb) { recvCb = cb; return 0; }
+sint8 espconn_regist_sentcb(struct espconn *c, espconn_sent_callback cb) { sentCb = cb; return 0; }
+sint8 espconn_gethostbyname(struct espconn *c, const char *name, ip_addr_t *addr, dns_found_callback found) { return 0; }
+sint8 espconn_secure_connect(struct espconn *c) { return 0; }
+sint8 espconn_secure_disconnect(struct espconn *c) { return 0; }
+sint8 espconn_secure_sent(struct espconn *c, uint8 *data, uint16 len) { return 0; }
+
+/* Run the MQTT task and complete sends until nothing is left to do */
+static void run(void)
+{
+	os_event_t e = { 0, (os_param_t)&client };
+
+	while(posted || sentPending){
+		posted = FALSE;
+		mqttTask(&e);
+		if(sentPending){
+			sentPending = FALSE;
+			sentCb(client.pCon);
+		}
+	}
+}
+
+static bool replay_same(const REPLAY_MESSAGE *m, const char *topic, uint32_t topicLen, const char *data, uint32_t len)
+{
+	return m->topicLen == topicLen && m->dataLen == len && memcmp(m->topic, topic, topicLen) == 0 &&
+			(len == 0 || memcmp(m->data, data, len) == 0);
+}
+
+static void on_data(uint32_t *args, const char *topic, uint32_t topicLen, const char *data, uint32_t len)
+{
+	uint32_t i, end;
+
+	delivered++;
+	if(checking == NULL)
+		return;
+	// the next expected one, or a later one if some were lost on the way
+	end = nextExpected + REPLAY_WINDOW < checking->publishes ? nextExpected + REPLAY_WINDOW : checking->publishes;
+	for(i = nextExpected; i < end; i++){
+		if(topic && data && replay_same(&checking->expected[i], topic, topicLen, data, len)){
+			dropped += i - nextExpected;
+			nextExpected = i + 1;
+			intact++;
+			return;
+		}
+	}
+	garbled++;
+}
+
+/* Walk the records, FALSE if the file is cut short or not a capture */
+static bool replay_index(REPLAY_CAPTURE *cap)
+{
+	const CAPTURE_HEADER *h = (const CAPTURE_HEADER *)cap->base;
+	const CAPTURE_RECORD *r;
+	size_t off = sizeof(*h);
+	uint32_t windowStart = 0, streamLen = 0, connStart = 0, total, i;
+	const CAPTURE_RECORD **segs;
+	uint8_t *p;
+
+	if(cap->size < sizeof(*h) || h->magic != CAPTURE_MAGIC || h->version != CAPTURE_VERSION)
+		return FALSE;
+	segs = malloc(sizeof(*segs) * (cap->size / sizeof(*r) + 1));
+	cap->stream = malloc(cap->size);
+	cap->expected = malloc(sizeof(REPLAY_MESSAGE) * (cap->size / 4 + 1));
+	if(segs == NULL || cap->stream == NULL || cap->expected == NULL)
+		return FALSE;
+
+	while(off + sizeof(*r) <= cap->size){
+		r = (const CAPTURE_RECORD *)(cap->base + off);
+		if(off + sizeof(*r) + r->len > cap->size)
+			break;
+		off += sizeof(*r) + r->len;
+		cap->records++;
+		cap->durationUs = r->us;
+
+		if(r->type == CAPTURE_OPEN){
+			cap->connections++;
+			// packets don't continue into a new connection
+			connStart = streamLen;
+			continue;
+		}
+		segs[cap->segments++] = r;
+		cap->bytes += r->len;
+		memcpy(cap->stream + streamLen, r + 1, r->len);
+		streamLen += r->len;
+
+		// split the reassembled stream of this connection into packets
+		p = cap->stream + connStart;
+		while(streamLen - connStart >= 2){
+			for(i = 1; i < streamLen - connStart && i < 5 && (p[i] & 0x80); i++)
+				;
+			if(i >= streamLen - connStart)
+				break;
+			total = mqtt_get_total_length(p, streamLen - connStart);
+			if(total > streamLen - connStart)
+				break;
+			cap->packets++;
+			if(mqtt_get_type(p) == MQTT_MSG_TYPE_PUBLISH){
+				REPLAY_MESSAGE *m = &cap->expected[cap->publishes++];
+				uint16_t len = total;
+
+				m->topic = (const uint8_t *)mqtt_get_publish_topic(p, &len);
+				m->topicLen = m->topic ? len : 0;
+				len = total;
+				m->data = (const uint8_t *)mqtt_get_publish_data(p, &len);
+				m->dataLen = m->data ? len : 0;
+			}
+			p += total;
+			connStart += total;
+		}
+
+		// the most segments that arrived within REPLAY_BUSY_US
+		while(segs[windowStart]->us + REPLAY_BUSY_US < r->us)
+			windowStart++;
+		if(cap->segments - windowStart > cap->busySegments)
+			cap->busySegments = cap->segments - windowStart;
+	}
+	free(segs);
+	return off == cap->size;
+}
+
+static int replay_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* One pass over the capture; per segment times go to recvNs and taskNs */
+static uint64_t replay_pass(REPLAY_CAPTURE *cap, uint32_t *recvNs, uint32_t *taskNs)
+{
+	const CAPTURE_RECORD *r;
+	size_t off = sizeof(CAPTURE_HEADER);
+	uint64_t t, total = 0;
+	uint32_t seg = 0;
+	bool open = FALSE;
+
+	while(off + sizeof(*r) <= cap->size){
+		r = (const CAPTURE_RECORD *)(cap->base + off);
+		off += sizeof(*r) + r->len;
+
+		if(r->type == CAPTURE_OPEN){
+			if(open){
+				disconCb(client.pCon);
+				run();
+			}
+			MQTT_Connect(&client);
+			connectCb(client.pCon);
+			run();
+			open = TRUE;
+			continue;
+		}
+		if(!open)
+			continue;		// data before the first connect
+
+		t = bench_now_ns();
+		recvCb(client.pCon, (char *)(r + 1), r->len);
+		t = bench_now_ns() - t;
+		total += t;
+		if(recvNs)
+			recvNs[seg] = t;
+
+		t = bench_now_ns();
+		run();
+		t = bench_now_ns() - t;
+		if(taskNs)
+			taskNs[seg] = t;
+		seg++;
+	}
+	if(open){
+		disconCb(client.pCon);
+		run();
+	}
+	return total;
+}
+
+static void replay_percentiles(const char *what, uint32_t *ns, uint32_t n)
+{
+	qsort(ns, n, sizeof(*ns), replay_compare);
+	printf("  %-6s per segment  p50 %8u ns  p90 %8u ns  p99 %8u ns  max %8u ns\n", what,
+			ns[n / 2], ns[n * 9 / 10], ns[n * 99 / 100], ns[n - 1]);
+}
+
+static int replay(const char *name, const uint8_t *base, size_t size, int passes)
+{
+	REPLAY_CAPTURE cap;
+	MQTT_STATS before, after;
+	uint32_t *recvNs, *taskNs;
+	uint64_t *totals;
+	int i;
+
+	memset(&cap, 0, sizeof(cap));
+	cap.base = base;
+	cap.size = size;
+	if(!replay_index(&cap)){
+		printf("%s: not a capture, or cut short\n", name);
+		return 1;
+	}
+	printf("%s: %u connections, %u segments, %u bytes, %u packets (%u PUBLISH) in %.1f ms, busiest %u ms: %u segments\n",
+			name, cap.connections, cap.segments, cap.bytes, cap.packets, cap.publishes,
+			cap.durationUs / 1000.0, REPLAY_BUSY_US / 1000, cap.busySegments);
+	if(cap.segments == 0)
+		return 0;
+
+	// checking pass
+	checking = &cap;
+	nextExpected = delivered = intact = garbled = dropped = 0;
+	MQTT_GetStats(&client, &before);
+	replay_pass(&cap, NULL, NULL);
+	MQTT_GetStats(&client, &after);
+	dropped += cap.publishes - nextExpected;
+	checking = NULL;
+	printf("  delivered %u of %u intact, %u dropped, %u garbled; too long %u, coalesced %u, queue drops %u\n",
+			intact, cap.publishes, dropped, garbled, after.recvTooLong - before.recvTooLong,
+			after.recvCoalesced - before.recvCoalesced, after.queueDrops - before.queueDrops);
+
+	recvNs = malloc(sizeof(uint32_t) * cap.segments * passes);
+	taskNs = malloc(sizeof(uint32_t) * cap.segments * passes);
+	totals = malloc(sizeof(uint64_t) * passes);
+	if(recvNs == NULL || taskNs == NULL || totals == NULL)
+		return 1;
+	for(i = 0; i < passes; i++)
+		totals[i] = replay_pass(&cap, recvNs + i * cap.segments, taskNs + i * cap.segments);
+	for(i = 1; i < passes; i++){
+		// median pass, insertion sort is plenty
+		uint64_t t = totals[i];
+		int j;
+
+		for(j = i; j > 0 && totals[j - 1] > t; j--)
+			totals[j] = totals[j - 1];
+		totals[j] = t;
+	}
+	replay_percentiles("recv", recvNs, cap.segments * passes);
+	replay_percentiles("task", taskNs, cap.segments * passes);
+	printf("  recv   per pass %10.1f us  %8.1f MB/s  (median of %d)\n", totals[passes / 2] / 1000.0,
+			cap.bytes * 1000.0 / totals[passes / 2], passes);
+
+	free(recvNs);
+	free(taskNs);
+	free(totals);
+	free(cap.stream);
+	free(cap.expected);
+	return 0;
+}
+
+/* Generators */
+typedef struct {
+	uint8_t *buf;
+	size_t len;
+	uint32_t us;
+	uint8_t stream[REPLAY_GEN_MAX];	// packets before they are cut into segments
+	size_t streamLen;
+} REPLAY_GEN;
+
+static void gen_record(REPLAY_GEN *g, uint8_t type, const void *data, uint16_t len)
+{
+	CAPTURE_RECORD r = { g->us, len, type, 0 };
+
+	memcpy(g->buf + g->len, &r, sizeof(r));
+	memcpy(g->buf + g->len + sizeof(r), data, len);
+	g->len += sizeof(r) + len;
+}
+
+static void gen_packet(REPLAY_GEN *g, mqtt_message_t *m)
+{
+	memcpy(g->stream + g->streamLen, m->data, m->length);
+	g->streamLen += m->length;
+}
+
+/* Cut what was queued into segments of at most mss, usGap apart */
+static void gen_flush(REPLAY_GEN *g, uint16_t mss, uint32_t usGap)
+{
+	size_t off = 0, n;
+
+	while(off < g->streamLen){
+		n = g->streamLen - off < mss ? g->streamLen - off : mss;
+		gen_record(g, CAPTURE_DATA, g->stream + off, n);
+		off += n;
+		g->us += usGap;
+	}
+	g->streamLen = 0;
+}
+
+static size_t gen_scenario(const char *scenario, uint8_t *out)
+{
+	static REPLAY_GEN g;
+	static const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+	static const uint8_t suback[] = { 0x90, 0x03, 0x00, 0x01, 0x00 };
+	static const uint8_t puback[] = { 0x40, 0x02, 0x00, 0x07 };
+	static const uint8_t pingresp[] = { 0xD0, 0x00 };
+	static const char *commands[] = { "{\"state\":\"ON\"}", "{\"state\":\"OFF\"}", "on", "off",
+			"{\"state\":\"ON\",\"brightness\":180,\"transition\":2}" };
+	mqtt_connection_t conn;
+	uint8_t buf[2048];
+	char topic[64], payload[1600];
+	uint16_t id;
+	int i, n, len;
+
+	memset(&g, 0, sizeof(g));
+	g.buf = out;
+	memcpy(g.buf, &(CAPTURE_HEADER){ CAPTURE_MAGIC, CAPTURE_VERSION, 0 }, sizeof(CAPTURE_HEADER));
+	g.len = sizeof(CAPTURE_HEADER);
+	mqtt_msg_init(&conn, buf, sizeof(buf));
+
+	gen_record(&g, CAPTURE_OPEN, NULL, 0);
+	g.us += 2000;
+	gen_record(&g, CAPTURE_DATA, connack, sizeof(connack));
+	g.us += 5000;
+
+	if(strcmp(scenario, "retained") == 0){
+		// SUBSCRIBE to homeassistant/#: every retained config at once
+		gen_record(&g, CAPTURE_DATA, suback, sizeof(suback));
+		g.us += 300;
+		for(i = 0; i < 200; i++){
+			sprintf(topic, "homeassistant/light/esp_%06X_s%02d/config", 0x1A2B00 + i / 3, i % 3 + 1);
+			len = sprintf(payload, "{\"name\":\"Light %d\",\"unique_id\":\"esp_%06X_s%02d\",\"cmd_t\":\"~/s%02d/set\","
+					"\"stat_t\":\"~/s%02d/state\",\"schema\":\"json\",\"brightness\":true,\"avty_t\":\"~/status\","
+					"\"dev\":{\"ids\":[\"esp_%06X\"],\"name\":\"esp_%06X\",\"mf\":\"Espressif\",\"mdl\":\"ESP8266\"},"
+					"\"~\":\"home/esp_%06X\"}", i, 0x1A2B00 + i / 3, i % 3 + 1, i % 3 + 1, i % 3 + 1,
+					0x1A2B00 + i / 3, 0x1A2B00 + i / 3, 0x1A2B00 + i / 3);
+			gen_packet(&g, mqtt_msg_publish(&conn, topic, payload, len, 0, 1, &id));
+		}
+		gen_flush(&g, REPLAY_MSS, 120);
+	}
+	else if(strcmp(scenario, "coalesced") == 0){
+		// commands queued at the broker while the link was slow, then sent together
+		for(i = 0; i < 500; ){
+			n = 1 + (i * 7) % 40;
+			while(n-- && i < 500){
+				sprintf(topic, "led%d", i % 3 + 1);
+				gen_packet(&g, mqtt_msg_publish(&conn, topic, commands[i % 5], strlen(commands[i % 5]), i % 4 == 3, 0, &id));
+				i++;
+				if(i % 97 == 0){
+					memcpy(g.stream + g.streamLen, i % 2 ? puback : pingresp, i % 2 ? sizeof(puback) : sizeof(pingresp));
+					g.streamLen += i % 2 ? sizeof(puback) : sizeof(pingresp);
+				}
+			}
+			gen_flush(&g, REPLAY_MSS, 50);
+			g.us += 1000;
+		}
+	}
+	else if(strcmp(scenario, "large") == 0){
+		memset(payload, 'x', 1500);
+		gen_packet(&g, mqtt_msg_publish(&conn, "led1", payload, 1500, 0, 0, &id));
+		gen_flush(&g, REPLAY_MSS, 100);
+		gen_packet(&g, mqtt_msg_publish(&conn, "led1", "on", 2, 0, 0, &id));
+		gen_flush(&g, REPLAY_MSS, 100);
+	}
+	else
+		return 0;
+	return g.len;
+}
+
+static int replay_file(const char *path, int passes)
+{
+	struct stat st;
+	void *base;
+	int fd, r;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0){
+		perror(path);
+		return 1;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED){
+		perror(path);
+		return 1;
+	}
+	r = replay(path, base, st.st_size, passes);
+	munmap(base, st.st_size);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *scenarios[] = { "retained", "coalesced", "large" };
+	static uint8_t gen[REPLAY_GEN_MAX * 2];
+	const char *generate = NULL, *output = NULL;
+	int opt, passes = REPLAY_PASSES, failed = 0;
+	unsigned i;
+	size_t len;
+	FILE *f;
+
+	while((opt = getopt(argc, argv, "n:g:o:")) != -1){
+		switch(opt){
+		case 'n':
+			passes = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 'g':
+			generate = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n passes] [capture ...]\n       %s -g retained|coalesced|large -o capture\n", argv[0], argv[0]);
+			return 2;
+		}
+	}
+
+	if(generate){
+		len = gen_scenario(generate, gen);
+		if(len == 0 || output == NULL){
+			fprintf(stderr, "%s: unknown scenario or no -o\n", generate);
+			return 2;
+		}
+		f = fopen(output, "wb");
+		if(f == NULL || fwrite(gen, len, 1, f) != 1){
+			perror(output);
+			return 1;
+		}
+		fclose(f);
+		return 0;
+	}
+
+	MQTT_InitConnection(&client, (uint8_t *)"192.168.1.10", 1883, 0);
+	MQTT_InitClient(&client, (uint8_t *)"device", (uint8_t *)"user", (uint8_t *)"pass", 120, 1);
+	MQTT_OnData(&client, on_data);
+	run();
+
+	if(optind < argc){
+		for(; optind < argc; optind++)
+			failed += replay_file(argv[optind], passes);
+	}
+	else {
+		for(i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++){
+			len = gen_scenario(scenarios[i], gen);
+			failed += replay(scenarios[i], gen, len, passes);
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * capture.h
+ *
+ * Captures of inbound TCP segments with their timing, recorded by the
+ * simulator (sim -r) or generated by bench_replay, and replayed through
+ * mqtt_tcpclient_recv by bench_replay.
+ *
+ * A file is a CAPTURE_HEADER followed by records, each a CAPTURE_RECORD
+ * and len bytes of segment, packed and little endian like the hosts
+ * this runs on. A connection starts with a CAPTURE_OPEN record, the
+ * segments received on it follow as CAPTURE_DATA records.
+ */
+#ifndef HOST_CAPTURE_H_
+#define HOST_CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC		0x5043514D	// "MQCP"
+#define CAPTURE_VERSION		1
+
+typedef enum {
+	CAPTURE_OPEN = 1,		// connected, len is 0
+	CAPTURE_DATA			// a segment as recv() returned it
+} CAPTURE_TYPE;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+} CAPTURE_HEADER;
+
+typedef struct __attribute__((packed)) {
+	uint32_t us;			// since the capture started
+	uint16_t len;
+	uint8_t type;
+	uint8_t conn;
+} CAPTURE_RECORD;
+
+static inline int capture_begin(FILE *f)
+{
+	CAPTURE_HEADER h = { CAPTURE_MAGIC, CAPTURE_VERSION, 0 };
+
+	return fwrite(&h, sizeof(h), 1, f) == 1 ? 0 : -1;
+}
+
+static inline int capture_write(FILE *f, uint32_t us, uint8_t type, uint8_t conn, const void *data, uint16_t len)
+{
+	CAPTURE_RECORD r = { us, len, type, conn };
+
+	if(fwrite(&r, sizeof(r), 1, f) != 1 || (len && fwrite(data, len, 1, f) != 1))
+		return -1;
+	return 0;
+}
+
+#endif /* HOST_CAPTURE_H_ */
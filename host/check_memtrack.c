@@ -0,0 +1,190 @@
+/*
+ * check_memtrack.c
+ *
+ * Runs the MQTT client through many connect, publish, receive and
+ * disconnect cycles against stubbed espconn calls and checks with the
+ * heap accounting of modules/memtrack.c that nothing grows: after the
+ * final disconnect every tag must be back at its level after init, and
+ * an espconn the SDK holds must stay allocated until its disconnect or
+ * reconnect callback. Cycles end in turn with the broker closing, the
+ * connection reset and the client disconnecting, or connecting again
+ * before the old connection is gone.
+ *
+ * Built with CHECK_ARENA the client runs on an arena instead, and not a
+ * single tracked allocation may happen from init to the last disconnect.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "c_types.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "mqtt.h"
+#include "memtrack.h"
+
+#define CHECK_CYCLES		500
+#define CHECK_PUBLISHES		10
+
+static MQTT_Client client;
+#if CHECK_ARENA
+static uint8_t arena[MQTT_ARENA_SIZE] __attribute__((aligned(4)));
+#endif
+static os_task_t mqttTask;
+static BOOL posted = FALSE, sentPending = FALSE;
+static uint32_t now = 0, connects = 0, closed = 0, deletes = 0, published = 0, received = 0;
+static struct espconn *closing = NULL;
+static espconn_connect_callback connectCb, disconCb;
+static espconn_reconnect_callback reconCb;
+static espconn_recv_callback recvCb;
+static espconn_sent_callback sentCb;
+
+/* SDK stubs */
+uint32 system_get_time(void) { return now += 1000; }
+uint32 system_get_chip_id(void) { return 0x00ABCDEF; }
+uint32 system_get_free_heap_size(void) { return 40000; }
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen) { mqttTask = task; return true; }
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par) { posted = TRUE; return true; }
+void os_timer_disarm(ETSTimer *timer) {}
+void os_timer_setfn(ETSTimer *timer, ETSTimerFunc *fn, void *arg) {}
+void os_timer_arm(ETSTimer *timer, uint32_t ms, bool repeat) {}
+
+sint8 espconn_connect(struct espconn *c) { connects++; return 0; }
+sint8 espconn_disconnect(struct espconn *c) { closing = c; return 0; }
+sint8 espconn_delete(struct espconn *c) { deletes++; return 0; }
+sint8 espconn_sent(struct espconn *c, uint8 *data, uint16 len) { sentPending = TRUE; return 0; }
+uint32 espconn_port(void) { return 1024; }
+sint8 espconn_regist_connectcb(struct espconn *c, espconn_connect_callback cb) { connectCb = cb; return 0; }
+sint8 espconn_regist_reconcb(struct espconn *c, espconn_reconnect_callback cb) { reconCb = cb; return 0; }
+sint8 espconn_regist_disconcb(struct espconn *c, espconn_connect_callback cb) { disconCb = cb; return 0; }
+sint8 espconn_regist_recvcb(struct espconn *c, espconn_recv_callback cb) { recvCb = cb; return 0; }
+sint8 espconn_regist_sentcb(struct espconn *c, espconn_sent_callback cb) { sentCb = cb; return 0; }
+sint8 espconn_gethostbyname(struct espconn *c, const char *name, ip_addr_t *addr, dns_found_callback found) { return 0; }
+sint8 espconn_secure_connect(struct espconn *c) { return 0; }
+sint8 espconn_secure_disconnect(struct espconn *c) { return 0; }
+sint8 espconn_secure_sent(struct espconn *c, uint8 *data, uint16 len) { return 0; }
+
+static void on_published(uint32_t *args) { published++; }
+static void on_data(uint32_t *args, const char *topic, uint32_t topicLen, const char *data, uint32_t len) { received++; }
+
+/* Run the MQTT task and complete sends until nothing is left to do */
+static void run(void)
+{
+	os_event_t e = { 0, (os_param_t)&client };
+
+	while(posted || sentPending){
+		posted = FALSE;
+		mqttTask(&e);
+		if(sentPending){
+			sentPending = FALSE;
+			sentCb(client.pCon);
+		}
+	}
+}
+
+static void snapshot(MEMTRACK_TAG *tags)
+{
+	int i;
+
+	for(i = 0; i < MEM_TAG_COUNT; i++)
+		MEMTRACK_Get(i, &tags[i]);
+}
+
+static int fail(const char *what)
+{
+	printf("FAIL: %s\n", what);
+	return 1;
+}
+
+int main(void)
+{
+	static const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+	static const uint8_t publish[] = { 0x30, 0x0A, 0x00, 0x03, '/', 'i', 'n', 'h', 'e', 'l', 'l', 'o' };
+	MEMTRACK_TAG before[MEM_TAG_COUNT], after[MEM_TAG_COUNT], conns;
+	struct espconn *conn;
+	BOOL reconnected = FALSE;
+	char json[MEMTRACK_JSON_MAX];
+	uint32_t i, j;
+
+#if CHECK_ARENA
+	MQTT_InitConnectionArena(&client, (uint8_t *)"192.168.1.10", 1883, 0, arena, sizeof(arena));
+#else
+	MQTT_InitConnection(&client, (uint8_t *)"192.168.1.10", 1883, 0);
+#endif
+	MQTT_InitClient(&client, (uint8_t *)"device", (uint8_t *)"user", (uint8_t *)"pass", 120, 1);
+	MQTT_InitLWT(&client, (uint8_t *)"/lwt", (uint8_t *)"offline", 0, 0);
+	MQTT_InitStats(&client, (uint8_t *)"/diag", 0);
+	MQTT_OnPublished(&client, on_published);
+	MQTT_OnData(&client, on_data);
+	run();
+	snapshot(before);
+
+	for(i = 0; i < CHECK_CYCLES; i++){
+		if(!reconnected)
+			MQTT_Connect(&client);
+		reconnected = FALSE;
+		connectCb(client.pCon);
+		run();
+		recvCb(client.pCon, (char *)connack, sizeof(connack));
+		run();
+		if(client.connState != MQTT_DATA)
+			return fail("not connected");
+
+		for(j = 0; j < CHECK_PUBLISHES; j++){
+			MQTT_Publish(&client, "/out", "state", 5, 0, 0);
+			run();
+		}
+		recvCb(client.pCon, (char *)publish, sizeof(publish));
+		run();
+
+		conn = client.pCon;
+		if(i % 3 == 0)
+			disconCb(conn);
+		else if(i % 3 == 1)
+			reconCb(conn, ESPCONN_RST);
+		else {
+			MEMTRACK_Get(MEM_TAG_CONN, &conns);
+			reconnected = i % 6 == 5;
+			if(reconnected)
+				MQTT_Connect(&client);
+			else
+				MQTT_Disconnect(&client);
+			if(closing != conn)
+				return fail("espconn not disconnected");
+			MEMTRACK_Get(MEM_TAG_CONN, &after[MEM_TAG_CONN]);
+			if(after[MEM_TAG_CONN].live < conns.live || client.connSpare == conn || client.pCon == conn)
+				return fail("espconn freed before its disconnect callback");
+			disconCb(conn);
+		}
+		closed++;
+		run();
+	}
+	MQTT_Disconnect(&client);
+	snapshot(after);
+
+	printf("%u cycles, %u published, %u received, %u connects, %u closed\n",
+			CHECK_CYCLES, published, received, connects, closed);
+	for(i = 0; i < MEM_TAG_COUNT; i++)
+		printf("tag %u: live %u peak %u count %u allocs %u\n", i, after[i].live, after[i].peak, after[i].count, after[i].allocs);
+
+	if(published != CHECK_CYCLES * CHECK_PUBLISHES || received != CHECK_CYCLES)
+		return fail("messages lost");
+	for(i = 0; i < MEM_TAG_COUNT; i++){
+		if(after[i].live != before[i].live || after[i].count != before[i].count)
+			return fail("heap grew");
+	}
+#if CHECK_ARENA
+	for(i = 0; i < MEM_TAG_COUNT; i++){
+		if(after[i].allocs != 0)
+			return fail("heap used with an arena");
+	}
+	printf("arena: %u of %u bytes\n", client.arenaUsed, client.arenaSize);
+#endif
+	if(deletes != 0)
+		return fail("espconn_delete on a TCP client");
+
+	if(MEMTRACK_Json(json, sizeof(json)) <= 0 || strncmp(json, "\"heap\":{", 8))
+		return fail("diagnostics");
+	printf("%s\n", json);
+
+	printf("ok\n");
+	return 0;
+}
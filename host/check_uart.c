@@ -0,0 +1,176 @@
+/*
+ * check_uart.c
+ *
+ * Runs the buffered UART0 transmit path of driver/uart.c against the
+ * register mock. Random writes are interleaved with random progress of the
+ * line; the bytes that reach the TX FIFO must be exactly the accepted
+ * bytes in order, with drops accounted (UART_TX_DROP) or no loss at all
+ * (UART_TX_BLOCK), and the FIFO must never be overrun. A blocking write
+ * from an interrupt handler must get through by polling the FIFO alone.
+ *
+ * On the receive side a random stream arrives at line rate while the
+ * reader task only gets to run every CHECK_TASK_EVERY byte times. Nothing
+ * may be lost, and bytes that arrive while the reader stalls must be
+ * counted as dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "c_types.h"
+#include "ets_sys.h"
+#include "user_interface.h"
+#include "driver/uart.h"
+#include "uart_mock.h"
+
+void uart0_write_char(char c);
+
+#define CHECK_WRITES	2000
+#define CHECK_RX_BYTES	200000
+#define CHECK_TASK_EVERY	256
+#define CHECK_RX_PRIO	1
+
+static uint8_t expected[HOST_UART_OUT_MAX];
+static uint32_t expectedLen = 0;
+static uint8_t received[CHECK_RX_BYTES];
+static uint32_t receivedLen = 0;
+static BOOL rxPosted = FALSE;
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par)
+{
+	if(prio == CHECK_RX_PRIO)
+		rxPosted = TRUE;
+	return true;
+}
+
+/* The reader task */
+static void rx_task(void)
+{
+	uint16_t n;
+
+	rxPosted = FALSE;
+	while((n = uart0_rx_read(received + receivedLen, 64)) > 0)
+		receivedLen += n;
+}
+
+static int fail(const char *what)
+{
+	printf("FAIL: %s\n", what);
+	return 1;
+}
+
+/* Let the line run until the ring and the FIFO are empty */
+static void drain(void)
+{
+	while(uart0_tx_room() < UART_TX_RING_SIZE || host_uart_fifo())
+		host_uart_shift(128);
+}
+
+int main(void)
+{
+	uint8_t msg[600];
+	uint32_t i, j, len, room, sent = 0;
+#if UART_TX_POLICY == UART_TX_BLOCK
+	uint32_t irqs;
+#endif
+	uint32_t dropped, overruns, frameErrors;
+	const char *text = "a\nb\rc\n";
+
+	srand(1);
+	uart_init(BIT_RATE_115200, BIT_RATE_115200);
+#if UART_TX_POLICY == UART_TX_BLOCK
+	// the driver polls the FIFO when the ring is full, let the line move meanwhile
+	host_uart_autoshift = 1;
+#endif
+
+	for(i = 0; i < CHECK_WRITES; i++){
+		len = 1 + rand() % sizeof(msg);
+		for(j = 0; j < len; j++)
+			msg[j] = rand();
+
+		room = uart0_tx_room();
+		uart0_tx_buffer(msg, len);
+		sent += len;
+#if UART_TX_POLICY == UART_TX_BLOCK
+		room = len;
+#endif
+		room = len < room ? len : room;
+		memcpy(expected + expectedLen, msg, room);
+		expectedLen += room;
+
+		host_uart_shift(rand() % 256);
+	}
+
+	drain();
+	for(; *text; text++)
+		uart0_write_char(*text);
+	memcpy(expected + expectedLen, "a\r\nbc\r\n", 7);
+	expectedLen += 7;
+	sent += 7;
+
+	drain();
+#if UART_TX_POLICY == UART_TX_BLOCK
+	// os_printf from a handler, more than the ring holds
+	host_intr_lock();
+	irqs = host_uart_irqs;
+	for(i = 0; i < UART_TX_RING_SIZE * 2 / sizeof(msg) + 1; i++){
+		for(j = 0; j < sizeof(msg); j++)
+			msg[j] = rand();
+		uart0_tx_buffer(msg, sizeof(msg));
+		memcpy(expected + expectedLen, msg, sizeof(msg));
+		expectedLen += sizeof(msg);
+		sent += sizeof(msg);
+	}
+	if(host_uart_irqs != irqs)
+		return fail("interrupt taken inside a handler");
+	host_intr_unlock();
+	drain();
+#endif
+
+	printf("%u writes, %u bytes, %u dropped, %u interrupts\n", CHECK_WRITES, sent, uart0_tx_dropped(), host_uart_irqs);
+	if(host_uart_overruns)
+		return fail("TX FIFO overrun");
+	if(host_uart_out_len != expectedLen || memcmp(host_uart_out, expected, expectedLen))
+		return fail("output differs from the accepted bytes");
+	if(uart0_tx_dropped() != sent - expectedLen)
+		return fail("drop counter");
+#if UART_TX_POLICY == UART_TX_BLOCK
+	if(uart0_tx_dropped())
+		return fail("bytes dropped in blocking mode");
+#endif
+	if(READ_PERI_REG(UART_INT_ENA(UART0)) & UART_TXFIFO_EMPTY_INT_ENA)
+		return fail("TX FIFO empty interrupt left enabled");
+
+	uart0_rx_attach(CHECK_RX_PRIO);
+	for(i = 0; i < CHECK_RX_BYTES; i += len){
+		len = 1 + rand() % 300;
+		if(len > CHECK_RX_BYTES - i)
+			len = CHECK_RX_BYTES - i;
+		for(j = 0; j < len; j++){
+			expected[i + j] = rand();
+			host_uart_rx(expected + i + j, 1);
+			if((i + j) % CHECK_TASK_EVERY == 0 && rxPosted)
+				rx_task();
+		}
+		// end of a message, the line goes idle and the timeout fires
+		host_uart_rx_idle();
+	}
+	rx_task();
+	uart0_rx_errors(&dropped, &overruns, &frameErrors);
+	printf("%u bytes received, %u dropped, %u FIFO overruns\n", receivedLen, dropped, overruns);
+	if(host_uart_rx_lost || overruns)
+		return fail("RX FIFO overrun");
+	if(dropped)
+		return fail("RX ring overflow at line rate");
+	if(receivedLen != CHECK_RX_BYTES || memcmp(received, expected, CHECK_RX_BYTES))
+		return fail("received bytes differ");
+
+	// a stalled reader loses what does not fit into the ring, and it is counted
+	host_uart_rx(expected, UART_RX_RING_SIZE * 2);
+	host_uart_rx_idle();
+	uart0_rx_errors(&dropped, &overruns, &frameErrors);
+	if(dropped != UART_RX_RING_SIZE || host_uart_rx_lost)
+		return fail("RX drop counter");
+
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,876 @@
+/*
+ * fleet.c
+ *
+ * Load generator for the broker and whatever listens behind it: thousands
+ * of simulated devices, each speaking MQTT through the firmware's own
+ * mqtt_msg.c and reporting its relays with json_lite the way report.c
+ * does. The devices are sharded across worker threads, each running its
+ * share from one epoll set.
+ *
+ *   fleet [-b host:port] [-n devices] [-w workers] [-d seconds]
+ *         [-r connects/s] [-t toggle ms] [-q qos] [-c churn s]
+ *
+ *   -b  broker, default 127.0.0.1:1883
+ *   -n  number of devices (100)
+ *   -w  worker threads (one per CPU)
+ *   -d  run time in seconds (30)
+ *   -r  connection ramp, new connections per second (200)
+ *   -t  mean time between relay toggles per device, in ms (10000)
+ *   -q  QoS of the state reports (1, so each one is acknowledged)
+ *   -c  mean time a connection stays up before it is dropped without a
+ *       DISCONNECT, in seconds (0, never)
+ *
+ * Each device connects with its LWT, subscribes to its three relay topics,
+ * reports the full state, then toggles relays at random: mostly one at a
+ * time, sometimes a few in quick succession, which the report window
+ * merges. Commands published to the relay topics are applied and
+ * reported too. Dropped devices come back after MQTT_RECONNECT_TIMEOUT.
+ *
+ * Every second a line of rates goes to stdout; at the end the totals and
+ * the latency percentiles of CONNACK (from the TCP connect), SUBACK,
+ * PUBACK and PINGRESP.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "bench.h"
+#include "mqtt_msg.h"
+#include "json_lite.h"
+#include "report.h"
+
+#define FLEET_CHANNELS		3
+#define FLEET_MSG_SIZE		256		// encode buffer, like the device the messages are small
+#define FLEET_RX_SIZE		512
+#define FLEET_TX_SIZE		512
+#define FLEET_INFLIGHT		4		// unacknowledged reports per device
+#define FLEET_EVENTS		64
+#define FLEET_TICK_MS		10		// longest epoll wait
+#define FLEET_TIMEOUT_S		10		// connect to subscribed
+#define FLEET_BURST_PERCENT	20		// toggles followed by more
+#define FLEET_BURST_MS		300		// apart within a burst
+#define FLEET_CHIP_BASE		0x00F1EE00
+#define FLEET_NS			1000000000ull
+#define FLEET_MS			1000000ull
+
+/* Log-linear histogram of microseconds, 16 steps per power of two */
+#define FLEET_HIST_SUB		16
+#define FLEET_HIST_BUCKETS	((32 - 3) * FLEET_HIST_SUB)
+
+typedef enum {
+	FLEET_CONNECT_LAT = 0,
+	FLEET_SUBACK_LAT,
+	FLEET_PUBACK_LAT,
+	FLEET_PING_LAT,
+	FLEET_LATENCIES
+} FLEET_LATENCY;
+
+static const char *fleetLatencyNames[FLEET_LATENCIES] = { "connack", "suback", "puback", "pingresp" };
+
+typedef struct {
+	uint32_t count[FLEET_HIST_BUCKETS];
+	uint64_t n;
+	uint32_t max;
+} FLEET_HIST;
+
+typedef struct {
+	uint64_t connects;		// CONNACK accepted
+	uint64_t failed;		// refused, reset or timed out before subscribed
+	uint64_t dropped;		// closed by the broker once up
+	uint64_t churned;		// dropped on purpose
+	uint64_t published;
+	uint64_t acked;
+	uint64_t lost;			// unacknowledged when the connection went
+	uint64_t received;		// commands
+	uint64_t up;			// devices subscribed right now, a gauge
+} FLEET_COUNTERS;
+
+typedef enum {
+	FLEET_IDLE = 0,			// waiting to connect
+	FLEET_CONNECTING,
+	FLEET_CONNACK,
+	FLEET_SUBACK,
+	FLEET_UP
+} FLEET_STATE;
+
+typedef struct {
+	uint16_t id;
+	uint64_t sent;
+} FLEET_PENDING;
+
+typedef struct {
+	int fd;
+	FLEET_STATE state;
+	uint32_t chipId;
+	char clientId[24];
+	char topics[FLEET_CHANNELS][32];
+	char reportTopic[20];
+	mqtt_connection_t conn;
+	uint64_t next;			// earliest of the times below, ns
+	uint64_t timeoutAt;		// not yet subscribed, or reconnect when idle
+	uint64_t toggleAt;
+	uint64_t reportAt;		// report window ends
+	uint64_t pingAt;
+	uint64_t pingSent;
+	uint64_t churnAt;
+	uint64_t connStart;
+	uint64_t subSent;
+	uint8_t subacks;
+	uint8_t mask;
+	uint8_t changed;
+	uint8_t burst;
+	bool windowArmed;
+	uint16_t seq;
+	FLEET_PENDING pending[FLEET_INFLIGHT];
+	uint16_t rxLen;
+	uint16_t txLen;
+	uint8_t rx[FLEET_RX_SIZE];
+	uint8_t tx[FLEET_TX_SIZE];
+} FLEET_DEVICE;
+
+typedef struct {
+	pthread_t thread;
+	int epfd;
+	FLEET_DEVICE *devices;
+	int count;
+	uint64_t due;			// earliest next of the devices
+	uint32_t rng;
+	uint8_t buf[FLEET_MSG_SIZE];
+	FLEET_COUNTERS counters;
+	FLEET_HIST hist[FLEET_LATENCIES];
+} FLEET_WORKER;
+
+static struct sockaddr_storage fleetAddr;
+static socklen_t fleetAddrLen;
+static int fleetDevices = 100;
+static int fleetWorkers = 0;
+static int fleetSeconds = 30;
+static int fleetRamp = 200;
+static int fleetToggleMs = 10000;
+static int fleetQos = 1;
+static int fleetChurnS = 0;
+static volatile bool fleetStop = FALSE;
+
+/* Counters are read by the main thread while the worker runs */
+#define FLEET_COUNT(w, field, n)	__atomic_fetch_add(&(w)->counters.field, (n), __ATOMIC_RELAXED)
+#define FLEET_READ(w, field)		__atomic_load_n(&(w)->counters.field, __ATOMIC_RELAXED)
+
+static uint64_t fleet_now(void)
+{
+	return bench_now_ns();
+}
+
+static uint32_t fleet_rand(FLEET_WORKER *w)
+{
+	// xorshift32, one stream per worker
+	w->rng ^= w->rng << 13;
+	w->rng ^= w->rng >> 17;
+	w->rng ^= w->rng << 5;
+	return w->rng;
+}
+
+/* Exponentially distributed delay with the given mean, for Poisson arrivals */
+static uint64_t fleet_exp(FLEET_WORKER *w, uint64_t mean)
+{
+	double u = (fleet_rand(w) + 1.0) / 4294967297.0;
+
+	return (uint64_t)(-log(u) * mean);
+}
+
+static uint32_t fleet_hist_bucket(uint32_t us)
+{
+	int e;
+
+	if(us < FLEET_HIST_SUB)
+		return us;
+	e = 31 - __builtin_clz(us);
+	return (e - 3) * FLEET_HIST_SUB + ((us >> (e - 4)) & (FLEET_HIST_SUB - 1));
+}
+
+/* Upper end of a bucket */
+static uint32_t fleet_hist_value(uint32_t bucket)
+{
+	uint32_t e = bucket / FLEET_HIST_SUB + 3, sub = bucket % FLEET_HIST_SUB;
+
+	if(bucket < FLEET_HIST_SUB)
+		return bucket;
+	return ((FLEET_HIST_SUB + sub + 1) << (e - 4)) - 1;
+}
+
+static void fleet_latency(FLEET_WORKER *w, FLEET_LATENCY which, uint64_t since, uint64_t now)
+{
+	FLEET_HIST *h = &w->hist[which];
+	uint64_t us = (now - since) / 1000;
+
+	if(us > UINT32_MAX)
+		us = UINT32_MAX;
+	h->count[fleet_hist_bucket(us)]++;
+	h->n++;
+	if(us > h->max)
+		h->max = us;
+}
+
+static uint32_t fleet_percentile(const FLEET_HIST *h, double p)
+{
+	uint64_t rank = (uint64_t)ceil(h->n * p), seen = 0;
+	uint32_t i;
+
+	for(i = 0; i < FLEET_HIST_BUCKETS; i++){
+		seen += h->count[i];
+		if(seen >= rank && seen)
+			return fleet_hist_value(i) < h->max ? fleet_hist_value(i) : h->max;
+	}
+	return h->max;
+}
+
+static void fleet_schedule(FLEET_WORKER *w, FLEET_DEVICE *d)
+{
+	uint64_t t = d->timeoutAt;
+
+	if(d->state == FLEET_UP){
+		t = d->toggleAt;
+		if(d->windowArmed && d->reportAt < t)
+			t = d->reportAt;
+		if(d->pingAt < t)
+			t = d->pingAt;
+		if(d->churnAt < t)
+			t = d->churnAt;
+	}
+	d->next = t;
+	if(t < w->due)
+		w->due = t;
+}
+
+static void fleet_epoll(FLEET_WORKER *w, FLEET_DEVICE *d, int op)
+{
+	struct epoll_event ev;
+
+	ev.events = d->state == FLEET_CONNECTING || d->txLen ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = d;
+	epoll_ctl(w->epfd, op, d->fd, &ev);
+}
+
+/* Close and come back after the reconnect timeout, like the firmware */
+static void fleet_close(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	int i;
+
+	if(d->fd >= 0)
+		close(d->fd);
+	if(d->state == FLEET_UP)
+		FLEET_COUNT(w, up, -1);
+	for(i = 0; i < FLEET_INFLIGHT; i++){
+		if(d->pending[i].sent){
+			FLEET_COUNT(w, lost, 1);
+			d->pending[i].sent = 0;
+		}
+	}
+	d->fd = -1;
+	d->state = FLEET_IDLE;
+	d->rxLen = 0;
+	d->txLen = 0;
+	d->timeoutAt = now + MQTT_RECONNECT_TIMEOUT * FLEET_NS + fleet_rand(w) % FLEET_NS;
+	fleet_schedule(w, d);
+}
+
+static void fleet_fail(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	FLEET_COUNT(w, failed, 1);
+	fleet_close(w, d, now);
+}
+
+/* Send what fits now, keep the rest for EPOLLOUT */
+static bool fleet_send(FLEET_WORKER *w, FLEET_DEVICE *d, mqtt_message_t *m)
+{
+	ssize_t n = 0;
+
+	if(m == NULL || m->length == 0)
+		return FALSE;
+	if(d->txLen == 0){
+		n = send(d->fd, m->data, m->length, MSG_NOSIGNAL);
+		if(n < 0 && errno != EAGAIN)
+			return FALSE;
+		if(n < 0)
+			n = 0;
+		if(n == m->length)
+			return TRUE;
+	}
+	if(d->txLen + m->length - n > FLEET_TX_SIZE)
+		return FALSE;
+	memcpy(d->tx + d->txLen, m->data + n, m->length - n);
+	if(d->txLen == 0){
+		d->txLen = m->length - n;
+		fleet_epoll(w, d, EPOLL_CTL_MOD);
+	}
+	else
+		d->txLen += m->length - n;
+	return TRUE;
+}
+
+static void fleet_flush(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	ssize_t n = send(d->fd, d->tx, d->txLen, MSG_NOSIGNAL);
+
+	if(n < 0){
+		if(errno != EAGAIN)
+			fleet_close(w, d, now);
+		return;
+	}
+	memmove(d->tx, d->tx + n, d->txLen - n);
+	d->txLen -= n;
+	if(d->txLen == 0)
+		fleet_epoll(w, d, EPOLL_CTL_MOD);
+}
+
+/* The report of report_send(): {"seq":..,"mask":..,"changed":..} */
+static void fleet_report(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	json_writer_t jw;
+	char payload[48];
+	uint16_t id = 0;
+	int len, i, slot = -1;
+
+	if(fleetQos){
+		for(i = 0; i < FLEET_INFLIGHT && slot < 0; i++){
+			if(d->pending[i].sent == 0)
+				slot = i;
+		}
+		if(slot < 0)
+			return;		// keep the change for the next window
+	}
+
+	json_writer_init(&jw, payload, sizeof(payload));
+	json_write_object_start(&jw);
+	json_write_pair_int(&jw, "seq", ++d->seq);
+	json_write_pair_int(&jw, "mask", d->mask);
+	json_write_pair_int(&jw, "changed", d->changed);
+	json_write_object_end(&jw);
+	len = json_writer_finish(&jw);
+
+	if(!fleet_send(w, d, mqtt_msg_publish(&d->conn, d->reportTopic, payload, len, fleetQos, 1, &id))){
+		fleet_close(w, d, now);
+		return;
+	}
+	FLEET_COUNT(w, published, 1);
+	if(slot >= 0){
+		d->pending[slot].id = id;
+		d->pending[slot].sent = now;
+	}
+	d->changed = 0;
+	d->windowArmed = TRUE;
+	d->reportAt = now + STATE_REPORT_WINDOW_MS * FLEET_MS;
+	d->pingAt = now + MQTT_KEEPALIVE * FLEET_NS;
+}
+
+/* REPORT_Changed(): the first change goes out, later ones wait for the window */
+static void fleet_changed(FLEET_WORKER *w, FLEET_DEVICE *d, uint8_t bits, uint64_t now)
+{
+	d->changed |= bits;
+	if(!d->windowArmed)
+		fleet_report(w, d, now);
+}
+
+static void fleet_connect(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	int one = 1;
+
+	d->fd = socket(fleetAddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(d->fd < 0){
+		fleet_fail(w, d, now);
+		return;
+	}
+	setsockopt(d->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	d->connStart = now;
+	d->timeoutAt = now + FLEET_TIMEOUT_S * FLEET_NS;
+	if(connect(d->fd, (struct sockaddr *)&fleetAddr, fleetAddrLen) < 0 && errno != EINPROGRESS){
+		fleet_fail(w, d, now);
+		return;
+	}
+	d->state = FLEET_CONNECTING;
+	fleet_epoll(w, d, EPOLL_CTL_ADD);
+	fleet_schedule(w, d);
+}
+
+static void fleet_connected(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	mqtt_connect_info_t info;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if(getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err){
+		fleet_fail(w, d, now);
+		return;
+	}
+	// as user_main.c sets it up
+	memset(&info, 0, sizeof(info));
+	info.client_id = d->clientId;
+	info.username = "";
+	info.password = "";
+	info.will_topic = "/lwt";
+	info.will_message = "offline";
+	info.keepalive = MQTT_KEEPALIVE;
+	info.clean_session = 1;
+
+	d->state = FLEET_CONNACK;
+	fleet_epoll(w, d, EPOLL_CTL_MOD);
+	if(!fleet_send(w, d, mqtt_msg_connect(&d->conn, &info)))
+		fleet_fail(w, d, now);
+}
+
+static void fleet_up(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	d->state = FLEET_UP;
+	FLEET_COUNT(w, up, 1);
+	d->toggleAt = now + fleet_exp(w, fleetToggleMs * FLEET_MS);
+	d->churnAt = fleetChurnS ? now + fleet_exp(w, fleetChurnS * FLEET_NS) : UINT64_MAX;
+	d->pingSent = 0;
+	d->windowArmed = FALSE;
+	// REPORT_Connected()
+	d->changed = (1 << FLEET_CHANNELS) - 1;
+	fleet_report(w, d, now);
+	if(d->state == FLEET_UP)
+		fleet_schedule(w, d);
+}
+
+static void fleet_command(FLEET_WORKER *w, FLEET_DEVICE *d, uint8_t *packet, uint16_t len, uint64_t now)
+{
+	json_ha_cmd_t cmd;
+	const char *topic, *data;
+	uint16_t topicLen = len, dataLen = len;
+	uint8_t bit;
+	bool on;
+	int i;
+
+	topic = mqtt_get_publish_topic(packet, &topicLen);
+	data = mqtt_get_publish_data(packet, &dataLen);
+	if(topic == NULL || data == NULL)
+		return;
+	if(mqtt_get_qos(packet) == 1 && !fleet_send(w, d, mqtt_msg_puback(&d->conn, mqtt_get_id(packet, len)))){
+		fleet_close(w, d, now);
+		return;
+	}
+	for(i = 0; i < FLEET_CHANNELS; i++){
+		if(strlen(d->topics[i]) == topicLen && memcmp(d->topics[i], topic, topicLen) == 0)
+			break;
+	}
+	if(i == FLEET_CHANNELS)
+		return;
+	FLEET_COUNT(w, received, 1);
+
+	// the JSON schema or bare on/off, as channel.c takes them
+	if(json_ha_parse(data, dataLen, &cmd) > 0 && (cmd.fields & JSON_HA_STATE))
+		on = cmd.state;
+	else
+		on = dataLen == 2 && strncasecmp(data, "on", 2) == 0;
+	bit = 1 << i;
+	if(!!(d->mask & bit) == on)
+		return;
+	d->mask ^= bit;
+	fleet_changed(w, d, bit, now);
+}
+
+static void fleet_packet(FLEET_WORKER *w, FLEET_DEVICE *d, uint8_t *packet, uint16_t len, uint64_t now)
+{
+	uint16_t id;
+	uint16_t topicId;
+	int i;
+
+	switch(mqtt_get_type(packet)){
+	case MQTT_MSG_TYPE_CONNACK:
+		if(d->state != FLEET_CONNACK || len < 4 || packet[3] != 0){
+			fleet_fail(w, d, now);
+			return;
+		}
+		FLEET_COUNT(w, connects, 1);
+		fleet_latency(w, FLEET_CONNECT_LAT, d->connStart, now);
+		// one SUBSCRIBE per channel, like mqttConnectedCb
+		d->state = FLEET_SUBACK;
+		d->subacks = 0;
+		d->subSent = now;
+		for(i = 0; i < FLEET_CHANNELS; i++){
+			topicId = 0;
+			if(!fleet_send(w, d, mqtt_msg_subscribe(&d->conn, d->topics[i], 0, &topicId))){
+				fleet_fail(w, d, now);
+				return;
+			}
+		}
+		break;
+	case MQTT_MSG_TYPE_SUBACK:
+		if(d->state == FLEET_SUBACK && ++d->subacks == FLEET_CHANNELS){
+			fleet_latency(w, FLEET_SUBACK_LAT, d->subSent, now);
+			fleet_up(w, d, now);
+		}
+		break;
+	case MQTT_MSG_TYPE_PUBACK:
+		id = mqtt_get_id(packet, len);
+		for(i = 0; i < FLEET_INFLIGHT; i++){
+			if(d->pending[i].sent && d->pending[i].id == id){
+				fleet_latency(w, FLEET_PUBACK_LAT, d->pending[i].sent, now);
+				FLEET_COUNT(w, acked, 1);
+				d->pending[i].sent = 0;
+				break;
+			}
+		}
+		break;
+	case MQTT_MSG_TYPE_PUBLISH:
+		fleet_command(w, d, packet, len, now);
+		break;
+	case MQTT_MSG_TYPE_PINGRESP:
+		if(d->pingSent){
+			fleet_latency(w, FLEET_PING_LAT, d->pingSent, now);
+			d->pingSent = 0;
+		}
+		break;
+	}
+}
+
+/* Length of the complete packet at the head of rx, 0 if it isn't yet */
+static int fleet_packet_length(FLEET_DEVICE *d)
+{
+	int i;
+
+	for(i = 1; i < d->rxLen && i <= 4; i++){
+		if((d->rx[i] & 0x80) == 0)
+			return mqtt_get_total_length(d->rx, d->rxLen);
+	}
+	return i > 4 ? -1 : 0;
+}
+
+static void fleet_receive(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	ssize_t n;
+	int len;
+
+	n = recv(d->fd, d->rx + d->rxLen, FLEET_RX_SIZE - d->rxLen, 0);
+	if(n == 0 || (n < 0 && errno != EAGAIN)){
+		if(d->state == FLEET_UP)
+			FLEET_COUNT(w, dropped, 1);
+		else
+			FLEET_COUNT(w, failed, 1);
+		fleet_close(w, d, now);
+		return;
+	}
+	if(n < 0)
+		return;
+	d->rxLen += n;
+
+	while(d->fd >= 0 && (len = fleet_packet_length(d)) != 0){
+		if(len < 0 || len > FLEET_RX_SIZE){
+			// nothing a device is sent is this long
+			fleet_fail(w, d, now);
+			return;
+		}
+		if(len > d->rxLen)
+			break;
+		fleet_packet(w, d, d->rx, len, now);
+		if(d->fd < 0)
+			return;
+		memmove(d->rx, d->rx + len, d->rxLen - len);
+		d->rxLen -= len;
+	}
+}
+
+static void fleet_event(FLEET_WORKER *w, FLEET_DEVICE *d, uint32_t events, uint64_t now)
+{
+	if(d->fd < 0)
+		return;
+	if(d->state == FLEET_CONNECTING){
+		fleet_connected(w, d, now);
+		return;
+	}
+	if((events & EPOLLOUT) && d->txLen)
+		fleet_flush(w, d, now);
+	if(d->fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		fleet_receive(w, d, now);
+}
+
+static void fleet_due(FLEET_WORKER *w, FLEET_DEVICE *d, uint64_t now)
+{
+	uint8_t bit;
+
+	switch(d->state){
+	case FLEET_IDLE:
+		fleet_connect(w, d, now);
+		return;
+	case FLEET_CONNECTING:
+	case FLEET_CONNACK:
+	case FLEET_SUBACK:
+		fleet_fail(w, d, now);
+		return;
+	case FLEET_UP:
+		break;
+	}
+
+	if(now >= d->churnAt){
+		FLEET_COUNT(w, churned, 1);
+		fleet_close(w, d, now);
+		return;
+	}
+	if(d->windowArmed && now >= d->reportAt){
+		// report_window()
+		d->windowArmed = FALSE;
+		if(d->changed)
+			fleet_report(w, d, now);
+	}
+	if(d->fd >= 0 && now >= d->toggleAt){
+		bit = 1 << (fleet_rand(w) % FLEET_CHANNELS);
+		d->mask ^= bit;
+		fleet_changed(w, d, bit, now);
+		if(d->burst == 0 && fleet_rand(w) % 100 < FLEET_BURST_PERCENT)
+			d->burst = 1 + fleet_rand(w) % 3;
+		if(d->burst){
+			d->burst--;
+			d->toggleAt = now + fleet_rand(w) % (FLEET_BURST_MS * FLEET_MS);
+		}
+		else
+			d->toggleAt = now + fleet_exp(w, fleetToggleMs * FLEET_MS);
+	}
+	if(d->fd >= 0 && now >= d->pingAt){
+		if(!fleet_send(w, d, mqtt_msg_pingreq(&d->conn))){
+			fleet_close(w, d, now);
+			return;
+		}
+		d->pingSent = now;
+		d->pingAt = now + MQTT_KEEPALIVE * FLEET_NS;
+	}
+	if(d->fd >= 0)
+		fleet_schedule(w, d);
+}
+
+static void *fleet_worker(void *arg)
+{
+	FLEET_WORKER *w = arg;
+	struct epoll_event events[FLEET_EVENTS];
+	uint64_t now;
+	int i, n, timeout;
+
+	while(!fleetStop){
+		now = fleet_now();
+		timeout = w->due > now ? (w->due - now + FLEET_MS - 1) / FLEET_MS : 0;
+		if(timeout > FLEET_TICK_MS)
+			timeout = FLEET_TICK_MS;
+		n = epoll_wait(w->epfd, events, FLEET_EVENTS, timeout);
+		now = fleet_now();
+		for(i = 0; i < n; i++)
+			fleet_event(w, events[i].data.ptr, events[i].events, now);
+		if(now < w->due)
+			continue;
+		// walk the shard for the due ones, finding the next due time on the way
+		w->due = UINT64_MAX;
+		for(i = 0; i < w->count; i++){
+			if(w->devices[i].next <= now)
+				fleet_due(w, &w->devices[i], now);
+			else if(w->devices[i].next < w->due)
+				w->due = w->devices[i].next;
+		}
+	}
+	for(i = 0; i < w->count; i++){
+		if(w->devices[i].fd >= 0)
+			close(w->devices[i].fd);
+	}
+	return NULL;
+}
+
+static bool fleet_resolve(const char *host, const char *port)
+{
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, port, &hints, &res) != 0)
+		return FALSE;
+	memcpy(&fleetAddr, res->ai_addr, res->ai_addrlen);
+	fleetAddrLen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return TRUE;
+}
+
+/* One descriptor per device, raise the soft limit as far as allowed */
+static void fleet_rlimit(void)
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return;
+	if(rl.rlim_cur < fleetDevices + 64u){
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if(rl.rlim_cur < fleetDevices + 64u)
+		fprintf(stderr, "fleet: only %lu descriptors for %d devices\n", (unsigned long)rl.rlim_cur, fleetDevices);
+}
+
+static void fleet_totals(FLEET_WORKER *workers, FLEET_COUNTERS *c)
+{
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	for(i = 0; i < fleetWorkers; i++){
+		c->connects += FLEET_READ(&workers[i], connects);
+		c->failed += FLEET_READ(&workers[i], failed);
+		c->dropped += FLEET_READ(&workers[i], dropped);
+		c->churned += FLEET_READ(&workers[i], churned);
+		c->published += FLEET_READ(&workers[i], published);
+		c->acked += FLEET_READ(&workers[i], acked);
+		c->lost += FLEET_READ(&workers[i], lost);
+		c->received += FLEET_READ(&workers[i], received);
+		c->up += FLEET_READ(&workers[i], up);
+	}
+}
+
+static void fleet_summary(FLEET_WORKER *workers, double seconds)
+{
+	FLEET_COUNTERS c;
+	FLEET_HIST h;
+	int i, j, b;
+
+	fleet_totals(workers, &c);
+	printf("\n%d devices, %d workers, %.1f s\n", fleetDevices, fleetWorkers, seconds);
+	printf("connects  %10llu %10.1f/s  failed %llu, dropped %llu, churned %llu\n",
+			(unsigned long long)c.connects, c.connects / seconds, (unsigned long long)c.failed,
+			(unsigned long long)c.dropped, (unsigned long long)c.churned);
+	printf("published %10llu %10.1f/s  acked %llu, lost %llu, commands %llu\n",
+			(unsigned long long)c.published, c.published / seconds, (unsigned long long)c.acked,
+			(unsigned long long)c.lost, (unsigned long long)c.received);
+
+	printf("\n%-10s %10s %10s %10s %10s %10s %10s\n", "us", "n", "p50", "p90", "p99", "p99.9", "max");
+	for(j = 0; j < FLEET_LATENCIES; j++){
+		memset(&h, 0, sizeof(h));
+		for(i = 0; i < fleetWorkers; i++){
+			for(b = 0; b < FLEET_HIST_BUCKETS; b++)
+				h.count[b] += workers[i].hist[j].count[b];
+			h.n += workers[i].hist[j].n;
+			if(workers[i].hist[j].max > h.max)
+				h.max = workers[i].hist[j].max;
+		}
+		if(h.n == 0){
+			printf("%-10s %10s\n", fleetLatencyNames[j], "-");
+			continue;
+		}
+		printf("%-10s %10llu %10u %10u %10u %10u %10u\n", fleetLatencyNames[j], (unsigned long long)h.n,
+				fleet_percentile(&h, 0.5), fleet_percentile(&h, 0.9), fleet_percentile(&h, 0.99),
+				fleet_percentile(&h, 0.999), h.max);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FLEET_WORKER *workers;
+	FLEET_COUNTERS last, now;
+	FLEET_DEVICE *d;
+	const char *host = "127.0.0.1", *port = "1883";
+	uint64_t start, t;
+	char *colon;
+	int opt, i, s;
+
+	while((opt = getopt(argc, argv, "b:n:w:d:r:t:q:c:")) != -1){
+		switch(opt){
+		case 'b':
+			host = optarg;
+			colon = strrchr(optarg, ':');
+			if(colon){
+				*colon = 0;
+				port = colon + 1;
+			}
+			break;
+		case 'n':
+			fleetDevices = atoi(optarg);
+			break;
+		case 'w':
+			fleetWorkers = atoi(optarg);
+			break;
+		case 'd':
+			fleetSeconds = atoi(optarg);
+			break;
+		case 'r':
+			fleetRamp = atoi(optarg);
+			break;
+		case 't':
+			fleetToggleMs = atoi(optarg);
+			break;
+		case 'q':
+			fleetQos = atoi(optarg) ? 1 : 0;
+			break;
+		case 'c':
+			fleetChurnS = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b host:port] [-n devices] [-w workers] [-d seconds] [-r connects/s] [-t toggle ms] [-q qos] [-c churn s]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(fleetWorkers <= 0)
+		fleetWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(fleetWorkers > fleetDevices)
+		fleetWorkers = fleetDevices;
+	if(fleetDevices <= 0 || fleetRamp <= 0 || fleetToggleMs <= 0 || fleetWorkers <= 0){
+		fprintf(stderr, "fleet: bad arguments\n");
+		return 2;
+	}
+	if(!fleet_resolve(host, port)){
+		fprintf(stderr, "fleet: can't resolve %s\n", host);
+		return 2;
+	}
+	fleet_rlimit();
+
+	workers = calloc(fleetWorkers, sizeof(FLEET_WORKER));
+	if(workers == NULL)
+		return 2;
+	start = fleet_now();
+	for(i = 0; i < fleetWorkers; i++){
+		workers[i].epfd = epoll_create1(0);
+		workers[i].count = fleetDevices / fleetWorkers + (i < fleetDevices % fleetWorkers);
+		workers[i].devices = calloc(workers[i].count, sizeof(FLEET_DEVICE));
+		workers[i].rng = 0x9E3779B9 * (i + 1);
+		workers[i].due = 0;
+		if(workers[i].epfd < 0 || workers[i].devices == NULL)
+			return 2;
+	}
+	// device k goes to worker k % workers and connects k / ramp seconds in
+	for(i = 0; i < fleetDevices; i++){
+		d = &workers[i % fleetWorkers].devices[i / fleetWorkers];
+		d->fd = -1;
+		d->chipId = FLEET_CHIP_BASE + i;
+		snprintf(d->clientId, sizeof(d->clientId), "fleet_%08X", d->chipId);
+		for(s = 0; s < FLEET_CHANNELS; s++)
+			snprintf(d->topics[s], sizeof(d->topics[s]), "%s/led%d", d->clientId, s + 1);
+		snprintf(d->reportTopic, sizeof(d->reportTopic), STATE_REPORT_TOPIC, d->chipId);
+		mqtt_msg_init(&d->conn, workers[i % fleetWorkers].buf, FLEET_MSG_SIZE);
+		d->timeoutAt = start + (uint64_t)i * FLEET_NS / fleetRamp;
+		d->next = d->timeoutAt;
+	}
+	for(i = 0; i < fleetWorkers; i++)
+		pthread_create(&workers[i].thread, NULL, fleet_worker, &workers[i]);
+
+	printf("%6s %8s %10s %10s %10s %8s %8s\n", "s", "up", "connect/s", "publish/s", "ack/s", "failed", "dropped");
+	memset(&last, 0, sizeof(last));
+	for(s = 1; s <= fleetSeconds; s++){
+		t = start + s * FLEET_NS;
+		while(fleet_now() < t)
+			usleep((t - fleet_now()) / 1000 + 1);
+		fleet_totals(workers, &now);
+		printf("%6d %8llu %10llu %10llu %10llu %8llu %8llu\n", s, (unsigned long long)now.up,
+				(unsigned long long)(now.connects - last.connects), (unsigned long long)(now.published - last.published),
+				(unsigned long long)(now.acked - last.acked), (unsigned long long)(now.failed - last.failed),
+				(unsigned long long)(now.dropped - last.dropped));
+		fflush(stdout);
+		last = now;
+	}
+	fleetStop = TRUE;
+	for(i = 0; i < fleetWorkers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	fleet_summary(workers, (fleet_now() - start) / (double)FLEET_NS);
+	return 0;
+}
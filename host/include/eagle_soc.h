@@ -0,0 +1,44 @@
+/*
+ * eagle_soc.h
+ *
+ * Host shim, peripheral register accesses go to the register mock
+ * (host/uart_mock.c) instead of memory.
+ */
+#ifndef HOST_EAGLE_SOC_H_
+#define HOST_EAGLE_SOC_H_
+
+#include "c_types.h"
+
+uint32_t host_reg_read(uint32_t addr);
+void host_reg_write(uint32_t addr, uint32_t val);
+
+#define READ_PERI_REG(addr)				host_reg_read(addr)
+#define WRITE_PERI_REG(addr, val)		host_reg_write((addr), (uint32_t)(val))
+#define CLEAR_PERI_REG_MASK(reg, mask)	WRITE_PERI_REG((reg), (READ_PERI_REG(reg) & (~(mask))))
+#define SET_PERI_REG_MASK(reg, mask)	WRITE_PERI_REG((reg), (READ_PERI_REG(reg) | (mask)))
+
+#define PERIPHS_IO_MUX_MTDO_U	0
+#define PERIPHS_IO_MUX_MTDI_U	0
+#define PERIPHS_IO_MUX_MTCK_U	0
+#define PERIPHS_IO_MUX_MTMS_U	0
+#define PERIPHS_IO_MUX_U0TXD_U	0
+#define PERIPHS_IO_MUX_GPIO0_U	0
+#define PERIPHS_IO_MUX_GPIO4_U	0
+#define PERIPHS_IO_MUX_GPIO5_U	0
+#define FUNC_GPIO0				0
+#define FUNC_GPIO4				0
+#define FUNC_GPIO5				0
+#define FUNC_GPIO12				0
+#define FUNC_GPIO13				0
+#define FUNC_GPIO14				0
+#define FUNC_GPIO15				0
+#define FUNC_U0TXD				0
+#define FUNC_U0RTS				0
+#define FUNC_U1TXD_BK			0
+#define PIN_FUNC_SELECT(pin, func)
+#define PIN_PULLUP_DIS(pin)
+#define PIN_PULLUP_EN(pin)
+
+#define UART_CLK_FREQ			(80 * 1000000)
+
+#endif /* HOST_EAGLE_SOC_H_ */
@@ -0,0 +1,52 @@
+/*
+ * ets_sys.h
+ *
+ * Host shim.
+ */
+#ifndef HOST_ETS_SYS_H_
+#define HOST_ETS_SYS_H_
+
+#include "c_types.h"
+#include "eagle_soc.h"
+
+typedef uint32_t ETSSignal;
+typedef uintptr_t ETSParam;	// uint32_t on the target, wide enough for a pointer here
+
+typedef struct ETSEventTag {
+	ETSSignal sig;
+	ETSParam par;
+} ETSEvent;
+
+typedef void (*ETSTask)(ETSEvent *e);
+typedef void ETSTimerFunc(void *timer_arg);
+
+typedef struct _ETSTIMER_ {
+	struct _ETSTIMER_ *timer_next;
+	uint32_t timer_expire;
+	uint32_t timer_period;
+	ETSTimerFunc *timer_func;
+	void *timer_arg;
+} ETSTimer;
+
+/* Interrupts are delivered by the register mock, see host/uart_mock.c,
+ * and for GPIO by the simulator, see host/sim_hw.c */
+void host_intr_lock(void);
+void host_intr_unlock(void);
+void host_uart_attach(void (*handler)(void *), void *arg);
+void host_gpio_attach(void (*handler)(void *), void *arg);
+void host_gpio_intr_enable(bool enable);
+
+#define ETS_INTR_LOCK()				host_intr_lock()
+#define ETS_INTR_UNLOCK()			host_intr_unlock()
+#define ETS_UART_INTR_ATTACH(f, a)	host_uart_attach((f), (a))
+#define ETS_UART_INTR_ENABLE()
+#define ETS_UART_INTR_DISABLE()
+#define ETS_GPIO_INTR_ATTACH(f, a)	host_gpio_attach((void (*)(void *))(f), (void *)(a))
+#define ETS_GPIO_INTR_ENABLE()		host_gpio_intr_enable(TRUE)
+#define ETS_GPIO_INTR_DISABLE()		host_gpio_intr_enable(FALSE)
+
+/* ROM functions */
+void uart_div_modify(uint8 uart_no, uint32 div);
+void os_install_putc1(void *p);
+
+#endif /* HOST_ETS_SYS_H_ */
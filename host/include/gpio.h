@@ -0,0 +1,56 @@
+/*
+ * gpio.h
+ *
+ * Host shim. Outputs land in host_gpio_out, a word that tests and
+ * benchmarks can read; the simulator backs the other GPIO registers
+ * (input, interrupt status, pin configuration) with plain memory.
+ */
+#ifndef HOST_GPIO_H_
+#define HOST_GPIO_H_
+
+#include "c_types.h"
+
+extern uint32_t host_gpio_out;
+
+uint32_t host_gpio_reg_read(uint32_t reg);
+void host_gpio_reg_write(uint32_t reg, uint32_t val);
+
+#define GPIO_OUT_ADDRESS			0x00
+#define GPIO_OUT_W1TS_ADDRESS		0x04
+#define GPIO_OUT_W1TC_ADDRESS		0x08
+#define GPIO_ENABLE_ADDRESS			0x0c
+#define GPIO_ENABLE_W1TS_ADDRESS	0x10
+#define GPIO_ENABLE_W1TC_ADDRESS	0x14
+#define GPIO_IN_ADDRESS				0x18
+#define GPIO_STATUS_ADDRESS			0x1c
+#define GPIO_STATUS_W1TS_ADDRESS	0x20
+#define GPIO_STATUS_W1TC_ADDRESS	0x24
+#define GPIO_PIN_ADDR(i)			(0x28 + (i) * 4)
+
+#define GPIO_PIN_INT_TYPE_S			7
+#define GPIO_PIN_INT_TYPE_MASK		(0x7 << GPIO_PIN_INT_TYPE_S)
+#define GPIO_PIN_WAKEUP_ENABLE_S	10
+
+#define GPIO_REG_READ(reg)			host_gpio_reg_read(reg)
+#define GPIO_REG_WRITE(reg, val)	host_gpio_reg_write((reg), (val))
+
+typedef enum {
+	GPIO_PIN_INTR_DISABLE = 0,
+	GPIO_PIN_INTR_POSEDGE = 1,
+	GPIO_PIN_INTR_NEGEDGE = 2,
+	GPIO_PIN_INTR_ANYEDGE = 3,
+	GPIO_PIN_INTR_LOLEVEL = 4,
+	GPIO_PIN_INTR_HILEVEL = 5
+} GPIO_INT_TYPE;
+
+#define GPIO_ID_PIN(n)	(n)
+#define GPIO_OUTPUT_SET(gpio_no, bit_value) \
+	(host_gpio_out = (bit_value) ? (host_gpio_out | BIT(gpio_no)) : (host_gpio_out & ~BIT(gpio_no)))
+#define GPIO_DIS_OUTPUT(gpio_no)	GPIO_REG_WRITE(GPIO_ENABLE_W1TC_ADDRESS, BIT(gpio_no))
+#define GPIO_INPUT_GET(gpio_no)		((GPIO_REG_READ(GPIO_IN_ADDRESS) >> (gpio_no)) & BIT0)
+
+void gpio_pin_intr_state_set(uint32 i, GPIO_INT_TYPE intr_state);
+void gpio_pin_wakeup_enable(uint32 i, GPIO_INT_TYPE intr_state);
+void gpio_pin_wakeup_disable(void);
+
+#endif /* HOST_GPIO_H_ */
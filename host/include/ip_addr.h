@@ -0,0 +1,15 @@
+/*
+ * ip_addr.h
+ *
+ * Host shim.
+ */
+#ifndef HOST_IP_ADDR_H_
+#define HOST_IP_ADDR_H_
+
+#include "c_types.h"
+
+typedef struct ip_addr {
+	uint32 addr;
+} ip_addr_t;
+
+#endif /* HOST_IP_ADDR_H_ */
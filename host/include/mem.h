@@ -0,0 +1,16 @@
+/*
+ * mem.h
+ *
+ * Host shim.
+ */
+#ifndef HOST_MEM_H_
+#define HOST_MEM_H_
+
+#include <stdlib.h>
+
+#define os_malloc	malloc
+#define os_zalloc(s)	calloc(1, (s))
+#define os_realloc	realloc
+#define os_free		free
+
+#endif /* HOST_MEM_H_ */
@@ -0,0 +1,19 @@
+/*
+ * os_type.h
+ *
+ * Host shim.
+ */
+#ifndef HOST_OS_TYPE_H_
+#define HOST_OS_TYPE_H_
+
+#include "ets_sys.h"
+
+#define os_timer_func_t	ETSTimerFunc
+#define os_timer_t		ETSTimer
+#define os_event_t		ETSEvent
+#define os_param_t		ETSParam
+#define os_signal_t		ETSSignal
+
+typedef void (*os_task_t)(os_event_t *e);
+
+#endif /* HOST_OS_TYPE_H_ */
@@ -0,0 +1,35 @@
+/*
+ * osapi.h
+ *
+ * Host shim, the os_ string and print helpers map onto libc.
+ */
+#ifndef HOST_OSAPI_H_
+#define HOST_OSAPI_H_
+
+#include <stdio.h>
+#include <string.h>
+#include "os_type.h"
+
+#define os_bzero	bzero
+#define os_memcmp	memcmp
+#define os_memcpy	memcpy
+#define os_memmove	memmove
+#define os_memset	memset
+#define os_strcat	strcat
+#define os_strchr	strchr
+#define os_strcmp	strcmp
+#define os_strcpy	strcpy
+#define os_strlen(s)	strlen((const char *)(s))
+#define os_strncmp	strncmp
+#define os_strncpy	strncpy
+#define os_strstr	strstr
+#define os_printf	printf
+#define os_sprintf	sprintf
+
+/* Timers are provided by the program under test */
+void os_timer_disarm(ETSTimer *timer);
+void os_timer_setfn(ETSTimer *timer, ETSTimerFunc *fn, void *arg);
+void os_timer_arm(ETSTimer *timer, uint32_t ms, bool repeat);
+void os_delay_us(uint32 us);
+
+#endif /* HOST_OSAPI_H_ */
@@ -0,0 +1,23 @@
+/*
+ * spi_flash.h
+ *
+ * Host shim, the simulator backs the flash with a file.
+ */
+#ifndef HOST_SPI_FLASH_H_
+#define HOST_SPI_FLASH_H_
+
+#include "c_types.h"
+
+typedef enum {
+	SPI_FLASH_RESULT_OK,
+	SPI_FLASH_RESULT_ERR,
+	SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+#define SPI_FLASH_SEC_SIZE	4096
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size);
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size);
+
+#endif /* HOST_SPI_FLASH_H_ */
@@ -0,0 +1,53 @@
+/*
+ * user_config.h
+ *
+ * Host build configuration, stands in for the (untracked) board config.
+ */
+#ifndef HOST_USER_CONFIG_H_
+#define HOST_USER_CONFIG_H_
+
+#define CFG_HOLDER		0x00FF55A4
+#define CFG_LOCATION	0x3C
+
+#define MQTT_HOST		"127.0.0.1"
+#define MQTT_PORT		1883
+#define MQTT_BUF_SIZE	1024	// largest packet, the buffers are sized in mqtt.h
+#define MQTT_KEEPALIVE	120
+
+#define MQTT_CLIENT_ID	"esp8266"
+#define MQTT_TOPIC_S01	"led1"
+#define MQTT_TOPIC_S02	"led2"
+#define MQTT_TOPIC_S03	"led3"
+#define MQTT_USER		""
+#define MQTT_PASS		""
+
+#define STA_SSID		"host"
+#define STA_PASS		"host"
+#define STA_TYPE		3
+
+#define MQTT_RECONNECT_TIMEOUT	5
+
+#define DEFAULT_SECURITY		0
+
+// -DPROTOCOL_NAMEv5 for MQTT 5
+#ifndef PROTOCOL_NAMEv5
+#define PROTOCOL_NAMEv31
+#endif
+
+#define SWITCH01_GPIO		14
+#define SWITCH01_GPIO_MUX	PERIPHS_IO_MUX_MTMS_U
+#define SWITCH01_GPIO_FUNC	FUNC_GPIO14
+
+#define SWITCH02_GPIO		12
+#define SWITCH02_GPIO_MUX	PERIPHS_IO_MUX_MTDI_U
+#define SWITCH02_GPIO_FUNC	FUNC_GPIO12
+
+#define SWITCH03_GPIO		13
+#define SWITCH03_GPIO_MUX	PERIPHS_IO_MUX_MTCK_U
+#define SWITCH03_GPIO_FUNC	FUNC_GPIO13
+
+#define BUTTON_GPIO			0
+#define BUTTON_GPIO_MUX		PERIPHS_IO_MUX_GPIO0_U
+#define BUTTON_GPIO_FUNC	FUNC_GPIO0
+
+#endif /* HOST_USER_CONFIG_H_ */
@@ -0,0 +1,151 @@
+/*
+ * user_interface.h
+ *
+ * Host shim. The system calls are provided by the program under test, or
+ * by the simulator (host/sim_*.c) which implements all of them.
+ */
+#ifndef HOST_USER_INTERFACE_H_
+#define HOST_USER_INTERFACE_H_
+
+#include "os_type.h"
+#include "ip_addr.h"
+#include "spi_flash.h"
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen);
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par);
+uint32 system_get_time(void);
+uint32 system_get_chip_id(void);
+void system_restart(void);
+uint32 system_get_free_heap_size(void);
+const char *system_get_sdk_version(void);
+void system_set_os_print(uint8 onoff);
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size);
+
+/* Station */
+#define NULL_MODE		0x00
+#define STATION_MODE	0x01
+#define SOFTAP_MODE		0x02
+
+#define STATION_IF		0x00
+
+enum {
+	STATION_IDLE = 0,
+	STATION_CONNECTING,
+	STATION_WRONG_PASSWORD,
+	STATION_NO_AP_FOUND,
+	STATION_CONNECT_FAIL,
+	STATION_GOT_IP
+};
+
+enum sleep_type {
+	NONE_SLEEP_T = 0,
+	LIGHT_SLEEP_T,
+	MODEM_SLEEP_T
+};
+
+struct ip_info {
+	struct ip_addr ip;
+	struct ip_addr netmask;
+	struct ip_addr gw;
+};
+
+#define IP2STR(ipaddr)	((uint8 *)&(ipaddr)->addr)[0], ((uint8 *)&(ipaddr)->addr)[1], \
+						((uint8 *)&(ipaddr)->addr)[2], ((uint8 *)&(ipaddr)->addr)[3]
+#define IPSTR			"%d.%d.%d.%d"
+
+struct station_config {
+	uint8 ssid[32];
+	uint8 password[64];
+	uint8 bssid_set;
+	uint8 bssid[6];
+};
+
+#define STAILQ_ENTRY(type)	struct { struct type *stqe_next; }
+#define STAILQ_NEXT(elm, field)	((elm)->field.stqe_next)
+
+struct bss_info {
+	STAILQ_ENTRY(bss_info) next;
+	uint8 bssid[6];
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 channel;
+	sint8 rssi;
+};
+
+struct scan_config {
+	uint8 *ssid;
+	uint8 *bssid;
+	uint8 channel;
+	uint8 show_hidden;
+};
+
+typedef void (*scan_done_cb_t)(void *arg, STATUS status);
+
+enum {
+	EVENT_STAMODE_CONNECTED = 0,
+	EVENT_STAMODE_DISCONNECTED,
+	EVENT_STAMODE_AUTHMODE_CHANGE,
+	EVENT_STAMODE_GOT_IP,
+	EVENT_STAMODE_DHCP_TIMEOUT,
+	EVENT_MAX
+};
+
+enum {
+	REASON_UNSPECIFIED = 1,
+	REASON_HANDSHAKE_TIMEOUT = 204,
+	REASON_BEACON_TIMEOUT = 200,
+	REASON_NO_AP_FOUND = 201,
+	REASON_AUTH_FAIL = 202,
+	REASON_ASSOC_FAIL = 203
+};
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 channel;
+} Event_StaMode_Connected_t;
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 reason;
+} Event_StaMode_Disconnected_t;
+
+typedef struct {
+	struct ip_addr ip;
+	struct ip_addr mask;
+	struct ip_addr gw;
+} Event_StaMode_Got_IP_t;
+
+typedef union {
+	Event_StaMode_Connected_t connected;
+	Event_StaMode_Disconnected_t disconnected;
+	Event_StaMode_Got_IP_t got_ip;
+} Event_Info_u;
+
+typedef struct _esp_event {
+	uint32 event;
+	Event_Info_u event_info;
+} System_Event_t;
+
+typedef void (*wifi_event_handler_cb_t)(System_Event_t *event);
+
+bool wifi_set_opmode(uint8 opmode);
+bool wifi_set_channel(uint8 channel);
+bool wifi_set_sleep_type(enum sleep_type type);
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info);
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb);
+bool wifi_station_connect(void);
+bool wifi_station_disconnect(void);
+bool wifi_station_set_config(struct station_config *config);
+bool wifi_station_set_auto_connect(uint8 set);
+bool wifi_station_set_reconnect_policy(bool set);
+bool wifi_station_scan(struct scan_config *config, scan_done_cb_t cb);
+bool wifi_station_dhcpc_start(void);
+bool wifi_station_dhcpc_stop(void);
+
+#endif /* HOST_USER_INTERFACE_H_ */
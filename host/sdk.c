@@ -0,0 +1,10 @@
+/*
+ * sdk.c
+ *
+ * State behind the host SDK shims.
+ */
+#include "c_types.h"
+#include "config.h"
+
+uint32_t host_gpio_out;
+SYSCFG config;
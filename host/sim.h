@@ -0,0 +1,74 @@
+/*
+ * sim.h
+ *
+ * Host simulator: the firmware (user/, modules/, mqtt/, driver/uart.c)
+ * built unchanged against the SDK shims in host/include and run as a
+ * Linux process.
+ *
+ *   sim_os.c	clock, tasks, timers, system_* calls
+ *   sim_net.c	espconn on POSIX sockets
+ *   sim_hw.c	flash file, GPIO registers, UART0, WiFi station
+ *   sim_main.c	command line, scripts
+ *
+ * The clock is either the real monotonic clock, or a virtual one that
+ * only moves when the firmware busy-waits, a script waits, or there is
+ * nothing to do until the next timer, which it then jumps to.
+ */
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include "c_types.h"
+#include "ip_addr.h"
+
+// Simulated heap, system_get_free_heap_size() minus what MEMTRACK counts
+#ifndef SIM_HEAP_SIZE
+#define SIM_HEAP_SIZE		40960
+#endif
+
+#ifndef SIM_FLASH_SIZE
+#define SIM_FLASH_SIZE		(4 * 1024 * 1024)
+#endif
+
+// Blocking times of the flash operations, charged to the clock
+#define SIM_FLASH_ERASE_US	30000
+#define SIM_FLASH_WRITE_US	2	// per byte
+
+// Association and DHCP once the station connects
+#define SIM_WIFI_ASSOC_MS	40
+#define SIM_WIFI_DHCP_MS	60
+
+// Real time the virtual clock waits for the network before it jumps,
+// and the longest jump
+#define SIM_NET_SETTLE_MS	5
+#define SIM_NET_STEP_MS		100
+
+/* sim_os.c */
+extern bool simVirtual;
+extern uint32_t simChipId;
+uint64_t sim_now(void);
+void sim_advance(uint64_t us);
+void sim_delay(uint32_t us);
+bool sim_step(uint64_t until);
+void sim_run(uint64_t until);
+void sim_stop(int status);
+bool sim_stopped(int *status);
+
+/* sim_net.c */
+void sim_net_broker(const char *host, uint16_t port);
+bool sim_net_capture(const char *path);
+bool sim_net_dispatch(void);
+bool sim_net_wait(int ms);
+bool sim_net_resolve(const char *host, ip_addr_t *addr);
+int sim_net_connect(const char *host, uint16_t port);
+bool sim_net_wait_fd(int fd, bool write);
+
+/* sim_hw.c */
+bool sim_flash_open(const char *path);
+void sim_gpio_input(uint8_t gpio, uint8_t level);
+bool sim_gpio_dispatch(void);
+void sim_uart_open(const char *path);
+void sim_uart_rx(const uint8_t *data, uint32_t len);
+void sim_uart_drain(void);
+void sim_wifi_link(bool up);
+
+#endif /* HOST_SIM_H_ */
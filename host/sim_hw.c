@@ -0,0 +1,385 @@
+/*
+ * sim_hw.c
+ *
+ * Simulated peripherals.
+ *
+ * Flash is a file of SIM_FLASH_SIZE bytes. Like NOR flash, a write can
+ * only clear bits, so a write to a sector that wasn't erased shows up as
+ * corrupt data; erase and write block for their typical duration.
+ *
+ * The GPIO registers are plain memory with the set/clear aliases, the
+ * output register is host_gpio_out. Driving an input with
+ * sim_gpio_input() latches the interrupt status of the pin according to
+ * its configured type, and the handler attached with ETS_GPIO_INTR_ATTACH
+ * runs from the scheduler while GPIO interrupts are enabled.
+ *
+ * UART0 is the register mock of host/uart_mock.c, its output is copied to
+ * a file.
+ *
+ * The WiFi station associates and gets an address a few ms after
+ * wifi_station_connect(), unless the link is down.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "c_types.h"
+#include "osapi.h"
+#include "gpio.h"
+#include "user_interface.h"
+#include "user_config.h"
+#include "uart_mock.h"
+#include "sim.h"
+
+#define SIM_GPIO_REGS		(GPIO_PIN_ADDR(16) / 4)
+
+uint32_t host_gpio_out = 0;
+
+static int simFlash = -1;
+static uint32_t simGpio[SIM_GPIO_REGS];
+static void (*simGpioIsr)(void *) = NULL;
+static void *simGpioIsrArg = NULL;
+static bool simGpioEnabled = FALSE;
+static FILE *simUart = NULL;
+static uint32_t simUartOut = 0;
+
+/**
+  * @brief  Back the flash with a file, created erased if it is new
+  * @retval FALSE if the file can't be used
+  */
+bool sim_flash_open(const char *path)
+{
+	static uint8_t erased[SPI_FLASH_SEC_SIZE];
+	off_t size;
+
+	simFlash = open(path, O_RDWR | O_CREAT, 0644);
+	if(simFlash < 0)
+		return FALSE;
+	size = lseek(simFlash, 0, SEEK_END);
+	memset(erased, 0xFF, sizeof(erased));
+	for(; size < SIM_FLASH_SIZE; size += sizeof(erased)){
+		if(pwrite(simFlash, erased, sizeof(erased), size) != sizeof(erased))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec)
+{
+	uint8_t erased[SPI_FLASH_SEC_SIZE];
+
+	if(simFlash < 0 || (sec + 1) * SPI_FLASH_SEC_SIZE > SIM_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	memset(erased, 0xFF, sizeof(erased));
+	if(pwrite(simFlash, erased, sizeof(erased), sec * SPI_FLASH_SEC_SIZE) != sizeof(erased))
+		return SPI_FLASH_RESULT_ERR;
+	sim_delay(SIM_FLASH_ERASE_US);
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size)
+{
+	uint8_t cur[SPI_FLASH_SEC_SIZE];
+	const uint8_t *src = (const uint8_t *)src_addr;
+	uint32_t i, n;
+
+	if(simFlash < 0 || (des_addr & 3) || (size & 3) || des_addr + size > SIM_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	for(; size; size -= n, des_addr += n, src += n){
+		n = size < sizeof(cur) ? size : sizeof(cur);
+		if(pread(simFlash, cur, n, des_addr) != n)
+			return SPI_FLASH_RESULT_ERR;
+		for(i = 0; i < n; i++)
+			cur[i] &= src[i];
+		if(pwrite(simFlash, cur, n, des_addr) != n)
+			return SPI_FLASH_RESULT_ERR;
+		sim_delay(n * SIM_FLASH_WRITE_US);
+	}
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size)
+{
+	if(simFlash < 0 || src_addr + size > SIM_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	if(pread(simFlash, des_addr, size, src_addr) != size)
+		return SPI_FLASH_RESULT_ERR;
+	return SPI_FLASH_RESULT_OK;
+}
+
+uint32_t host_gpio_reg_read(uint32_t reg)
+{
+	if(reg == GPIO_OUT_ADDRESS)
+		return host_gpio_out;
+	if(reg / 4 >= SIM_GPIO_REGS)
+		return 0;
+	return simGpio[reg / 4];
+}
+
+void host_gpio_reg_write(uint32_t reg, uint32_t val)
+{
+	switch(reg){
+	case GPIO_OUT_ADDRESS:
+		host_gpio_out = val;
+		break;
+	case GPIO_OUT_W1TS_ADDRESS:
+		host_gpio_out |= val;
+		break;
+	case GPIO_OUT_W1TC_ADDRESS:
+		host_gpio_out &= ~val;
+		break;
+	case GPIO_ENABLE_W1TS_ADDRESS:
+	case GPIO_STATUS_W1TS_ADDRESS:
+		simGpio[reg / 4 - 1] |= val;
+		break;
+	case GPIO_ENABLE_W1TC_ADDRESS:
+	case GPIO_STATUS_W1TC_ADDRESS:
+		simGpio[reg / 4 - 2] &= ~val;
+		break;
+	case GPIO_IN_ADDRESS:
+		break;
+	default:
+		if(reg / 4 < SIM_GPIO_REGS)
+			simGpio[reg / 4] = val;
+		break;
+	}
+}
+
+void gpio_pin_intr_state_set(uint32 i, GPIO_INT_TYPE intr_state)
+{
+	uint32_t pin = GPIO_REG_READ(GPIO_PIN_ADDR(i));
+
+	GPIO_REG_WRITE(GPIO_PIN_ADDR(i), (pin & ~GPIO_PIN_INT_TYPE_MASK) | (intr_state << GPIO_PIN_INT_TYPE_S));
+}
+
+void gpio_pin_wakeup_enable(uint32 i, GPIO_INT_TYPE intr_state)
+{
+	gpio_pin_intr_state_set(i, intr_state);
+	GPIO_REG_WRITE(GPIO_PIN_ADDR(i), GPIO_REG_READ(GPIO_PIN_ADDR(i)) | BIT(GPIO_PIN_WAKEUP_ENABLE_S));
+}
+
+void gpio_pin_wakeup_disable(void)
+{
+	int i;
+
+	for(i = 0; i < 16; i++)
+		GPIO_REG_WRITE(GPIO_PIN_ADDR(i), GPIO_REG_READ(GPIO_PIN_ADDR(i)) & ~BIT(GPIO_PIN_WAKEUP_ENABLE_S));
+}
+
+void host_gpio_attach(void (*handler)(void *), void *arg)
+{
+	simGpioIsr = handler;
+	simGpioIsrArg = arg;
+}
+
+void host_gpio_intr_enable(bool enable)
+{
+	simGpioEnabled = enable;
+}
+
+/* Drive an input pin, an edge or level matching its type raises its status bit */
+void sim_gpio_input(uint8_t gpio, uint8_t level)
+{
+	uint32_t in = simGpio[GPIO_IN_ADDRESS / 4];
+	uint8_t prev = (in >> gpio) & 1;
+	GPIO_INT_TYPE type = (GPIO_REG_READ(GPIO_PIN_ADDR(gpio)) & GPIO_PIN_INT_TYPE_MASK) >> GPIO_PIN_INT_TYPE_S;
+	bool raise;
+
+	level = level ? 1 : 0;
+	simGpio[GPIO_IN_ADDRESS / 4] = level ? in | BIT(gpio) : in & ~BIT(gpio);
+
+	switch(type){
+	case GPIO_PIN_INTR_POSEDGE:
+		raise = !prev && level;
+		break;
+	case GPIO_PIN_INTR_NEGEDGE:
+		raise = prev && !level;
+		break;
+	case GPIO_PIN_INTR_ANYEDGE:
+		raise = prev != level;
+		break;
+	case GPIO_PIN_INTR_LOLEVEL:
+		raise = !level;
+		break;
+	case GPIO_PIN_INTR_HILEVEL:
+		raise = level;
+		break;
+	default:
+		raise = FALSE;
+		break;
+	}
+	if(raise)
+		simGpio[GPIO_STATUS_ADDRESS / 4] |= BIT(gpio);
+}
+
+/* Run the GPIO interrupt handler if a status bit is pending */
+bool sim_gpio_dispatch(void)
+{
+	if(!simGpioEnabled || simGpioIsr == NULL || simGpio[GPIO_STATUS_ADDRESS / 4] == 0)
+		return FALSE;
+	simGpioIsr(simGpioIsrArg);
+	return TRUE;
+}
+
+void sim_uart_open(const char *path)
+{
+	simUart = fopen(path, "wb");
+}
+
+void sim_uart_rx(const uint8_t *data, uint32_t len)
+{
+	host_uart_rx(data, len);
+	host_uart_rx_idle();
+}
+
+/* The line sends instantly, write out what the driver put in the FIFO */
+void sim_uart_drain(void)
+{
+	if(simUartOut == host_uart_out_len)
+		return;
+	if(simUart){
+		fwrite(host_uart_out + simUartOut, 1, host_uart_out_len - simUartOut, simUart);
+		fflush(simUart);
+	}
+	simUartOut = host_uart_out_len;
+	if(simUartOut > HOST_UART_OUT_MAX / 2){
+		host_uart_out_len = 0;
+		simUartOut = 0;
+	}
+	host_uart_shift(host_uart_fifo());
+}
+
+/* WiFi station */
+static wifi_event_handler_cb_t simWifiCb = NULL;
+static struct station_config simStation;
+static ETSTimer simWifiTimer;
+static bool simWifiDown = FALSE, simWifiAssociated = FALSE;
+static uint8_t simWifiState = STATION_IDLE;
+
+static void sim_wifi_event(uint32 event, uint8 reason)
+{
+	System_Event_t evt;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.event = event;
+	switch(event){
+	case EVENT_STAMODE_CONNECTED:
+		os_memcpy(evt.event_info.connected.ssid, simStation.ssid, sizeof(simStation.ssid));
+		evt.event_info.connected.ssid_len = os_strlen(simStation.ssid);
+		evt.event_info.connected.bssid[5] = 1;
+		evt.event_info.connected.channel = 1;
+		break;
+	case EVENT_STAMODE_DISCONNECTED:
+		os_memcpy(evt.event_info.disconnected.ssid, simStation.ssid, sizeof(simStation.ssid));
+		evt.event_info.disconnected.ssid_len = os_strlen(simStation.ssid);
+		evt.event_info.disconnected.reason = reason;
+		break;
+	case EVENT_STAMODE_GOT_IP:
+		evt.event_info.got_ip.ip.addr = 0x0100007F;	// 127.0.0.1
+		evt.event_info.got_ip.mask.addr = 0x000000FF;
+		break;
+	}
+	if(simWifiCb)
+		simWifiCb(&evt);
+}
+
+static void sim_wifi_step(void *arg)
+{
+	if(simWifiDown){
+		simWifiState = STATION_IDLE;
+		simWifiAssociated = FALSE;
+		sim_wifi_event(EVENT_STAMODE_DISCONNECTED, REASON_NO_AP_FOUND);
+		return;
+	}
+	if(!simWifiAssociated){
+		simWifiAssociated = TRUE;
+		os_timer_arm(&simWifiTimer, SIM_WIFI_DHCP_MS, 0);
+		sim_wifi_event(EVENT_STAMODE_CONNECTED, 0);
+		return;
+	}
+	simWifiState = STATION_GOT_IP;
+	sim_wifi_event(EVENT_STAMODE_GOT_IP, 0);
+}
+
+/* Take the access point away or bring it back */
+void sim_wifi_link(bool up)
+{
+	simWifiDown = !up;
+	if(!up && simWifiState != STATION_IDLE){
+		os_timer_disarm(&simWifiTimer);
+		simWifiState = STATION_IDLE;
+		simWifiAssociated = FALSE;
+		sim_wifi_event(EVENT_STAMODE_DISCONNECTED, REASON_BEACON_TIMEOUT);
+	}
+}
+
+bool wifi_station_connect(void)
+{
+	simWifiState = STATION_CONNECTING;
+	simWifiAssociated = FALSE;
+	os_timer_disarm(&simWifiTimer);
+	os_timer_setfn(&simWifiTimer, sim_wifi_step, NULL);
+	os_timer_arm(&simWifiTimer, SIM_WIFI_ASSOC_MS, 0);
+	return TRUE;
+}
+
+bool wifi_station_disconnect(void)
+{
+	os_timer_disarm(&simWifiTimer);
+	simWifiState = STATION_IDLE;
+	simWifiAssociated = FALSE;
+	return TRUE;
+}
+
+bool wifi_station_set_config(struct station_config *config)
+{
+	os_memcpy(&simStation, config, sizeof(simStation));
+	return TRUE;
+}
+
+static void sim_wifi_scan_done(void *arg)
+{
+	static struct bss_info bss;
+	scan_done_cb_t cb = (scan_done_cb_t)arg;
+
+	memset(&bss, 0, sizeof(bss));
+	os_strncpy((char *)bss.ssid, STA_SSID, sizeof(bss.ssid));
+	bss.ssid_len = os_strlen((char *)bss.ssid);
+	bss.bssid[5] = 1;
+	bss.channel = 1;
+	bss.rssi = -50;
+	cb(simWifiDown ? NULL : &bss, OK);
+}
+
+/* One access point with the configured SSID, unless the link is down */
+bool wifi_station_scan(struct scan_config *config, scan_done_cb_t cb)
+{
+	static ETSTimer scanTimer;
+
+	os_timer_disarm(&scanTimer);
+	os_timer_setfn(&scanTimer, sim_wifi_scan_done, cb);
+	os_timer_arm(&scanTimer, SIM_WIFI_ASSOC_MS, 0);
+	return TRUE;
+}
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb)
+{
+	simWifiCb = cb;
+}
+
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	if(simWifiState == STATION_GOT_IP)
+		info->ip.addr = 0x0100007F;
+	return TRUE;
+}
+
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info) { return TRUE; }
+bool wifi_set_opmode(uint8 opmode) { return TRUE; }
+bool wifi_set_channel(uint8 channel) { return TRUE; }
+bool wifi_set_sleep_type(enum sleep_type type) { return TRUE; }
+bool wifi_station_set_auto_connect(uint8 set) { return TRUE; }
+bool wifi_station_set_reconnect_policy(bool set) { return TRUE; }
+bool wifi_station_dhcpc_start(void) { return TRUE; }
+bool wifi_station_dhcpc_stop(void) { return TRUE; }
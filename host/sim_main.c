@@ -0,0 +1,278 @@
+/*
+ * sim_main.c
+ *
+ * Runs the firmware as a Linux process, see sim.h.
+ *
+ *   sim [-v] [-b host:port] [-f flash.bin] [-u uart.out] [-c chipid]
+ *       [-r capture] [-t ms] [-s script]
+ *
+ *   -v  virtual clock
+ *   -b  connect to this broker instead of the configured one
+ *   -f  flash image, created erased if missing (default sim_flash.bin)
+ *   -u  file for the UART0 output (console frames)
+ *   -c  chip id, hex
+ *   -r  record the received TCP segments for bench_replay, see capture.h
+ *   -t  stop after this many ms
+ *   -s  run a script, then stop; the exit status is 1 if an expect failed
+ *
+ * Script lines, # starts a comment:
+ *
+ *   wait <ms>                     let the firmware run
+ *   input <gpio> <0|1>            drive an input pin
+ *   expect <gpio> <0|1> [<ms>]    the output has the level, or gets it
+ *                                 within ms
+ *   publish <topic> <payload>     publish to the broker as another client
+ *   uart <hex>                    bytes received on UART0
+ *   wifi <up|down>                bring the access point up or down
+ *
+ * Built with SELFBENCH=1 (build/sim_bench) the run ends with the
+ * self-benchmark, see selfbench.h; the exit status is 1 if a phase timed
+ * out. Leave out -v, the phases are timed on the clock of the firmware.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "c_types.h"
+#include "osapi.h"
+#include "gpio.h"
+#include "mqtt_msg.h"
+#include "selfbench.h"
+#include "sim.h"
+
+#define SIM_LINE_MAX		512
+
+void user_init(void);
+
+static char simBroker[64] = "127.0.0.1";
+static uint16_t simPort = 1883;
+
+static void sim_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void sim_log(const char *fmt, ...)
+{
+	va_list ap;
+	uint64_t now = sim_now();
+
+	printf("SIM: %llu.%03llu ", (unsigned long long)(now / 1000000), (unsigned long long)(now / 1000 % 1000));
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	fflush(stdout);
+}
+
+#if SELFBENCH
+static void sim_selfbench_done(BOOL ok)
+{
+	sim_log("self-benchmark %s", ok ? "done" : "timed out");
+	sim_stop(ok ? 0 : 1);
+}
+#endif
+
+static bool sim_send(int fd, mqtt_message_t *m)
+{
+	return m != NULL && send(fd, m->data, m->length, MSG_NOSIGNAL) == m->length;
+}
+
+/* Publish QoS 0 from a short-lived client of our own */
+static bool sim_publish(const char *topic, const char *payload)
+{
+	mqtt_connection_t conn;
+	mqtt_connect_info_t info;
+	uint8_t buf[SIM_LINE_MAX + 64], connack[4];
+	uint16_t id;
+	int fd, n = 0, r;
+	bool ok = FALSE;
+
+	fd = sim_net_connect(simBroker, simPort);
+	if(fd < 0)
+		return FALSE;
+
+	memset(&conn, 0, sizeof(conn));
+	mqtt_msg_init(&conn, buf, sizeof(buf));
+	memset(&info, 0, sizeof(info));
+	info.client_id = "sim";
+	info.keepalive = 10;
+	info.clean_session = 1;
+
+	// the socket is non-blocking, wait for each step
+	if(!sim_net_wait_fd(fd, TRUE) || !sim_send(fd, mqtt_msg_connect(&conn, &info)))
+		goto done;
+	while(n < sizeof(connack) && sim_net_wait_fd(fd, FALSE)){
+		r = recv(fd, connack + n, sizeof(connack) - n, 0);
+		if(r <= 0)
+			goto done;
+		n += r;
+	}
+	if(n != sizeof(connack) || connack[0] != 0x20 || connack[3] != 0)
+		goto done;
+	ok = sim_send(fd, mqtt_msg_publish(&conn, topic, payload, strlen(payload), 0, 0, &id)) &&
+			sim_send(fd, mqtt_msg_disconnect(&conn));
+done:
+	close(fd);
+	return ok;
+}
+
+static bool sim_expect(uint8_t gpio, uint8_t level, uint32_t ms)
+{
+	uint64_t until = sim_now() + (uint64_t)ms * 1000;
+
+	while(((host_gpio_out >> gpio) & 1) != level && !sim_stopped(NULL) && sim_now() < until)
+		sim_step(until);
+	return ((host_gpio_out >> gpio) & 1) == level;
+}
+
+static int sim_hex(const char *s, uint8_t *out, int max)
+{
+	unsigned int b;
+	int n = 0;
+
+	while(n < max && sscanf(s, " %2x", &b) == 1){
+		out[n++] = b;
+		while(*s == ' ')
+			s++;
+		s += 2;
+	}
+	return n;
+}
+
+/* One script line, FALSE if it failed */
+static bool sim_command(char *line, int lineNo)
+{
+	char cmd[16], arg[SIM_LINE_MAX];
+	unsigned int a, b, c;
+	uint8_t bytes[SIM_LINE_MAX / 2];
+	char *p;
+	int n;
+
+	if((p = strchr(line, '#')) != NULL)
+		*p = 0;
+	n = sscanf(line, "%15s", cmd);
+	if(n <= 0)
+		return TRUE;
+
+	if(strcmp(cmd, "wait") == 0 && sscanf(line, "%*s %u", &a) == 1){
+		sim_run(sim_now() + (uint64_t)a * 1000);
+		return TRUE;
+	}
+	if(strcmp(cmd, "input") == 0 && sscanf(line, "%*s %u %u", &a, &b) == 2){
+		sim_log("input %u %u", a, b);
+		sim_gpio_input(a, b);
+		return TRUE;
+	}
+	if(strcmp(cmd, "expect") == 0 && (n = sscanf(line, "%*s %u %u %u", &a, &b, &c)) >= 2){
+		if(sim_expect(a, b, n == 3 ? c : 0)){
+			sim_log("expect %u %u ok", a, b);
+			return TRUE;
+		}
+		sim_log("line %d: expected gpio %u at %u", lineNo, a, b);
+		return FALSE;
+	}
+	if(strcmp(cmd, "publish") == 0 && sscanf(line, "%*s %127s %n", arg, &n) == 1){
+		p = line + n;
+		p[strcspn(p, "\r\n")] = 0;
+		sim_log("publish %s %s", arg, p);
+		if(sim_publish(arg, p))
+			return TRUE;
+		sim_log("line %d: publish to %s:%d failed", lineNo, simBroker, simPort);
+		return FALSE;
+	}
+	if(strcmp(cmd, "uart") == 0){
+		n = sim_hex(strstr(line, "uart") + 4, bytes, sizeof(bytes));
+		sim_log("uart %d bytes", n);
+		sim_uart_rx(bytes, n);
+		return TRUE;
+	}
+	if(strcmp(cmd, "wifi") == 0 && sscanf(line, "%*s %15s", arg) == 1){
+		sim_log("wifi %s", arg);
+		sim_wifi_link(strcmp(arg, "down") != 0);
+		return TRUE;
+	}
+	sim_log("line %d: bad command %s", lineNo, line);
+	return FALSE;
+}
+
+static int sim_script(const char *path)
+{
+	char line[SIM_LINE_MAX];
+	int lineNo = 0, failed = 0;
+	FILE *f = fopen(path, "r");
+
+	if(f == NULL){
+		perror(path);
+		return 2;
+	}
+	while(fgets(line, sizeof(line), f) && !sim_stopped(NULL)){
+		if(!sim_command(line, ++lineNo))
+			failed++;
+	}
+	fclose(f);
+	sim_log("%s: %d failed", path, failed);
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *flash = "sim_flash.bin", *script = NULL;
+	uint32_t limit = 0;
+	int opt, status;
+	char *colon;
+
+	while((opt = getopt(argc, argv, "vb:f:u:c:r:t:s:")) != -1){
+		switch(opt){
+		case 'v':
+			simVirtual = TRUE;
+			break;
+		case 'b':
+			colon = strchr(optarg, ':');
+			if(colon){
+				*colon = 0;
+				simPort = atoi(colon + 1);
+			}
+			os_strncpy(simBroker, optarg, sizeof(simBroker) - 1);
+			sim_net_broker(simBroker, simPort);
+			break;
+		case 'f':
+			flash = optarg;
+			break;
+		case 'u':
+			sim_uart_open(optarg);
+			break;
+		case 'c':
+			simChipId = strtoul(optarg, NULL, 16);
+			break;
+		case 'r':
+			if(!sim_net_capture(optarg)){
+				perror(optarg);
+				return 2;
+			}
+			break;
+		case 't':
+			limit = atoi(optarg);
+			break;
+		case 's':
+			script = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-v] [-b host:port] [-f flash.bin] [-u uart.out] [-c chipid] [-r capture] [-t ms] [-s script]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(!sim_flash_open(flash)){
+		perror(flash);
+		return 2;
+	}
+
+#if SELFBENCH
+	SELFBENCH_OnDone(sim_selfbench_done);
+#endif
+	user_init();
+	if(script)
+		return sim_script(script);
+	sim_run(limit ? (uint64_t)limit * 1000 : UINT64_MAX);
+	sim_stopped(&status);
+	return status;
+}
@@ -0,0 +1,441 @@
+/*
+ * sim_net.c
+ *
+ * espconn TCP client connections on non-blocking POSIX sockets. Each
+ * espconn in use has a slot with its socket; sim_net_dispatch() delivers
+ * at most one callback per call, so a callback may free or reconnect any
+ * espconn, its own included. As in the SDK a client connection is gone
+ * once its disconnect or reconnect callback ran, espconn_delete only
+ * knows servers and fails for it. Data goes out as it is handed to
+ * espconn_sent and the sent callback follows once the kernel took all of
+ * it. Received data is delivered in segments of up to SIM_NET_MSS bytes.
+ *
+ * DNS lookups are resolved with getaddrinfo and answered from the loop.
+ * TLS is not simulated, the secure calls fail. With a capture file open
+ * every connect and received segment is recorded, see capture.h.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "c_types.h"
+#include "osapi.h"
+#include "espconn.h"
+#include "sim.h"
+#include "capture.h"
+
+#define SIM_NET_CONNS		8
+#define SIM_NET_MSS			1460
+#define SIM_NET_TX_MAX		2920	// TCP_SND_BUF of the SDK lwIP
+#define SIM_NET_TIMEOUT_MS	2000
+
+typedef enum {
+	SIM_CONN_FREE,
+	SIM_CONN_CONNECTING,
+	SIM_CONN_OPEN,
+	SIM_CONN_CLOSING		// closed here, callback pending
+} tSimConnState;
+
+typedef struct {
+	struct espconn *conn;
+	int fd;
+	tSimConnState state;
+	uint8_t tx[SIM_NET_TX_MAX];
+	uint16_t txLen;
+	BOOL sentPending;
+	sint8 err;				// CLOSING: reconnect callback with this, 0 for disconnect
+} SIM_CONN;
+
+typedef struct {
+	struct espconn *conn;
+	char name[64];
+	dns_found_callback found;
+} SIM_DNS;
+
+static SIM_CONN simConns[SIM_NET_CONNS];
+static SIM_DNS simDns;
+static char simBrokerHost[64];
+static uint16_t simBrokerPort = 0;
+static uint16_t simLocalPort = 49152;
+static FILE *simCapture = NULL;
+
+/* Record the inbound traffic to this file */
+bool sim_net_capture(const char *path)
+{
+	simCapture = fopen(path, "wb");
+	if(simCapture == NULL || capture_begin(simCapture) < 0)
+		return FALSE;
+	return TRUE;
+}
+
+static void sim_capture(SIM_CONN *c, uint8_t type, const uint8_t *data, uint16_t len)
+{
+	if(simCapture == NULL)
+		return;
+	capture_write(simCapture, (uint32_t)sim_now(), type, c - simConns, data, len);
+	fflush(simCapture);
+}
+
+/* Send every connection to host:port, whatever address the firmware uses */
+void sim_net_broker(const char *host, uint16_t port)
+{
+	os_strncpy(simBrokerHost, host, sizeof(simBrokerHost) - 1);
+	simBrokerPort = port;
+}
+
+bool sim_net_resolve(const char *host, ip_addr_t *addr)
+{
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, NULL, &hints, &res) != 0)
+		return FALSE;
+	addr->addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+	freeaddrinfo(res);
+	return TRUE;
+}
+
+/* Non-blocking connect, -1 if it failed right away */
+int sim_net_connect(const char *host, uint16_t port)
+{
+	struct sockaddr_in sa;
+	ip_addr_t addr;
+	int fd, one = 1;
+
+	if(!sim_net_resolve(host, &addr))
+		return -1;
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = addr.addr;
+	if(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 && errno != EINPROGRESS){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static SIM_CONN *sim_conn_find(struct espconn *conn)
+{
+	int i;
+
+	for(i = 0; i < SIM_NET_CONNS; i++){
+		if(simConns[i].state != SIM_CONN_FREE && simConns[i].conn == conn)
+			return &simConns[i];
+	}
+	return NULL;
+}
+
+static void sim_conn_close(SIM_CONN *c, tSimConnState state)
+{
+	if(c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->txLen = 0;
+	c->sentPending = FALSE;
+	c->state = state;
+}
+
+static void sim_conn_flush(SIM_CONN *c)
+{
+	ssize_t n;
+
+	if(c->txLen == 0)
+		return;
+	n = send(c->fd, c->tx, c->txLen, MSG_NOSIGNAL);
+	if(n <= 0)
+		return;
+	memmove(c->tx, c->tx + n, c->txLen - n);
+	c->txLen -= n;
+	if(c->txLen == 0)
+		c->sentPending = TRUE;
+}
+
+sint8 espconn_connect(struct espconn *espconn)
+{
+	SIM_CONN *c;
+	char host[16];
+	int i;
+
+	if(sim_conn_find(espconn))
+		return ESPCONN_ISCONN;
+	for(i = 0; i < SIM_NET_CONNS && simConns[i].state != SIM_CONN_FREE; i++);
+	if(i == SIM_NET_CONNS)
+		return ESPCONN_MAXNUM;
+	c = &simConns[i];
+
+	os_sprintf(host, "%d.%d.%d.%d", espconn->proto.tcp->remote_ip[0], espconn->proto.tcp->remote_ip[1],
+			espconn->proto.tcp->remote_ip[2], espconn->proto.tcp->remote_ip[3]);
+	c->conn = espconn;
+	c->txLen = 0;
+	c->sentPending = FALSE;
+	c->err = 0;
+	c->state = SIM_CONN_CONNECTING;
+	c->fd = simBrokerPort ? sim_net_connect(simBrokerHost, simBrokerPort) : sim_net_connect(host, espconn->proto.tcp->remote_port);
+	// a failed connect is reported through the reconnect callback
+	if(c->fd < 0){
+		c->state = SIM_CONN_CLOSING;
+		c->err = ESPCONN_CONN;
+	}
+	return ESPCONN_OK;
+}
+
+sint8 espconn_disconnect(struct espconn *espconn)
+{
+	SIM_CONN *c = sim_conn_find(espconn);
+
+	if(c == NULL || c->state == SIM_CONN_CLOSING)
+		return ESPCONN_ARG;
+	sim_conn_close(c, SIM_CONN_CLOSING);
+	c->err = 0;
+	return ESPCONN_OK;
+}
+
+/* There are no servers here */
+sint8 espconn_delete(struct espconn *espconn)
+{
+	if(sim_conn_find(espconn))
+		os_printf("SIM: espconn_delete on a TCP client\n");
+	return ESPCONN_ARG;
+}
+
+sint8 espconn_sent(struct espconn *espconn, uint8 *psent, uint16 length)
+{
+	SIM_CONN *c = sim_conn_find(espconn);
+
+	if(c == NULL || c->state != SIM_CONN_OPEN)
+		return ESPCONN_CONN;
+	if(c->txLen || c->sentPending || length > SIM_NET_TX_MAX)
+		return ESPCONN_MAXNUM;
+	memcpy(c->tx, psent, length);
+	c->txLen = length;
+	sim_conn_flush(c);
+	return ESPCONN_OK;
+}
+
+uint32 espconn_port(void)
+{
+	if(++simLocalPort == 0)
+		simLocalPort = 49152;
+	return simLocalPort;
+}
+
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb)
+{
+	espconn->proto.tcp->connect_callback = connect_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb)
+{
+	espconn->proto.tcp->reconnect_callback = recon_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb)
+{
+	espconn->proto.tcp->disconnect_callback = discon_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb)
+{
+	espconn->recv_callback = recv_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb)
+{
+	espconn->sent_callback = sent_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_gethostbyname(struct espconn *pespconn, const char *hostname, ip_addr_t *addr, dns_found_callback found)
+{
+	if(simDns.found)
+		return ESPCONN_INPROGRESS;
+	simDns.conn = pespconn;
+	os_strncpy(simDns.name, hostname, sizeof(simDns.name) - 1);
+	simDns.found = found;
+	return ESPCONN_INPROGRESS;
+}
+
+sint8 espconn_secure_connect(struct espconn *espconn)
+{
+	os_printf("SIM: TLS is not simulated\n");
+	return ESPCONN_ARG;
+}
+
+sint8 espconn_secure_disconnect(struct espconn *espconn)
+{
+	return ESPCONN_ARG;
+}
+
+sint8 espconn_secure_sent(struct espconn *espconn, uint8 *psent, uint16 length)
+{
+	return ESPCONN_ARG;
+}
+
+static bool sim_dns_dispatch(void)
+{
+	dns_found_callback found = simDns.found;
+	ip_addr_t addr;
+
+	if(found == NULL)
+		return FALSE;
+	simDns.found = NULL;
+	if(sim_net_resolve(simDns.name, &addr))
+		found(simDns.name, &addr, simDns.conn);
+	else
+		found(simDns.name, NULL, simDns.conn);
+	return TRUE;
+}
+
+/* One callback for one connection, after polling the sockets */
+static bool sim_conn_dispatch(SIM_CONN *c, short revents)
+{
+	struct espconn *conn = c->conn;
+	uint8_t buf[SIM_NET_MSS];
+	socklen_t len = sizeof(int);
+	ssize_t n;
+	int err = 0;
+
+	switch(c->state){
+	case SIM_CONN_CONNECTING:
+		if(!(revents & (POLLOUT | POLLERR | POLLHUP)))
+			return FALSE;
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if(err){
+			sim_conn_close(c, SIM_CONN_FREE);
+			if(conn->proto.tcp->reconnect_callback)
+				conn->proto.tcp->reconnect_callback(conn, ESPCONN_CONN);
+			return TRUE;
+		}
+		c->state = SIM_CONN_OPEN;
+		sim_capture(c, CAPTURE_OPEN, NULL, 0);
+		if(conn->proto.tcp->connect_callback)
+			conn->proto.tcp->connect_callback(conn);
+		return TRUE;
+
+	case SIM_CONN_CLOSING:
+		c->state = SIM_CONN_FREE;
+		if(c->err && conn->proto.tcp->reconnect_callback)
+			conn->proto.tcp->reconnect_callback(conn, c->err);
+		else if(c->err == 0 && conn->proto.tcp->disconnect_callback)
+			conn->proto.tcp->disconnect_callback(conn);
+		return TRUE;
+
+	case SIM_CONN_OPEN:
+		if(revents & POLLOUT)
+			sim_conn_flush(c);
+		if(c->sentPending){
+			c->sentPending = FALSE;
+			if(conn->sent_callback)
+				conn->sent_callback(conn);
+			return TRUE;
+		}
+		if(!(revents & (POLLIN | POLLERR | POLLHUP)))
+			return FALSE;
+		n = recv(c->fd, buf, sizeof(buf), 0);
+		if(n > 0){
+			sim_capture(c, CAPTURE_DATA, buf, n);
+			if(conn->recv_callback)
+				conn->recv_callback(conn, (char *)buf, n);
+			return TRUE;
+		}
+		if(n < 0 && (errno == EAGAIN || errno == EINTR))
+			return FALSE;
+		// the broker closed, or reset the connection
+		sim_conn_close(c, SIM_CONN_FREE);
+		if(n == 0 && conn->proto.tcp->disconnect_callback)
+			conn->proto.tcp->disconnect_callback(conn);
+		else if(n < 0 && conn->proto.tcp->reconnect_callback)
+			conn->proto.tcp->reconnect_callback(conn, ESPCONN_RST);
+		return TRUE;
+
+	default:
+		return FALSE;
+	}
+}
+
+/* Sockets to poll, TRUE if an event is pending without them */
+static bool sim_net_fds(struct pollfd *fds, int *n)
+{
+	SIM_CONN *c;
+	bool ready = simDns.found != NULL;
+	int i;
+
+	*n = 0;
+	for(i = 0; i < SIM_NET_CONNS; i++){
+		c = &simConns[i];
+		fds[i].fd = -1;		// ignored by poll
+		fds[i].events = 0;
+		fds[i].revents = 0;
+		if(c->state == SIM_CONN_CLOSING || (c->state == SIM_CONN_OPEN && c->sentPending))
+			ready = TRUE;
+		if(c->state != SIM_CONN_CONNECTING && c->state != SIM_CONN_OPEN)
+			continue;
+		fds[i].fd = c->fd;
+		fds[i].events = c->state == SIM_CONN_CONNECTING || c->txLen ? POLLOUT : POLLIN;
+		(*n)++;
+	}
+	return ready;
+}
+
+/* Deliver one pending network event without waiting */
+bool sim_net_dispatch(void)
+{
+	struct pollfd fds[SIM_NET_CONNS];
+	int i, n;
+
+	sim_net_fds(fds, &n);
+	if(n && poll(fds, SIM_NET_CONNS, 0) < 0)
+		return FALSE;
+	if(sim_dns_dispatch())
+		return TRUE;
+	for(i = 0; i < SIM_NET_CONNS; i++){
+		if(simConns[i].state != SIM_CONN_FREE && sim_conn_dispatch(&simConns[i], fds[i].revents))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+  * @brief  Wait for network activity
+  * @param  ms: longest wait; with the real clock also spent when there
+  *         is no connection, the virtual clock doesn't wait then
+  * @retval TRUE if an event is pending
+  */
+bool sim_net_wait(int ms)
+{
+	struct pollfd fds[SIM_NET_CONNS];
+	int n;
+
+	if(sim_net_fds(fds, &n))
+		return TRUE;
+	if(n == 0 && simVirtual)
+		return FALSE;
+	return poll(fds, SIM_NET_CONNS, ms) > 0;
+}
+
+/* Blocking wait on a socket of our own, for the script helpers */
+bool sim_net_wait_fd(int fd, bool write)
+{
+	struct pollfd pfd = { fd, write ? POLLOUT : POLLIN, 0 };
+
+	return poll(&pfd, 1, SIM_NET_TIMEOUT_MS) > 0 && !(pfd.revents & (POLLERR | POLLNVAL));
+}
@@ -0,0 +1,289 @@
+/*
+ * sim_os.c
+ *
+ * Simulated NONOS scheduler: the clock, the three task priorities, the
+ * software timers and the system_* calls. Work is done one item at a
+ * time in sim_step(), in the order the SDK would: pending interrupts,
+ * then the highest priority task event, then due timers, then network
+ * events. Timers are kept in a list sorted by expiry, like ets_timer.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "c_types.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "memtrack.h"
+#include "sim.h"
+
+#define SIM_TASK_PRIOS		3
+#define SIM_RTC_SIZE		768
+
+typedef struct {
+	os_task_t task;
+	os_event_t *queue;
+	uint8_t len;
+	uint8_t head;
+	uint8_t count;
+} SIM_TASK;
+
+bool simVirtual = FALSE;
+uint32_t simChipId = 0x00C0FFEE;
+
+static uint64_t simClock = 0;		// virtual
+static uint64_t simStart = 0;		// real, monotonic us at start
+static SIM_TASK simTasks[SIM_TASK_PRIOS];
+static ETSTimer *simTimers = NULL;
+static uint8_t simRtc[SIM_RTC_SIZE];
+static bool simStop = FALSE;
+static int simStatus = 0;
+
+static uint64_t sim_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* us since start */
+uint64_t sim_now(void)
+{
+	if(simVirtual)
+		return simClock;
+	if(simStart == 0)
+		simStart = sim_monotonic();
+	return sim_monotonic() - simStart;
+}
+
+/* Move the virtual clock forward, the real one moves by itself */
+void sim_advance(uint64_t us)
+{
+	if(simVirtual)
+		simClock += us;
+}
+
+/* Block like a busy-wait on the device */
+void sim_delay(uint32_t us)
+{
+	struct timespec ts;
+
+	if(simVirtual){
+		simClock += us;
+		return;
+	}
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+void sim_stop(int status)
+{
+	simStop = TRUE;
+	simStatus = status;
+}
+
+bool sim_stopped(int *status)
+{
+	if(status)
+		*status = simStatus;
+	return simStop;
+}
+
+/* Expiry on the 32 bit us clock, within 35 minutes of now */
+static int32_t sim_timer_due_in(ETSTimer *t)
+{
+	return (int32_t)(t->timer_expire - (uint32_t)sim_now());
+}
+
+static void sim_timer_insert(ETSTimer *timer)
+{
+	ETSTimer **p = &simTimers;
+
+	while(*p && (int32_t)((*p)->timer_expire - timer->timer_expire) <= 0)
+		p = &(*p)->timer_next;
+	timer->timer_next = *p;
+	*p = timer;
+}
+
+void os_timer_disarm(ETSTimer *timer)
+{
+	ETSTimer **p;
+
+	for(p = &simTimers; *p; p = &(*p)->timer_next){
+		if(*p == timer){
+			*p = timer->timer_next;
+			break;
+		}
+	}
+	timer->timer_next = NULL;
+}
+
+void os_timer_setfn(ETSTimer *timer, ETSTimerFunc *fn, void *arg)
+{
+	timer->timer_func = fn;
+	timer->timer_arg = arg;
+}
+
+void os_timer_arm(ETSTimer *timer, uint32_t ms, bool repeat)
+{
+	os_timer_disarm(timer);
+	timer->timer_expire = (uint32_t)sim_now() + ms * 1000;
+	timer->timer_period = repeat ? ms : 0;
+	sim_timer_insert(timer);
+}
+
+static bool sim_timer_fire(void)
+{
+	ETSTimer *t = simTimers;
+
+	if(t == NULL || sim_timer_due_in(t) > 0)
+		return FALSE;
+	simTimers = t->timer_next;
+	t->timer_next = NULL;
+	// rearm first, the handler may disarm or rearm it
+	if(t->timer_period){
+		t->timer_expire += t->timer_period * 1000;
+		sim_timer_insert(t);
+	}
+	if(t->timer_func)
+		t->timer_func(t->timer_arg);
+	return TRUE;
+}
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen)
+{
+	if(prio >= SIM_TASK_PRIOS || qlen == 0)
+		return FALSE;
+	simTasks[prio].task = task;
+	simTasks[prio].queue = queue;
+	simTasks[prio].len = qlen;
+	simTasks[prio].head = 0;
+	simTasks[prio].count = 0;
+	return TRUE;
+}
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par)
+{
+	SIM_TASK *t;
+	os_event_t *e;
+
+	if(prio >= SIM_TASK_PRIOS || simTasks[prio].task == NULL)
+		return FALSE;
+	t = &simTasks[prio];
+	if(t->count == t->len)
+		return FALSE;
+	e = &t->queue[(t->head + t->count++) % t->len];
+	e->sig = sig;
+	e->par = par;
+	return TRUE;
+}
+
+static bool sim_task_run(void)
+{
+	SIM_TASK *t;
+	os_event_t e;
+	int prio;
+
+	for(prio = SIM_TASK_PRIOS - 1; prio >= 0; prio--){
+		t = &simTasks[prio];
+		if(t->count == 0)
+			continue;
+		e = t->queue[t->head];
+		t->head = (t->head + 1) % t->len;
+		t->count--;
+		t->task(&e);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+  * @brief  Do one unit of work, or wait for the next one
+  * @param  until: don't wait past this time, in us
+  * @retval TRUE if something ran
+  */
+bool sim_step(uint64_t until)
+{
+	uint64_t now, next;
+
+	sim_uart_drain();
+	if(sim_gpio_dispatch() || sim_task_run() || sim_timer_fire() || sim_net_dispatch())
+		return TRUE;
+
+	now = sim_now();
+	next = until;
+	if(simTimers && now + sim_timer_due_in(simTimers) < next)
+		next = now + sim_timer_due_in(simTimers);
+	if(next <= now)
+		return FALSE;
+
+	if(simVirtual){
+		// give the broker a moment to answer before time jumps ahead,
+		// and don't jump so far that a late answer lands long after it
+		if(sim_net_wait(SIM_NET_SETTLE_MS))
+			return TRUE;
+		if(next > now + SIM_NET_STEP_MS * 1000)
+			next = now + SIM_NET_STEP_MS * 1000;
+		simClock = next;
+		return FALSE;
+	}
+	return sim_net_wait((next - now + 999) / 1000);
+}
+
+void sim_run(uint64_t until)
+{
+	while(!simStop && sim_now() < until)
+		sim_step(until);
+}
+
+uint32 system_get_time(void)
+{
+	return (uint32)sim_now();
+}
+
+uint32 system_get_chip_id(void)
+{
+	return simChipId;
+}
+
+void system_restart(void)
+{
+	os_printf("SIM: Restart requested\n");
+	sim_stop(3);
+}
+
+uint32 system_get_free_heap_size(void)
+{
+	return SIM_HEAP_SIZE - MEMTRACK_Live();
+}
+
+const char *system_get_sdk_version(void)
+{
+	return "host";
+}
+
+void system_set_os_print(uint8 onoff)
+{
+}
+
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size)
+{
+	if(src_addr * 4 + load_size > SIM_RTC_SIZE)
+		return FALSE;
+	memcpy(des_addr, simRtc + src_addr * 4, load_size);
+	return TRUE;
+}
+
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size)
+{
+	if(des_addr * 4 + save_size > SIM_RTC_SIZE)
+		return FALSE;
+	memcpy(simRtc + des_addr * 4, src_addr, save_size);
+	return TRUE;
+}
+
+void os_delay_us(uint32 us)
+{
+	sim_delay(us);
+}
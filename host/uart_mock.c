@@ -0,0 +1,179 @@
+/*
+ * uart_mock.c
+ *
+ * Register level model of UART0 for host builds of driver/uart.c. Bytes
+ * written to UART_FIFO land in host_uart_out, UART_STATUS reports the TX
+ * FIFO fill and UART_INT_ST the enabled TX FIFO empty condition. The line
+ * is advanced explicitly with host_uart_shift(), or by host_uart_autoshift
+ * bytes on every UART_STATUS read to model a CPU polling the FIFO.
+ * Received bytes are pushed into the RX FIFO with host_uart_rx(), which
+ * raises the full, timeout and overflow conditions like the hardware.
+ * A pending interrupt is delivered when the line advances or interrupts
+ * are unmasked.
+ */
+#include <stdlib.h>
+#include "c_types.h"
+#include "ets_sys.h"
+#include "driver/uart.h"
+#include "uart_mock.h"
+
+#define MOCK_REGS		(0x80 / 4)
+#define MOCK_FIFO_LEN	128
+
+UartDevice UartDev;
+
+uint8_t host_uart_out[HOST_UART_OUT_MAX];
+uint32_t host_uart_out_len = 0;
+uint32_t host_uart_overruns = 0;
+uint32_t host_uart_autoshift = 0;
+uint32_t host_uart_irqs = 0;
+uint32_t host_uart_rx_lost = 0;
+
+static uint32_t regs[2][MOCK_REGS];
+#define MOCK_REG(addr)	regs[0][((addr) - REG_UART_BASE(0)) >> 2]
+static uint32_t txCount = 0;
+static uint8_t rxFifo[MOCK_FIFO_LEN];
+static uint32_t rxHead = 0, rxCount = 0;
+static uint32_t lockDepth = 0;
+static void (*uartIsr)(void *) = NULL;
+static void *uartIsrArg = NULL;
+
+static uint32_t mock_raw(void)
+{
+	uint32_t conf1 = MOCK_REG(UART_CONF1(0));
+	uint32_t raw = MOCK_REG(UART_INT_RAW(0)) & ~(UART_TXFIFO_EMPTY_INT_RAW | UART_RXFIFO_FULL_INT_RAW);
+
+	if(txCount < (conf1 >> UART_TXFIFO_EMPTY_THRHD_S & UART_TXFIFO_EMPTY_THRHD))
+		raw |= UART_TXFIFO_EMPTY_INT_RAW;
+	if(rxCount >= (conf1 >> UART_RXFIFO_FULL_THRHD_S & UART_RXFIFO_FULL_THRHD))
+		raw |= UART_RXFIFO_FULL_INT_RAW;
+	return raw;
+}
+
+static void mock_irq(void)
+{
+	uint32_t ena = MOCK_REG(UART_INT_ENA(0));
+
+	if(lockDepth == 0 && uartIsr && (mock_raw() & ena)){
+		host_uart_irqs++;
+		lockDepth++;
+		uartIsr(uartIsrArg);
+		lockDepth--;
+	}
+}
+
+static void mock_locate(uint32_t addr, uint32_t *uart, uint32_t *offset)
+{
+	*uart = (addr - REG_UART_BASE(0)) / 0xf00;
+	*offset = addr - REG_UART_BASE(*uart);
+	if(*uart > 1 || *offset >= MOCK_REGS * 4)
+		abort();
+}
+
+uint32_t host_reg_read(uint32_t addr)
+{
+	uint32_t uart, offset;
+
+	mock_locate(addr, &uart, &offset);
+	if(uart == 0){
+		if(addr == UART_STATUS(0)){
+			if(host_uart_autoshift)
+				txCount -= txCount < host_uart_autoshift ? txCount : host_uart_autoshift;
+			return txCount << UART_TXFIFO_CNT_S | rxCount << UART_RXFIFO_CNT_S;
+		}
+		if(addr == UART_INT_RAW(0))
+			return mock_raw();
+		if(addr == UART_INT_ST(0))
+			return mock_raw() & MOCK_REG(UART_INT_ENA(0));
+		if(addr == UART_FIFO(0)){
+			uint8_t c;
+
+			if(rxCount == 0)
+				return 0;
+			c = rxFifo[rxHead];
+			rxHead = (rxHead + 1) % MOCK_FIFO_LEN;
+			rxCount--;
+			return c;
+		}
+	}
+	return regs[uart][offset >> 2];
+}
+
+void host_reg_write(uint32_t addr, uint32_t val)
+{
+	uint32_t uart, offset;
+
+	mock_locate(addr, &uart, &offset);
+	if(uart == 0 && addr == UART_FIFO(0)){
+		if(txCount >= MOCK_FIFO_LEN || host_uart_out_len >= HOST_UART_OUT_MAX){
+			host_uart_overruns++;
+			return;
+		}
+		host_uart_out[host_uart_out_len++] = val;
+		txCount++;
+		return;
+	}
+	if(addr == UART_INT_CLR(uart)){
+		regs[uart][(UART_INT_RAW(uart) - REG_UART_BASE(uart)) >> 2] &= ~val;
+		return;
+	}
+	regs[uart][offset >> 2] = val;
+}
+
+uint32_t host_uart_fifo(void)
+{
+	return txCount;
+}
+
+void host_uart_shift(uint32_t bytes)
+{
+	txCount -= txCount < bytes ? txCount : bytes;
+	mock_irq();
+}
+
+void host_uart_rx(const uint8_t *data, uint32_t len)
+{
+	while(len--){
+		if(rxCount == MOCK_FIFO_LEN){
+			MOCK_REG(UART_INT_RAW(0)) |= UART_RXFIFO_OVF_INT_RAW;
+			host_uart_rx_lost++;
+		}
+		else {
+			rxFifo[(rxHead + rxCount++) % MOCK_FIFO_LEN] = *data;
+		}
+		data++;
+		mock_irq();
+	}
+}
+
+void host_uart_rx_idle(void)
+{
+	if(rxCount)
+		MOCK_REG(UART_INT_RAW(0)) |= UART_RXFIFO_TOUT_INT_RAW;
+	mock_irq();
+}
+
+void host_intr_lock(void)
+{
+	lockDepth++;
+}
+
+void host_intr_unlock(void)
+{
+	if(--lockDepth == 0)
+		mock_irq();
+}
+
+void host_uart_attach(void (*handler)(void *), void *arg)
+{
+	uartIsr = handler;
+	uartIsrArg = arg;
+}
+
+void uart_div_modify(uint8 uart_no, uint32 div)
+{
+}
+
+void os_install_putc1(void *p)
+{
+}
@@ -0,0 +1,25 @@
+/*
+ * uart_mock.h
+ *
+ * Controls of the UART register mock.
+ */
+#ifndef HOST_UART_MOCK_H_
+#define HOST_UART_MOCK_H_
+
+#include "c_types.h"
+
+#define HOST_UART_OUT_MAX	(1 << 20)
+
+extern uint8_t host_uart_out[HOST_UART_OUT_MAX];	// everything written to the TX FIFO
+extern uint32_t host_uart_out_len;
+extern uint32_t host_uart_overruns;		// writes to a full TX FIFO
+extern uint32_t host_uart_autoshift;	// bytes sent per UART_STATUS read
+extern uint32_t host_uart_irqs;
+extern uint32_t host_uart_rx_lost;		// bytes that hit a full RX FIFO
+
+uint32_t host_uart_fifo(void);
+void host_uart_shift(uint32_t bytes);
+void host_uart_rx(const uint8_t *data, uint32_t len);
+void host_uart_rx_idle(void);
+
+#endif /* HOST_UART_MOCK_H_ */
@@ -0,0 +1,61 @@
+/*
+ * bridge.h
+ *
+ * UART to MQTT bridge for microcontrollers attached to the serial console.
+ * Sub-nodes register each topic once and get a small id back; after that
+ * only ids travel over the wire. All frames use the console framing (see
+ * console.h):
+ *
+ *   BRIDGE_CMD_REGISTER  node, flags, topic      -> topic id
+ *   BRIDGE_CMD_PUBLISH   { id, length, payload }... -> records accepted
+ *   BRIDGE_CMD_DELIVER   { id, length, payload }... (sent by the gateway)
+ *
+ * The topic is "<BRIDGE_TOPIC_PREFIX>/<node>/<topic>", without wildcards.
+ * Registering the same topic again returns the same id, so a node can
+ * simply register everything after it restarts. Messages on topics
+ * registered with BRIDGE_FLAG_SUBSCRIBE are collected for BRIDGE_BATCH_MS
+ * and sent down in one DELIVER frame.
+ */
+#ifndef USER_BRIDGE_H_
+#define USER_BRIDGE_H_
+
+#include "mqtt.h"
+#include "console.h"
+
+// Gateway mode, off by default since the node frames share UART0 with the log
+#ifndef BRIDGE_ENABLE
+#define BRIDGE_ENABLE		0
+#endif
+
+#ifndef BRIDGE_TOPIC_PREFIX
+#define BRIDGE_TOPIC_PREFIX	"/%08X/node"
+#endif
+
+// Registered topics, ids are 0..BRIDGE_TOPICS - 1
+#ifndef BRIDGE_TOPICS
+#define BRIDGE_TOPICS		16
+#endif
+
+// Longest topic including the prefix
+#ifndef BRIDGE_TOPIC_MAX
+#define BRIDGE_TOPIC_MAX	48
+#endif
+
+// Inbound messages within this window go down in one frame
+#ifndef BRIDGE_BATCH_MS
+#define BRIDGE_BATCH_MS		20
+#endif
+
+#define BRIDGE_CMD_REGISTER	(CONSOLE_CMD_APP + 0x10)
+#define BRIDGE_CMD_PUBLISH	(CONSOLE_CMD_APP + 0x11)
+#define BRIDGE_CMD_DELIVER	(CONSOLE_CMD_APP + 0x12)
+
+#define BRIDGE_FLAG_SUBSCRIBE	0x01	// route messages on the topic to the node
+#define BRIDGE_FLAG_RETAIN		0x02	// publish with the retain flag
+
+void BRIDGE_Init(MQTT_Client *client);
+uint8_t BRIDGE_Command(uint8_t cmd, const uint8_t *data, uint16_t len, uint8_t *reply, uint16_t *replyLen);
+BOOL BRIDGE_Data(const char *topic, uint32_t topicLen, const char *data, uint32_t dataLen);
+void BRIDGE_Connected(void);
+
+#endif /* USER_BRIDGE_H_ */
@@ -0,0 +1,45 @@
+/*
+ * channel.h
+ *
+ * Relay channels: output GPIO, toggle input and MQTT command topic.
+ */
+#ifndef USER_CHANNEL_H_
+#define USER_CHANNEL_H_
+
+#include "os_type.h"
+
+// Toggle inputs, the relay outputs are defined in user_config.h
+#define TOGGLE01_GPIO 5
+#define TOGGLE01_GPIO_MUX PERIPHS_IO_MUX_GPIO5_U
+#define TOGGLE01_GPIO_FUNC FUNC_GPIO5
+
+#define TOGGLE02_GPIO 4
+#define TOGGLE02_GPIO_MUX PERIPHS_IO_MUX_GPIO4_U
+#define TOGGLE02_GPIO_FUNC FUNC_GPIO4
+
+#define TOGGLE03_GPIO 15
+#define TOGGLE03_GPIO_MUX PERIPHS_IO_MUX_MTDO_U
+#define TOGGLE03_GPIO_FUNC FUNC_GPIO15
+
+#define CHANNEL_COUNT			3
+#define CHANNEL_STATUS_UNKNOWN	0xFF
+
+typedef struct {
+	uint8_t gpio;			// relay output
+	uint8_t input;			// toggle input
+	uint8_t *topic;			// command topic
+	uint8_t status;			// 0 = off, 1 = on
+} CHANNEL;
+
+typedef void (*ChannelCallback)(CHANNEL *channel);
+
+extern CHANNEL channels[CHANNEL_COUNT];
+
+void CHANNEL_OnChange(ChannelCallback cb);
+CHANNEL* CHANNEL_ByGpio(uint8_t gpio);
+CHANNEL* CHANNEL_ByInput(uint32_t gpio_status);
+CHANNEL* CHANNEL_ByTopic(const char *topic, uint32_t topic_len);
+BOOL CHANNEL_Set(CHANNEL *channel, uint8_t status);
+BOOL CHANNEL_Command(CHANNEL *channel, const char *data, uint32_t data_len);
+
+#endif /* USER_CHANNEL_H_ */
@@ -0,0 +1,18 @@
+/*
+ * discovery.h
+ *
+ * Home Assistant MQTT discovery for the relay channels.
+ */
+#ifndef USER_DISCOVERY_H_
+#define USER_DISCOVERY_H_
+
+#include "mqtt.h"
+
+#ifndef DISCOVERY_PREFIX
+#define DISCOVERY_PREFIX	"homeassistant"
+#endif
+
+void DISCOVERY_Start(MQTT_Client *client);
+BOOL DISCOVERY_IsDone(void);
+
+#endif /* USER_DISCOVERY_H_ */
@@ -10,6 +10,38 @@
 #define UART0   0
 #define UART1   1
 
+/* UART0 transmit ring, drained by the TX FIFO empty interrupt. Must be a
+ * power of two. */
+#ifndef UART_TX_RING_SIZE
+#define UART_TX_RING_SIZE    512
+#endif
+
+/* What a write does when the ring is full: drop the bytes that do not fit
+ * (counted, see uart0_tx_dropped) or wait for the FIFO to take them */
+#define UART_TX_DROP    0
+#define UART_TX_BLOCK   1
+#ifndef UART_TX_POLICY
+#define UART_TX_POLICY  UART_TX_DROP
+#endif
+
+/* Refill the TX FIFO when it holds less than this many bytes */
+#define UART_TX_EMPTY_THRHD  0x10
+
+/* UART0 receive ring, filled by the interrupt handler. Must be a power of
+ * two and hold what arrives at full line rate while the reader task waits
+ * for its turn (512 bytes are 5.5 ms at 921600 baud). */
+#ifndef UART_RX_RING_SIZE
+#define UART_RX_RING_SIZE    512
+#endif
+
+/* Empty the RX FIFO (128 bytes) once it holds this many bytes, the rest of
+ * the FIFO is the interrupt latency budget */
+#ifndef UART_RX_FULL_THRHD
+#define UART_RX_FULL_THRHD   0x10
+#endif
+
+#define UART_RX_NO_TASK      0xFF
+
 typedef enum {
     FIVE_BITS = 0x0,
     SIX_BITS = 0x1,
@@ -97,5 +129,11 @@ typedef struct {
 
 void uart_init(UartBautRate uart0_br, UartBautRate uart1_br);
 void uart0_sendStr(const char *str);
+void uart0_tx_buffer(uint8 *buf, uint16 len);
+uint16 uart0_tx_room(void);
+uint32 uart0_tx_dropped(void);
+void uart0_rx_attach(uint8 prio);
+uint16 uart0_rx_read(uint8 *buf, uint16 len);
+void uart0_rx_errors(uint32 *dropped, uint32 *overruns, uint32 *frame_errors);
 #endif
 
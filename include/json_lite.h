@@ -0,0 +1,100 @@
+#ifndef __JSON_LITE_H__
+#define __JSON_LITE_H__
+
+#include "c_types.h"
+
+/*
+ * Allocation free JSON helpers.
+ *
+ * The tokenizer splits the input in place into an array of tokens
+ * (offsets into the input, nothing is copied). The writer appends into a
+ * caller supplied buffer and never writes past it. Both keep all of their
+ * state in the structures below, so they are reentrant.
+ */
+
+typedef enum {
+    JSON_TOK_UNDEFINED = 0,
+    JSON_TOK_OBJECT,
+    JSON_TOK_ARRAY,
+    JSON_TOK_STRING,
+    JSON_TOK_PRIMITIVE
+} json_tok_type_t;
+
+#define JSON_ERROR_NOMEM    -1  /* not enough tokens */
+#define JSON_ERROR_INVAL    -2  /* invalid character */
+#define JSON_ERROR_PART     -3  /* input ended inside a value */
+
+typedef struct {
+    uint8 type;
+    uint16 start;           /* offset of the first character */
+    uint16 end;             /* offset past the last character */
+    uint16 size;            /* children: keys of an object, items of an array */
+    sint16 parent;
+} json_token_t;
+
+typedef struct {
+    uint16 pos;
+    uint16 toknext;
+    sint16 toksuper;
+} json_tokenizer_t;
+
+#define JSON_WRITER_MAX_DEPTH   8
+
+typedef struct {
+    char *buf;
+    uint16 size;
+    uint16 len;
+    uint8 overflow;
+    uint8 depth;
+    uint8 first;            /* bit n set while depth n has no member yet */
+} json_writer_t;
+
+void json_tok_init(json_tokenizer_t *parser);
+int json_tokenize(json_tokenizer_t *parser, const char *js, uint16 len,
+                  json_token_t *tokens, uint16 num_tokens);
+int json_tok_eq(const char *js, const json_token_t *tok, const char *s);
+int json_tok_find(const char *js, const json_token_t *tokens, int count, int object, const char *key);
+int json_tok_next(const json_token_t *tokens, int count, int index);
+sint32 json_tok_int(const char *js, const json_token_t *tok);
+
+void json_writer_init(json_writer_t *w, char *buf, uint16 size);
+void json_write_raw(json_writer_t *w, const char *s, uint16 len);
+void json_write_object_start(json_writer_t *w);
+void json_write_object_end(json_writer_t *w);
+void json_write_array_start(json_writer_t *w);
+void json_write_array_end(json_writer_t *w);
+void json_write_key(json_writer_t *w, const char *key);
+void json_write_string(json_writer_t *w, const char *s, uint16 len);
+void json_write_int(json_writer_t *w, sint32 value);
+void json_write_pair_string(json_writer_t *w, const char *key, const char *value);
+void json_write_pair_int(json_writer_t *w, const char *key, sint32 value);
+int json_writer_finish(json_writer_t *w);
+
+/* Home Assistant JSON schema (lights and switches) */
+
+#ifndef JSON_HA_MAX_TOKENS
+#define JSON_HA_MAX_TOKENS  32
+#endif
+
+#define JSON_HA_STATE       0x01
+#define JSON_HA_BRIGHTNESS  0x02
+#define JSON_HA_TRANSITION  0x04
+#define JSON_HA_COLOR_TEMP  0x08
+#define JSON_HA_COLOR       0x10
+#define JSON_HA_EFFECT      0x20
+
+typedef struct {
+    uint8 fields;           /* JSON_HA_* present in the payload */
+    uint8 state;            /* 1 = ON */
+    uint8 brightness;
+    uint8 color[3];         /* r, g, b */
+    uint16 color_temp;
+    uint32 transition_ms;
+    uint16 effect;          /* offset of the effect name in the payload */
+    uint16 effect_len;
+} json_ha_cmd_t;
+
+int json_ha_parse(const char *js, uint16 len, json_ha_cmd_t *cmd);
+int json_ha_write(char *buf, uint16 size, const json_ha_cmd_t *cmd, const char *js);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * report.h
+ *
+ * Aggregated channel state reporting.
+ */
+#ifndef USER_REPORT_H_
+#define USER_REPORT_H_
+
+#include "mqtt.h"
+#include "channel.h"
+
+// All channels in one message: {"seq":<n>,"mask":<on bits>,"changed":<bits>}
+#ifndef STATE_REPORT_TOPIC
+#define STATE_REPORT_TOPIC			"/%08X/state"
+#endif
+
+// Changes within this window are merged into one report
+#ifndef STATE_REPORT_WINDOW_MS
+#define STATE_REPORT_WINDOW_MS		100
+#endif
+
+// Also send {"state":...} on <channel topic>/set for every changed channel
+#ifndef STATE_REPORT_PER_CHANNEL
+#define STATE_REPORT_PER_CHANNEL	0
+#endif
+
+void REPORT_Init(MQTT_Client *client);
+void REPORT_Changed(CHANNEL *channel);
+void REPORT_Connected(void);
+BOOL REPORT_Pending(void);
+const char* REPORT_GetTopic(void);
+
+#endif /* USER_REPORT_H_ */
@@ -0,0 +1,88 @@
+/*
+ * selfbench.h
+ *
+ * Self-benchmark, the bench flavor of the firmware (make FLAVOR=bench on
+ * the device, host/build/sim_bench on the host). SELFBENCH_START_MS after
+ * the first broker connection it runs a fixed scenario against the
+ * configured broker, one phase at a time:
+ *
+ *   burst      SELFBENCH_BURST QoS 0 publishes queued back to back, until
+ *              the queue has drained
+ *   rtt        SELFBENCH_RTT QoS 1 publishes to a topic the device is
+ *              subscribed to, each sent when the previous one came back
+ *   subscribe  SELFBENCH_SUBSCRIBE subscribes queued back to back, until
+ *              an echo queued behind them comes back
+ *   toggle     SELFBENCH_TOGGLE changes of the first relay, until an echo
+ *              queued behind the state report comes back
+ *
+ * Every phase records its wall time (system_get_time) and the CCOUNT
+ * cycles spent in the calls it makes into the firmware. The summary is
+ * published once to "<SELFBENCH_TOPIC>/summary":
+ *
+ *   {"mhz":80,"heap":<free>,"burst":{"n":<ops>,"us":<wall>,"cyc":<cycles>,
+ *    "max":<slowest call>,"drop":<queue drops>},"rtt":{...,"min":<us>,
+ *    "avg":<us>,"rmax":<us>},"subscribe":{...},"toggle":{...}}
+ *
+ * A phase that is not done within SELFBENCH_TIMEOUT_MS gets "to":1 and
+ * the next one starts.
+ */
+#ifndef USER_SELFBENCH_H_
+#define USER_SELFBENCH_H_
+
+#include "mqtt.h"
+
+#ifndef SELFBENCH
+#define SELFBENCH			0
+#endif
+
+#ifndef SELFBENCH_TOPIC
+#define SELFBENCH_TOPIC		"/%08X/bench"
+#endif
+
+// Quiet time after connecting, for the discovery and state messages
+#ifndef SELFBENCH_START_MS
+#define SELFBENCH_START_MS	2000
+#endif
+
+// Pause between phases
+#ifndef SELFBENCH_GAP_MS
+#define SELFBENCH_GAP_MS	500
+#endif
+
+#ifndef SELFBENCH_TIMEOUT_MS
+#define SELFBENCH_TIMEOUT_MS	10000
+#endif
+
+// Operations per phase; the burst has to fit QUEUE_BUFFER_SIZE, which is
+// sized for two diagnostics snapshots
+#ifndef SELFBENCH_BURST
+#define SELFBENCH_BURST		8
+#endif
+
+#ifndef SELFBENCH_PAYLOAD
+#define SELFBENCH_PAYLOAD	64
+#endif
+
+#ifndef SELFBENCH_RTT
+#define SELFBENCH_RTT		20
+#endif
+
+#ifndef SELFBENCH_SUBSCRIBE
+#define SELFBENCH_SUBSCRIBE	16
+#endif
+
+// Even, so the relay ends where it started
+#ifndef SELFBENCH_TOGGLE
+#define SELFBENCH_TOGGLE	10
+#endif
+
+/* Called once with the summary published, ok is FALSE if a phase timed out */
+typedef void (*SelfbenchDoneCallback)(BOOL ok);
+
+void SELFBENCH_Init(MQTT_Client *client);
+void SELFBENCH_OnDone(SelfbenchDoneCallback cb);
+void SELFBENCH_Connected(void);
+void SELFBENCH_Published(void);
+BOOL SELFBENCH_Data(const char *topic, uint32_t topicLen, const char *data, uint32_t dataLen);
+
+#endif /* USER_SELFBENCH_H_ */
@@ -1,5 +1,5 @@
 /*
-/* config.c
+ * config.c
 *
 * Copyright (c) 2014-2015, Tuan PM <tuanpm at live dot com>
 * All rights reserved.
@@ -36,35 +36,82 @@
 
 #include "mqtt.h"
 #include "config.h"
+#include "flash.h"
 #include "user_config.h"
+#define LOG_MODULE CONFIG
 #include "debug.h"
 
 SYSCFG config;
-SAVE_FLAG save_flag;
+SAVE_FLAG save_flag __attribute__((aligned(4)));
 
+static SAVE_FLAG flagNext __attribute__((aligned(4)));	// save_flag once it is written
+static FLASH_RECORD cfgRecord, flagRecord;
+static BOOL cfgPending = FALSE;
+
+static void ICACHE_FLASH_ATTR
+config_save_pending(void)
+{
+	if(cfgPending){
+		cfgPending = FALSE;
+		config_save();
+	}
+}
+
+static void ICACHE_FLASH_ATTR
+config_flag_saved(void *arg, BOOL success)
+{
+	// Until then the flag in flash may still be the old one
+	if(success)
+		save_flag = flagNext;
+	else
+		LOG_E("CONFIG: Save flag write failed\r\n");
+	config_save_pending();
+}
+
+static void ICACHE_FLASH_ATTR
+config_data_saved(void *arg, BOOL success)
+{
+	if(!success){
+		LOG_E("CONFIG: Data write failed\r\n");
+		config_save_pending();
+		return;
+	}
+
+	// The new copy is complete, only now point the save flag at it
+	flagNext = save_flag;
+	flagNext.flag = (save_flag.flag == 0) ? 1 : 0;
+	flagRecord.sector = CFG_LOCATION + 3;
+	flagRecord.data = &flagNext;
+	flagRecord.length = sizeof(SAVE_FLAG);
+	flagRecord.cb = config_flag_saved;
+	FLASH_Write(&flagRecord);
+}
+
+/**
+  * @brief  Schedule the configuration to be written in the background.
+  *         Saves issued while a write is in progress are merged into one.
+  * @retval None
+  */
 void ICACHE_FLASH_ATTR
 config_save()
 {
-	 spi_flash_read((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE,
-	                   (uint32 *)&save_flag, sizeof(SAVE_FLAG));
-
-	if (save_flag.flag == 0) {
-		spi_flash_erase_sector(CFG_LOCATION + 1);
-		spi_flash_write((CFG_LOCATION + 1) * SPI_FLASH_SEC_SIZE,
-						(uint32 *)&config, sizeof(SYSCFG));
-		save_flag.flag = 1;
-		spi_flash_erase_sector(CFG_LOCATION + 3);
-		spi_flash_write((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE,
-						(uint32 *)&save_flag, sizeof(SAVE_FLAG));
-	} else {
-		spi_flash_erase_sector(CFG_LOCATION + 0);
-		spi_flash_write((CFG_LOCATION + 0) * SPI_FLASH_SEC_SIZE,
-						(uint32 *)&config, sizeof(SYSCFG));
-		save_flag.flag = 0;
-		spi_flash_erase_sector(CFG_LOCATION + 3);
-		spi_flash_write((CFG_LOCATION + 3) * SPI_FLASH_SEC_SIZE,
-						(uint32 *)&save_flag, sizeof(SAVE_FLAG));
+	if(flagRecord.state != FLASH_REC_IDLE){
+		cfgPending = TRUE;
+		return;
 	}
+
+	cfgRecord.sector = CFG_LOCATION + ((save_flag.flag == 0) ? 1 : 0);
+	cfgRecord.data = &config;
+	cfgRecord.length = sizeof(SYSCFG);
+	cfgRecord.cb = config_data_saved;
+	FLASH_Write(&cfgRecord);
+}
+
+/* A default, fmt may hold a %08X for the chip ID */
+static void ICACHE_FLASH_ATTR
+config_default(uint8_t *field, const char *fmt)
+{
+	os_sprintf((char *)field, fmt, system_get_chip_id());
 }
 
 void ICACHE_FLASH_ATTR
@@ -86,18 +133,18 @@ config_load()
 
 		config.cfg_holder = CFG_HOLDER;
 
-		os_sprintf(config.sta_ssid, "%s", STA_SSID);
-		os_sprintf(config.sta_pwd, "%s", STA_PASS);
+		os_sprintf((char *)config.sta_ssid, "%s", STA_SSID);
+		os_sprintf((char *)config.sta_pwd, "%s", STA_PASS);
 		config.sta_type = STA_TYPE;
 
-		os_sprintf(config.device_id, MQTT_CLIENT_ID, system_get_chip_id());
-		os_sprintf(config.mqtt_topic_s01, MQTT_TOPIC_S01, system_get_chip_id());
-		os_sprintf(config.mqtt_topic_s02, MQTT_TOPIC_S02, system_get_chip_id());
-		os_sprintf(config.mqtt_topic_s03, MQTT_TOPIC_S03, system_get_chip_id());
-		os_sprintf(config.mqtt_host, "%s", MQTT_HOST);
+		config_default(config.device_id, MQTT_CLIENT_ID);
+		config_default(config.mqtt_topic_s01, MQTT_TOPIC_S01);
+		config_default(config.mqtt_topic_s02, MQTT_TOPIC_S02);
+		config_default(config.mqtt_topic_s03, MQTT_TOPIC_S03);
+		os_sprintf((char *)config.mqtt_host, "%s", MQTT_HOST);
 		config.mqtt_port = MQTT_PORT;
-		os_sprintf(config.mqtt_user, "%s", MQTT_USER);
-		os_sprintf(config.mqtt_pass, "%s", MQTT_PASS);
+		os_sprintf((char *)config.mqtt_user, "%s", MQTT_USER);
+		os_sprintf((char *)config.mqtt_pass, "%s", MQTT_PASS);
 
 		config.security = DEFAULT_SECURITY;	/* default non ssl */
 
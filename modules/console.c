@@ -0,0 +1,243 @@
+/*
+ * console.c
+ *
+ *  Binary command console on UART0.
+ *
+ *  The UART driver collects received bytes in its RX ring from the
+ *  interrupt handler and posts the console task, which feeds them through
+ *  a PROTO_PARSER. Complete frames are executed in the task and answered
+ *  through the buffered transmit path.
+ */
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "driver/uart.h"
+#include "proto.h"
+#include "config.h"
+#include "flash.h"
+#include "console.h"
+#define LOG_MODULE CONSOLE
+#include "debug.h"
+
+#define CONSOLE_TYPE_STR	0
+#define CONSOLE_TYPE_U32	1
+#define CONSOLE_TYPE_U8		2
+
+typedef struct {
+	void *data;
+	uint8_t size;
+	uint8_t type;
+} CONSOLE_FIELD;
+
+static const CONSOLE_FIELD consoleFields[] = {
+	[CONSOLE_FIELD_DEVICE_ID] = { config.device_id, sizeof(config.device_id), CONSOLE_TYPE_STR },
+	[CONSOLE_FIELD_STA_SSID] = { config.sta_ssid, sizeof(config.sta_ssid), CONSOLE_TYPE_STR },
+	[CONSOLE_FIELD_STA_PWD] = { config.sta_pwd, sizeof(config.sta_pwd), CONSOLE_TYPE_STR },
+	[CONSOLE_FIELD_MQTT_HOST] = { config.mqtt_host, sizeof(config.mqtt_host), CONSOLE_TYPE_STR },
+	[CONSOLE_FIELD_MQTT_PORT] = { &config.mqtt_port, sizeof(config.mqtt_port), CONSOLE_TYPE_U32 },
+	[CONSOLE_FIELD_MQTT_USER] = { config.mqtt_user, sizeof(config.mqtt_user), CONSOLE_TYPE_STR },
+	[CONSOLE_FIELD_MQTT_PASS] = { config.mqtt_pass, sizeof(config.mqtt_pass), CONSOLE_TYPE_STR },
+	[CONSOLE_FIELD_KEEPALIVE] = { &config.mqtt_keepalive, sizeof(config.mqtt_keepalive), CONSOLE_TYPE_U32 },
+	[CONSOLE_FIELD_SECURITY] = { &config.security, sizeof(config.security), CONSOLE_TYPE_U8 },
+	[CONSOLE_FIELD_TOPIC_S01] = { config.mqtt_topic_s01, sizeof(config.mqtt_topic_s01), CONSOLE_TYPE_STR },
+	[CONSOLE_FIELD_TOPIC_S02] = { config.mqtt_topic_s02, sizeof(config.mqtt_topic_s02), CONSOLE_TYPE_STR },
+	[CONSOLE_FIELD_TOPIC_S03] = { config.mqtt_topic_s03, sizeof(config.mqtt_topic_s03), CONSOLE_TYPE_STR },
+};
+#define CONSOLE_FIELD_COUNT	(sizeof(consoleFields) / sizeof(consoleFields[0]))
+
+static os_event_t consoleQueue[CONSOLE_TASK_QUEUE_SIZE];
+static PROTO_PARSER consoleParser;
+static uint8_t consoleFrame[CONSOLE_FRAME_MAX];
+static ConsoleCallback consoleCb = NULL;
+static ETSTimer consoleTimer;
+
+/* PROTO_Add reads the length from the first two bytes, keep it aligned */
+static uint16_t consoleReply[(CONSOLE_FRAME_MAX + 1) / 2];
+static uint8_t consoleTx[CONSOLE_FRAME_MAX * 2 + 2];
+
+static void ICACHE_FLASH_ATTR console_restart(void *arg)
+{
+	// a config save may still be on its way to flash
+	FLASH_Flush();
+	system_restart();
+}
+
+static uint8_t ICACHE_FLASH_ATTR console_get(const uint8_t *data, uint16_t len, uint8_t *out, uint16_t *outLen)
+{
+	const CONSOLE_FIELD *field;
+	uint32_t value = 0;
+
+	if(len != 1 || data[0] >= CONSOLE_FIELD_COUNT)
+		return CONSOLE_ERR_ARG;
+	field = &consoleFields[data[0]];
+
+	switch(field->type){
+	case CONSOLE_TYPE_STR:
+		*outLen = os_strlen(field->data);
+		if(*outLen >= field->size)
+			*outLen = field->size - 1;
+		os_memcpy(out, field->data, *outLen);
+		break;
+	default:
+		value = field->type == CONSOLE_TYPE_U32 ? *(uint32_t *)field->data : *(uint8_t *)field->data;
+		out[0] = value;
+		out[1] = value >> 8;
+		out[2] = value >> 16;
+		out[3] = value >> 24;
+		*outLen = 4;
+		break;
+	}
+	return CONSOLE_OK;
+}
+
+static uint8_t ICACHE_FLASH_ATTR console_set(const uint8_t *data, uint16_t len)
+{
+	const CONSOLE_FIELD *field;
+	uint32_t value;
+
+	if(len < 1 || data[0] >= CONSOLE_FIELD_COUNT)
+		return CONSOLE_ERR_ARG;
+	field = &consoleFields[data[0]];
+	data++;
+	len--;
+
+	switch(field->type){
+	case CONSOLE_TYPE_STR:
+		if(len >= field->size)
+			return CONSOLE_ERR_ARG;
+		os_memset(field->data, 0, field->size);
+		os_memcpy(field->data, data, len);
+		break;
+	default:
+		if(len != 4)
+			return CONSOLE_ERR_ARG;
+		value = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+		if(field->type == CONSOLE_TYPE_U32)
+			*(uint32_t *)field->data = value;
+		else if(value > 0xFF)
+			return CONSOLE_ERR_ARG;
+		else
+			*(uint8_t *)field->data = value;
+		break;
+	}
+	return CONSOLE_OK;
+}
+
+static void ICACHE_FLASH_ATTR console_send(uint8_t cmd, uint8_t status, uint16_t outLen)
+{
+	uint8_t *reply = (uint8_t *)consoleReply;
+	int16_t txLen;
+
+	if(status != CONSOLE_OK)
+		outLen = 0;
+	consoleReply[0] = 4 + outLen;
+	reply[2] = cmd | CONSOLE_REPLY;
+	reply[3] = status;
+
+	txLen = PROTO_Add(consoleTx, reply, sizeof(consoleTx));
+	if(txLen > 0)
+		uart0_tx_buffer(consoleTx, txLen);
+}
+
+static void ICACHE_FLASH_ATTR console_execute(uint8_t cmd, const uint8_t *data, uint16_t len)
+{
+	uint8_t *out = (uint8_t *)consoleReply + 4;
+	uint16_t outLen = 0;
+	uint8_t status = CONSOLE_OK;
+	uint32_t id;
+
+	switch(cmd){
+	case CONSOLE_CMD_PING:
+		id = system_get_chip_id();
+		os_memcpy(out, &id, 4);
+		outLen = 4;
+		break;
+	case CONSOLE_CMD_GET:
+		status = console_get(data, len, out, &outLen);
+		break;
+	case CONSOLE_CMD_SET:
+		status = console_set(data, len);
+		break;
+	case CONSOLE_CMD_SAVE:
+		config_save();
+		break;
+	case CONSOLE_CMD_RESTART:
+		// give the reply time to leave the UART
+		os_timer_disarm(&consoleTimer);
+		os_timer_setfn(&consoleTimer, (os_timer_func_t *)console_restart, NULL);
+		os_timer_arm(&consoleTimer, 100, 0);
+		break;
+	default:
+		if(cmd >= CONSOLE_CMD_APP && consoleCb){
+			outLen = CONSOLE_FRAME_MAX - 4;
+			status = consoleCb(cmd, data, len, out, &outLen);
+		}
+		else {
+			status = CONSOLE_ERR_COMMAND;
+		}
+		break;
+	}
+	console_send(cmd, status, outLen);
+}
+
+/* End of frame from the parser, also called for a stray 0x7F */
+static void ICACHE_FLASH_ATTR console_frame(void)
+{
+	uint16_t len = consoleParser.dataLen;
+
+	if(!consoleParser.isBegin || len < 3)
+		return;
+	if(len >= CONSOLE_FRAME_MAX || (consoleFrame[0] | (consoleFrame[1] << 8)) != len){
+		LOG_W("CONSOLE: Bad frame length %d\r\n", len);
+		console_send(consoleFrame[2], CONSOLE_ERR_LENGTH, 0);
+		return;
+	}
+	console_execute(consoleFrame[2], consoleFrame + 3, len - 3);
+}
+
+static void ICACHE_FLASH_ATTR console_task(os_event_t *e)
+{
+	uint8_t buf[64];
+	uint16_t n;
+
+	while((n = uart0_rx_read(buf, sizeof(buf))) > 0)
+		PROTO_Parse(&consoleParser, buf, n);
+}
+
+/**
+  * @brief  Send an unsolicited frame, e.g. an event for an attached device
+  * @param  cmd: command, without CONSOLE_REPLY
+  * @param  data: arguments
+  * @param  len: length of data, at most CONSOLE_FRAME_MAX - 3
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR CONSOLE_Send(uint8_t cmd, const uint8_t *data, uint16_t len)
+{
+	uint8_t *frame = (uint8_t *)consoleReply;
+	int16_t txLen;
+
+	if(len > CONSOLE_FRAME_MAX - 3)
+		return;
+	consoleReply[0] = 3 + len;
+	frame[2] = cmd;
+	os_memcpy(frame + 3, data, len);
+
+	txLen = PROTO_Add(consoleTx, frame, sizeof(consoleTx));
+	if(txLen > 0)
+		uart0_tx_buffer(consoleTx, txLen);
+}
+
+/**
+  * @brief  Start the console on UART0
+  * @param  cb: handler for the application commands, may be NULL
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR CONSOLE_Init(ConsoleCallback cb)
+{
+	consoleCb = cb;
+	os_memset(&consoleParser, 0, sizeof(consoleParser));
+	PROTO_Init(&consoleParser, console_frame, consoleFrame, sizeof(consoleFrame));
+	system_os_task(console_task, CONSOLE_TASK_PRIO, consoleQueue, CONSOLE_TASK_QUEUE_SIZE);
+	uart0_rx_attach(CONSOLE_TASK_PRIO);
+}
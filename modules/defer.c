@@ -0,0 +1,38 @@
+/*
+ * defer.c
+ *
+ *  Interrupt handlers may only post a task event and set flags. They note
+ *  what is to be done in their own state and post the function that does
+ *  it, which then runs in task context.
+ */
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "defer.h"
+
+static os_event_t deferQueue[DEFER_TASK_QUEUE_SIZE];
+
+static void ICACHE_FLASH_ATTR defer_task(os_event_t *e)
+{
+	((DeferFunc)e->par)();
+}
+
+/**
+  * @brief  Register the task, before any interrupt handler is attached
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR DEFER_Init(void)
+{
+	system_os_task(defer_task, DEFER_TASK_PRIO, deferQueue, DEFER_TASK_QUEUE_SIZE);
+}
+
+/**
+  * @brief  Run func from the task, may be called from an interrupt handler
+  * @param  func: function to run
+  * @retval FALSE if the queue was full
+  */
+BOOL DEFER_Post(DeferFunc func)
+{
+	return system_os_post(DEFER_TASK_PRIO, 0, (os_param_t)func);
+}
@@ -0,0 +1,156 @@
+/*
+ * flash.c
+ *
+ *  Background flash writer.
+ *
+ *  spi_flash_erase_sector() alone takes tens of milliseconds. Instead of
+ *  running erase and write back to back, every record goes through a queue
+ *  and one step (a sector erase or a FLASH_WRITE_CHUNK sized write) is done
+ *  per timer tick, leaving the tasks, timers and espconn callbacks free to
+ *  run in between.
+ *
+ *  Writing a record that is already queued is a no-op, the latest data is
+ *  picked up when its turn comes. Writing a record that is in progress
+ *  marks it dirty and it is written again once the current pass is done,
+ *  so a torn image is never reported as saved.
+ */
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "flash.h"
+#define LOG_MODULE FLASH
+#include "debug.h"
+
+#ifndef FLASH_STEP_INTERVAL
+#define FLASH_STEP_INTERVAL		5
+#endif
+
+#ifndef FLASH_WRITE_CHUNK
+#define FLASH_WRITE_CHUNK		256
+#endif
+
+static ETSTimer flashTimer;
+static FLASH_RECORD *flashHead = NULL, *flashTail = NULL;
+
+static void ICACHE_FLASH_ATTR flash_finish(FLASH_RECORD *rec, BOOL success)
+{
+	flashHead = rec->next;
+	if(flashHead == NULL)
+		flashTail = NULL;
+	rec->next = NULL;
+	rec->state = FLASH_REC_IDLE;
+	rec->dirty = 0;
+
+	if(rec->cb)
+		rec->cb(rec->arg, success);
+}
+
+static BOOL ICACHE_FLASH_ATTR flash_step(void)
+{
+	FLASH_RECORD *rec = flashHead;
+	SpiFlashOpResult res;
+	uint16_t len;
+
+	if(rec == NULL)
+		return FALSE;
+
+	switch(rec->state){
+	case FLASH_REC_QUEUED:
+	case FLASH_REC_ERASE:
+		rec->dirty = 0;
+		rec->offset = 0;
+		res = spi_flash_erase_sector(rec->sector);
+		rec->state = FLASH_REC_WRITE;
+		break;
+	case FLASH_REC_WRITE:
+		len = rec->length - rec->offset;
+		if(len > FLASH_WRITE_CHUNK)
+			len = FLASH_WRITE_CHUNK;
+		res = spi_flash_write(rec->sector * SPI_FLASH_SEC_SIZE + rec->offset,
+							  (uint32 *)((uint8_t *)rec->data + rec->offset), len);
+		rec->offset += len;
+		if(res == SPI_FLASH_RESULT_OK && rec->offset >= rec->length){
+			if(rec->dirty)
+				rec->state = FLASH_REC_ERASE;
+			else
+				flash_finish(rec, TRUE);
+		}
+		break;
+	default:
+		res = SPI_FLASH_RESULT_ERR;
+		break;
+	}
+
+	if(res != SPI_FLASH_RESULT_OK){
+		LOG_E("FLASH: sector %d failed (%d)\r\n", rec->sector, res);
+		flash_finish(rec, FALSE);
+	}
+	return flashHead != NULL;
+}
+
+static void ICACHE_FLASH_ATTR flash_timer(void *arg);
+
+static void ICACHE_FLASH_ATTR flash_schedule(void)
+{
+	os_timer_disarm(&flashTimer);
+	os_timer_setfn(&flashTimer, (os_timer_func_t *)flash_timer, NULL);
+	os_timer_arm(&flashTimer, FLASH_STEP_INTERVAL, 0);
+}
+
+static void ICACHE_FLASH_ATTR flash_timer(void *arg)
+{
+	if(flash_step())
+		flash_schedule();
+}
+
+/**
+  * @brief  Schedule a record to be written to its sector.
+  * @param  rec: record to write, length is rounded up to a whole word
+  * @retval TRUE if the record is queued or already pending
+  */
+BOOL ICACHE_FLASH_ATTR FLASH_Write(FLASH_RECORD *rec)
+{
+	if(rec->data == NULL || rec->length == 0 || rec->length > SPI_FLASH_SEC_SIZE)
+		return FALSE;
+	rec->length = (rec->length + 3) & ~3;
+
+	switch(rec->state){
+	case FLASH_REC_QUEUED:
+		return TRUE;
+	case FLASH_REC_ERASE:
+	case FLASH_REC_WRITE:
+		rec->dirty = 1;
+		return TRUE;
+	default:
+		break;
+	}
+
+	rec->state = FLASH_REC_QUEUED;
+	rec->dirty = 0;
+	rec->next = NULL;
+	if(flashTail)
+		flashTail->next = rec;
+	else
+		flashHead = rec;
+	flashTail = rec;
+
+	if(flashHead == rec)
+		flash_schedule();
+	return TRUE;
+}
+
+BOOL ICACHE_FLASH_ATTR FLASH_IsBusy(void)
+{
+	return flashHead != NULL;
+}
+
+/**
+  * @brief  Run all pending steps now, blocking. Use before a restart.
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR FLASH_Flush(void)
+{
+	os_timer_disarm(&flashTimer);
+	while(flash_step());
+}
@@ -0,0 +1,43 @@
+/*
+ * ccount.h
+ *
+ *  The Xtensa cycle counter, CCOUNT. It runs at the CPU clock and wraps
+ *  every 53 s at 80 MHz, so only differences over short spans mean
+ *  anything. Host builds count nanoseconds of the monotonic clock
+ *  instead, as a 1000 MHz CPU would; cycles / CCOUNT_MHZ is us on both.
+ */
+
+#ifndef USER_CCOUNT_H_
+#define USER_CCOUNT_H_
+
+#include "c_types.h"
+
+#ifdef __XTENSA__
+
+#define CCOUNT_MHZ		system_get_cpu_freq()
+
+static inline uint32_t ccount_read(void)
+{
+	uint32_t ccount;
+
+	__asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+	return ccount;
+}
+
+#else
+
+#include <time.h>
+
+#define CCOUNT_MHZ		1000
+
+static inline uint32_t ccount_read(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+#endif
+
+#endif /* USER_CCOUNT_H_ */
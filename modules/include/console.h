@@ -0,0 +1,64 @@
+/*
+ * console.h
+ *
+ *  Binary command console on UART0, for provisioning and local control
+ *  without WiFi. Frames use the PROTO framing (0x7E start, 0x7F end, 0x7D
+ *  escapes the next byte, which is sent xor 0x20) around
+ *
+ *    length (16 bit little endian, whole payload), command, arguments
+ *
+ *  Every frame is answered with command | CONSOLE_REPLY, a status byte and
+ *  the result. Frames the device sends on its own (CONSOLE_Send) carry
+ *  the command without the reply bit and no status. tools/console.py
+ *  talks this protocol.
+ */
+
+#ifndef USER_CONSOLE_H_
+#define USER_CONSOLE_H_
+#include "os_type.h"
+
+#define CONSOLE_TASK_PRIO		1
+#define CONSOLE_TASK_QUEUE_SIZE	2
+
+#ifndef CONSOLE_FRAME_MAX
+#define CONSOLE_FRAME_MAX		128
+#endif
+
+#define CONSOLE_REPLY			0x80
+
+#define CONSOLE_CMD_PING		0x01	// -> chip id (32 bit)
+#define CONSOLE_CMD_GET			0x02	// field -> value
+#define CONSOLE_CMD_SET			0x03	// field, value
+#define CONSOLE_CMD_SAVE		0x04	// write the configuration to flash
+#define CONSOLE_CMD_RESTART		0x05
+#define CONSOLE_CMD_APP			0x10	// this and above go to the ConsoleCallback
+
+#define CONSOLE_OK				0
+#define CONSOLE_ERR_COMMAND		1
+#define CONSOLE_ERR_ARG			2
+#define CONSOLE_ERR_LENGTH		3
+
+/* Configuration fields for GET/SET. Strings are sent without terminator,
+ * numbers as 32 bit little endian. */
+#define CONSOLE_FIELD_DEVICE_ID	0
+#define CONSOLE_FIELD_STA_SSID	1
+#define CONSOLE_FIELD_STA_PWD	2
+#define CONSOLE_FIELD_MQTT_HOST	3
+#define CONSOLE_FIELD_MQTT_PORT	4
+#define CONSOLE_FIELD_MQTT_USER	5
+#define CONSOLE_FIELD_MQTT_PASS	6
+#define CONSOLE_FIELD_KEEPALIVE	7
+#define CONSOLE_FIELD_SECURITY	8
+#define CONSOLE_FIELD_TOPIC_S01	9
+#define CONSOLE_FIELD_TOPIC_S02	10
+#define CONSOLE_FIELD_TOPIC_S03	11
+
+/* Handles commands from CONSOLE_CMD_APP up. The result goes to reply (at
+ * most *replyLen bytes, set *replyLen to the length used). Returns the
+ * status byte. */
+typedef uint8_t (*ConsoleCallback)(uint8_t cmd, const uint8_t *data, uint16_t len, uint8_t *reply, uint16_t *replyLen);
+
+void ICACHE_FLASH_ATTR CONSOLE_Init(ConsoleCallback cb);
+void ICACHE_FLASH_ATTR CONSOLE_Send(uint8_t cmd, const uint8_t *data, uint16_t len);
+
+#endif /* USER_CONSOLE_H_ */
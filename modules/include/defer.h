@@ -0,0 +1,21 @@
+/*
+ * defer.h
+ *
+ *  Work handed from interrupt handlers to task context. The SDK has three
+ *  task priorities and MQTT and the console take two of them, so all
+ *  interrupt handlers share the one task here.
+ */
+
+#ifndef USER_DEFER_H_
+#define USER_DEFER_H_
+#include "os_type.h"
+
+#define DEFER_TASK_PRIO			2
+#define DEFER_TASK_QUEUE_SIZE	4	// one per user, each keeps at most one post in flight
+
+typedef void (*DeferFunc)(void);
+
+void ICACHE_FLASH_ATTR DEFER_Init(void);
+BOOL DEFER_Post(DeferFunc func);
+
+#endif /* USER_DEFER_H_ */
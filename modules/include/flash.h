@@ -0,0 +1,39 @@
+/*
+ * flash.h
+ *
+ *  Background flash writer. Erase and write work is split into small steps
+ *  that run from a timer, so persisting a record never stalls the caller.
+ */
+
+#ifndef USER_FLASH_H_
+#define USER_FLASH_H_
+#include "os_type.h"
+
+typedef void (*FlashCallback)(void *arg, BOOL success);
+
+typedef enum {
+	FLASH_REC_IDLE,
+	FLASH_REC_QUEUED,
+	FLASH_REC_ERASE,
+	FLASH_REC_WRITE
+} tFlashRecState;
+
+/* A record owns one flash sector. The data is read at write time, so the
+ * buffer must stay valid (and 4-byte aligned) until the callback fires. */
+typedef struct flash_record {
+	uint16_t sector;
+	const void *data;
+	uint16_t length;
+	FlashCallback cb;
+	void *arg;
+	tFlashRecState state;
+	uint8_t dirty;
+	uint16_t offset;
+	struct flash_record *next;
+} FLASH_RECORD;
+
+BOOL ICACHE_FLASH_ATTR FLASH_Write(FLASH_RECORD *rec);
+BOOL ICACHE_FLASH_ATTR FLASH_IsBusy(void);
+void ICACHE_FLASH_ATTR FLASH_Flush(void);
+
+#endif /* USER_FLASH_H_ */
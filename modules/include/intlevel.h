@@ -0,0 +1,36 @@
+/*
+ * intlevel.h
+ *
+ *  Critical sections for code that also runs in interrupt handlers.
+ *  ETS_INTR_UNLOCK enables all interrupts whatever the level was before,
+ *  inside an ISR that lets it nest. xt_rsil raises the interrupt level and
+ *  returns the old PS, xt_wsr_ps puts it back:
+ *
+ *    uint32_t ps = xt_rsil(15);
+ *    ...
+ *    xt_wsr_ps(ps);
+ *
+ *  Host builds take the lock of the interrupt mocks instead.
+ */
+
+#ifndef USER_INTLEVEL_H_
+#define USER_INTLEVEL_H_
+
+#include "c_types.h"
+
+#ifdef __XTENSA__
+
+#define xt_rsil(level)		(__extension__({ uint32_t state; \
+								__asm__ __volatile__("rsil %0," #level : "=a"(state) :: "memory"); state; }))
+#define xt_wsr_ps(state)	__asm__ __volatile__("wsr %0,ps; isync" :: "a"(state) : "memory")
+
+#else
+
+#include "ets_sys.h"
+
+#define xt_rsil(level)		(host_intr_lock(), (uint32_t)(level))
+#define xt_wsr_ps(state)	((void)(state), host_intr_unlock())
+
+#endif
+
+#endif /* USER_INTLEVEL_H_ */
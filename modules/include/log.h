@@ -0,0 +1,39 @@
+/*
+ * log.h
+ *
+ *  Deferred binary log ring, used by the LOG_x() macros in debug.h when
+ *  LOG_DEFERRED is set. Each record is framed as
+ *
+ *    0xA5, length, module, level << 4 | nargs, line (16 bit),
+ *    string mask (16 bit), timestamp us (32 bit), arguments
+ *
+ *  little endian, length counting the bytes after itself. A plain argument
+ *  is stored as 32 bits, a string as a length byte and at most LOG_STR_MAX
+ *  characters. A record that does not fit is dropped and counted.
+ */
+
+#ifndef USER_LOG_H_
+#define USER_LOG_H_
+#include "os_type.h"
+
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE		1024
+#endif
+
+#ifndef LOG_STR_MAX
+#define LOG_STR_MAX			20
+#endif
+
+/* Drain interval, up to 128 bytes are handed to the UART this often */
+#ifndef LOG_DRAIN_MS
+#define LOG_DRAIN_MS		20
+#endif
+
+#define LOG_MAX_ARGS		10
+#define LOG_SYNC			0xA5
+
+void ICACHE_FLASH_ATTR LOG_Init(void);
+uint32_t ICACHE_FLASH_ATTR LOG_Dropped(void);
+void ICACHE_FLASH_ATTR log_write(uint32_t header, uint16_t strmask, ...);
+
+#endif /* USER_LOG_H_ */
@@ -0,0 +1,59 @@
+/*
+ * memtrack.h
+ *
+ *  Heap accounting. Allocations made through MEM_ZALLOC carry a small
+ *  header with their size and a subsystem tag, so live bytes, peak and
+ *  allocation count are known per tag and a leak shows up as growth of
+ *  one of them. MEMTRACK_Json appends the figures and the SDK heap
+ *  numbers to the diagnostics message.
+ */
+
+#ifndef USER_MEMTRACK_H_
+#define USER_MEMTRACK_H_
+#include "os_type.h"
+#include "mem.h"
+
+#ifndef MEMTRACK
+#define MEMTRACK			1
+#endif
+
+/* Allocation tags, appended only, they index the diagnostics array */
+#define MEM_TAG_APP			0
+#define MEM_TAG_MQTT		1	// client strings and buffers
+#define MEM_TAG_QUEUE		2	// outbound message queue
+#define MEM_TAG_CONN		3	// espconn and esp_tcp
+#define MEM_TAG_COUNT		4
+
+typedef struct {
+	uint32_t live;			// bytes currently allocated
+	uint32_t peak;			// high-water mark of live
+	uint32_t allocs;		// allocations ever made
+	uint16_t count;			// allocations currently live
+} MEMTRACK_TAG;
+
+typedef struct {
+	uint32_t free;			// system_get_free_heap_size()
+	uint32_t minFree;		// lowest free seen by MEMTRACK_GetHeap
+	uint32_t largest;		// largest block that can be allocated
+	uint8_t fragPct;		// 100 - largest * 100 / free
+} MEMTRACK_HEAP;
+
+/* Longest MEMTRACK_Json output */
+#define MEMTRACK_JSON_MAX	(80 + MEM_TAG_COUNT * 36)
+
+#if MEMTRACK
+#define MEM_ZALLOC(tag, size)	MEMTRACK_Zalloc((tag), (size))
+#define MEM_FREE(p)				MEMTRACK_Free(p)
+#else
+#define MEM_ZALLOC(tag, size)	os_zalloc(size)
+#define MEM_FREE(p)				os_free(p)
+#endif
+
+void* ICACHE_FLASH_ATTR MEMTRACK_Zalloc(uint8_t tag, uint32_t size);
+void ICACHE_FLASH_ATTR MEMTRACK_Free(void *p);
+void ICACHE_FLASH_ATTR MEMTRACK_Get(uint8_t tag, MEMTRACK_TAG *stats);
+uint32_t ICACHE_FLASH_ATTR MEMTRACK_Live(void);
+void ICACHE_FLASH_ATTR MEMTRACK_GetHeap(MEMTRACK_HEAP *heap);
+int ICACHE_FLASH_ATTR MEMTRACK_Json(char *buf, int size);
+
+#endif /* USER_MEMTRACK_H_ */
@@ -0,0 +1,52 @@
+/*
+ * power.h
+ *
+ *  Radio power scheduler. The radio sleeps (modem or light sleep) whenever
+ *  nothing holds it awake; commands in flight and pending reports take a
+ *  hold until they are done.
+ */
+
+#ifndef USER_POWER_H_
+#define USER_POWER_H_
+#include "os_type.h"
+
+typedef enum {
+	POWER_MODE_NONE,
+	POWER_MODE_MODEM,
+	POWER_MODE_LIGHT
+} tPowerMode;
+
+#ifndef POWER_SLEEP_MODE
+#define POWER_SLEEP_MODE		POWER_MODE_MODEM
+#endif
+
+/* Print the power statistics every this many seconds, 0 to disable */
+#ifndef POWER_REPORT_INTERVAL
+#define POWER_REPORT_INTERVAL	300
+#endif
+
+#define POWER_MAX_WAKE_PINS		4
+
+#define POWER_HOLD_COMMAND		0x01	// inbound command being actuated/reported
+#define POWER_HOLD_INPUT		0x02	// input edge waiting for its publish
+#define POWER_HOLD_CONNECT		0x04	// MQTT session being set up
+#define POWER_HOLD_BENCH		0x08	// self-benchmark running, see selfbench.h
+
+typedef struct {
+	uint32_t uptime_ms;
+	uint32_t awake_ms;
+	uint8_t awake_pct;
+	uint32_t wakes;
+	uint32_t wake_latency_last_us;
+	uint32_t wake_latency_max_us;
+	uint32_t wake_latency_avg_us;
+} POWER_STATS;
+
+void ICACHE_FLASH_ATTR POWER_Init(tPowerMode mode);
+void ICACHE_FLASH_ATTR POWER_Hold(uint8_t reason);
+void POWER_HoldFromISR(uint8_t reason);
+void ICACHE_FLASH_ATTR POWER_Release(uint8_t reason);
+void ICACHE_FLASH_ATTR POWER_WakeOnGpio(uint8_t gpio);
+void ICACHE_FLASH_ATTR POWER_GetStats(POWER_STATS *stats);
+
+#endif /* USER_POWER_H_ */
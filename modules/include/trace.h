@@ -0,0 +1,74 @@
+/*
+ * trace.h
+ *
+ *  Latency tracing of the switch paths. Trace points store a CCOUNT
+ *  timestamp in a RAM ring, from the GPIO interrupt as well as from
+ *  tasks:
+ *
+ *    input    GPIO ISR -> debounce -> CHANNEL_Set -> GPIO write
+ *    command  recv -> dispatch -> CHANNEL_Set -> GPIO write
+ *    report   GPIO write -> MQTT_Publish -> espconn_sent -> sent callback
+ *
+ *  TRACE_Json walks the ring, pairs every point with the one before it on
+ *  the path and sums the gaps into a log2 histogram per segment. A message
+ *  on TRACE_TOPIC "/get" publishes it to TRACE_TOPIC:
+ *
+ *    {"n":<points>,"isr-debounce":{"n":..,"avg":<us>,"max":<us>,
+ *     "h":[<1 us>,<2 us>,<4 us>,...]},...}
+ *
+ *  Only segments with samples are listed, each histogram ends with its
+ *  last non-empty bucket. Bucket i counts gaps of 2^i to 2^(i+1) - 1 us,
+ *  the last one everything longer.
+ */
+
+#ifndef USER_TRACE_H_
+#define USER_TRACE_H_
+#include "os_type.h"
+
+#ifndef TRACE
+#define TRACE				0
+#endif
+
+#ifndef TRACE_TOPIC
+#define TRACE_TOPIC			"/%08X/trace"
+#endif
+
+// Points kept, a power of two; 8 bytes each
+#ifndef TRACE_RING
+#define TRACE_RING			128
+#endif
+
+#define TRACE_BUCKETS		20
+
+#define TRACE_SEGMENT_COUNT	8		// segments summarized, see trace.c
+
+/* Longest segment in TRACE_Json: a name of up to 16 characters, three
+ * counters and TRACE_BUCKETS counts of up to 5 digits */
+#define TRACE_SEGMENT_JSON	(64 + 16 + TRACE_BUCKETS * 6)
+
+/* Longest TRACE_Json output, every segment included */
+#define TRACE_JSON_MAX		(16 + TRACE_SEGMENT_COUNT * TRACE_SEGMENT_JSON)
+
+/* Trace points, appended only */
+#define TRACE_GPIO_ISR		0	// input edge interrupt entry
+#define TRACE_DEBOUNCE		1	// edge accepted for a channel
+#define TRACE_SET			2	// CHANNEL_Set with a new state
+#define TRACE_GPIO_WRITE	3	// relay output written
+#define TRACE_ENQUEUE		4	// MQTT_Publish queued a message
+#define TRACE_SEND			5	// espconn_sent of a queued publish
+#define TRACE_SENT			6	// sent callback of that publish
+#define TRACE_RECV			7	// mqtt_tcpclient_recv entry
+#define TRACE_DISPATCH		8	// command for a channel found
+#define TRACE_POINTS		9
+
+#if TRACE
+#define TRACE_POINT(point)	TRACE_Point(point)
+#else
+#define TRACE_POINT(point)
+#endif
+
+void TRACE_Point(uint8_t point);
+void ICACHE_FLASH_ATTR TRACE_Clear(void);
+int ICACHE_FLASH_ATTR TRACE_Json(char *buf, int size);
+
+#endif /* USER_TRACE_H_ */
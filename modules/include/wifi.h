@@ -8,8 +8,42 @@
 #ifndef USER_WIFI_H_
 #define USER_WIFI_H_
 #include "os_type.h"
+
+/* Reconnect straight to the last AP (BSSID and channel kept in RTC memory)
+ * instead of scanning, falling back to a full scan if that fails. */
+#ifndef WIFI_FAST_BOOT
+#define WIFI_FAST_BOOT				1
+#endif
+
+/* Also reuse the last DHCP lease (ip, netmask, gateway) on fast boot */
+#ifndef WIFI_FAST_BOOT_STATIC_IP
+#define WIFI_FAST_BOOT_STATIC_IP	0
+#endif
+
+/* Give up on the cached AP after this many ms without an IP */
+#ifndef WIFI_FAST_BOOT_TIMEOUT
+#define WIFI_FAST_BOOT_TIMEOUT		3000
+#endif
+
+/* Number of networks that can be registered with WIFI_AddAP */
+#ifndef WIFI_MAX_APS
+#define WIFI_MAX_APS				4
+#endif
+
+/* Reconnect when an association got no IP within this many ms */
+#ifndef WIFI_GOT_IP_TIMEOUT
+#define WIFI_GOT_IP_TIMEOUT			10000
+#endif
+
+/* Delay before retrying after a disconnect or an empty scan, in ms */
+#ifndef WIFI_RETRY_INTERVAL
+#define WIFI_RETRY_INTERVAL			1000
+#endif
+
 typedef void (*WifiCallback)(uint8_t);
+BOOL ICACHE_FLASH_ATTR WIFI_AddAP(uint8_t* ssid, uint8_t* pass);
 void ICACHE_FLASH_ATTR WIFI_Connect(uint8_t* ssid, uint8_t* pass, WifiCallback cb);
+BOOL ICACHE_FLASH_ATTR WIFI_IsFastBoot(void);
 
 
 #endif /* USER_WIFI_H_ */
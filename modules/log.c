@@ -0,0 +1,146 @@
+/*
+ * log.c
+ *
+ *  Deferred binary log ring.
+ *
+ *  log_write() builds the record on the stack and copies it into the ring
+ *  with interrupts masked. It restores the saved PS instead of unlocking,
+ *  so it is safe from the GPIO interrupt handler.
+ *  A timer moves at most what the UART TX ring can take without waiting,
+ *  the CPU never spins on the UART. When records had to be dropped, a
+ *  record with module APP, line 0 and the drop count is sent once the ring
+ *  has room again.
+ */
+#include <stdarg.h>
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "driver/uart.h"
+#include "ringbuf.h"
+#include "intlevel.h"
+#include "debug.h"
+#include "log.h"
+
+#if LOG_DEFERRED
+
+#define LOG_HEADER_LEN		12
+#define LOG_RECORD_MAX		(LOG_HEADER_LEN + LOG_MAX_ARGS * (LOG_STR_MAX + 1))
+
+#if LOG_RECORD_MAX - 2 > 255
+#error "LOG_STR_MAX too large for the record length byte"
+#endif
+
+/* Statically initialised so that messages from before LOG_Init() are kept */
+static uint8_t logBuf[LOG_RING_SIZE];
+static RINGBUF logRing = { logBuf, logBuf, logBuf, 0, LOG_RING_SIZE };
+static uint32_t logDropped = 0, logDropReported = 0;
+static ETSTimer logTimer;
+
+static uint8_t ICACHE_FLASH_ATTR log_put32(uint8_t *p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+	return 4;
+}
+
+/* Append a complete record or nothing. Interrupts are masked by the caller */
+static BOOL ICACHE_FLASH_ATTR log_commit(const uint8_t *rec, uint16_t len)
+{
+	return RINGBUF_PutBlock(&logRing, rec, len) == 0;
+}
+
+void ICACHE_FLASH_ATTR log_write(uint32_t header, uint16_t strmask, ...)
+{
+	uint8_t rec[LOG_RECORD_MAX];
+	uint8_t nargs = (header >> 12) & 0x0F, i, n;
+	uint16_t len;
+	uint32_t ps;
+	const uint8_t *s;
+	va_list ap;
+
+	rec[0] = LOG_SYNC;
+	rec[2] = header;
+	rec[3] = ((header >> 4) & 0xF0) | nargs;
+	rec[4] = header >> 16;
+	rec[5] = header >> 24;
+	rec[6] = strmask;
+	rec[7] = strmask >> 8;
+	len = 8 + log_put32(rec + 8, system_get_time());
+
+	va_start(ap, strmask);
+	for(i = 0; i < nargs && i < LOG_MAX_ARGS; i++){
+		if(strmask & (1 << i)){
+			s = (const uint8_t *)va_arg(ap, size_t);
+			for(n = 0; s && n < LOG_STR_MAX && s[n]; n++)
+				rec[len + 1 + n] = s[n];
+			rec[len] = n;
+			len += 1 + n;
+		}
+		else {
+			len += log_put32(rec + len, va_arg(ap, size_t));
+		}
+	}
+	va_end(ap);
+	rec[1] = len - 2;
+
+	ps = xt_rsil(15);
+	if(!log_commit(rec, len))
+		logDropped++;
+	xt_wsr_ps(ps);
+}
+
+static void ICACHE_FLASH_ATTR log_drain(void *arg)
+{
+	uint8_t chunk[128], rec[LOG_HEADER_LEN + 4];
+	uint16_t room, n = 0;
+
+	if(logDropped != logDropReported){
+		rec[0] = LOG_SYNC;
+		rec[1] = LOG_HEADER_LEN + 4 - 2;
+		rec[2] = LOG_ID_APP;
+		rec[3] = (LOG_LEVEL_WARN << 4) | 1;
+		rec[4] = rec[5] = rec[6] = rec[7] = 0;
+		log_put32(rec + 8, system_get_time());
+		log_put32(rec + 12, logDropped);
+		ETS_INTR_LOCK();
+		if(log_commit(rec, sizeof(rec)))
+			logDropReported = logDropped;
+		ETS_INTR_UNLOCK();
+	}
+
+	room = uart0_tx_room();
+	if(room > sizeof(chunk))
+		room = sizeof(chunk);
+
+	ETS_INTR_LOCK();
+	while(n < room && RINGBUF_Get(&logRing, &chunk[n]) == 0)
+		n++;
+	ETS_INTR_UNLOCK();
+
+	if(n)
+		uart0_tx_buffer(chunk, n);
+}
+
+/**
+  * @brief  Start draining the log ring to UART0
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR LOG_Init(void)
+{
+	os_timer_disarm(&logTimer);
+	os_timer_setfn(&logTimer, (os_timer_func_t *)log_drain, NULL);
+	os_timer_arm(&logTimer, LOG_DRAIN_MS, 1);
+}
+
+/**
+  * @brief  Number of records dropped because the ring was full
+  */
+uint32_t ICACHE_FLASH_ATTR LOG_Dropped(void)
+{
+	return logDropped;
+}
+
+#endif /* LOG_DEFERRED */
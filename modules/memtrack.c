@@ -0,0 +1,160 @@
+/*
+ * memtrack.c
+ *
+ *  Heap accounting for MEM_ZALLOC/MEM_FREE.
+ *
+ *  Every tracked block starts with an 8 byte header (size, tag and a
+ *  magic number, which catches frees of untracked or already freed
+ *  pointers). The header keeps the returned pointer 8 byte aligned.
+ *
+ *  The SDK only reports the free heap size, so the largest free block is
+ *  found by a binary search of trial allocations when the heap figures
+ *  are read. It's a few dozen malloc/free pairs, cheap enough for the
+ *  diagnostics interval.
+ */
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "mem.h"
+#include "user_interface.h"
+#include "memtrack.h"
+#define LOG_MODULE MEM
+#include "debug.h"
+
+#define MEMTRACK_MAGIC		0xA110
+#define MEMTRACK_FREED		0xDEAD
+
+typedef struct {
+	uint32_t size;
+	uint16_t magic;
+	uint8_t tag;
+	uint8_t reserved;
+} MEMTRACK_HEADER;
+
+static MEMTRACK_TAG memTags[MEM_TAG_COUNT];
+static uint32_t memMinFree = 0xFFFFFFFF;
+
+/**
+  * @brief  Allocate zeroed memory and account it to a tag
+  * @param  tag: MEM_TAG_*
+  * @param  size: bytes
+  * @retval The memory, NULL if the heap is exhausted
+  */
+void* ICACHE_FLASH_ATTR MEMTRACK_Zalloc(uint8_t tag, uint32_t size)
+{
+	MEMTRACK_HEADER *h;
+	MEMTRACK_TAG *t;
+
+	if(tag >= MEM_TAG_COUNT)
+		tag = MEM_TAG_APP;
+	h = (MEMTRACK_HEADER *)os_zalloc(sizeof(MEMTRACK_HEADER) + size);
+	if(h == NULL){
+		LOG_E("MEM: %d bytes for tag %d failed\r\n", size, tag);
+		return NULL;
+	}
+	h->size = size;
+	h->magic = MEMTRACK_MAGIC;
+	h->tag = tag;
+
+	t = &memTags[tag];
+	t->live += size;
+	t->count++;
+	t->allocs++;
+	if(t->live > t->peak)
+		t->peak = t->live;
+	return h + 1;
+}
+
+/**
+  * @brief  Free memory from MEMTRACK_Zalloc, NULL is ignored
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR MEMTRACK_Free(void *p)
+{
+	MEMTRACK_HEADER *h;
+	MEMTRACK_TAG *t;
+
+	if(p == NULL)
+		return;
+	h = (MEMTRACK_HEADER *)p - 1;
+	if(h->magic != MEMTRACK_MAGIC || h->tag >= MEM_TAG_COUNT){
+		LOG_E("MEM: Free of an untracked or freed block\r\n");
+		return;
+	}
+	t = &memTags[h->tag];
+	t->live -= h->size;
+	t->count--;
+	h->magic = MEMTRACK_FREED;
+	os_free(h);
+}
+
+void ICACHE_FLASH_ATTR MEMTRACK_Get(uint8_t tag, MEMTRACK_TAG *stats)
+{
+	if(tag < MEM_TAG_COUNT)
+		os_memcpy(stats, &memTags[tag], sizeof(MEMTRACK_TAG));
+}
+
+/* Live bytes over all tags, a leak check compares it before and after */
+uint32_t ICACHE_FLASH_ATTR MEMTRACK_Live(void)
+{
+	uint32_t live = 0;
+	int i;
+
+	for(i = 0; i < MEM_TAG_COUNT; i++)
+		live += memTags[i].live;
+	return live;
+}
+
+/**
+  * @brief  Read the SDK heap figures and estimate the fragmentation
+  * @param  heap: filled in
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR MEMTRACK_GetHeap(MEMTRACK_HEAP *heap)
+{
+	uint32_t lo = 0, hi, mid;
+	void *p;
+
+	heap->free = system_get_free_heap_size();
+	if(heap->free < memMinFree)
+		memMinFree = heap->free;
+	heap->minFree = memMinFree;
+
+	// largest block: lo can be allocated, hi can't
+	hi = heap->free + 1;
+	while(hi - lo > 16){
+		mid = lo + (hi - lo) / 2;
+		p = os_malloc(mid);
+		if(p != NULL){
+			os_free(p);
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	heap->largest = lo;
+	heap->fragPct = heap->free ? 100 - lo * 100 / heap->free : 0;
+}
+
+/**
+  * @brief  Append the heap figures to a JSON object
+  * @param  buf: receives "heap":{...}, without separator
+  * @param  size: at least MEMTRACK_JSON_MAX
+  * @retval Length written, 0 if buf is too small
+  */
+int ICACHE_FLASH_ATTR MEMTRACK_Json(char *buf, int size)
+{
+	MEMTRACK_HEAP heap;
+	int len, i;
+
+	if(size < MEMTRACK_JSON_MAX)
+		return 0;
+	MEMTRACK_GetHeap(&heap);
+	len = os_sprintf(buf, "\"heap\":{\"free\":%d,\"min\":%d,\"big\":%d,\"frag\":%d,\"tags\":[",
+			heap.free, heap.minFree, heap.largest, heap.fragPct);
+	for(i = 0; i < MEM_TAG_COUNT; i++)
+		len += os_sprintf(buf + len, "%s[%d,%d,%d]", i ? "," : "", memTags[i].live, memTags[i].peak, memTags[i].count);
+	len += os_sprintf(buf + len, "]}");
+	return len;
+}
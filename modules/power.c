@@ -0,0 +1,227 @@
+/*
+ * power.c
+ *
+ *  Radio power scheduler.
+ *
+ *  The SDK sleep type is switched between the configured mode and
+ *  NONE_SLEEP_T depending on a hold mask. Holds are taken while an
+ *  inbound command is being actuated and reported, while an input edge is
+ *  waiting for its publish to leave, and while the MQTT session is being
+ *  set up. With no hold the radio only wakes for DTIM beacons, outbound
+ *  queue flushes and the keepalive.
+ *
+ *  In light sleep the CPU is halted as well, so the input pins are armed
+ *  as level wakeup sources (the opposite of their current level) while no
+ *  hold is active and switched back to edge interrupts on wake.
+ *
+ *  None of that may run in an interrupt: POWER_HoldFromISR only notes the
+ *  hold and defers taking it to task context.
+ */
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "gpio.h"
+#include "user_interface.h"
+#include "ccount.h"
+#include "defer.h"
+#include "power.h"
+#define LOG_MODULE POWER
+#include "debug.h"
+
+static tPowerMode powerMode = POWER_MODE_NONE;
+static uint8_t powerHolds = 0;
+static uint8_t wakePins[POWER_MAX_WAKE_PINS];
+static uint8_t wakePinCount = 0;
+static ETSTimer powerTimer;
+static volatile uint8_t powerPending = 0;		// holds from interrupts
+static volatile uint32_t powerPendingAt;		// ccount of the first
+
+static uint32_t lastSample, inputSince;
+static uint64_t uptimeTotal, awakeTotal;
+static POWER_STATS powerStats;
+
+/* Account the time since the last sample, call before the holds change.
+ * system_get_time() wraps every ~71 minutes, the report timer keeps the
+ * samples closer together than that. */
+static void ICACHE_FLASH_ATTR power_sample(void)
+{
+	uint32_t now = system_get_time();
+	uint32_t delta = now - lastSample;
+
+	lastSample = now;
+	uptimeTotal += delta;
+	if(powerHolds || powerMode == POWER_MODE_NONE)
+		awakeTotal += delta;
+}
+
+static void ICACHE_FLASH_ATTR power_arm_wakeup(void)
+{
+	int i;
+	uint8_t level;
+
+	for(i = 0; i < wakePinCount; i++){
+		level = GPIO_INPUT_GET(GPIO_ID_PIN(wakePins[i]));
+		gpio_pin_wakeup_enable(GPIO_ID_PIN(wakePins[i]), level ? GPIO_PIN_INTR_LOLEVEL : GPIO_PIN_INTR_HILEVEL);
+	}
+}
+
+static void ICACHE_FLASH_ATTR power_disarm_wakeup(void)
+{
+	int i;
+
+	if(wakePinCount == 0)
+		return;
+	gpio_pin_wakeup_disable();
+	for(i = 0; i < wakePinCount; i++)
+		gpio_pin_intr_state_set(GPIO_ID_PIN(wakePins[i]), GPIO_PIN_INTR_ANYEDGE);
+}
+
+static void ICACHE_FLASH_ATTR power_apply(void)
+{
+	if(powerHolds || powerMode == POWER_MODE_NONE){
+		wifi_set_sleep_type(NONE_SLEEP_T);
+	}
+	else if(powerMode == POWER_MODE_LIGHT){
+		power_arm_wakeup();
+		wifi_set_sleep_type(LIGHT_SLEEP_T);
+	}
+	else {
+		wifi_set_sleep_type(MODEM_SLEEP_T);
+	}
+}
+
+static void ICACHE_FLASH_ATTR power_report(void *arg)
+{
+	POWER_STATS stats;
+
+	POWER_GetStats(&stats);
+	INFO("POWER: awake %d%% (%d/%d ms), wakes %d, wake-to-publish last %d max %d avg %d us\r\n",
+			stats.awake_pct, stats.awake_ms, stats.uptime_ms, stats.wakes,
+			stats.wake_latency_last_us, stats.wake_latency_max_us, stats.wake_latency_avg_us);
+}
+
+/* since: system_get_time() of the event the hold is for */
+static void ICACHE_FLASH_ATTR power_hold(uint8_t reason, uint32_t since)
+{
+	if((reason & POWER_HOLD_INPUT) && !(powerHolds & POWER_HOLD_INPUT))
+		inputSince = since;
+
+	if(powerHolds == 0){
+		power_sample();
+		powerStats.wakes ++;
+		powerHolds |= reason;
+		if(powerMode == POWER_MODE_LIGHT)
+			power_disarm_wakeup();
+		power_apply();
+		return;
+	}
+	powerHolds |= reason;
+}
+
+/* Take the holds noted by POWER_HoldFromISR */
+static void ICACHE_FLASH_ATTR power_pending(void)
+{
+	uint8_t reasons;
+	uint32_t since;
+
+	ETS_INTR_LOCK();
+	reasons = powerPending;
+	since = powerPendingAt;
+	powerPending = 0;
+	ETS_INTR_UNLOCK();
+	// the input latency counts from the edge, not from here
+	if(reasons)
+		power_hold(reasons, system_get_time() - (ccount_read() - since) / CCOUNT_MHZ);
+}
+
+/**
+  * @brief  Select the sleep mode used while nothing holds the radio awake
+  * @param  mode: POWER_MODE_NONE, POWER_MODE_MODEM or POWER_MODE_LIGHT
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR POWER_Init(tPowerMode mode)
+{
+	powerMode = mode;
+	lastSample = system_get_time();
+	uptimeTotal = 0;
+	awakeTotal = 0;
+	os_memset(&powerStats, 0, sizeof(POWER_STATS));
+	power_apply();
+
+#if POWER_REPORT_INTERVAL > 0
+	os_timer_disarm(&powerTimer);
+	os_timer_setfn(&powerTimer, (os_timer_func_t *)power_report, NULL);
+	os_timer_arm(&powerTimer, POWER_REPORT_INTERVAL * 1000, 1);
+#endif
+}
+
+/**
+  * @brief  Keep the radio awake until the matching POWER_Release
+  * @param  reason: one of the POWER_HOLD_* flags
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR POWER_Hold(uint8_t reason)
+{
+	power_hold(reason, system_get_time());
+}
+
+/**
+  * @brief  POWER_Hold for interrupt handlers, taken from the defer task
+  * @param  reason: one of the POWER_HOLD_* flags
+  * @retval None
+  */
+void POWER_HoldFromISR(uint8_t reason)
+{
+	// a post is in flight while anything is pending
+	if(powerPending == 0){
+		powerPendingAt = ccount_read();
+		DEFER_Post(power_pending);
+	}
+	powerPending |= reason;
+}
+
+void ICACHE_FLASH_ATTR POWER_Release(uint8_t reason)
+{
+	uint32_t latency;
+
+	if((reason & POWER_HOLD_INPUT) && (powerHolds & POWER_HOLD_INPUT)){
+		latency = system_get_time() - inputSince;
+		powerStats.wake_latency_last_us = latency;
+		if(latency > powerStats.wake_latency_max_us)
+			powerStats.wake_latency_max_us = latency;
+		// exponential moving average, 1/8 weight
+		if(powerStats.wake_latency_avg_us == 0)
+			powerStats.wake_latency_avg_us = latency;
+		else
+			powerStats.wake_latency_avg_us += ((int32_t)latency - (int32_t)powerStats.wake_latency_avg_us) / 8;
+	}
+
+	if(powerHolds == 0 || (powerHolds & reason) == 0)
+		return;
+	if((powerHolds & ~reason) == 0)
+		power_sample();
+	powerHolds &= ~reason;
+	if(powerHolds == 0)
+		power_apply();
+}
+
+/**
+  * @brief  Register an input pin that wakes the chip from light sleep
+  * @param  gpio: GPIO number, must already be configured as an input
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR POWER_WakeOnGpio(uint8_t gpio)
+{
+	if(wakePinCount < POWER_MAX_WAKE_PINS)
+		wakePins[wakePinCount++] = gpio;
+}
+
+void ICACHE_FLASH_ATTR POWER_GetStats(POWER_STATS *stats)
+{
+	power_sample();
+
+	os_memcpy(stats, &powerStats, sizeof(POWER_STATS));
+	stats->uptime_ms = uptimeTotal / 1000;
+	stats->awake_ms = awakeTotal / 1000;
+	stats->awake_pct = stats->uptime_ms ? (stats->awake_ms * 100) / stats->uptime_ms : 100;
+}
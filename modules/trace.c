@@ -0,0 +1,190 @@
+/*
+ * trace.c
+ *
+ *  Trace point ring and its latency summary, see trace.h.
+ *
+ *  TRACE_Point is in IRAM, it's called from the GPIO interrupt. The ring
+ *  is summarized as it is, so a point written during TRACE_Json can make
+ *  one pair look reversed; those gaps are skipped.
+ *
+ *  Pairing: a point opens a pending gap on the segment it starts, the
+ *  next point the segment ends closes it. Where the path forks into one
+ *  point (CHANNEL_Set after a debounce or a dispatch) the most recent
+ *  pending gap wins. Queue segments close the oldest pending gap first;
+ *  the others close the newest and drop older ones, which were merged
+ *  into it (several writes, one report).
+ */
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "ccount.h"
+#include "intlevel.h"
+#include "trace.h"
+
+#if TRACE
+
+#define TRACE_PENDING		4
+
+typedef struct {
+	uint32_t ccount;
+	uint8_t point;
+	uint8_t reserved[3];
+} TRACE_ENTRY;
+
+typedef struct {
+	const char *name;
+	uint8_t from;
+	uint8_t to;
+	uint8_t fifo;
+} TRACE_SEGMENT;
+
+typedef struct {
+	uint32_t pending[TRACE_PENDING];	// ccount of the open gaps, oldest first
+	uint8_t pendingCount;
+	uint16_t n;
+	uint32_t sumUs;
+	uint32_t maxUs;
+	uint16_t hist[TRACE_BUCKETS];
+} TRACE_STATS;
+
+static const TRACE_SEGMENT traceSegments[TRACE_SEGMENT_COUNT] = {
+	{ "isr-debounce",	TRACE_GPIO_ISR,		TRACE_DEBOUNCE,		0 },
+	{ "debounce-set",	TRACE_DEBOUNCE,		TRACE_SET,			0 },
+	{ "recv-dispatch",	TRACE_RECV,			TRACE_DISPATCH,		0 },
+	{ "dispatch-set",	TRACE_DISPATCH,		TRACE_SET,			0 },
+	{ "set-write",		TRACE_SET,			TRACE_GPIO_WRITE,	0 },
+	{ "write-enqueue",	TRACE_GPIO_WRITE,	TRACE_ENQUEUE,		0 },
+	{ "enqueue-send",	TRACE_ENQUEUE,		TRACE_SEND,			1 },
+	{ "send-sent",		TRACE_SEND,			TRACE_SENT,			1 }
+};
+
+#define TRACE_SEGMENTS		TRACE_SEGMENT_COUNT
+
+static TRACE_ENTRY traceRing[TRACE_RING];
+static uint32_t traceHead = 0;				// points ever recorded
+static TRACE_STATS traceStats[TRACE_SEGMENTS];
+
+/**
+  * @brief  Record a trace point with the current cycle count
+  * @param  point: TRACE_*
+  */
+void TRACE_Point(uint8_t point)
+{
+	uint32_t now = ccount_read();
+	uint32_t ps;
+	TRACE_ENTRY *e;
+
+	// ETS_INTR_UNLOCK would enable interrupts inside the GPIO ISR
+	ps = xt_rsil(15);
+	e = &traceRing[traceHead++ & (TRACE_RING - 1)];
+	e->ccount = now;
+	e->point = point;
+	xt_wsr_ps(ps);
+}
+
+void ICACHE_FLASH_ATTR TRACE_Clear(void)
+{
+	ETS_INTR_LOCK();
+	traceHead = 0;
+	ETS_INTR_UNLOCK();
+}
+
+static void ICACHE_FLASH_ATTR trace_open(TRACE_STATS *s, uint32_t ccount)
+{
+	if(s->pendingCount == TRACE_PENDING){
+		os_memmove(s->pending, s->pending + 1, (TRACE_PENDING - 1) * sizeof(s->pending[0]));
+		s->pendingCount--;
+	}
+	s->pending[s->pendingCount++] = ccount;
+}
+
+static void ICACHE_FLASH_ATTR trace_close(const TRACE_SEGMENT *seg, TRACE_STATS *s, uint32_t ccount, uint32_t mhz)
+{
+	uint32_t from, us;
+	uint8_t bucket = 0;
+
+	if(seg->fifo){
+		from = s->pending[0];
+		os_memmove(s->pending, s->pending + 1, (s->pendingCount - 1) * sizeof(s->pending[0]));
+		s->pendingCount--;
+	} else {
+		from = s->pending[s->pendingCount - 1];
+		s->pendingCount = 0;
+	}
+	if(ccount - from >= 0x80000000)
+		return;
+
+	us = (ccount - from) / mhz;
+	while(bucket < TRACE_BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+		bucket++;
+	s->hist[bucket]++;
+	s->n++;
+	s->sumUs += us;
+	if(us > s->maxUs)
+		s->maxUs = us;
+}
+
+static void ICACHE_FLASH_ATTR trace_summarize(void)
+{
+	uint32_t head = traceHead, first, i, mhz = CCOUNT_MHZ;
+	const TRACE_ENTRY *e;
+	TRACE_STATS *s;
+	int k, best;
+
+	os_memset(traceStats, 0, sizeof(traceStats));
+	first = head > TRACE_RING ? head - TRACE_RING : 0;
+	for(i = first; i < head; i++){
+		e = &traceRing[i & (TRACE_RING - 1)];
+
+		// close the newest pending gap that ends here
+		best = -1;
+		for(k = 0; k < TRACE_SEGMENTS; k++){
+			s = &traceStats[k];
+			if(traceSegments[k].to != e->point || s->pendingCount == 0)
+				continue;
+			if(best < 0 || (int32_t)(s->pending[s->pendingCount - 1] - traceStats[best].pending[traceStats[best].pendingCount - 1]) > 0)
+				best = k;
+		}
+		if(best >= 0)
+			trace_close(&traceSegments[best], &traceStats[best], e->ccount, mhz);
+
+		for(k = 0; k < TRACE_SEGMENTS; k++){
+			if(traceSegments[k].from == e->point)
+				trace_open(&traceStats[k], e->ccount);
+		}
+	}
+}
+
+/**
+  * @brief  Summarize the ring into per segment histograms
+  * @param  buf: at least TRACE_JSON_MAX bytes
+  * @retval Length of the JSON object written, 0 if buf is too small
+  */
+int ICACHE_FLASH_ATTR TRACE_Json(char *buf, int size)
+{
+	TRACE_STATS *s;
+	int len, k, i, last;
+
+	if(size < TRACE_JSON_MAX)
+		return 0;
+	trace_summarize();
+
+	len = os_sprintf(buf, "{\"n\":%d", traceHead > TRACE_RING ? TRACE_RING : traceHead);
+	for(k = 0; k < TRACE_SEGMENTS && len + TRACE_SEGMENT_JSON < size; k++){
+		s = &traceStats[k];
+		if(s->n == 0)
+			continue;
+		len += os_sprintf(buf + len, ",\"%s\":{\"n\":%d,\"avg\":%d,\"max\":%d,\"h\":[",
+				traceSegments[k].name, s->n, s->sumUs / s->n, s->maxUs);
+		for(last = TRACE_BUCKETS - 1; last > 0 && s->hist[last] == 0; last--)
+			;
+		for(i = 0; i <= last; i++)
+			len += os_sprintf(buf + len, "%s%d", i ? "," : "", s->hist[i]);
+		len += os_sprintf(buf + len, "]}");
+	}
+	len += os_sprintf(buf + len, "}");
+	return len;
+}
+
+#endif
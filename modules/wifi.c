@@ -3,6 +3,11 @@
  *
  *  Created on: Dec 30, 2014
  *      Author: Minh
+ *
+ *  Station management driven by SDK WiFi events. Link loss, association
+ *  and DHCP results are reported to the WifiCallback as they happen. When
+ *  several APs are known, a scan picks the strongest one on every
+ *  (re)connect.
  */
 #include "wifi.h"
 #include "user_interface.h"
@@ -11,89 +16,313 @@
 #include "os_type.h"
 #include "mem.h"
 #include "mqtt_msg.h"
+#define LOG_MODULE WIFI
 #include "debug.h"
 #include "user_config.h"
 #include "config.h"
 
+#ifndef MACSTR
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+#endif
+
+#define WIFI_CACHE_MAGIC		0x57464331
+#define WIFI_CACHE_RTC_ADDR		64		// first RTC block available to user code
+
+typedef struct {
+	uint32_t magic;
+	uint32_t ssid_sum;
+	uint8_t bssid[6];
+	uint8_t channel;
+	uint8_t has_ip;
+	struct ip_info ip;
+	uint32_t checksum;
+} WIFI_CACHE;
+
+typedef struct {
+	uint8_t ssid[33];		// up to 32 bytes and the terminator
+	uint8_t pass[64];
+} WIFI_AP;
+
 static ETSTimer WiFiLinker;
 WifiCallback wifiCb = NULL;
 static uint8_t wifiStatus = STATION_IDLE, lastWifiStatus = STATION_IDLE;
-static void ICACHE_FLASH_ATTR wifi_check_ip(void *arg)
+static struct station_config stationConf;
+static WIFI_CACHE wifiCache;
+static WIFI_AP wifiAps[WIFI_MAX_APS];
+static uint8_t wifiApCount = 0;
+static BOOL fastBoot = FALSE, fastBootPending = FALSE, scanning = FALSE;
+
+static uint32_t ICACHE_FLASH_ATTR wifi_sum(const uint8_t *data, uint32_t len)
 {
-	struct ip_info ipConfig;
+	uint32_t sum = 0x811C9DC5;
+	while(len--)
+		sum = (sum ^ *data++) * 0x01000193;
+	return sum;
+}
 
-	os_timer_disarm(&WiFiLinker);
-	wifi_get_ip_info(STATION_IF, &ipConfig);
-	wifiStatus = wifi_station_get_connect_status();
-	if (wifiStatus == STATION_GOT_IP && ipConfig.ip.addr != 0)
-	{
+/* station_config holds a 32 byte SSID without a terminator */
+static uint8_t ICACHE_FLASH_ATTR wifi_ssid_len(const uint8_t *ssid)
+{
+	uint8_t len = 0;
+	while(len < 32 && ssid[len])
+		len++;
+	return len;
+}
 
-		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-		os_timer_arm(&WiFiLinker, 2000, 0);
+static BOOL ICACHE_FLASH_ATTR wifi_cache_load(void)
+{
+	if(!system_rtc_mem_read(WIFI_CACHE_RTC_ADDR, &wifiCache, sizeof(WIFI_CACHE)))
+		return FALSE;
+	if(wifiCache.magic != WIFI_CACHE_MAGIC)
+		return FALSE;
+	return wifiCache.checksum == wifi_sum((uint8_t *)&wifiCache, sizeof(WIFI_CACHE) - 4);
+}
 
+static void ICACHE_FLASH_ATTR wifi_cache_save(void)
+{
+	wifiCache.magic = WIFI_CACHE_MAGIC;
+	wifiCache.ssid_sum = wifi_sum(stationConf.ssid, wifi_ssid_len(stationConf.ssid));
+	wifiCache.checksum = wifi_sum((uint8_t *)&wifiCache, sizeof(WIFI_CACHE) - 4);
+	system_rtc_mem_write(WIFI_CACHE_RTC_ADDR, &wifiCache, sizeof(WIFI_CACHE));
+}
 
+static void ICACHE_FLASH_ATTR wifi_cache_clear(void)
+{
+	os_memset(&wifiCache, 0, sizeof(WIFI_CACHE));
+	system_rtc_mem_write(WIFI_CACHE_RTC_ADDR, &wifiCache, sizeof(WIFI_CACHE));
+}
+
+static WIFI_AP* ICACHE_FLASH_ATTR wifi_find_ap(const uint8_t *ssid, uint8_t len)
+{
+	int i;
+	for(i = 0; i < wifiApCount; i++){
+		if(os_strlen(wifiAps[i].ssid) == len && os_memcmp(wifiAps[i].ssid, ssid, len) == 0)
+			return &wifiAps[i];
 	}
-	else
-	{
-		if(wifi_station_get_connect_status() == STATION_WRONG_PASSWORD)
-		{
+	return NULL;
+}
 
-			INFO("STATION_WRONG_PASSWORD\r\n");
-			wifi_station_connect();
+static void ICACHE_FLASH_ATTR wifi_set_status(uint8_t status)
+{
+	wifiStatus = status;
+	if(wifiStatus != lastWifiStatus){
+		lastWifiStatus = wifiStatus;
+		if(wifiCb)
+			wifiCb(wifiStatus);
+	}
+}
+
+static void ICACHE_FLASH_ATTR wifi_connect_ap(WIFI_AP *ap, const uint8_t *bssid, uint8_t channel)
+{
+	os_memset(&stationConf, 0, sizeof(struct station_config));
+	os_memcpy(stationConf.ssid, ap->ssid, sizeof(stationConf.ssid));
+	os_memcpy(stationConf.password, ap->pass, sizeof(stationConf.password));
+	if(bssid){
+		stationConf.bssid_set = 1;
+		os_memcpy(stationConf.bssid, bssid, 6);
+	}
+	if(channel)
+		wifi_set_channel(channel);
 
+	wifi_station_disconnect();
+	wifi_station_set_config(&stationConf);
+	wifi_station_connect();
+}
 
+static void ICACHE_FLASH_ATTR wifi_scan_done(void *arg, STATUS status)
+{
+	struct bss_info *bss = (struct bss_info *)arg;
+	struct bss_info *best = NULL;
+	WIFI_AP *ap, *bestAp = NULL;
+
+	scanning = FALSE;
+	if(status == OK){
+		for(; bss != NULL; bss = STAILQ_NEXT(bss, next)){
+			ap = wifi_find_ap(bss->ssid, bss->ssid_len ? bss->ssid_len : os_strlen(bss->ssid));
+			if(ap && (best == NULL || bss->rssi > best->rssi)){
+				best = bss;
+				bestAp = ap;
+			}
 		}
-		else if(wifi_station_get_connect_status() == STATION_NO_AP_FOUND)
-		{
+	}
 
-			INFO("STATION_NO_AP_FOUND\r\n");
-			wifi_station_connect();
+	if(best == NULL){
+		LOG_W("WIFI: No known AP found\r\n");
+		os_timer_arm(&WiFiLinker, WIFI_RETRY_INTERVAL, 0);
+		return;
+	}
 
+	INFO("WIFI: Connect to %s " MACSTR " ch %d rssi %d\r\n", bestAp->ssid, MAC2STR(best->bssid), best->channel, best->rssi);
+	wifi_connect_ap(bestAp, best->bssid, best->channel);
+}
+
+/* (Re)connect to the best known AP */
+static void ICACHE_FLASH_ATTR wifi_reconnect(void *arg)
+{
+	os_timer_disarm(&WiFiLinker);
+
+	if(wifiApCount > 1){
+		if(scanning)
+			return;
+		scanning = wifi_station_scan(NULL, wifi_scan_done);
+		if(!scanning)
+			os_timer_arm(&WiFiLinker, WIFI_RETRY_INTERVAL, 0);
+	}
+	else {
+		wifi_connect_ap(&wifiAps[0], NULL, 0);
+	}
+}
+
+/* The cached AP did not work out, forget it and do a full scan + DHCP */
+static void ICACHE_FLASH_ATTR wifi_fallback(void *arg)
+{
+	INFO("WIFI: Fast boot failed, scanning\r\n");
+	fastBoot = FALSE;
+	fastBootPending = FALSE;
+	wifi_cache_clear();
+#if WIFI_FAST_BOOT_STATIC_IP
+	wifi_station_dhcpc_start();
+#endif
+	os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_reconnect, NULL);
+	wifi_reconnect(NULL);
+}
 
+static void ICACHE_FLASH_ATTR wifi_event_cb(System_Event_t *evt)
+{
+	switch(evt->event){
+	case EVENT_STAMODE_CONNECTED:
+		INFO("WIFI: Associated, channel %d\r\n", evt->event_info.connected.channel);
+		os_memcpy(wifiCache.bssid, evt->event_info.connected.bssid, 6);
+		wifiCache.channel = evt->event_info.connected.channel;
+		// Nothing to report before GOT_IP, the link is not usable yet. A
+		// retry must not disturb the association, but if no address comes
+		// the timeout reconnects. The fast boot one is armed already.
+		if(!fastBootPending){
+			os_timer_disarm(&WiFiLinker);
+			os_timer_arm(&WiFiLinker, WIFI_GOT_IP_TIMEOUT, 0);
 		}
-		else if(wifi_station_get_connect_status() == STATION_CONNECT_FAIL)
-		{
+		break;
 
-			INFO("STATION_CONNECT_FAIL\r\n");
-			wifi_station_connect();
+	case EVENT_STAMODE_GOT_IP:
+		INFO("WIFI: Got ip " IPSTR "\r\n", IP2STR(&evt->event_info.got_ip.ip));
+		os_timer_disarm(&WiFiLinker);
+		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_reconnect, NULL);
+		fastBootPending = FALSE;
+#if WIFI_FAST_BOOT
+		wifi_get_ip_info(STATION_IF, &wifiCache.ip);
+		wifiCache.has_ip = 1;
+		wifi_cache_save();
+#endif
+		wifi_set_status(STATION_GOT_IP);
+		break;
+
+	case EVENT_STAMODE_DISCONNECTED:
+		INFO("WIFI: Disconnected, reason %d\r\n", evt->event_info.disconnected.reason);
+		switch(evt->event_info.disconnected.reason){
+		case REASON_NO_AP_FOUND:
+			wifi_set_status(STATION_NO_AP_FOUND);
+			break;
+		case REASON_AUTH_FAIL:
+		case REASON_HANDSHAKE_TIMEOUT:
+			wifi_set_status(STATION_WRONG_PASSWORD);
+			break;
+		default:
+			wifi_set_status(STATION_CONNECT_FAIL);
+			break;
+		}
 
+		if(fastBootPending){
+			wifi_fallback(NULL);
 		}
-		else
-		{
-			INFO("STATION_IDLE\r\n");
+		else {
+			os_timer_disarm(&WiFiLinker);
+			os_timer_arm(&WiFiLinker, WIFI_RETRY_INTERVAL, 0);
 		}
+		break;
 
-		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-		os_timer_arm(&WiFiLinker, 500, 0);
-	}
-	if(wifiStatus != lastWifiStatus){
-		lastWifiStatus = wifiStatus;
-		if(wifiCb)
-			wifiCb(wifiStatus);
+	case EVENT_STAMODE_DHCP_TIMEOUT:
+		INFO("WIFI: DHCP timeout\r\n");
+		if(fastBootPending){
+			wifi_fallback(NULL);
+		}
+		else {
+			// associated but unusable, start over like after a disconnect
+			wifi_station_disconnect();
+			os_timer_disarm(&WiFiLinker);
+			os_timer_arm(&WiFiLinker, WIFI_RETRY_INTERVAL, 0);
+		}
+		break;
 	}
 }
 
+/**
+  * @brief  Add an AP to the list of known networks
+  * @retval TRUE if added
+  */
+BOOL ICACHE_FLASH_ATTR WIFI_AddAP(uint8_t* ssid, uint8_t* pass)
+{
+	if(ssid == NULL || ssid[0] == 0 || wifiApCount >= WIFI_MAX_APS)
+		return FALSE;
+	if(wifi_find_ap(ssid, os_strlen(ssid)))
+		return TRUE;
+
+	os_memset(&wifiAps[wifiApCount], 0, sizeof(WIFI_AP));
+	os_strncpy((char *)wifiAps[wifiApCount].ssid, (char *)ssid, sizeof(wifiAps[0].ssid) - 1);
+	os_strncpy((char *)wifiAps[wifiApCount].pass, (char *)pass, sizeof(wifiAps[0].pass) - 1);
+	wifiApCount++;
+	return TRUE;
+}
+
 void ICACHE_FLASH_ATTR WIFI_Connect(uint8_t* ssid, uint8_t* pass, WifiCallback cb)
 {
-	struct station_config stationConf;
+	int i;
+	WIFI_AP *ap = NULL;
 
 	INFO("WIFI_INIT\r\n");
 	wifi_set_opmode(STATION_MODE);
 	wifi_station_set_auto_connect(FALSE);
+	wifi_station_set_reconnect_policy(FALSE);
 	wifiCb = cb;
 
-	os_memset(&stationConf, 0, sizeof(struct station_config));
+	WIFI_AddAP(ssid, pass);
+	if(wifiApCount == 0)
+		return;
 
-	os_sprintf(stationConf.ssid, "%s", ssid);
-	os_sprintf(stationConf.password, "%s", pass);
+	wifi_set_event_handler_cb(wifi_event_cb);
+	os_timer_disarm(&WiFiLinker);
+	os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_reconnect, NULL);
 
-	wifi_station_set_config(&stationConf);
+#if WIFI_FAST_BOOT
+	if(wifi_cache_load()){
+		for(i = 0; i < wifiApCount; i++){
+			if(wifiCache.ssid_sum == wifi_sum(wifiAps[i].ssid, os_strlen(wifiAps[i].ssid)))
+				ap = &wifiAps[i];
+		}
+	}
+	if(ap){
+		INFO("WIFI: Fast boot, channel %d, bssid " MACSTR "\r\n", wifiCache.channel, MAC2STR(wifiCache.bssid));
+		fastBoot = TRUE;
+		fastBootPending = TRUE;
+#if WIFI_FAST_BOOT_STATIC_IP
+		if(wifiCache.has_ip){
+			wifi_station_dhcpc_stop();
+			wifi_set_ip_info(STATION_IF, &wifiCache.ip);
+		}
+#endif
+		wifi_connect_ap(ap, wifiCache.bssid, wifiCache.channel);
 
-	os_timer_disarm(&WiFiLinker);
-	os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-	os_timer_arm(&WiFiLinker, 1000, 0);
+		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_fallback, NULL);
+		os_timer_arm(&WiFiLinker, WIFI_FAST_BOOT_TIMEOUT, 0);
+		return;
+	}
+	os_memset(&wifiCache, 0, sizeof(WIFI_CACHE));
+#endif
 
-	wifi_station_set_auto_connect(TRUE);
-	wifi_station_connect();
+	wifi_reconnect(NULL);
 }
 
+BOOL ICACHE_FLASH_ATTR WIFI_IsFastBoot(void)
+{
+	return fastBoot;
+}
@@ -3,13 +3,156 @@
  *
  *  Created on: Dec 4, 2014
  *      Author: Minh
+ *
+ *  Leveled logging. A source file names its module before including this
+ *  header (#define LOG_MODULE MQTT) and every LOG_x() call below the
+ *  module's level compiles away. The level defaults to LOG_LEVEL and can be
+ *  set per module, e.g. -DLOG_LEVEL_MQTT=LOG_LEVEL_WARN.
+ *
+ *  With LOG_DEFERRED set, a call stores only the module, line and raw
+ *  arguments in a RAM ring (see log.h) which is drained to UART0 in the
+ *  background. The format string is never referenced, so it is not linked
+ *  into flash; tools/logdecode.py rebuilds it from the sources.
  */
 
 #ifndef USER_DEBUG_H_
 #define USER_DEBUG_H_
 
+#define LOG_LEVEL_NONE		0
+#define LOG_LEVEL_ERROR		1
+#define LOG_LEVEL_WARN		2
+#define LOG_LEVEL_INFO		3
+#define LOG_LEVEL_DEBUG		4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL			LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_DEFERRED
+#define LOG_DEFERRED		0
+#endif
+
+/* Module ids are part of the binary record, append only */
+#define LOG_ID_APP			0
+#define LOG_ID_MQTT			1
+#define LOG_ID_WIFI			2
+#define LOG_ID_CONFIG		3
+#define LOG_ID_FLASH		4
+#define LOG_ID_POWER		5
+#define LOG_ID_MAIN			6
+#define LOG_ID_CHANNEL		7
+#define LOG_ID_REPORT		8
+#define LOG_ID_DISCOVERY	9
+#define LOG_ID_CONSOLE		10
+#define LOG_ID_BRIDGE		11
+#define LOG_ID_MEM			12
+#define LOG_ID_BENCH		13
+
+#ifndef LOG_LEVEL_APP
+#define LOG_LEVEL_APP		LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_MQTT
+#define LOG_LEVEL_MQTT		LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_WIFI
+#define LOG_LEVEL_WIFI		LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_CONFIG
+#define LOG_LEVEL_CONFIG	LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_FLASH
+#define LOG_LEVEL_FLASH		LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_POWER
+#define LOG_LEVEL_POWER		LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_MAIN
+#define LOG_LEVEL_MAIN		LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_CHANNEL
+#define LOG_LEVEL_CHANNEL	LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_REPORT
+#define LOG_LEVEL_REPORT	LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_DISCOVERY
+#define LOG_LEVEL_DISCOVERY	LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_CONSOLE
+#define LOG_LEVEL_CONSOLE	LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_BRIDGE
+#define LOG_LEVEL_BRIDGE	LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_MEM
+#define LOG_LEVEL_MEM		LOG_LEVEL
+#endif
+#ifndef LOG_LEVEL_BENCH
+#define LOG_LEVEL_BENCH		LOG_LEVEL
+#endif
+
+#ifndef LOG_MODULE
+#define LOG_MODULE			APP
+#endif
+
+#define LOG_PASTE_(a, b)	a##b
+#define LOG_PASTE(a, b)		LOG_PASTE_(a, b)
+#define LOG_ENABLED(level)	(LOG_PASTE(LOG_LEVEL_, LOG_MODULE) >= (level))
+
+#if LOG_DEFERRED
+#include "log.h"
+
+/* Argument count and per-argument mapping, up to LOG_MAX_ARGS */
+#define LOG_NARGS(...)		LOG_NARGS_(0, ##__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, n, ...) n
+
+#define LOG_EACH(m, ...)	LOG_PASTE(LOG_EACH_, LOG_NARGS(__VA_ARGS__))(m, 0, ##__VA_ARGS__)
+#define LOG_EACH_0(m, i)
+#define LOG_EACH_1(m, i, a)		m(i, a)
+#define LOG_EACH_2(m, i, a, ...)	m(i, a) LOG_EACH_1(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_3(m, i, a, ...)	m(i, a) LOG_EACH_2(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_4(m, i, a, ...)	m(i, a) LOG_EACH_3(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_5(m, i, a, ...)	m(i, a) LOG_EACH_4(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_6(m, i, a, ...)	m(i, a) LOG_EACH_5(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_7(m, i, a, ...)	m(i, a) LOG_EACH_6(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_8(m, i, a, ...)	m(i, a) LOG_EACH_7(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_9(m, i, a, ...)	m(i, a) LOG_EACH_8(m, i + 1, __VA_ARGS__)
+#define LOG_EACH_10(m, i, a, ...)	m(i, a) LOG_EACH_9(m, i + 1, __VA_ARGS__)
+
+/* Bit i of the string mask marks argument i as a RAM string to copy */
+#define LOG_IS_STR(x) \
+	(__builtin_types_compatible_p(__typeof__((x) + 0), char *) || \
+	 __builtin_types_compatible_p(__typeof__((x) + 0), const char *) || \
+	 __builtin_types_compatible_p(__typeof__((x) + 0), unsigned char *) || \
+	 __builtin_types_compatible_p(__typeof__((x) + 0), const unsigned char *))
+#define LOG_STR_BIT(i, x)	| (LOG_IS_STR(x) << (i))
+#define LOG_ARG(i, x)		, (size_t)(x)
+
+#define LOG_HEADER(level, n) \
+	((LOG_PASTE(LOG_ID_, LOG_MODULE)) | ((level) << 8) | ((n) << 12) | ((uint32_t)__LINE__ << 16))
+
+#define LOG_EMIT_(level, fmt, ...) \
+	log_write(LOG_HEADER(level, LOG_NARGS(__VA_ARGS__)), \
+			0 LOG_EACH(LOG_STR_BIT, ##__VA_ARGS__) LOG_EACH(LOG_ARG, ##__VA_ARGS__))
+#else
+#define LOG_EMIT_(level, fmt, ...)	os_printf(fmt, ##__VA_ARGS__)
+#endif
+
+/* The extra level expands argument macros (MAC2STR, IP2STR) before counting */
+#define LOG_EMIT(level, ...)	LOG_EMIT_(level, __VA_ARGS__)
+
+#define LOG_AT(level, ...) do { \
+	if(LOG_ENABLED(level)) \
+		LOG_EMIT(level, __VA_ARGS__); \
+} while(0)
+
+#define LOG_E(...)	LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_W(...)	LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_I(...)	LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_D(...)	LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
 #ifndef INFO
-#define INFO os_printf
+#define INFO		LOG_I
 #endif
 
 #endif /* USER_DEBUG_H_ */
@@ -31,8 +31,88 @@
 #define USER_AT_MQTT_H_
 #include "mqtt_msg.h"
 #include "user_interface.h"
+#include "espconn.h"
 
 #include "queue.h"
+#include "user_config.h"
+
+/* Buffer sizes. Inbound, outbound and the queue are sized separately,
+ * by default for the longest topic and payload the firmware uses in that
+ * direction. MQTT_BUF_SIZE (user_config.h) is the largest packet taken
+ * at all, see MQTT_BUF_DYNAMIC. */
+
+// Fixed header, topic length and packet id around topic and payload
+#define MQTT_PACKET_OVERHEAD	8
+
+// Type byte and up to 4 remaining length bytes
+#define MQTT_FIXED_HEADER_MAX	5
+
+// Longest topic: the bridge topics (BRIDGE_TOPIC_MAX), channel topics are 20
+#ifndef MQTT_TOPIC_MAX
+#define MQTT_TOPIC_MAX			48
+#endif
+
+// Longest inbound payload: a bridge record, Home Assistant commands are shorter
+#ifndef MQTT_IN_PAYLOAD_MAX
+#define MQTT_IN_PAYLOAD_MAX		128
+#endif
+
+// Longest outbound payload: the diagnostics snapshot, longer ones are streamed
+#ifndef MQTT_OUT_PAYLOAD_MAX
+#define MQTT_OUT_PAYLOAD_MAX	MQTT_STATS_JSON_MAX
+#endif
+
+#ifndef MQTT_IN_BUF_SIZE
+#define MQTT_IN_BUF_SIZE		(MQTT_PACKET_OVERHEAD + MQTT_TOPIC_MAX + MQTT_IN_PAYLOAD_MAX)
+#endif
+
+#ifndef MQTT_OUT_BUF_SIZE
+#define MQTT_OUT_BUF_SIZE		(MQTT_PACKET_OVERHEAD + MQTT_TOPIC_MAX + MQTT_OUT_PAYLOAD_MAX)
+#endif
+
+// The longest message even if every byte needs escaping, or it and the
+// short ones queued behind it
+#ifndef QUEUE_BUFFER_SIZE
+#define QUEUE_BUFFER_SIZE		(2 * MQTT_OUT_BUF_SIZE)
+#endif
+
+// Take packets up to MQTT_BUF_SIZE that don't fit the buffers in a heap
+// buffer of their size, freed again right after
+#ifndef MQTT_BUF_DYNAMIC
+#define MQTT_BUF_DYNAMIC		0
+#endif
+
+#ifndef MQTT_BUF_SIZE
+#define MQTT_BUF_SIZE			1024
+#endif
+
+// Largest message that can be queued, the size of the send buffer
+#if MQTT_BUF_DYNAMIC
+#define MQTT_SEND_BUF_SIZE		MQTT_BUF_SIZE
+#else
+#define MQTT_SEND_BUF_SIZE		MQTT_OUT_BUF_SIZE
+#endif
+
+// Heap saved against MQTT_BUF_SIZE both ways and the former 2 KB queue
+#define MQTT_BUF_RECLAIMED		((int)(2 * MQTT_BUF_SIZE + 2048) - \
+								 (int)(MQTT_IN_BUF_SIZE + MQTT_OUT_BUF_SIZE + QUEUE_BUFFER_SIZE))
+
+// Take the client memory from a static arena instead of the heap
+#ifndef MQTT_ARENA
+#define MQTT_ARENA				1
+#endif
+
+// Room for the host, client id, credentials, will and diagnostics topic
+#ifndef MQTT_ARENA_STRINGS
+#define MQTT_ARENA_STRINGS		256
+#endif
+
+// Arena for MQTT_InitConnectionArena: in and out buffer, queue, strings,
+// two espconn with their esp_tcp (the connection and one still closing),
+// and their rounding to 4 bytes
+#define MQTT_ARENA_SIZE			(MQTT_IN_BUF_SIZE + MQTT_OUT_BUF_SIZE + QUEUE_BUFFER_SIZE + MQTT_ARENA_STRINGS + \
+								 2 * (sizeof(struct espconn) + sizeof(esp_tcp)) + 16)
+
 typedef struct mqtt_event_data_t
 {
   uint8_t type;
@@ -79,11 +159,80 @@ typedef enum {
 	MQTT_SUBSCIBE_SENDING,
 	MQTT_DATA,
 	MQTT_PUBLISH_RECV,
-	MQTT_PUBLISHING
+	MQTT_PUBLISHING,
+	MQTT_STATE_COUNT
 } tConnState;
 
+// Interval of the diagnostics snapshot, in seconds
+#ifndef MQTT_STATS_INTERVAL
+#define MQTT_STATS_INTERVAL		300
+#endif
+
+// Room for the fields added by the MqttStatsCallback
+#ifndef MQTT_STATS_EXTRA
+#define MQTT_STATS_EXTRA		240
+#endif
+
+// Longest diagnostics snapshot: 113 bytes of names, punctuation and the
+// terminator, 16 counters of up to 10 digits and the sign of "rh", a state
+// time of up to 10 digits and a comma per state, the callback fields
+#define MQTT_STATS_JSON_MAX		(113 + 16 * 10 + 1 + MQTT_STATE_COUNT * 11 + MQTT_STATS_EXTRA)
+
+// MQTT 5 (PROTOCOL_NAMEv5): topics published on more than once get a topic
+// alias, up to this many and the Topic Alias Maximum of the broker. Later
+// publishes on them carry two bytes instead of the topic.
+#ifndef MQTT_TOPIC_ALIASES
+#if defined(PROTOCOL_NAMEv5)
+#define MQTT_TOPIC_ALIASES		4
+#else
+#define MQTT_TOPIC_ALIASES		0
+#endif
+#endif
+
+// Recently published topics without an alias, remembered as hashes
+#define MQTT_ALIAS_SEEN			8
+
+// Publishes whose queue-to-sent latency can be tracked at once
+#ifndef MQTT_STATS_PUB_RING
+#define MQTT_STATS_PUB_RING		8
+#endif
+
+typedef struct {
+	uint32_t bytesIn;
+	uint32_t bytesOut;
+	uint32_t packetsIn;
+	uint32_t packetsOut;
+	uint32_t queueHigh;			// msgQueue fill high-water mark, bytes
+	uint32_t queueDrops;		// messages lost to a full queue
+	uint32_t reconnects;
+	uint32_t recvTooLong;		// packets dropped as "Message too long"
+	uint32_t recvCoalesced;		// further packets found in a segment
+	uint32_t bufGrows;			// packets passed through a MQTT_BUF_DYNAMIC buffer
+	uint32_t aliasSaved;		// bytes of topic not sent thanks to topic aliases
+	uint32_t pingRtt;			// last PINGREQ to PINGRESP, us
+	uint32_t pingRttMax;
+	uint32_t pubLatency;		// last publish queued to sent, us
+	uint32_t pubLatencyMax;
+	uint32_t stateTime[MQTT_STATE_COUNT];	// ms spent in each tConnState
+} MQTT_STATS;
+
 typedef void (*MqttCallback)(uint32_t *args);
 typedef void (*MqttDataCallback)(uint32_t *args, const char* topic, uint32_t topic_len, const char *data, uint32_t lengh);
+/* Append "key":value pairs to the diagnostics snapshot, returns the length */
+typedef int (*MqttStatsCallback)(char *buf, int size);
+/* Copy len bytes of a streamed payload starting at offset into buf */
+typedef uint16_t (*MqttStreamCallback)(void *arg, uint32_t offset, uint8_t *buf, uint16_t len);
+
+typedef struct {
+	const char *topic;
+	uint32_t length;			// payload length
+	uint32_t offset;			// payload bytes sent so far
+	uint8_t retain;
+	uint8_t started;			// header sent, the packet must be finished first
+	MqttStreamCallback fill;	// NULL when no stream is pending
+	MqttCallback doneCb;
+	void *arg;
+} MQTT_STREAM;
 
 typedef struct  {
 	struct espconn *pCon;
@@ -100,9 +249,43 @@ typedef struct  {
 	ETSTimer mqttTimer;
 	uint32_t keepAliveTick;
 	uint32_t reconnectTick;
+	uint8_t timerIdle;
+	uint32_t idleSince;
 	uint32_t sendTimeout;
 	tConnState connState;
 	QUEUE msgQueue;
+	MQTT_STREAM stream;
+	MQTT_STATS stats;
+	uint32_t stateSince;
+	uint32_t pingSentAt;
+	uint32_t pubQueuedAt[MQTT_STATS_PUB_RING];	// publishes in the queue, oldest first
+	uint8_t pubHead;
+	uint8_t pubCount;
+	uint16_t pubUntracked;		// queued behind a full ring
+	uint32_t pubSendStart;
+	uint8_t pubSending;
+	ETSTimer statsTimer;
+	uint8_t statsDue;			// snapshot waiting for MQTT_Task
+	uint8_t recvHead[MQTT_FIXED_HEADER_MAX];	// fixed header cut at a segment end
+	uint8_t recvHeadLen;
+	uint8_t *recvPacket;		// packet continuing in the next segment
+	int recvLen;				// its total length
+	int recvFill;				// bytes of it received so far
+	uint32_t recvSkip;			// bytes left of a packet too long to take
+#if MQTT_TOPIC_ALIASES
+	uint16_t aliasMax;			// Topic Alias Maximum of the broker
+	uint8_t aliasCount;			// aliases set up on this connection
+	uint8_t aliasSeenNext;
+	uint32_t aliasSeen[MQTT_ALIAS_SEEN];
+	char aliasTopic[MQTT_TOPIC_ALIASES][MQTT_TOPIC_MAX];	// topic of alias i + 1
+#endif
+	uint8_t* statsTopic;
+	MqttStatsCallback statsCb;
+	uint8_t* arena;				// NULL: the client allocates from the heap
+	uint32_t arenaSize;
+	uint32_t arenaUsed;
+	uint8_t connOpen;			// the SDK holds pCon until its disconnect or reconnect callback
+	struct espconn *connSpare;	// arena espconn released by the SDK, for the next connection
 	void* user_data;
 } MQTT_Client;
 
@@ -124,6 +307,7 @@ typedef struct  {
 #define MQTT_EVENT_TYPE_PUBLISH_CONTINUATION 8
 
 void ICACHE_FLASH_ATTR MQTT_InitConnection(MQTT_Client *mqttClient, uint8_t* host, uint32 port, uint8_t security);
+void ICACHE_FLASH_ATTR MQTT_InitConnectionArena(MQTT_Client *mqttClient, uint8_t* host, uint32 port, uint8_t security, uint8_t* arena, uint32_t arenaSize);
 void ICACHE_FLASH_ATTR MQTT_InitClient(MQTT_Client *mqttClient, uint8_t* client_id, uint8_t* client_user, uint8_t* client_pass, uint32_t keepAliveTime, uint8_t cleanSession);
 void ICACHE_FLASH_ATTR MQTT_InitLWT(MQTT_Client *mqttClient, uint8_t* will_topic, uint8_t* will_msg, uint8_t will_qos, uint8_t will_retain);
 void ICACHE_FLASH_ATTR MQTT_OnConnected(MQTT_Client *mqttClient, MqttCallback connectedCb);
@@ -134,5 +318,9 @@ BOOL ICACHE_FLASH_ATTR MQTT_Subscribe(MQTT_Client *client, char* topic, uint8_t
 void ICACHE_FLASH_ATTR MQTT_Connect(MQTT_Client *mqttClient);
 void ICACHE_FLASH_ATTR MQTT_Disconnect(MQTT_Client *mqttClient);
 BOOL ICACHE_FLASH_ATTR MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain);
+void ICACHE_FLASH_ATTR MQTT_InitStats(MQTT_Client *client, uint8_t* topic, uint32_t interval);
+void ICACHE_FLASH_ATTR MQTT_GetStats(MQTT_Client *client, MQTT_STATS *stats);
+void ICACHE_FLASH_ATTR MQTT_OnStats(MQTT_Client *client, MqttStatsCallback statsCb);
+BOOL ICACHE_FLASH_ATTR MQTT_PublishStream(MQTT_Client *client, const char* topic, uint32_t data_length, int retain, MqttStreamCallback fill, MqttCallback doneCb, void *arg);
 
 #endif /* USER_AT_MQTT_H_ */
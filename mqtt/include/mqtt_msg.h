@@ -43,7 +43,7 @@ extern "C" {
 *
 */
 /* 7			6			5			4			3			2			1			0*/
-/*|      --- Message Type----			|  DUP Flag	|	   QoS Level		|	Retain	|
+/*|      --- Message Type----			|  DUP Flag	|	   QoS Level		|	Retain	|*/
 /*										Remaining Length								 */
 
 
@@ -82,6 +82,58 @@ typedef struct mqtt_connection
 
 } mqtt_connection_t;
 
+/* MQTT 5 property identifiers */
+enum mqtt_property_id
+{
+  MQTT_PROP_PAYLOAD_FORMAT = 0x01,
+  MQTT_PROP_MESSAGE_EXPIRY = 0x02,
+  MQTT_PROP_CONTENT_TYPE = 0x03,
+  MQTT_PROP_RESPONSE_TOPIC = 0x08,
+  MQTT_PROP_CORRELATION_DATA = 0x09,
+  MQTT_PROP_SUBSCRIPTION_ID = 0x0b,
+  MQTT_PROP_SESSION_EXPIRY = 0x11,
+  MQTT_PROP_ASSIGNED_CLIENT_ID = 0x12,
+  MQTT_PROP_SERVER_KEEP_ALIVE = 0x13,
+  MQTT_PROP_AUTH_METHOD = 0x15,
+  MQTT_PROP_AUTH_DATA = 0x16,
+  MQTT_PROP_REQUEST_PROBLEM_INFO = 0x17,
+  MQTT_PROP_WILL_DELAY = 0x18,
+  MQTT_PROP_REQUEST_RESPONSE_INFO = 0x19,
+  MQTT_PROP_RESPONSE_INFO = 0x1a,
+  MQTT_PROP_SERVER_REFERENCE = 0x1c,
+  MQTT_PROP_REASON_STRING = 0x1f,
+  MQTT_PROP_RECEIVE_MAXIMUM = 0x21,
+  MQTT_PROP_TOPIC_ALIAS_MAXIMUM = 0x22,
+  MQTT_PROP_TOPIC_ALIAS = 0x23,
+  MQTT_PROP_MAXIMUM_QOS = 0x24,
+  MQTT_PROP_RETAIN_AVAILABLE = 0x25,
+  MQTT_PROP_USER_PROPERTY = 0x26,
+  MQTT_PROP_MAXIMUM_PACKET_SIZE = 0x27,
+  MQTT_PROP_WILDCARD_AVAILABLE = 0x28,
+  MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE = 0x29,
+  MQTT_PROP_SHARED_AVAILABLE = 0x2a
+};
+
+/* One property of a received packet. Strings and binary data are not
+ * copied, they point into the packet. */
+typedef struct mqtt_property
+{
+  uint8_t id;
+  uint32_t value;           // byte, two and four byte integer, varint
+  const uint8_t* data;      // string or binary data, user property name
+  uint16_t length;
+  const uint8_t* data2;     // user property value
+  uint16_t length2;
+
+} mqtt_property_t;
+
+typedef struct mqtt_property_iter
+{
+  const uint8_t* pos;
+  const uint8_t* end;
+
+} mqtt_property_iter_t;
+
 typedef struct mqtt_connect_info
 {
   char* client_id;
@@ -110,6 +162,7 @@ uint16_t ICACHE_FLASH_ATTR mqtt_get_id(uint8_t* buffer, uint16_t length);
 
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* data, int data_length, int qos, int retain, uint16_t* message_id);
+int ICACHE_FLASH_ATTR mqtt_msg_publish_header(uint8_t* buffer, uint16_t buffer_length, const char* topic, uint32_t data_length, int retain);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pubrec(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pubrel(mqtt_connection_t* connection, uint16_t message_id);
@@ -120,6 +173,11 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pingreq(mqtt_connection_t* connection
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pingresp(mqtt_connection_t* connection);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_disconnect(mqtt_connection_t* connection);
 
+/* MQTT 5 (PROTOCOL_NAMEv5) only */
+int ICACHE_FLASH_ATTR mqtt_get_properties(uint8_t* buffer, uint16_t length, mqtt_property_iter_t* iter);
+int ICACHE_FLASH_ATTR mqtt_property_next(mqtt_property_iter_t* iter, mqtt_property_t* property);
+int ICACHE_FLASH_ATTR mqtt_msg_publish_alias(uint8_t* buffer, uint16_t length, uint16_t buffer_length, uint16_t alias, int keep_topic);
+
 
 #ifdef	__cplusplus
 }
@@ -38,6 +38,7 @@ typedef struct {
 } QUEUE;
 
 void ICACHE_FLASH_ATTR QUEUE_Init(QUEUE *queue, int bufferSize);
+void ICACHE_FLASH_ATTR QUEUE_InitBuffer(QUEUE *queue, uint8_t *buf, int bufferSize);
 int32_t ICACHE_FLASH_ATTR QUEUE_Puts(QUEUE *queue, uint8_t* buffer, uint16_t len);
 int32_t ICACHE_FLASH_ATTR QUEUE_Gets(QUEUE *queue, uint8_t* buffer, uint16_t* len, uint16_t maxLen);
 BOOL ICACHE_FLASH_ATTR QUEUE_IsEmpty(QUEUE *queue);
@@ -15,5 +15,6 @@ typedef struct{
 
 I16 ICACHE_FLASH_ATTR RINGBUF_Init(RINGBUF *r, U8* buf, I32 size);
 I16 ICACHE_FLASH_ATTR RINGBUF_Put(RINGBUF *r, U8 c);
+I16 ICACHE_FLASH_ATTR RINGBUF_PutBlock(RINGBUF *r, const U8 *data, I32 len);
 I16 ICACHE_FLASH_ATTR RINGBUF_Get(RINGBUF *r, U8* c);
 #endif
@@ -34,18 +34,30 @@
 #include "espconn.h"
 #include "os_type.h"
 #include "mem.h"
+#include "memtrack.h"
+#include "trace.h"
 #include "mqtt_msg.h"
+#define LOG_MODULE MQTT
 #include "debug.h"
 #include "user_config.h"
 #include "mqtt.h"
 #include "queue.h"
+#include "utils.h"
 
+// Lowest priority: sending and the diagnostics snapshot wait for
+// everything else, commands are actuated in the receive callback
 #define MQTT_TASK_PRIO        		0
 #define MQTT_TASK_QUEUE_SIZE    	1
 #define MQTT_SEND_TIMOUT			5
 
-#ifndef QUEUE_BUFFER_SIZE
-#define QUEUE_BUFFER_SIZE		 	2048
+// Payload bytes per TCP send of a streamed publish
+#ifndef MQTT_STREAM_CHUNK
+#define MQTT_STREAM_CHUNK			256
+#endif
+
+// Stop the 1 s tick while idle and sleep straight to the keepalive deadline
+#ifndef MQTT_TICKLESS
+#define MQTT_TICKLESS				1
 #endif
 
 unsigned char *default_certificate;
@@ -55,6 +67,425 @@ unsigned int default_private_key_len = 0;
 
 os_event_t mqtt_procTaskQueue[MQTT_TASK_QUEUE_SIZE];
 
+/* Client memory: carved from the arena when there is one, else the heap.
+ * Arena blocks are never freed, everything is allocated once at init. */
+LOCAL void* ICACHE_FLASH_ATTR
+mqtt_alloc(MQTT_Client *client, uint8_t tag, uint32_t size)
+{
+	uint8_t *p;
+
+	if(client->arena == NULL)
+		return MEM_ZALLOC(tag, size);
+	size = (size + 3) & ~3;
+	if(client->arenaUsed + size > client->arenaSize){
+		LOG_E("MQTT: Arena full, %d bytes from the heap\r\n", size);
+		return MEM_ZALLOC(tag, size);
+	}
+	p = client->arena + client->arenaUsed;
+	client->arenaUsed += size;
+	os_memset(p, 0, size);
+	return p;
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_in_arena(MQTT_Client *client, void *p)
+{
+	return client->arena != NULL && (uint8_t *)p >= client->arena && (uint8_t *)p < client->arena + client->arenaSize;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_free(MQTT_Client *client, void *p)
+{
+	if(!mqtt_in_arena(client, p))
+		MEM_FREE(p);
+}
+
+LOCAL uint8_t* ICACHE_FLASH_ATTR
+mqtt_strdup(MQTT_Client *client, const uint8_t *str)
+{
+	uint32_t len = os_strlen(str);
+	uint8_t *copy = (uint8_t *)mqtt_alloc(client, MEM_TAG_MQTT, len + 1);
+
+	os_memcpy(copy, str, len + 1);
+	return copy;
+}
+
+/* A zeroed espconn with its esp_tcp. With an arena the pairs of closed
+ * connections are reused, so reconnects don't allocate. A pair is spare
+ * only once the SDK released it, a reconnect while the last connection
+ * is still closing takes a second one. */
+LOCAL struct espconn* ICACHE_FLASH_ATTR
+mqtt_conn_alloc(MQTT_Client *client)
+{
+	struct espconn *conn = client->connSpare;
+	esp_tcp *tcp;
+
+	if(conn != NULL){
+		tcp = conn->proto.tcp;
+		client->connSpare = (struct espconn *)conn->reverse;
+	}
+	else {
+		conn = (struct espconn *)mqtt_alloc(client, MEM_TAG_CONN, sizeof(struct espconn));
+		tcp = (esp_tcp *)mqtt_alloc(client, MEM_TAG_CONN, sizeof(esp_tcp));
+	}
+	os_memset(conn, 0, sizeof(struct espconn));
+	os_memset(tcp, 0, sizeof(esp_tcp));
+	conn->proto.tcp = tcp;
+	return conn;
+}
+
+/* Only once the SDK let go of conn: after its disconnect or reconnect
+ * callback, or if it was never connected */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_conn_free(MQTT_Client *client, struct espconn *conn)
+{
+	// spare arena pairs are chained through reverse
+	if(mqtt_in_arena(client, conn)){
+		conn->reverse = client->connSpare;
+		client->connSpare = conn;
+		return;
+	}
+	if(conn->proto.tcp)
+		MEM_FREE(conn->proto.tcp);
+	MEM_FREE(conn);
+}
+
+/* Hand pCon to the SDK */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_conn_open(MQTT_Client *client)
+{
+	if(client->security){
+		INFO("Secure Connect/n");
+		client->connOpen = espconn_secure_connect(client->pCon) == ESPCONN_OK;
+	}
+	else {
+		INFO("No Secure Connect/n");
+		client->connOpen = espconn_connect(client->pCon) == ESPCONN_OK;
+	}
+}
+
+/* Tear pCon down. espconn_delete only ends servers and UDP, a client the
+ * SDK holds is closed and freed in its disconnect callback. */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_conn_close(MQTT_Client *client)
+{
+	struct espconn *conn = client->pCon;
+	sint8 err = ESPCONN_ARG;
+
+	client->pCon = NULL;
+	if(client->connOpen){
+		client->connOpen = 0;
+		err = client->security ? espconn_secure_disconnect(conn) : espconn_disconnect(conn);
+	}
+	if(err != ESPCONN_OK)
+		mqtt_conn_free(client, conn);
+}
+
+/* A buffer for an inbound packet: the in buffer, or with MQTT_BUF_DYNAMIC
+ * a heap one up to MQTT_BUF_SIZE. NULL if the packet is too long. */
+LOCAL uint8_t* ICACHE_FLASH_ATTR
+mqtt_in_get(MQTT_Client *client, int size)
+{
+	if(size <= client->mqtt_state.in_buffer_length)
+		return client->mqtt_state.in_buffer;
+#if MQTT_BUF_DYNAMIC
+	if(size <= MQTT_BUF_SIZE){
+		client->stats.bufGrows++;
+		return (uint8_t *)MEM_ZALLOC(MEM_TAG_MQTT, size);
+	}
+#endif
+	return NULL;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_in_put(MQTT_Client *client, uint8_t *packet)
+{
+	if(packet != client->mqtt_state.in_buffer)
+		MEM_FREE(packet);
+}
+
+/* Forget a packet cut at a segment end, the connection is new */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_recv_reset(MQTT_Client *client)
+{
+	if(client->recvPacket != NULL)
+		mqtt_in_put(client, client->recvPacket);
+	client->recvPacket = NULL;
+	client->recvHeadLen = 0;
+	client->recvSkip = 0;
+}
+
+/* TRUE if the data ends inside the fixed header, in the remaining length */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_header_cut(const uint8_t *data, uint16_t len)
+{
+	uint16_t i;
+
+	for(i = 1; i < len && i < MQTT_FIXED_HEADER_MAX; i++){
+		if((data[i] & 0x80) == 0)
+			return FALSE;
+	}
+	return i == len && len < MQTT_FIXED_HEADER_MAX;
+}
+
+/* Take the next packet from the segment. One that continues in the next
+ * segment is collected in its buffer and completed from there, one longer
+ * than mqtt_in_get takes is passed over. Returns the packet once it is
+ * complete, NULL if the segment ended first or the packet was dropped. */
+LOCAL uint8_t* ICACHE_FLASH_ATTR
+mqtt_recv_packet(MQTT_Client *client, char **pdata, unsigned short *len, int *packetLen)
+{
+	uint8_t *packet;
+	int n;
+
+	if(client->recvSkip > 0){
+		n = client->recvSkip < *len ? client->recvSkip : *len;
+		client->recvSkip -= n;
+		*pdata += n;
+		*len -= n;
+		return NULL;
+	}
+
+	if(client->recvPacket == NULL){
+		// the header first, its length may be cut as well
+		do {
+			client->recvHead[client->recvHeadLen++] = **pdata;
+			(*pdata)++;
+			(*len)--;
+		} while(*len > 0 && mqtt_header_cut(client->recvHead, client->recvHeadLen));
+		if(mqtt_header_cut(client->recvHead, client->recvHeadLen))
+			return NULL;
+
+		client->recvLen = mqtt_get_total_length(client->recvHead, client->recvHeadLen);
+		client->recvPacket = mqtt_in_get(client, client->recvLen);
+		if(client->recvPacket == NULL){
+			LOG_E("ERROR: Message too long\r\n");
+			client->stats.recvTooLong++;
+			client->recvSkip = client->recvLen - client->recvHeadLen;
+			client->recvHeadLen = 0;
+			return NULL;
+		}
+		os_memcpy(client->recvPacket, client->recvHead, client->recvHeadLen);
+		client->recvFill = client->recvHeadLen;
+		client->recvHeadLen = 0;
+	}
+
+	n = client->recvLen - client->recvFill;
+	if(n > *len)
+		n = *len;
+	os_memcpy(client->recvPacket + client->recvFill, *pdata, n);
+	client->recvFill += n;
+	*pdata += n;
+	*len -= n;
+	if(client->recvFill < client->recvLen)
+		return NULL;
+
+	packet = client->recvPacket;
+	client->recvPacket = NULL;
+	*packetLen = client->recvLen;
+	return packet;
+}
+
+#if MQTT_TOPIC_ALIASES
+/* A new connection, aliases are only valid on the one they were set up on */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_alias_reset(MQTT_Client *client, uint16_t aliasMax)
+{
+	client->aliasMax = aliasMax < MQTT_TOPIC_ALIASES ? aliasMax : MQTT_TOPIC_ALIASES;
+	client->aliasCount = 0;
+	client->aliasSeenNext = 0;
+	os_memset(client->aliasSeen, 0, sizeof(client->aliasSeen));
+}
+
+LOCAL uint32_t ICACHE_FLASH_ATTR
+mqtt_alias_hash(const char *topic, uint16_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while(len--)
+		hash = (hash ^ (uint8_t)*topic++) * 16777619u;
+	return hash | 1;
+}
+
+/* Put the alias of its topic on a queued publish about to be sent. A
+ * topic seen for the second time gets the next free alias and goes out
+ * once more in full to set it up, after that as the alias only. */
+LOCAL uint16_t ICACHE_FLASH_ATTR
+mqtt_alias_apply(MQTT_Client *client, uint8_t *buffer, uint16_t len, uint16_t size)
+{
+	char topic[MQTT_TOPIC_MAX];
+	const char *t;
+	uint16_t topicLen = len;
+	uint32_t hash;
+	int alias, n;
+
+	if(client->aliasMax == 0 || mqtt_get_type(buffer) != MQTT_MSG_TYPE_PUBLISH)
+		return len;
+	t = mqtt_get_publish_topic(buffer, &topicLen);
+	if(t == NULL || topicLen == 0 || topicLen >= MQTT_TOPIC_MAX)
+		return len;
+
+	for(alias = 0; alias < client->aliasCount; alias++){
+		if(os_strlen(client->aliasTopic[alias]) == topicLen && os_memcmp(client->aliasTopic[alias], t, topicLen) == 0){
+			n = mqtt_msg_publish_alias(buffer, len, size, alias + 1, 0);
+			if(n < 0)
+				return len;
+			client->stats.aliasSaved += len - n;
+			return n;
+		}
+	}
+
+	if(client->aliasCount >= client->aliasMax)
+		return len;
+	hash = mqtt_alias_hash(t, topicLen);
+	for(n = 0; n < MQTT_ALIAS_SEEN && client->aliasSeen[n] != hash; n++)
+		;
+	if(n == MQTT_ALIAS_SEEN){
+		client->aliasSeen[client->aliasSeenNext] = hash;
+		client->aliasSeenNext = (client->aliasSeenNext + 1) % MQTT_ALIAS_SEEN;
+		return len;
+	}
+
+	// the rewrite moves the topic
+	os_memcpy(topic, t, topicLen);
+	topic[topicLen] = 0;
+	n = mqtt_msg_publish_alias(buffer, len, size, client->aliasCount + 1, 1);
+	if(n < 0)
+		return len;
+	os_strcpy(client->aliasTopic[client->aliasCount++], topic);
+	LOG_D("MQTT: Alias %d for %s\r\n", client->aliasCount, topic);
+	return n;
+}
+
+/* Topic Alias Maximum of the broker from the CONNACK properties */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_connack_properties(MQTT_Client *client, uint8_t *packet, uint16_t len)
+{
+	mqtt_property_iter_t iter;
+	mqtt_property_t property;
+	uint16_t aliasMax = 0;
+
+	if(mqtt_get_properties(packet, len, &iter) >= 0){
+		while(mqtt_property_next(&iter, &property) > 0){
+			if(property.id == MQTT_PROP_TOPIC_ALIAS_MAXIMUM)
+				aliasMax = property.value;
+		}
+	}
+	mqtt_alias_reset(client, aliasMax);
+	INFO("MQTT: %d topic aliases\r\n", client->aliasMax);
+}
+#endif
+
+#if defined(PROTOCOL_NAMEv5)
+/* MQTT 5 SUBACKs say why a subscription was refused */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_suback_check(uint8_t *packet, uint16_t len)
+{
+	mqtt_property_iter_t iter;
+	mqtt_property_t property;
+	char reason[32] = "";
+	int pos;
+
+	pos = mqtt_get_properties(packet, len, &iter);
+	if(pos < 0 || pos >= len || packet[pos] < 0x80)
+		return;
+	while(mqtt_property_next(&iter, &property) > 0){
+		if(property.id == MQTT_PROP_REASON_STRING && property.length < sizeof(reason)){
+			os_memcpy(reason, property.data, property.length);
+			reason[property.length] = 0;
+		}
+	}
+	LOG_W("MQTT: Subscribe refused, 0x%02X %s\r\n", packet[pos], reason);
+}
+#endif
+
+/* Add the time since the last sample to the current state */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_stats_sample(MQTT_Client *client)
+{
+	uint32_t ms = (system_get_time() - client->stateSince) / 1000;
+	client->stats.stateTime[client->connState] += ms;
+	client->stateSince += ms * 1000;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_set_state(MQTT_Client *client, tConnState state)
+{
+	mqtt_stats_sample(client);
+	client->connState = state;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_send(MQTT_Client *client, uint8_t *data, uint16_t len)
+{
+	client->stats.bytesOut += len;
+	client->stats.packetsOut++;
+	if(client->security){
+		espconn_secure_sent(client->pCon, data, len);
+	}
+	else{
+		espconn_sent(client->pCon, data, len);
+	}
+}
+
+/* Publish timestamps follow the queue order, publishes queued while the
+ * ring is full are counted but not timed */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_stats_pub_push(MQTT_Client *client)
+{
+	if(client->pubUntracked || client->pubCount >= MQTT_STATS_PUB_RING){
+		client->pubUntracked++;
+		return;
+	}
+	client->pubQueuedAt[(client->pubHead + client->pubCount) % MQTT_STATS_PUB_RING] = system_get_time();
+	client->pubCount++;
+}
+
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_stats_pub_pop(MQTT_Client *client, uint32_t *queuedAt)
+{
+	if(client->pubCount == 0){
+		if(client->pubUntracked)
+			client->pubUntracked--;
+		return FALSE;
+	}
+	*queuedAt = client->pubQueuedAt[client->pubHead];
+	client->pubHead = (client->pubHead + 1) % MQTT_STATS_PUB_RING;
+	client->pubCount--;
+	return TRUE;
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_stats_queued(MQTT_Client *client)
+{
+	if(client->msgQueue.rb.fill_cnt > client->stats.queueHigh)
+		client->stats.queueHigh = client->msgQueue.rb.fill_cnt;
+}
+
+/* The oldest queued message was thrown out to make room */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_stats_dropped(MQTT_Client *client, uint8_t *msg)
+{
+	uint32_t queuedAt;
+
+	client->stats.queueDrops++;
+	if(mqtt_get_type(msg) == MQTT_MSG_TYPE_PUBLISH)
+		mqtt_stats_pub_pop(client, &queuedAt);
+}
+
+/* Queue a protocol response, it is dropped if the queue is full */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_queue(MQTT_Client *client, mqtt_message_t *msg)
+{
+	if(QUEUE_Puts(&client->msgQueue, msg->data, msg->length) == -1){
+		LOG_W("MQTT: Queue full\r\n");
+		client->stats.queueDrops++;
+		return FALSE;
+	}
+	mqtt_stats_queued(client);
+	return TRUE;
+}
+
 LOCAL void ICACHE_FLASH_ATTR
 mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 {
@@ -65,7 +496,7 @@ mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 	if(ipaddr == NULL)
 	{
 		INFO("DNS: Found, but got no ip, try to reconnect\r\n");
-		client->connState = TCP_RECONNECT_REQ;
+		mqtt_set_state(client, TCP_RECONNECT_REQ);
 		return;
 	}
 
@@ -78,14 +509,9 @@ mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 	if(client->ip.addr == 0 && ipaddr->addr != 0)
 	{
 		os_memcpy(client->pCon->proto.tcp->remote_ip, &ipaddr->addr, 4);
-		if(client->security){
-			espconn_secure_connect(client->pCon);
-		}
-		else {
-			espconn_connect(client->pCon);
-		}
+		mqtt_conn_open(client);
 
-		client->connState = TCP_CONNECTING;
+		mqtt_set_state(client, TCP_CONNECTING);
 		INFO("TCP: connecting...\r\n");
 	}
 
@@ -123,23 +549,34 @@ mqtt_tcpclient_recv(void *arg, char *pdata, unsigned short len)
 	uint8_t msg_type;
 	uint8_t msg_qos;
 	uint16_t msg_id;
+	uint8_t *packet;
+	int packetLen;
 
 	struct espconn *pCon = (struct espconn*)arg;
 	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
 
-READPACKET:
-	INFO("TCP: data received %d bytes\r\n", len);
-	if(len < MQTT_BUF_SIZE && len > 0){
-		os_memcpy(client->mqtt_state.in_buffer, pdata, len);
+	TRACE_POINT(TRACE_RECV);
+	client->stats.bytesIn += len;
+	LOG_D("TCP: data received %d bytes\r\n", len);
+	// One packet at a time, a segment can carry several
+	while(len > 0){
+		packet = mqtt_recv_packet(client, &pdata, &len, &packetLen);
+		if(packet == NULL)
+			continue;
+		if(len > 0){
+			LOG_D("MQTT: Another packet in the segment\r\n");
+			client->stats.recvCoalesced++;
+		}
+		client->stats.packetsIn++;
 
-		msg_type = mqtt_get_type(client->mqtt_state.in_buffer);
-		msg_qos = mqtt_get_qos(client->mqtt_state.in_buffer);
-		msg_id = mqtt_get_id(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_length);
+		msg_type = mqtt_get_type(packet);
+		msg_qos = mqtt_get_qos(packet);
+		msg_id = mqtt_get_id(packet, packetLen);
 		switch(client->connState){
 		case MQTT_CONNECT_SENDING:
 			if(msg_type == MQTT_MSG_TYPE_CONNACK){
 				if(client->mqtt_state.pending_msg_type != MQTT_MSG_TYPE_CONNECT){
-					INFO("MQTT: Invalid packet\r\n");
+					LOG_W("MQTT: Invalid packet\r\n");
 					if(client->security){
 						espconn_secure_disconnect(client->pCon);
 					}
@@ -148,7 +585,10 @@ READPACKET:
 					}
 				} else {
 					INFO("MQTT: Connected to %s:%d\r\n", client->host, client->port);
-					client->connState = MQTT_DATA;
+#if MQTT_TOPIC_ALIASES
+					mqtt_connack_properties(client, packet, packetLen);
+#endif
+					mqtt_set_state(client, MQTT_DATA);
 					if(client->connectedCb)
 						client->connectedCb((uint32_t*)client);
 				}
@@ -156,14 +596,17 @@ READPACKET:
 			}
 			break;
 		case MQTT_DATA:
-			client->mqtt_state.message_length_read = len;
-			client->mqtt_state.message_length = mqtt_get_total_length(client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
+			client->mqtt_state.message_length_read = packetLen;
+			client->mqtt_state.message_length = mqtt_get_total_length(packet, packetLen);
 
 
 			switch(msg_type)
 			{
 
 			  case MQTT_MSG_TYPE_SUBACK:
+#if defined(PROTOCOL_NAMEv5)
+				mqtt_suback_check(packet, packetLen);
+#endif
 				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_SUBSCRIBE && client->mqtt_state.pending_msg_id == msg_id)
 				  INFO("MQTT: Subscribe successful\r\n");
 				break;
@@ -172,18 +615,16 @@ READPACKET:
 				  INFO("MQTT: UnSubscribe successful\r\n");
 				break;
 			  case MQTT_MSG_TYPE_PUBLISH:
+				// actuate first, the ack and the log can wait
+				deliver_publish(client, packet, packetLen);
 				if(msg_qos == 1)
 					client->mqtt_state.outbound_message = mqtt_msg_puback(&client->mqtt_state.mqtt_connection, msg_id);
 				else if(msg_qos == 2)
 					client->mqtt_state.outbound_message = mqtt_msg_pubrec(&client->mqtt_state.mqtt_connection, msg_id);
 				if(msg_qos == 1 || msg_qos == 2){
 					INFO("MQTT: Queue response QoS: %d\r\n", msg_qos);
-					if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-						INFO("MQTT: Queue full\r\n");
-					}
+					mqtt_queue(client, client->mqtt_state.outbound_message);
 				}
-
-				deliver_publish(client, client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
 				break;
 			  case MQTT_MSG_TYPE_PUBACK:
 				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id){
@@ -193,15 +634,11 @@ READPACKET:
 				break;
 			  case MQTT_MSG_TYPE_PUBREC:
 				  client->mqtt_state.outbound_message = mqtt_msg_pubrel(&client->mqtt_state.mqtt_connection, msg_id);
-				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-				  	INFO("MQTT: Queue full\r\n");
-				  }
+				  mqtt_queue(client, client->mqtt_state.outbound_message);
 				break;
 			  case MQTT_MSG_TYPE_PUBREL:
 				  client->mqtt_state.outbound_message = mqtt_msg_pubcomp(&client->mqtt_state.mqtt_connection, msg_id);
-				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-					INFO("MQTT: Queue full\r\n");
-				  }
+				  mqtt_queue(client, client->mqtt_state.outbound_message);
 				break;
 			  case MQTT_MSG_TYPE_PUBCOMP:
 				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id){
@@ -210,37 +647,22 @@ READPACKET:
 				break;
 			  case MQTT_MSG_TYPE_PINGREQ:
 				  client->mqtt_state.outbound_message = mqtt_msg_pingresp(&client->mqtt_state.mqtt_connection);
-				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-					INFO("MQTT: Queue full\r\n");
-				  }
+				  mqtt_queue(client, client->mqtt_state.outbound_message);
 				break;
 			  case MQTT_MSG_TYPE_PINGRESP:
-				// Ignore
+				if(client->pingSentAt != 0){
+					client->stats.pingRtt = system_get_time() - client->pingSentAt;
+					if(client->stats.pingRtt > client->stats.pingRttMax)
+						client->stats.pingRttMax = client->stats.pingRtt;
+					client->pingSentAt = 0;
+				}
 				break;
 			}
-			// NOTE: this is done down here and not in the switch case above
-			// because the PSOCK_READBUF_LEN() won't work inside a switch
-			// statement due to the way protothreads resume.
-			if(msg_type == MQTT_MSG_TYPE_PUBLISH)
-			{
-			  len = client->mqtt_state.message_length_read;
-
-			  if(client->mqtt_state.message_length < client->mqtt_state.message_length_read)
-			  {
-				  //client->connState = MQTT_PUBLISH_RECV;
-				  //Not Implement yet
-				  len -= client->mqtt_state.message_length;
-				  pdata += client->mqtt_state.message_length;
-
-				  INFO("Get another published message\r\n");
-				  goto READPACKET;
-			  }
-
-			}
+			break;
+		default:
 			break;
 		}
-	} else {
-		INFO("ERROR: Message too long\r\n");
+		mqtt_in_put(client, packet);
 	}
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 }
@@ -255,19 +677,42 @@ mqtt_tcpclient_sent_cb(void *arg)
 {
 	struct espconn *pCon = (struct espconn *)arg;
 	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
-	INFO("TCP: Sent\r\n");
+	LOG_D("TCP: Sent\r\n");
 	client->sendTimeout = 0;
+	if(client->pubSending){
+		client->pubSending = 0;
+		client->stats.pubLatency = system_get_time() - client->pubSendStart;
+		if(client->stats.pubLatency > client->stats.pubLatencyMax)
+			client->stats.pubLatencyMax = client->stats.pubLatency;
+	}
 	if(client->connState == MQTT_DATA && client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH){
+		TRACE_POINT(TRACE_SENT);
 		if(client->publishedCb)
 			client->publishedCb((uint32_t*)client);
 	}
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 }
 
+/* Leave the keepalive sleep: catch up on the seconds slept and go back
+ * to 1 s ticks */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_timer_resume(MQTT_Client* client)
+{
+	if(!client->timerIdle)
+		return;
+	client->timerIdle = 0;
+	client->keepAliveTick += (system_get_time() - client->idleSince) / 1000000;
+	os_timer_disarm(&client->mqttTimer);
+	os_timer_arm(&client->mqttTimer, 1000, 1);
+}
+
 void ICACHE_FLASH_ATTR mqtt_timer(void *arg)
 {
 	MQTT_Client* client = (MQTT_Client*)arg;
 
+	mqtt_timer_resume(client);
+	mqtt_stats_sample(client);
+
 	if(client->connState == MQTT_DATA){
 		client->keepAliveTick ++;
 		if(client->keepAliveTick > client->mqtt_state.connect_info->keepalive){
@@ -280,13 +725,9 @@ void ICACHE_FLASH_ATTR mqtt_timer(void *arg)
 
 
 			client->sendTimeout = MQTT_SEND_TIMOUT;
-			INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-			if(client->security){
-				espconn_secure_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-			}
-			else{
-				espconn_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-			}
+			LOG_D("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
+			client->pingSentAt = system_get_time();
+			mqtt_send(client, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
 
 			client->mqtt_state.outbound_message = NULL;
 
@@ -298,12 +739,23 @@ void ICACHE_FLASH_ATTR mqtt_timer(void *arg)
 		client->reconnectTick ++;
 		if(client->reconnectTick > MQTT_RECONNECT_TIMEOUT) {
 			client->reconnectTick = 0;
-			client->connState = TCP_RECONNECT;
+			mqtt_set_state(client, TCP_RECONNECT);
 			system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 		}
 	}
 	if(client->sendTimeout > 0)
 		client->sendTimeout --;
+
+#if MQTT_TICKLESS
+	// Nothing to send or wait for: sleep until the next keepalive is due
+	if(client->connState == MQTT_DATA && client->sendTimeout == 0 && QUEUE_IsEmpty(&client->msgQueue) && client->stream.fill == NULL &&
+	   client->keepAliveTick < client->mqtt_state.connect_info->keepalive){
+		os_timer_disarm(&client->mqttTimer);
+		os_timer_arm(&client->mqttTimer, (client->mqtt_state.connect_info->keepalive - client->keepAliveTick + 1) * 1000, 0);
+		client->timerIdle = 1;
+		client->idleSince = system_get_time();
+	}
+#endif
 }
 
 void ICACHE_FLASH_ATTR
@@ -313,7 +765,14 @@ mqtt_tcpclient_discon_cb(void *arg)
 	struct espconn *pespconn = (struct espconn *)arg;
 	MQTT_Client* client = (MQTT_Client *)pespconn->reverse;
 	INFO("TCP: Disconnected callback\r\n");
-	client->connState = TCP_RECONNECT_REQ;
+	// the end of a connection MQTT_Disconnect already gave up
+	if(pespconn != client->pCon){
+		mqtt_conn_free(client, pespconn);
+		return;
+	}
+	client->connOpen = 0;
+	mqtt_set_state(client, TCP_RECONNECT_REQ);
+	client->stream.fill = NULL;
 	if(client->disconnectedCb)
 		client->disconnectedCb((uint32_t*)client);
 
@@ -345,16 +804,11 @@ mqtt_tcpclient_connect_cb(void *arg)
 
 
 	client->sendTimeout = MQTT_SEND_TIMOUT;
-	INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-	if(client->security){
-		espconn_secure_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-	}
-	else{
-		espconn_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-	}
+	LOG_D("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
+	mqtt_send(client, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
 
 	client->mqtt_state.outbound_message = NULL;
-	client->connState = MQTT_CONNECT_SENDING;
+	mqtt_set_state(client, MQTT_CONNECT_SENDING);
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 }
 
@@ -369,14 +823,76 @@ mqtt_tcpclient_recon_cb(void *arg, sint8 errType)
 	struct espconn *pCon = (struct espconn *)arg;
 	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
 
+	if(pCon != client->pCon){
+		mqtt_conn_free(client, pCon);
+		return;
+	}
+	client->connOpen = 0;
 	INFO("TCP: Reconnect to %s:%d\r\n", client->host, client->port);
 
-	client->connState = TCP_RECONNECT_REQ;
+	mqtt_set_state(client, TCP_RECONNECT_REQ);
 
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 
 }
 
+/* Queue the encoded outbound message, dropping the oldest ones for room */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_publish_queue(MQTT_Client *client)
+{
+	uint8_t dataBuffer[MQTT_SEND_BUF_SIZE];
+	uint16_t dataLen;
+
+	if(client->mqtt_state.outbound_message->length == 0){
+		LOG_W("MQTT: Queuing publish failed\r\n");
+		return FALSE;
+	}
+	LOG_D("MQTT: queuing publish, length: %d, queue size(%d/%d)\r\n", client->mqtt_state.outbound_message->length, (int)client->msgQueue.rb.fill_cnt, (int)client->msgQueue.rb.size);
+	while(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
+		LOG_W("MQTT: Queue full\r\n");
+		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_SEND_BUF_SIZE) == -1) {
+			LOG_E("MQTT: Serious buffer error\r\n");
+			return FALSE;
+		}
+		mqtt_stats_dropped(client, dataBuffer);
+	}
+	mqtt_stats_queued(client);
+	mqtt_stats_pub_push(client);
+	TRACE_POINT(TRACE_ENQUEUE);
+	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+	return TRUE;
+}
+
+#if MQTT_BUF_DYNAMIC
+/* Encode a publish too long for the out buffer in a heap buffer of its
+ * size, queue it and free the buffer again */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_publish_grown(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain)
+{
+	mqtt_connection_t *conn = &client->mqtt_state.mqtt_connection;
+	uint32_t size = MQTT_PACKET_OVERHEAD + os_strlen(topic) + data_length;
+	uint8_t *buffer;
+	BOOL ok;
+
+	if(size > MQTT_BUF_SIZE || (buffer = (uint8_t *)MEM_ZALLOC(MEM_TAG_MQTT, size)) == NULL){
+		LOG_W("MQTT: Queuing publish failed, %d bytes\r\n", size);
+		return FALSE;
+	}
+	client->stats.bufGrows++;
+	conn->buffer = buffer;
+	conn->buffer_length = size;
+	client->mqtt_state.outbound_message = mqtt_msg_publish(conn, topic, data, data_length,
+										 qos, retain, &client->mqtt_state.pending_msg_id);
+	ok = mqtt_publish_queue(client);
+
+	conn->buffer = client->mqtt_state.out_buffer;
+	conn->buffer_length = client->mqtt_state.out_buffer_length;
+	client->mqtt_state.outbound_message = NULL;
+	MEM_FREE(buffer);
+	return ok;
+}
+#endif
+
 /**
   * @brief  MQTT publish function.
   * @param  client: 	MQTT_Client reference
@@ -390,26 +906,108 @@ mqtt_tcpclient_recon_cb(void *arg, sint8 errType)
 BOOL ICACHE_FLASH_ATTR
 MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain)
 {
-	uint8_t dataBuffer[MQTT_BUF_SIZE];
-	uint16_t dataLen;
 	client->mqtt_state.outbound_message = mqtt_msg_publish(&client->mqtt_state.mqtt_connection,
 										 topic, data, data_length,
 										 qos, retain,
 										 &client->mqtt_state.pending_msg_id);
-	if(client->mqtt_state.outbound_message->length == 0){
-		INFO("MQTT: Queuing publish failed\r\n");
+#if MQTT_BUF_DYNAMIC
+	if(client->mqtt_state.outbound_message->length == 0)
+		return mqtt_publish_grown(client, topic, data, data_length, qos, retain);
+#endif
+	return mqtt_publish_queue(client);
+}
+
+/**
+  * @brief  Publish a payload that is produced while it is sent (QoS 0).
+  *         The payload is pulled from fill in chunks of MQTT_STREAM_CHUNK,
+  *         one chunk per sent callback, so it never has to be in RAM as a
+  *         whole. Only one stream can be pending at a time.
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 		topic, must stay valid until the header is sent
+  * @param  data_length: total payload length
+  * @param  retain:		retain
+  * @param  fill:		called for every chunk of payload
+  * @param  doneCb:		called once the last chunk is handed to TCP
+  * @param  arg:		passed to fill
+  * @retval TRUE if the stream was accepted
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTT_PublishStream(MQTT_Client *client, const char* topic, uint32_t data_length, int retain, MqttStreamCallback fill, MqttCallback doneCb, void *arg)
+{
+	if(client->stream.fill != NULL || fill == NULL)
 		return FALSE;
+
+	client->stream.topic = topic;
+	client->stream.length = data_length;
+	client->stream.offset = 0;
+	client->stream.retain = retain;
+	client->stream.started = 0;
+	client->stream.fill = fill;
+	client->stream.doneCb = doneCb;
+	client->stream.arg = arg;
+	INFO("MQTT: queuing stream, topic: %s, length: %d\r\n", topic, data_length);
+	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+	return TRUE;
+}
+
+/* Send the next piece of the pending stream, the publish header goes out
+ * together with the first chunk */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_stream_send(MQTT_Client *client, uint8_t *buffer, uint16_t size)
+{
+	MQTT_STREAM *stream = &client->stream;
+	BOOL headerSent = stream->started;
+	int len = 0;
+	uint16_t chunk, filled = 0;
+
+	if(!stream->started){
+		len = mqtt_msg_publish_header(buffer, size, stream->topic, stream->length, stream->retain);
+		if(len < 0){
+			LOG_E("MQTT: Stream topic too long\r\n");
+			stream->fill = NULL;
+			if(stream->doneCb)
+				stream->doneCb((uint32_t*)client);
+			return;
+		}
+		stream->started = 1;
 	}
-	INFO("MQTT: queuing publish, length: %d, queue size(%d/%d)\r\n", client->mqtt_state.outbound_message->length, client->msgQueue.rb.fill_cnt, client->msgQueue.rb.size);
-	while(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-		INFO("MQTT: Queue full\r\n");
-		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == -1) {
-			INFO("MQTT: Serious buffer error\r\n");
-			return FALSE;
+
+	chunk = size - len;
+	if(chunk > MQTT_STREAM_CHUNK)
+		chunk = MQTT_STREAM_CHUNK;
+	if(chunk > stream->length - stream->offset)
+		chunk = stream->length - stream->offset;
+	if(chunk > 0)
+		filled = stream->fill(stream->arg, stream->offset, buffer + len, chunk);
+	// The header announced stream->length bytes, a short payload can't be
+	// made up for: drop the stream, and the connection if it went out
+	if(filled != chunk){
+		LOG_E("MQTT: Stream fill short at %d\r\n", stream->offset + filled);
+		stream->fill = NULL;
+		if(stream->doneCb)
+			stream->doneCb((uint32_t*)client);
+		if(headerSent){
+			if(client->security)
+				espconn_secure_disconnect(client->pCon);
+			else
+				espconn_disconnect(client->pCon);
 		}
+		return;
+	}
+	len += filled;
+	stream->offset += filled;
+
+	// Report the publish only once, when its last byte has been sent
+	client->mqtt_state.pending_msg_type = stream->offset >= stream->length ? MQTT_MSG_TYPE_PUBLISH : 0;
+	client->mqtt_state.pending_msg_id = 0;
+	client->sendTimeout = MQTT_SEND_TIMOUT;
+	mqtt_send(client, buffer, len);
+
+	if(stream->offset >= stream->length){
+		stream->fill = NULL;
+		if(stream->doneCb)
+			stream->doneCb((uint32_t*)client);
 	}
-	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
-	return TRUE;
 }
 
 /**
@@ -422,7 +1020,7 @@ MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_
 BOOL ICACHE_FLASH_ATTR
 MQTT_Subscribe(MQTT_Client *client, char* topic, uint8_t qos)
 {
-	uint8_t dataBuffer[MQTT_BUF_SIZE];
+	uint8_t dataBuffer[MQTT_SEND_BUF_SIZE];
 	uint16_t dataLen;
 
 	client->mqtt_state.outbound_message = mqtt_msg_subscribe(&client->mqtt_state.mqtt_connection,
@@ -430,24 +1028,63 @@ MQTT_Subscribe(MQTT_Client *client, char* topic, uint8_t qos)
 											&client->mqtt_state.pending_msg_id);
 	INFO("MQTT: queue subscribe, topic\"%s\", id: %d\r\n",topic, client->mqtt_state.pending_msg_id);
 	while(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-		INFO("MQTT: Queue full\r\n");
-		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == -1) {
-			INFO("MQTT: Serious buffer error\r\n");
+		LOG_W("MQTT: Queue full\r\n");
+		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_SEND_BUF_SIZE) == -1) {
+			LOG_E("MQTT: Serious buffer error\r\n");
 			return FALSE;
 		}
+		mqtt_stats_dropped(client, dataBuffer);
 	}
+	mqtt_stats_queued(client);
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 	return TRUE;
 }
 
-void ICACHE_FLASH_ATTR
-MQTT_Task(os_event_t *e)
+/* Snapshot on the diagnostics topic:
+ * {"bi":bytes in,"bo":bytes out,"pi":packets in,"po":packets out,
+ *  "qh":queue high-water,"qd":queue drops,"rc":reconnects,
+ *  "tl":packets too long,"co":coalesced packets,
+ *  "bg":packets through a dynamic buffer,"rh":heap reclaimed by the buffer sizes,
+ *  "as":bytes saved by topic aliases,
+ *  "rtt":ping rtt us,"rttx":max,"lat":publish latency us,"latx":max,
+ *  "st":[ms in each tConnState], fields of the MqttStatsCallback} */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_stats_publish(MQTT_Client *client)
 {
-	MQTT_Client* client = (MQTT_Client*)e->par;
-	uint8_t dataBuffer[MQTT_BUF_SIZE];
-	uint16_t dataLen;
-	if(e->par == 0)
+	MQTT_STATS stats;
+	char buf[MQTT_STATS_JSON_MAX];
+	int len, i, extra;
+
+	if(client->connState != MQTT_DATA)
 		return;
+
+	MQTT_GetStats(client, &stats);
+	len = os_sprintf(buf, "{\"bi\":%u,\"bo\":%u,\"pi\":%u,\"po\":%u,\"qh\":%u,\"qd\":%u,\"rc\":%u,\"tl\":%u,\"co\":%u,\"bg\":%u,\"rh\":%d,\"as\":%u,",
+			stats.bytesIn, stats.bytesOut, stats.packetsIn, stats.packetsOut,
+			stats.queueHigh, stats.queueDrops, stats.reconnects, stats.recvTooLong, stats.recvCoalesced,
+			stats.bufGrows, MQTT_BUF_RECLAIMED, stats.aliasSaved);
+	len += os_sprintf(buf + len, "\"rtt\":%u,\"rttx\":%u,\"lat\":%u,\"latx\":%u,\"st\":[",
+			stats.pingRtt, stats.pingRttMax, stats.pubLatency, stats.pubLatencyMax);
+	for(i = 0; i < MQTT_STATE_COUNT; i++)
+		len += os_sprintf(buf + len, i ? ",%u" : "%u", stats.stateTime[i]);
+	len += os_sprintf(buf + len, "]");
+	if(client->statsCb){
+		buf[len++] = ',';
+		// what is left after the closing brace, at least MQTT_STATS_EXTRA
+		extra = client->statsCb(buf + len, sizeof(buf) - len - sizeof("}"));
+		len = extra > 0 ? len + extra : len - 1;
+	}
+	len += os_sprintf(buf + len, "}");
+
+	MQTT_Publish(client, (const char *)client->statsTopic, buf, len, 0, 0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_task_send(MQTT_Client *client)
+{
+	uint8_t dataBuffer[MQTT_SEND_BUF_SIZE];
+	uint16_t dataLen;
+
 	switch(client->connState){
 
 	case TCP_RECONNECT_REQ:
@@ -455,33 +1092,61 @@ MQTT_Task(os_event_t *e)
 	case TCP_RECONNECT:
 		MQTT_Connect(client);
 		INFO("TCP: Reconnect to: %s:%d\r\n", client->host, client->port);
-		client->connState = TCP_CONNECTING;
+		client->stats.reconnects++;
+		mqtt_set_state(client, TCP_CONNECTING);
 		break;
 	case MQTT_DATA:
-		if(QUEUE_IsEmpty(&client->msgQueue) || client->sendTimeout != 0) {
+		if(client->sendTimeout != 0)
+			break;
+		// A started stream must be finished before anything else goes out
+		if(client->stream.fill != NULL && (client->stream.started || QUEUE_IsEmpty(&client->msgQueue))){
+			mqtt_stream_send(client, dataBuffer, MQTT_SEND_BUF_SIZE);
+			break;
+		}
+		if(QUEUE_IsEmpty(&client->msgQueue)) {
 			break;
 		}
-		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == 0){
+		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_SEND_BUF_SIZE) == 0){
+#if MQTT_TOPIC_ALIASES
+			dataLen = mqtt_alias_apply(client, dataBuffer, dataLen, MQTT_SEND_BUF_SIZE);
+#endif
 			client->mqtt_state.pending_msg_type = mqtt_get_type(dataBuffer);
 			client->mqtt_state.pending_msg_id = mqtt_get_id(dataBuffer, dataLen);
 
 
-			client->sendTimeout = MQTT_SEND_TIMOUT;
-			INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-			if(client->security){
-				espconn_secure_sent(client->pCon, dataBuffer, dataLen);
-			}
-			else{
-				espconn_sent(client->pCon, dataBuffer, dataLen);
+			if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH){
+				client->pubSending = mqtt_stats_pub_pop(client, &client->pubSendStart);
+				TRACE_POINT(TRACE_SEND);
 			}
 
+			client->sendTimeout = MQTT_SEND_TIMOUT;
+			LOG_D("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
+			mqtt_send(client, dataBuffer, dataLen);
+
 			client->mqtt_state.outbound_message = NULL;
 			break;
 		}
 		break;
+	default:
+		break;
 	}
 }
 
+void ICACHE_FLASH_ATTR
+MQTT_Task(os_event_t *e)
+{
+	MQTT_Client* client = (MQTT_Client*)e->par;
+	if(e->par == 0)
+		return;
+	mqtt_timer_resume(client);
+	// one after the other, the snapshot and the send buffer never share the stack
+	if(client->statsDue){
+		client->statsDue = 0;
+		mqtt_stats_publish(client);
+	}
+	mqtt_task_send(client);
+}
+
 /**
   * @brief  MQTT initialization connection function
   * @param  client: 	MQTT_Client reference
@@ -493,15 +1158,28 @@ MQTT_Task(os_event_t *e)
 void ICACHE_FLASH_ATTR
 MQTT_InitConnection(MQTT_Client *mqttClient, uint8_t* host, uint32 port, uint8_t security)
 {
-	uint32_t temp;
+	MQTT_InitConnectionArena(mqttClient, host, port, security, NULL, 0);
+}
+
+/**
+  * @brief  MQTT_InitConnection for a client that takes all of its memory
+  *         (strings, buffers, queue, connection) from arena instead of
+  *         the heap. MQTT_ARENA_SIZE fits the default configuration.
+  * @param  arena: 	4 byte aligned, must stay valid as long as the client
+  * @param  arenaSize: size of arena
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTT_InitConnectionArena(MQTT_Client *mqttClient, uint8_t* host, uint32 port, uint8_t security, uint8_t* arena, uint32_t arenaSize)
+{
 	INFO("MQTT_InitConnection\r\n");
 	os_memset(mqttClient, 0, sizeof(MQTT_Client));
-	temp = os_strlen(host);
-	mqttClient->host = (uint8_t*)os_zalloc(temp + 1);
-	os_strcpy(mqttClient->host, host);
-	mqttClient->host[temp] = 0;
+	mqttClient->arena = arena;
+	mqttClient->arenaSize = arena ? arenaSize : 0;
+	mqttClient->host = mqtt_strdup(mqttClient, host);
 	mqttClient->port = port;
 	mqttClient->security = security;
+	mqttClient->stateSince = system_get_time();
 
 }
 
@@ -517,39 +1195,31 @@ MQTT_InitConnection(MQTT_Client *mqttClient, uint8_t* host, uint32 port, uint8_t
 void ICACHE_FLASH_ATTR
 MQTT_InitClient(MQTT_Client *mqttClient, uint8_t* client_id, uint8_t* client_user, uint8_t* client_pass, uint32_t keepAliveTime, uint8_t cleanSession)
 {
-	uint32_t temp;
 	INFO("MQTT_InitClient\r\n");
 
 	os_memset(&mqttClient->connect_info, 0, sizeof(mqtt_connect_info_t));
 
-	temp = os_strlen(client_id);
-	mqttClient->connect_info.client_id = (uint8_t*)os_zalloc(temp + 1);
-	os_strcpy(mqttClient->connect_info.client_id, client_id);
-	mqttClient->connect_info.client_id[temp] = 0;
-
-	temp = os_strlen(client_user);
-	mqttClient->connect_info.username = (uint8_t*)os_zalloc(temp + 1);
-	os_strcpy(mqttClient->connect_info.username, client_user);
-	mqttClient->connect_info.username[temp] = 0;
-
-	temp = os_strlen(client_pass);
-	mqttClient->connect_info.password = (uint8_t*)os_zalloc(temp + 1);
-	os_strcpy(mqttClient->connect_info.password, client_pass);
-	mqttClient->connect_info.password[temp] = 0;
+	mqttClient->connect_info.client_id = (char *)mqtt_strdup(mqttClient, client_id);
+	mqttClient->connect_info.username = (char *)mqtt_strdup(mqttClient, client_user);
+	mqttClient->connect_info.password = (char *)mqtt_strdup(mqttClient, client_pass);
 
 
 	mqttClient->connect_info.keepalive = keepAliveTime;
 	mqttClient->connect_info.clean_session = cleanSession;
 
-	mqttClient->mqtt_state.in_buffer = (uint8_t *)os_zalloc(MQTT_BUF_SIZE);
-	mqttClient->mqtt_state.in_buffer_length = MQTT_BUF_SIZE;
-	mqttClient->mqtt_state.out_buffer =  (uint8_t *)os_zalloc(MQTT_BUF_SIZE);
-	mqttClient->mqtt_state.out_buffer_length = MQTT_BUF_SIZE;
+	mqttClient->mqtt_state.in_buffer = (uint8_t *)mqtt_alloc(mqttClient, MEM_TAG_MQTT, MQTT_IN_BUF_SIZE);
+	mqttClient->mqtt_state.in_buffer_length = MQTT_IN_BUF_SIZE;
+	mqttClient->mqtt_state.out_buffer =  (uint8_t *)mqtt_alloc(mqttClient, MEM_TAG_MQTT, MQTT_OUT_BUF_SIZE);
+	mqttClient->mqtt_state.out_buffer_length = MQTT_OUT_BUF_SIZE;
 	mqttClient->mqtt_state.connect_info = &mqttClient->connect_info;
 
 	mqtt_msg_init(&mqttClient->mqtt_state.mqtt_connection, mqttClient->mqtt_state.out_buffer, mqttClient->mqtt_state.out_buffer_length);
 
-	QUEUE_Init(&mqttClient->msgQueue, QUEUE_BUFFER_SIZE);
+	QUEUE_InitBuffer(&mqttClient->msgQueue, (uint8_t *)mqtt_alloc(mqttClient, MEM_TAG_QUEUE, QUEUE_BUFFER_SIZE), QUEUE_BUFFER_SIZE);
+	INFO("MQTT: Buffers in %d, out %d, queue %d bytes, %d reclaimed\r\n",
+			MQTT_IN_BUF_SIZE, MQTT_OUT_BUF_SIZE, QUEUE_BUFFER_SIZE, MQTT_BUF_RECLAIMED);
+	if(mqttClient->arena)
+		INFO("MQTT: Arena %d of %d bytes used\r\n", mqttClient->arenaUsed, mqttClient->arenaSize);
 
 	system_os_task(MQTT_Task, MQTT_TASK_PRIO, mqtt_procTaskQueue, MQTT_TASK_QUEUE_SIZE);
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)mqttClient);
@@ -557,21 +1227,58 @@ MQTT_InitClient(MQTT_Client *mqttClient, uint8_t* client_id, uint8_t* client_use
 void ICACHE_FLASH_ATTR
 MQTT_InitLWT(MQTT_Client *mqttClient, uint8_t* will_topic, uint8_t* will_msg, uint8_t will_qos, uint8_t will_retain)
 {
-	uint32_t temp;
-	temp = os_strlen(will_topic);
-	mqttClient->connect_info.will_topic = (uint8_t*)os_zalloc(temp + 1);
-	os_strcpy(mqttClient->connect_info.will_topic, will_topic);
-	mqttClient->connect_info.will_topic[temp] = 0;
-
-	temp = os_strlen(will_msg);
-	mqttClient->connect_info.will_message = (uint8_t*)os_zalloc(temp + 1);
-	os_strcpy(mqttClient->connect_info.will_message, will_msg);
-	mqttClient->connect_info.will_message[temp] = 0;
+	mqttClient->connect_info.will_topic = (char *)mqtt_strdup(mqttClient, will_topic);
+	mqttClient->connect_info.will_message = (char *)mqtt_strdup(mqttClient, will_msg);
 
 
 	mqttClient->connect_info.will_qos = will_qos;
 	mqttClient->connect_info.will_retain = will_retain;
 }
+/* Building the snapshot is left to MQTT_Task, so it never holds up a
+ * command; a failed post is picked up by the next one */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_stats_timer(void *arg)
+{
+	MQTT_Client* client = (MQTT_Client*)arg;
+
+	client->statsDue = 1;
+	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+}
+
+/**
+  * @brief  Publish a metrics snapshot periodically
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 		diagnostics topic
+  * @param  interval:	seconds between snapshots, 0 to only collect
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTT_InitStats(MQTT_Client *mqttClient, uint8_t* topic, uint32_t interval)
+{
+	os_timer_disarm(&mqttClient->statsTimer);
+	if(mqttClient->statsTopic)
+		mqtt_free(mqttClient, mqttClient->statsTopic);
+	mqttClient->statsTopic = mqtt_strdup(mqttClient, topic);
+
+	if(interval == 0)
+		return;
+	os_timer_setfn(&mqttClient->statsTimer, (os_timer_func_t *)mqtt_stats_timer, mqttClient);
+	os_timer_arm(&mqttClient->statsTimer, interval * 1000, 1);
+}
+
+/**
+  * @brief  Read the client metrics
+  * @param  client: 	MQTT_Client reference
+  * @param  stats: 		filled with the counters, state times up to now
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTT_GetStats(MQTT_Client *client, MQTT_STATS *stats)
+{
+	mqtt_stats_sample(client);
+	os_memcpy(stats, &client->stats, sizeof(MQTT_STATS));
+}
+
 /**
   * @brief  Begin connect to MQTT broker
   * @param  client: MQTT_Client reference
@@ -581,10 +1288,9 @@ void ICACHE_FLASH_ATTR
 MQTT_Connect(MQTT_Client *mqttClient)
 {
 	MQTT_Disconnect(mqttClient);
-	mqttClient->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
+	mqttClient->pCon = mqtt_conn_alloc(mqttClient);
 	mqttClient->pCon->type = ESPCONN_TCP;
 	mqttClient->pCon->state = ESPCONN_NONE;
-	mqttClient->pCon->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
 	mqttClient->pCon->proto.tcp->local_port = espconn_port();
 	mqttClient->pCon->proto.tcp->remote_port = mqttClient->port;
 	mqttClient->pCon->reverse = mqttClient;
@@ -593,28 +1299,24 @@ MQTT_Connect(MQTT_Client *mqttClient)
 
 	mqttClient->keepAliveTick = 0;
 	mqttClient->reconnectTick = 0;
+	mqttClient->timerIdle = 0;
+	mqtt_recv_reset(mqttClient);
+	mqttClient->stream.fill = NULL;
 
 
 	os_timer_disarm(&mqttClient->mqttTimer);
 	os_timer_setfn(&mqttClient->mqttTimer, (os_timer_func_t *)mqtt_timer, mqttClient);
 	os_timer_arm(&mqttClient->mqttTimer, 1000, 1);
 
-	if(UTILS_StrToIP(mqttClient->host, &mqttClient->pCon->proto.tcp->remote_ip)) {
+	if(UTILS_StrToIP((const int8_t *)mqttClient->host, &mqttClient->pCon->proto.tcp->remote_ip)) {
 		INFO("TCP: Connect to ip  %s:%d\r\n", mqttClient->host, mqttClient->port);
-		if(mqttClient->security){
-			INFO("Secure Connect/n");
-			espconn_secure_connect(mqttClient->pCon);
-		}
-		else {
-			INFO("No Secure Connect/n");
-			espconn_connect(mqttClient->pCon);
-		}
+		mqtt_conn_open(mqttClient);
 	}
 	else {
 		INFO("TCP: Connect to domain %s:%d\r\n", mqttClient->host, mqttClient->port);
-		espconn_gethostbyname(mqttClient->pCon, mqttClient->host, &mqttClient->ip, mqtt_dns_found);
+		espconn_gethostbyname(mqttClient->pCon, (const char *)mqttClient->host, &mqttClient->ip, mqtt_dns_found);
 	}
-	mqttClient->connState = TCP_CONNECTING;
+	mqtt_set_state(mqttClient, TCP_CONNECTING);
 }
 
 void ICACHE_FLASH_ATTR
@@ -623,11 +1325,12 @@ MQTT_Disconnect(MQTT_Client *mqttClient)
 	INFO("MQTT Disconnect\n");
 	if(mqttClient->pCon){
 		INFO("Free memory\r\n");
-		if(mqttClient->pCon->proto.tcp)
-			os_free(mqttClient->pCon->proto.tcp);
-		os_free(mqttClient->pCon);
-		mqttClient->pCon = NULL;
+		mqtt_conn_close(mqttClient);
 	}
+	// queued messages wait for the next MQTT_Connect
+	mqtt_set_state(mqttClient, TCP_DISCONNECTED);
+	mqttClient->sendTimeout = 0;
+	mqttClient->stream.fill = NULL;
 
 	os_timer_disarm(&mqttClient->mqttTimer);
 }
@@ -654,3 +1357,9 @@ MQTT_OnPublished(MQTT_Client *mqttClient, MqttCallback publishedCb)
 {
 	mqttClient->publishedCb = publishedCb;
 }
+
+void ICACHE_FLASH_ATTR
+MQTT_OnStats(MQTT_Client *mqttClient, MqttStatsCallback statsCb)
+{
+	mqttClient->statsCb = statsCb;
+}
@@ -32,7 +32,8 @@
 #include <string.h>
 #include "mqtt_msg.h"
 #include "user_config.h"
-#define MQTT_MAX_FIXED_HEADER_SIZE 3
+// type and up to three length bytes, enough for a 16 bit buffer
+#define MQTT_MAX_FIXED_HEADER_SIZE 4
 
 enum mqtt_connect_flag
 {
@@ -49,7 +50,7 @@ struct __attribute((__packed__)) mqtt_connect_variable_header
   uint8_t lengthLsb;
 #if defined(PROTOCOL_NAMEv31)
   uint8_t magic[6];
-#elif defined(PROTOCOL_NAMEv311)
+#elif defined(PROTOCOL_NAMEv311) || defined(PROTOCOL_NAMEv5)
   uint8_t magic[4];
 #else
 #error "Please define protocol name"
@@ -58,8 +59,34 @@ struct __attribute((__packed__)) mqtt_connect_variable_header
   uint8_t flags;
   uint8_t keepaliveMsb;
   uint8_t keepaliveLsb;
+#if defined(PROTOCOL_NAMEv5)
+  uint8_t propertiesLength;
+#endif
 };
 
+#if defined(PROTOCOL_NAMEv5)
+/* Variable byte integer at *pos, which is moved past it. -1 if it runs
+ * over end or over four bytes. */
+static int ICACHE_FLASH_ATTR read_varint(const uint8_t** pos, const uint8_t* end, uint32_t* value)
+{
+  int i;
+
+  *value = 0;
+  for(i = 0; i < 4 && *pos < end; ++i)
+  {
+    *value |= (uint32_t)(**pos & 0x7f) << (7 * i);
+    if((*(*pos)++ & 0x80) == 0)
+      return 0;
+  }
+  return -1;
+}
+
+static int ICACHE_FLASH_ATTR varint_length(uint32_t value)
+{
+  return value > 2097151 ? 4 : value > 16383 ? 3 : value > 127 ? 2 : 1;
+}
+#endif
+
 static int ICACHE_FLASH_ATTR append_string(mqtt_connection_t* connection, const char* string, int len)
 {
   if(connection->message.length + len + 2 > connection->buffer_length)
@@ -73,6 +100,17 @@ static int ICACHE_FLASH_ATTR append_string(mqtt_connection_t* connection, const
   return len + 2;
 }
 
+/* The properties of an outgoing packet, none: only their length in MQTT 5 */
+static int ICACHE_FLASH_ATTR append_properties(mqtt_connection_t* connection)
+{
+#if defined(PROTOCOL_NAMEv5)
+  if(connection->message.length + 1 > connection->buffer_length)
+    return -1;
+  connection->buffer[connection->message.length++] = 0;
+#endif
+  return 0;
+}
+
 static uint16_t ICACHE_FLASH_ATTR append_message_id(mqtt_connection_t* connection, uint16_t message_id)
 {
   // If message_id is zero then we should assign one, otherwise
@@ -105,29 +143,30 @@ static mqtt_message_t* ICACHE_FLASH_ATTR fail_message(mqtt_connection_t* connect
 static mqtt_message_t* ICACHE_FLASH_ATTR fini_message(mqtt_connection_t* connection, int type, int dup, int qos, int retain)
 {
   int remaining_length = connection->message.length - MQTT_MAX_FIXED_HEADER_SIZE;
+  int header_length = remaining_length > 16383 ? 4 : remaining_length > 127 ? 3 : 2;
+  uint8_t* header = connection->buffer + MQTT_MAX_FIXED_HEADER_SIZE - header_length;
+  int i;
 
-  if(remaining_length > 127)
+  // the fixed header ends where the variable header starts, with seven
+  // bits of the remaining length per byte
+  header[0] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
+  for(i = 1; i < header_length; ++i)
   {
-    connection->buffer[0] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
-    connection->buffer[1] = 0x80 | (remaining_length % 128);
-    connection->buffer[2] = remaining_length / 128;
-    connection->message.length = remaining_length + 3;
-    connection->message.data = connection->buffer;
-  }
-  else
-  {
-    connection->buffer[1] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
-    connection->buffer[2] = remaining_length;
-    connection->message.length = remaining_length + 2;
-    connection->message.data = connection->buffer + 1;
+    header[i] = remaining_length % 128;
+    remaining_length /= 128;
+    if(i < header_length - 1)
+      header[i] |= 0x80;
   }
 
+  connection->message.length += header_length - MQTT_MAX_FIXED_HEADER_SIZE;
+  connection->message.data = header;
+
   return &connection->message;
 }
 
 void ICACHE_FLASH_ATTR mqtt_msg_init(mqtt_connection_t* connection, uint8_t* buffer, uint16_t buffer_length)
 {
-  memset(connection, 0, sizeof(connection));
+  memset(connection, 0, sizeof(*connection));
   connection->buffer = buffer;
   connection->buffer_length = buffer_length;
 }
@@ -202,7 +241,8 @@ const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* l
   topiclen = buffer[i++] << 8;
   topiclen |= buffer[i++];
 
-  if(i + topiclen >= *length){
+  // the payload may be empty, then it starts at the end
+  if(i + topiclen > *length){
 	*length = 0;
     return NULL;
   }
@@ -210,11 +250,26 @@ const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* l
 
   if(mqtt_get_qos(buffer) > 0)
   {
-    if(i + 2 >= *length)
+    if(i + 2 > *length){
+      *length = 0;
       return NULL;
+    }
     i += 2;
   }
 
+#if defined(PROTOCOL_NAMEv5)
+  {
+    const uint8_t* pos = buffer + i;
+    uint32_t properties_length;
+
+    if(read_varint(&pos, buffer + *length, &properties_length) < 0){
+      *length = 0;
+      return NULL;
+    }
+    i = pos - buffer + properties_length;
+  }
+#endif
+
   if(totlen < i)
     return NULL;
 
@@ -251,13 +306,13 @@ uint16_t ICACHE_FLASH_ATTR mqtt_get_id(uint8_t* buffer, uint16_t length)
       topiclen = buffer[i++] << 8;
       topiclen |= buffer[i++];
 
-      if(i + topiclen >= length)
+      if(i + topiclen > length)
         return 0;
       i += topiclen;
 
       if(mqtt_get_qos(buffer) > 0)
       {
-        if(i + 2 >= length)
+        if(i + 2 > length)
           return 0;
         //i += 2;
       } else {
@@ -307,6 +362,12 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_connect(mqtt_connection_t* connection
   variable_header->lengthLsb = 4;
   memcpy(variable_header->magic, "MQTT", 4);
   variable_header->version = 4;
+#elif defined(PROTOCOL_NAMEv5)
+  variable_header->lengthLsb = 4;
+  memcpy(variable_header->magic, "MQTT", 4);
+  variable_header->version = 5;
+  // no Topic Alias Maximum, the broker must not use aliases towards us
+  variable_header->propertiesLength = 0;
 #else
 #error "Please define protocol name"
 #endif
@@ -328,6 +389,10 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_connect(mqtt_connection_t* connection
 
   if(info->will_topic != NULL && info->will_topic[0] != '\0')
   {
+    // MQTT 5: the will properties come first
+    if(append_properties(connection) < 0)
+      return fail_message(connection);
+
     if(append_string(connection, info->will_topic, strlen(info->will_topic)) < 0)
       return fail_message(connection);
 
@@ -377,6 +442,9 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection
   else
     *message_id = 0;
 
+  if(append_properties(connection) < 0)
+    return fail_message(connection);
+
   if(connection->message.length + data_length > connection->buffer_length)
     return fail_message(connection);
   memcpy(connection->buffer + connection->message.length, data, data_length);
@@ -385,6 +453,42 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection
   return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain);
 }
 
+/* Fixed header, remaining length and topic of a QoS 0 publish whose payload
+ * is sent separately. Returns the header length or -1 if it does not fit. */
+int ICACHE_FLASH_ATTR mqtt_msg_publish_header(uint8_t* buffer, uint16_t buffer_length, const char* topic, uint32_t data_length, int retain)
+{
+  int topic_length = strlen(topic);
+  int properties_length = 0;
+  uint32_t remaining_length;
+  int length = 0;
+
+#if defined(PROTOCOL_NAMEv5)
+  properties_length = 1;
+#endif
+  remaining_length = 2 + topic_length + properties_length + data_length;
+  if(topic_length == 0 || buffer_length < 5 + 2 + topic_length + properties_length)
+    return -1;
+
+  buffer[length++] = ((MQTT_MSG_TYPE_PUBLISH & 0x0f) << 4) | (retain & 1);
+  do
+  {
+    buffer[length] = remaining_length % 128;
+    remaining_length /= 128;
+    if(remaining_length > 0)
+      buffer[length] |= 0x80;
+    length++;
+  } while(remaining_length > 0 && length < 5);
+
+  buffer[length++] = topic_length >> 8;
+  buffer[length++] = topic_length & 0xff;
+  memcpy(buffer + length, topic, topic_length);
+  length += topic_length;
+  if(properties_length)
+    buffer[length++] = 0;
+
+  return length;
+}
+
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id)
 {
   init_message(connection);
@@ -427,6 +531,9 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_subscribe(mqtt_connection_t* connecti
   if((*message_id = append_message_id(connection, 0)) == 0)
     return fail_message(connection);
 
+  if(append_properties(connection) < 0)
+    return fail_message(connection);
+
   if(append_string(connection, topic, strlen(topic)) < 0)
     return fail_message(connection);
 
@@ -447,6 +554,9 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_unsubscribe(mqtt_connection_t* connec
   if((*message_id = append_message_id(connection, 0)) == 0)
     return fail_message(connection);
 
+  if(append_properties(connection) < 0)
+    return fail_message(connection);
+
   if(append_string(connection, topic, strlen(topic)) < 0)
     return fail_message(connection);
 
@@ -470,3 +580,214 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_disconnect(mqtt_connection_t* connect
   init_message(connection);
   return fini_message(connection, MQTT_MSG_TYPE_DISCONNECT, 0, 0, 0);
 }
+
+#if defined(PROTOCOL_NAMEv5)
+/* Size of a property value by identifier: 1, 2 or 4 bytes, or one of the
+ * variable length kinds below; 0 for identifiers we don't know */
+#define PROPERTY_VARINT   5
+#define PROPERTY_BINARY   6
+#define PROPERTY_PAIR     7
+
+static int ICACHE_FLASH_ATTR property_kind(uint8_t id)
+{
+  switch(id)
+  {
+    case MQTT_PROP_PAYLOAD_FORMAT:
+    case MQTT_PROP_REQUEST_PROBLEM_INFO:
+    case MQTT_PROP_REQUEST_RESPONSE_INFO:
+    case MQTT_PROP_MAXIMUM_QOS:
+    case MQTT_PROP_RETAIN_AVAILABLE:
+    case MQTT_PROP_WILDCARD_AVAILABLE:
+    case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
+    case MQTT_PROP_SHARED_AVAILABLE:
+      return 1;
+    case MQTT_PROP_SERVER_KEEP_ALIVE:
+    case MQTT_PROP_RECEIVE_MAXIMUM:
+    case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+    case MQTT_PROP_TOPIC_ALIAS:
+      return 2;
+    case MQTT_PROP_MESSAGE_EXPIRY:
+    case MQTT_PROP_SESSION_EXPIRY:
+    case MQTT_PROP_WILL_DELAY:
+    case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+      return 4;
+    case MQTT_PROP_SUBSCRIPTION_ID:
+      return PROPERTY_VARINT;
+    case MQTT_PROP_CONTENT_TYPE:
+    case MQTT_PROP_RESPONSE_TOPIC:
+    case MQTT_PROP_CORRELATION_DATA:
+    case MQTT_PROP_ASSIGNED_CLIENT_ID:
+    case MQTT_PROP_AUTH_METHOD:
+    case MQTT_PROP_AUTH_DATA:
+    case MQTT_PROP_RESPONSE_INFO:
+    case MQTT_PROP_SERVER_REFERENCE:
+    case MQTT_PROP_REASON_STRING:
+      return PROPERTY_BINARY;
+    case MQTT_PROP_USER_PROPERTY:
+      return PROPERTY_PAIR;
+    default:
+      return 0;
+  }
+}
+
+/* Two byte length and the bytes after it, left where they are */
+static int ICACHE_FLASH_ATTR read_binary(const uint8_t** pos, const uint8_t* end, const uint8_t** data, uint16_t* length)
+{
+  if(end - *pos < 2)
+    return -1;
+  *length = ((*pos)[0] << 8) | (*pos)[1];
+  if(end - *pos - 2 < *length)
+    return -1;
+  *data = *pos + 2;
+  *pos += 2 + *length;
+  return 0;
+}
+
+/* Start iterating the properties of a CONNACK, PUBLISH, SUBACK or
+ * UNSUBACK in buffer. Returns the offset of what follows them (the
+ * payload, the reason codes), -1 if the packet has none or is cut. */
+int ICACHE_FLASH_ATTR mqtt_get_properties(uint8_t* buffer, uint16_t length, mqtt_property_iter_t* iter)
+{
+  const uint8_t* end = buffer + length;
+  const uint8_t* pos = buffer + 1;
+  uint32_t remaining_length;
+  uint16_t topic_length;
+
+  if(length < 2 || read_varint(&pos, end, &remaining_length) < 0)
+    return -1;
+  if(remaining_length < end - pos)
+    end = pos + remaining_length;
+
+  switch(mqtt_get_type(buffer))
+  {
+    case MQTT_MSG_TYPE_CONNACK:
+      pos += 2;
+      break;
+    case MQTT_MSG_TYPE_PUBLISH:
+      if(end - pos < 2)
+        return -1;
+      topic_length = (pos[0] << 8) | pos[1];
+      pos += 2 + topic_length;
+      if(mqtt_get_qos(buffer) > 0)
+        pos += 2;
+      break;
+    case MQTT_MSG_TYPE_SUBACK:
+    case MQTT_MSG_TYPE_UNSUBACK:
+      pos += 2;
+      break;
+    default:
+      return -1;
+  }
+
+  if(pos >= end || read_varint(&pos, end, &remaining_length) < 0 || remaining_length > end - pos)
+    return -1;
+  iter->pos = pos;
+  iter->end = pos + remaining_length;
+  return iter->end - buffer;
+}
+
+/* The next property. Returns 1, 0 after the last one, -1 if the block is
+ * malformed or has a property we can't size. Strings point into the packet. */
+int ICACHE_FLASH_ATTR mqtt_property_next(mqtt_property_iter_t* iter, mqtt_property_t* property)
+{
+  const uint8_t* pos = iter->pos;
+  int kind;
+
+  if(pos >= iter->end)
+    return 0;
+  memset(property, 0, sizeof(*property));
+  property->id = *pos++;
+  kind = property_kind(property->id);
+  switch(kind)
+  {
+    case 1:
+    case 2:
+    case 4:
+      if(iter->end - pos < kind)
+        return -1;
+      while(kind-- > 0)
+        property->value = (property->value << 8) | *pos++;
+      break;
+    case PROPERTY_VARINT:
+      if(read_varint(&pos, iter->end, &property->value) < 0)
+        return -1;
+      break;
+    case PROPERTY_BINARY:
+      if(read_binary(&pos, iter->end, &property->data, &property->length) < 0)
+        return -1;
+      break;
+    case PROPERTY_PAIR:
+      if(read_binary(&pos, iter->end, &property->data, &property->length) < 0 ||
+          read_binary(&pos, iter->end, &property->data2, &property->length2) < 0)
+        return -1;
+      break;
+    default:
+      return -1;
+  }
+  iter->pos = pos;
+  return 1;
+}
+
+/* Rewrite a publish encoded by mqtt_msg_publish in place to carry a Topic
+ * Alias property, with the topic to set the alias up (keep_topic) or with
+ * an empty topic to use it. Returns the new length, -1 if the packet is
+ * not such a publish or the result does not fit buffer_length. */
+int ICACHE_FLASH_ATTR mqtt_msg_publish_alias(uint8_t* buffer, uint16_t length, uint16_t buffer_length, uint16_t alias, int keep_topic)
+{
+  const uint8_t* pos = buffer + 1;
+  uint32_t remaining_length;
+  int header_length, topic_length, id_length, payload_offset, payload_length;
+  int new_header_length, new_topic_length, new_payload_offset;
+  uint8_t id[2];
+  int i;
+
+  if(mqtt_get_type(buffer) != MQTT_MSG_TYPE_PUBLISH || read_varint(&pos, buffer + length, &remaining_length) < 0)
+    return -1;
+  header_length = pos - buffer;
+  if(header_length + remaining_length != length || remaining_length < 3)
+    return -1;
+  topic_length = (pos[0] << 8) | pos[1];
+  id_length = mqtt_get_qos(buffer) > 0 ? 2 : 0;
+  payload_offset = header_length + 2 + topic_length + id_length + 1;
+  // our own publishes have no properties
+  if(payload_offset > length || buffer[payload_offset - 1] != 0)
+    return -1;
+  payload_length = length - payload_offset;
+  if(id_length)
+    memcpy(id, buffer + payload_offset - 3, 2);
+
+  new_topic_length = keep_topic ? topic_length : 0;
+  remaining_length = 2 + new_topic_length + id_length + 4 + payload_length;
+  new_header_length = 1 + varint_length(remaining_length);
+  new_payload_offset = new_header_length + 2 + new_topic_length + id_length + 4;
+  if(new_payload_offset + payload_length > buffer_length)
+    return -1;
+
+  // the payload first, it only moves right when the topic stays
+  memmove(buffer + new_payload_offset, buffer + payload_offset, payload_length);
+  if(keep_topic)
+    memmove(buffer + new_header_length + 2, buffer + header_length + 2, topic_length);
+
+  for(i = 1; i < new_header_length; ++i)
+  {
+    buffer[i] = remaining_length % 128;
+    remaining_length /= 128;
+    if(i < new_header_length - 1)
+      buffer[i] |= 0x80;
+  }
+  buffer[new_header_length] = new_topic_length >> 8;
+  buffer[new_header_length + 1] = new_topic_length & 0xff;
+  i = new_header_length + 2 + new_topic_length;
+  if(id_length)
+  {
+    buffer[i++] = id[0];
+    buffer[i++] = id[1];
+  }
+  buffer[i++] = 3;
+  buffer[i++] = MQTT_PROP_TOPIC_ALIAS;
+  buffer[i++] = alias >> 8;
+  buffer[i++] = alias & 0xff;
+
+  return new_payload_offset + payload_length;
+}
+#endif
@@ -1,5 +1,40 @@
 #include "proto.h"
 #include "ringbuf.h"
+#include "osapi.h"
+
+/* 0x7D, 0x7E and 0x7F are escaped, everything else goes through as is */
+#define PROTO_IS_SPECIAL(c)	((U8)((c) - 0x7D) < 3)
+
+/* Nonzero if any byte of the word is special. (b & 0x7F) + 3 sets bit 7
+ * exactly for 0x7D..0x7F and 0xFD..0xFF and never carries into the next
+ * byte, & ~w drops the latter. */
+#define PROTO_HAS_SPECIAL(w)	((((w) & 0x7F7F7F7Ful) + 0x03030303ul) & ~(w) & 0x80808080ul)
+
+/*
+ * Number of leading bytes of p that need no escaping. Aligned words are
+ * tested four bytes at a time, the bytes around them and the word holding
+ * a hit one by one. Word loads must be aligned on the ESP8266.
+ */
+static U16 ICACHE_FLASH_ATTR PROTO_Plain(const U8 *p, U16 len)
+{
+    const U8 *start = p, *end = p + len;
+    uint32_t w;
+
+    while (p < end && ((size_t)p & 3)) {
+        if (PROTO_IS_SPECIAL(*p)) return p - start;
+        p++;
+    }
+    while (end - p >= 4) {
+        w = *(const uint32_t *)p;
+        if (PROTO_HAS_SPECIAL(w)) break;
+        p += 4;
+    }
+    while (p < end && !PROTO_IS_SPECIAL(*p))
+        p++;
+
+    return p - start;
+}
+
 I8 ICACHE_FLASH_ATTR PROTO_Init(PROTO_PARSER *parser, PROTO_PARSE_CALLBACK *completeCallback, U8 *buf, U16 bufSize)
 {
     parser->buf = buf;
@@ -7,6 +42,7 @@ I8 ICACHE_FLASH_ATTR PROTO_Init(PROTO_PARSER *parser, PROTO_PARSE_CALLBACK *comp
     parser->dataLen = 0;
     parser->callback = completeCallback;
     parser->isEsc = 0;
+    parser->isBegin = 0;
     return 0;
 }
 
@@ -48,8 +84,25 @@ I8 ICACHE_FLASH_ATTR PROTO_ParseByte(PROTO_PARSER *parser, U8 value)
 
 I8 ICACHE_FLASH_ATTR PROTO_Parse(PROTO_PARSER *parser, U8 *buf, U16 len)
 {
-    while(len--)
-        PROTO_ParseByte(parser, *buf++);
+    U16 run, room;
+
+    while (len) {
+        run = parser->isEsc ? 0 : PROTO_Plain(buf, len);
+        if (run == 0) {
+            PROTO_ParseByte(parser, *buf++);
+            len--;
+            continue;
+        }
+        // plain bytes are data inside a frame and dropped outside
+        if (parser->isBegin) {
+            room = parser->bufSize - parser->dataLen;
+            if (room > run) room = run;
+            os_memcpy(parser->buf + parser->dataLen, buf, room);
+            parser->dataLen += room;
+        }
+        buf += run;
+        len -= run;
+    }
 
     return 0;
 }
@@ -71,30 +124,31 @@ I16 ICACHE_FLASH_ATTR PROTO_Add(U8 *buf, const U8 *packet, I16 bufSize)
 {
     U16 i = 2;
     U16 len = *(U16*) packet;
+    U16 run;
 
     if (bufSize < 1) return -1;
 
     *buf++ = 0x7E;
     bufSize--;
 
-    while (len--) {
-        switch (*packet) {
-        case 0x7D:
-        case 0x7E:
-        case 0x7F:
-            if (bufSize < 2) return -1;
-            *buf++ = 0x7D;
-            *buf++ = *packet++ ^ 0x20;
-            i += 2;
-            bufSize -= 2;
-            break;
-        default:
-            if (bufSize < 1) return -1;
-            *buf++ = *packet++;
-            i++;
-            bufSize--;
-            break;
+    while (len) {
+        run = PROTO_Plain(packet, len);
+        if (run) {
+            if (bufSize < run) return -1;
+            os_memcpy(buf, packet, run);
+            buf += run;
+            packet += run;
+            len -= run;
+            i += run;
+            bufSize -= run;
+            continue;
         }
+        if (bufSize < 2) return -1;
+        *buf++ = 0x7D;
+        *buf++ = *packet++ ^ 0x20;
+        len--;
+        i += 2;
+        bufSize -= 2;
     }
 
     if (bufSize < 1) return -1;
@@ -106,21 +160,21 @@ I16 ICACHE_FLASH_ATTR PROTO_Add(U8 *buf, const U8 *packet, I16 bufSize)
 I16 ICACHE_FLASH_ATTR PROTO_AddRb(RINGBUF *rb, const U8 *packet, I16 len)
 {
     U16 i = 2;
+    U16 run;
     if(RINGBUF_Put(rb, 0x7E) == -1) return -1;
-    while (len--) {
-        switch (*packet) {
-        case 0x7D:
-        case 0x7E:
-        case 0x7F:
-        	if(RINGBUF_Put(rb, 0x7D) == -1) return -1;
-        	if(RINGBUF_Put(rb, *packet++ ^ 0x20) == -1) return -1;
-            i += 2;
-            break;
-        default:
-        	if(RINGBUF_Put(rb, *packet++) == -1) return -1;
-            i++;
-            break;
+    while (len > 0) {
+        run = PROTO_Plain(packet, len);
+        if (run) {
+        	if(RINGBUF_PutBlock(rb, packet, run) == -1) return -1;
+            packet += run;
+            len -= run;
+            i += run;
+            continue;
         }
+        if(RINGBUF_Put(rb, 0x7D) == -1) return -1;
+        if(RINGBUF_Put(rb, *packet++ ^ 0x20) == -1) return -1;
+        len--;
+        i += 2;
     }
     if(RINGBUF_Put(rb, 0x7F) == -1) return -1;
 
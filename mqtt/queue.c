@@ -33,10 +33,16 @@
 #include "osapi.h"
 #include "os_type.h"
 #include "mem.h"
+#include "memtrack.h"
 #include "proto.h"
 void ICACHE_FLASH_ATTR QUEUE_Init(QUEUE *queue, int bufferSize)
 {
-	queue->buf = (uint8_t*)os_zalloc(bufferSize);
+	QUEUE_InitBuffer(queue, (uint8_t*)MEM_ZALLOC(MEM_TAG_QUEUE, bufferSize), bufferSize);
+}
+/* Queue on memory owned by the caller */
+void ICACHE_FLASH_ATTR QUEUE_InitBuffer(QUEUE *queue, uint8_t *buf, int bufferSize)
+{
+	queue->buf = buf;
 	RINGBUF_Init(&queue->rb, queue->buf, bufferSize);
 }
 int32_t ICACHE_FLASH_ATTR QUEUE_Puts(QUEUE *queue, uint8_t* buffer, uint16_t len)
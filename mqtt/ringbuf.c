@@ -4,6 +4,7 @@
 */
 
 #include "ringbuf.h"
+#include "osapi.h"
 
 
 /**
@@ -45,6 +46,34 @@ I16 ICACHE_FLASH_ATTR RINGBUF_Put(RINGBUF *r, U8 c)
 	return 0;
 }
 /**
+* \brief put a block of characters into ring buffer
+* \param r pointer to a ringbuf object
+* \param data characters to be put
+* \param len number of characters
+* \return 0 if successfull, otherwise failed and nothing is put
+*/
+I16 ICACHE_FLASH_ATTR RINGBUF_PutBlock(RINGBUF *r, const U8 *data, I32 len)
+{
+	I32 first;
+
+	if(r->size - r->fill_cnt < len)return -1;	// not enough free slots
+
+	first = r->p_o + r->size - r->p_w;			// up to the physical boundary
+	if(first > len)
+		first = len;
+	os_memcpy(r->p_w, data, first);
+	os_memcpy(r->p_o, data + first, len - first);
+
+	if(r->p_w + len >= r->p_o + r->size)		// rollback if write pointer go pass
+		r->p_w += len - r->size;				// the physical boundary
+	else
+		r->p_w += len;
+
+	r->fill_cnt += len;							// count the slots once they are written
+
+	return 0;
+}
+/**
 * \brief get a character from ring buffer
 * \param r pointer to a ringbuf object
 * \param c read character
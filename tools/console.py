@@ -0,0 +1,182 @@
+#!/usr/bin/env python
+#
+# Serial console client (see modules/include/console.h)
+#
+# Provision and control a device over UART0 without WiFi:
+#
+#   tools/console.py --port /dev/ttyUSB0 set sta_ssid MyNetwork
+#   tools/console.py --port /dev/ttyUSB0 set mqtt_port 1883
+#   tools/console.py --port /dev/ttyUSB0 save
+#   tools/console.py --port /dev/ttyUSB0 restart
+#   tools/console.py --port /dev/ttyUSB0 switch 0 1
+#
+# With BRIDGE_ENABLE it also acts as a bridge sub-node (see include/bridge.h):
+#
+#   tools/console.py --port /dev/ttyUSB0 register 2 cmd --subscribe
+#   tools/console.py --port /dev/ttyUSB0 publish 0 hello 1 world
+#   tools/console.py --port /dev/ttyUSB0 listen
+#
+# Log output on the same port is skipped while waiting for the reply.
+#
+
+import argparse
+import struct
+import sys
+import time
+
+import serial
+
+START, END, ESC = 0x7E, 0x7F, 0x7D
+REPLY = 0x80
+
+PING, GET, SET, SAVE, RESTART = 0x01, 0x02, 0x03, 0x04, 0x05
+SWITCH, STATE = 0x10, 0x11
+REGISTER, PUBLISH, DELIVER = 0x20, 0x21, 0x22
+SUBSCRIBE, RETAIN = 0x01, 0x02
+
+STATUS = {0: 'ok', 1: 'unknown command', 2: 'bad argument', 3: 'bad frame length'}
+
+# name: (id, numeric)
+FIELDS = {
+    'device_id': (0, False),
+    'sta_ssid': (1, False),
+    'sta_pwd': (2, False),
+    'mqtt_host': (3, False),
+    'mqtt_port': (4, True),
+    'mqtt_user': (5, False),
+    'mqtt_pass': (6, False),
+    'mqtt_keepalive': (7, True),
+    'security': (8, True),
+    'topic_s01': (9, False),
+    'topic_s02': (10, False),
+    'topic_s03': (11, False),
+}
+
+
+def frame(cmd, data=b''):
+    payload = struct.pack('<HB', 3 + len(data), cmd) + data
+    out = bytearray([START])
+    for b in bytearray(payload):
+        if b in (START, END, ESC):
+            out += bytearray([ESC, b ^ 0x20])
+        else:
+            out.append(b)
+    out.append(END)
+    return bytes(out)
+
+
+def read_frames(port, timeout):
+    """Yield the payload of every valid frame until timeout (None: forever)"""
+    deadline = None if timeout is None else time.time() + timeout
+    buf, inside, esc = bytearray(), False, False
+    while deadline is None or time.time() < deadline:
+        for b in bytearray(port.read(256)):
+            if b == START:
+                buf, inside, esc = bytearray(), True, False
+            elif not inside:
+                continue
+            elif b == END:
+                inside = False
+                if len(buf) >= 3 and struct.unpack_from('<H', buf)[0] == len(buf):
+                    yield buf
+            elif b == ESC:
+                esc = True
+            else:
+                buf.append(b ^ 0x20 if esc else b)
+                esc = False
+
+
+def read_reply(port, cmd, timeout=2.0):
+    """Wait for the reply to cmd, returns (status, data)"""
+    for buf in read_frames(port, timeout):
+        if len(buf) >= 4 and buf[2] == cmd | REPLY:
+            return buf[3], bytes(buf[4:])
+    raise SystemExit('no reply')
+
+
+def records(data):
+    """Split a PUBLISH/DELIVER body into (id, payload)"""
+    i = 0
+    while i + 2 <= len(data):
+        n = data[i + 1]
+        yield data[i], bytes(data[i + 2:i + 2 + n])
+        i += 2 + n
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Serial console client')
+    parser.add_argument('--port', required=True)
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--subscribe', action='store_true', help='register: route messages on the topic to the node')
+    parser.add_argument('--retain', action='store_true', help='register: publish retained')
+    parser.add_argument('command', choices=['ping', 'get', 'set', 'save', 'restart', 'switch', 'state',
+                                            'register', 'publish', 'listen'])
+    parser.add_argument('args', nargs='*')
+    args = parser.parse_args()
+
+    if args.command == 'listen':
+        port = serial.Serial(args.port, args.baud, timeout=0.1)
+        for buf in read_frames(port, None):
+            if buf[2] == DELIVER:
+                for topic, payload in records(bytes(buf[3:])):
+                    print('%d %s' % (topic, payload.decode('latin-1')))
+
+    if args.command in ('get', 'set'):
+        if not args.args or args.args[0] not in FIELDS:
+            raise SystemExit('field must be one of: ' + ', '.join(sorted(FIELDS)))
+        field, numeric = FIELDS[args.args[0]]
+
+    if args.command == 'ping':
+        cmd, data = PING, b''
+    elif args.command == 'get':
+        cmd, data = GET, bytes(bytearray([field]))
+    elif args.command == 'set':
+        if len(args.args) != 2:
+            raise SystemExit('set <field> <value>')
+        value = struct.pack('<I', int(args.args[1], 0)) if numeric else args.args[1].encode()
+        cmd, data = SET, bytes(bytearray([field])) + value
+    elif args.command == 'save':
+        cmd, data = SAVE, b''
+    elif args.command == 'restart':
+        cmd, data = RESTART, b''
+    elif args.command == 'switch':
+        if len(args.args) != 2:
+            raise SystemExit('switch <channel> <0|1>')
+        cmd, data = SWITCH, bytes(bytearray([int(args.args[0]), int(args.args[1])]))
+    elif args.command == 'register':
+        if len(args.args) != 2:
+            raise SystemExit('register <node> <topic>')
+        flags = (SUBSCRIBE if args.subscribe else 0) | (RETAIN if args.retain else 0)
+        cmd, data = REGISTER, bytes(bytearray([int(args.args[0]), flags])) + args.args[1].encode()
+    elif args.command == 'publish':
+        if not args.args or len(args.args) % 2:
+            raise SystemExit('publish <id> <payload> [<id> <payload>...]')
+        cmd, data = PUBLISH, b''
+        for i in range(0, len(args.args), 2):
+            payload = args.args[i + 1].encode()
+            data += bytes(bytearray([int(args.args[i]), len(payload)])) + payload
+    else:
+        cmd, data = STATE, b''
+
+    port = serial.Serial(args.port, args.baud, timeout=0.1)
+    port.write(frame(cmd, data))
+    status, reply = read_reply(port, cmd)
+    if status:
+        raise SystemExit(STATUS.get(status, 'error %d' % status))
+
+    if cmd == PING:
+        print('chip id %08X' % struct.unpack('<I', reply)[0])
+    elif cmd == GET:
+        print(struct.unpack('<I', reply)[0] if numeric else reply.decode('latin-1'))
+    elif cmd == STATE:
+        print(' '.join(str(b) for b in bytearray(reply)))
+    elif cmd == REGISTER:
+        print('topic id %d' % bytearray(reply)[0])
+    elif cmd == PUBLISH:
+        print('%d published' % bytearray(reply)[0])
+    else:
+        print(STATUS[0])
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,234 @@
+#!/usr/bin/env python
+#
+# Decoder for the deferred binary log (LOG_DEFERRED=1, see modules/include/log.h)
+#
+# The firmware only sends module id, source line and raw arguments. The
+# format strings are recovered from the sources the firmware was built
+# from, so run this against the same checkout. Bytes outside a record
+# (SDK messages, boot ROM output) are passed through unchanged.
+#
+#   tools/logdecode.py capture.bin
+#   tools/logdecode.py --port /dev/ttyUSB0 --baud 115200
+#
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+SYNC = 0xA5
+MAX_ARGS = 10
+LEVELS = {1: 'E', 2: 'W', 3: 'I', 4: 'D'}
+SOURCE_DIRS = ('driver', 'user', 'mqtt', 'modules')
+
+# String macros from the SDK headers, the ones defined in the tree are read from it
+BUILTIN_MACROS = {
+    'MACSTR': '%02x:%02x:%02x:%02x:%02x:%02x',
+    'IPSTR': '%d.%d.%d.%d',
+}
+
+CALL_RE = re.compile(r'\b(INFO|LOG_[EWID])\s*\(')
+MODULE_RE = re.compile(r'^\s*#define\s+LOG_MODULE\s+(\w+)', re.M)
+ID_RE = re.compile(r'^\s*#define\s+LOG_ID_(\w+)\s+(\d+)', re.M)
+STRDEF_RE = re.compile(r'^\s*#define\s+(\w+)\s+((?:"(?:[^"\\]|\\.)*"\s*)+)$', re.M)
+STRING_RE = re.compile(r'"((?:[^"\\]|\\.)*)"')
+FORMAT_RE = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d+))?(?:hh|h|ll|l|z)?([diuxXcsp%])')
+
+
+def unescape(s):
+    return bytes(s, 'latin-1').decode('unicode_escape')
+
+
+def parse_format(text, macros):
+    """Concatenate the string literals and string macros of the first argument"""
+    out = []
+    pos = 0
+    while pos < len(text):
+        c = text[pos]
+        if c == '"':
+            m = STRING_RE.match(text, pos)
+            out.append(unescape(m.group(1)))
+            pos = m.end()
+        elif c.isalpha() or c == '_':
+            m = re.match(r'\w+', text[pos:])
+            if m.group(0) not in macros:
+                return None
+            out.append(macros[m.group(0)])
+            pos += m.end()
+        elif c in ',)':
+            break
+        else:
+            pos += 1
+    return ''.join(out) if out else None
+
+
+def call_end(text, pos):
+    """Offset of the parenthesis closing the call opened just before pos"""
+    depth = 1
+    while pos < len(text) and depth:
+        c = text[pos]
+        if c == '"':
+            pos = STRING_RE.match(text, pos).end()
+            continue
+        if c == '(':
+            depth += 1
+        elif c == ')':
+            depth -= 1
+        pos += 1
+    return pos
+
+
+def load_sources(root):
+    with open(os.path.join(root, 'mqtt', 'include', 'debug.h')) as f:
+        ids = dict((name, int(v)) for name, v in ID_RE.findall(f.read()))
+
+    files = []
+    macros = dict(BUILTIN_MACROS)
+    for d in SOURCE_DIRS:
+        for dirpath, _, names in os.walk(os.path.join(root, d)):
+            for name in sorted(names):
+                if name.endswith(('.c', '.h')):
+                    with open(os.path.join(dirpath, name), errors='replace') as f:
+                        text = f.read()
+                    for key, lit in STRDEF_RE.findall(text):
+                        macros[key] = ''.join(unescape(s) for s in STRING_RE.findall(lit))
+                    if name.endswith('.c'):
+                        files.append((os.path.join(dirpath, name), text))
+
+    formats = {}
+    for path, text in files:
+        m = MODULE_RE.search(text)
+        module = ids[m.group(1) if m else 'APP']
+        for call in CALL_RE.finditer(text):
+            fmt = parse_format(text[call.end():], macros)
+            if fmt is None:
+                continue
+            first = text.count('\n', 0, call.start()) + 1
+            last = text.count('\n', 0, call_end(text, call.end())) + 1
+            # __LINE__ of a multi-line call is the first or the last line
+            # depending on the compiler version
+            for line in (first, last):
+                formats.setdefault((module, line), fmt)
+    names = dict((v, k) for k, v in ids.items())
+    return formats, names
+
+
+def render(fmt, args):
+    it = iter(args)
+
+    def conv(m):
+        flags, width, prec, kind = m.groups()
+        if kind == '%':
+            return '%'
+        try:
+            value = next(it)
+        except StopIteration:
+            return m.group(0)
+        spec = '%' + flags + width + ('.' + prec if prec else '')
+        if kind == 's':
+            return (spec + 's') % (value if isinstance(value, str) else '?')
+        if isinstance(value, str):
+            return value
+        if kind in 'di':
+            return (spec + 'd') % struct.unpack('<i', struct.pack('<I', value))[0]
+        if kind == 'u':
+            return (spec + 'd') % value
+        if kind == 'c':
+            return chr(value & 0xFF)
+        if kind == 'p':
+            return '0x%08x' % value
+        return (spec + kind) % value
+    return FORMAT_RE.sub(conv, fmt)
+
+
+class Decoder(object):
+    def __init__(self, formats, names, out):
+        self.formats = formats
+        self.names = names
+        self.out = out
+        self.buf = bytearray()
+
+    def record(self, rec):
+        """Decode one record without the sync and length bytes, None if invalid"""
+        if len(rec) < 10:
+            return None
+        module, ln, line, mask, ts = struct.unpack_from('<BBHHI', rec)
+        level, nargs = ln >> 4, ln & 0x0F
+        if module not in self.names or nargs > MAX_ARGS:
+            return None
+        pos, args = 10, []
+        for i in range(nargs):
+            if mask & (1 << i):
+                if pos >= len(rec) or pos + 1 + rec[pos] > len(rec):
+                    return None
+                args.append(rec[pos + 1:pos + 1 + rec[pos]].decode('latin-1'))
+                pos += 1 + rec[pos]
+            else:
+                if pos + 4 > len(rec):
+                    return None
+                args.append(struct.unpack_from('<I', rec, pos)[0])
+                pos += 4
+        if pos != len(rec):
+            return None
+
+        if module == 0 and line == 0:
+            text = 'log: %d records dropped' % args[0]
+        else:
+            fmt = self.formats.get((module, line))
+            if fmt is None:
+                text = '<unknown %s:%d> %r' % (self.names[module], line, args)
+            else:
+                text = render(fmt, args)
+        return '[%10.6f] %s %s\n' % (ts / 1e6, LEVELS.get(level, '?'), text.strip('\r\n'))
+
+    def feed(self, data):
+        self.buf += data
+        while self.buf:
+            sync = self.buf.find(SYNC)
+            if sync < 0:
+                self.text(self.buf)
+                del self.buf[:]
+                break
+            if sync:
+                self.text(self.buf[:sync])
+                del self.buf[:sync]
+            if len(self.buf) < 2 or len(self.buf) < 2 + self.buf[1]:
+                break
+            line = self.record(bytes(self.buf[2:2 + self.buf[1]]))
+            if line is None:
+                self.text(self.buf[:1])
+                del self.buf[:1]
+                continue
+            self.out.write(line)
+            del self.buf[:2 + self.buf[1]]
+        self.out.flush()
+
+    def text(self, data):
+        self.out.write(bytes(data).decode('latin-1'))
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    parser = argparse.ArgumentParser(description='Decode the deferred binary log')
+    parser.add_argument('input', nargs='?', help='captured log, - for stdin')
+    parser.add_argument('--port', help='read from a serial port (needs pyserial)')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--src', default=root, help='source tree the firmware was built from')
+    args = parser.parse_args()
+
+    formats, names = load_sources(args.src)
+    decoder = Decoder(formats, names, sys.stdout)
+
+    if args.port:
+        import serial
+        port = serial.Serial(args.port, args.baud, timeout=0.1)
+        while True:
+            decoder.feed(port.read(256))
+    else:
+        stream = sys.stdin.buffer if args.input in (None, '-') else open(args.input, 'rb')
+        decoder.feed(stream.read())
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,205 @@
+/*
+ * bridge.c
+ *
+ * UART to MQTT bridge, see bridge.h for the protocol. Topic strings live
+ * here only; the serial link carries the ids handed out at registration.
+ * Uplink records are published as they arrive in a PUBLISH frame, inbound
+ * messages for the nodes are packed into a DELIVER frame that goes out
+ * when it is full or BRIDGE_BATCH_MS after its first record.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#define LOG_MODULE BRIDGE
+#include "debug.h"
+#include "mqtt.h"
+#include "console.h"
+#include "bridge.h"
+
+#if BRIDGE_ENABLE
+
+#define BRIDGE_BATCH_SIZE	(CONSOLE_FRAME_MAX - 3)
+#define BRIDGE_RECORD_HEAD	2	// id, length
+
+typedef struct {
+	char topic[BRIDGE_TOPIC_MAX];
+	uint8_t flags;
+} BRIDGE_TOPIC;
+
+static MQTT_Client *bridgeClient = NULL;
+static BRIDGE_TOPIC bridgeTopics[BRIDGE_TOPICS];
+static uint8_t bridgeTopicCount = 0;
+static uint8_t bridgeBatch[BRIDGE_BATCH_SIZE];
+static uint16_t bridgeBatchLen = 0;
+static uint32_t bridgeDropped = 0;
+static ETSTimer bridgeTimer;
+
+static void ICACHE_FLASH_ATTR bridge_flush(void *arg)
+{
+	os_timer_disarm(&bridgeTimer);
+	if(bridgeBatchLen == 0)
+		return;
+	CONSOLE_Send(BRIDGE_CMD_DELIVER, bridgeBatch, bridgeBatchLen);
+	bridgeBatchLen = 0;
+}
+
+static BOOL ICACHE_FLASH_ATTR bridge_subscribe(BRIDGE_TOPIC *t)
+{
+	if(bridgeClient == NULL || bridgeClient->connState != MQTT_DATA)
+		return TRUE;	// BRIDGE_Connected subscribes
+	INFO("BRIDGE: Subscribe %s\r\n", t->topic);
+	return MQTT_Subscribe(bridgeClient, t->topic, 0);
+}
+
+static uint8_t ICACHE_FLASH_ATTR bridge_register(const uint8_t *data, uint16_t len, uint8_t *reply, uint16_t *replyLen)
+{
+	char topic[BRIDGE_TOPIC_MAX];
+	uint16_t prefixLen;
+	uint8_t id;
+
+	if(len < 3 || *replyLen < 1)
+		return CONSOLE_ERR_ARG;
+	prefixLen = os_sprintf(topic, BRIDGE_TOPIC_PREFIX "/%d/", system_get_chip_id(), data[0]);
+	if(prefixLen + len - 2 >= sizeof(topic))
+		return CONSOLE_ERR_ARG;
+	os_memcpy(topic + prefixLen, data + 2, len - 2);
+	topic[prefixLen + len - 2] = 0;
+	if(os_strlen(topic) != prefixLen + len - 2 || os_strchr(topic, '+') || os_strchr(topic, '#'))
+		return CONSOLE_ERR_ARG;
+
+	for(id = 0; id < bridgeTopicCount; id++){
+		if(os_strcmp(bridgeTopics[id].topic, topic) == 0)
+			break;
+	}
+	if(id == bridgeTopicCount){
+		if(bridgeTopicCount == BRIDGE_TOPICS){
+			LOG_W("BRIDGE: No room for %s\r\n", topic);
+			return CONSOLE_ERR_ARG;
+		}
+		os_strcpy(bridgeTopics[id].topic, topic);
+		bridgeTopics[id].flags = 0;
+		bridgeTopicCount++;
+	}
+
+	// a node that restarts registers again, possibly with other flags
+	if((data[1] & BRIDGE_FLAG_SUBSCRIBE) && !(bridgeTopics[id].flags & BRIDGE_FLAG_SUBSCRIBE)){
+		if(!bridge_subscribe(&bridgeTopics[id]))
+			return CONSOLE_ERR_ARG;
+	}
+	// the subscription stays, the other flags follow the node
+	bridgeTopics[id].flags = data[1] | (bridgeTopics[id].flags & BRIDGE_FLAG_SUBSCRIBE);
+
+	INFO("BRIDGE: Topic %d %s\r\n", id, topic);
+	reply[0] = id;
+	*replyLen = 1;
+	return CONSOLE_OK;
+}
+
+static uint8_t ICACHE_FLASH_ATTR bridge_publish(const uint8_t *data, uint16_t len, uint8_t *reply, uint16_t *replyLen)
+{
+	const uint8_t *end = data + len, *p;
+	uint8_t id, n, accepted = 0;
+
+	if(*replyLen < 1)
+		return CONSOLE_ERR_ARG;
+
+	// check the whole batch first, a rejected frame publishes nothing
+	for(p = data; p < end; p += BRIDGE_RECORD_HEAD + p[1]){
+		if(p + BRIDGE_RECORD_HEAD > end || p + BRIDGE_RECORD_HEAD + p[1] > end)
+			return CONSOLE_ERR_LENGTH;
+		if(p[0] >= bridgeTopicCount)
+			return CONSOLE_ERR_ARG;
+	}
+
+	while(data < end){
+		id = data[0];
+		n = data[1];
+		data += BRIDGE_RECORD_HEAD;
+		if(!MQTT_Publish(bridgeClient, bridgeTopics[id].topic, (const char *)data, n, 0, bridgeTopics[id].flags & BRIDGE_FLAG_RETAIN ? 1 : 0))
+			break;
+		accepted++;
+		data += n;
+	}
+
+	// the node resends everything after the accepted records
+	reply[0] = accepted;
+	*replyLen = 1;
+	return CONSOLE_OK;
+}
+
+void ICACHE_FLASH_ATTR BRIDGE_Init(MQTT_Client *client)
+{
+	bridgeClient = client;
+	os_timer_disarm(&bridgeTimer);
+	os_timer_setfn(&bridgeTimer, (os_timer_func_t *)bridge_flush, NULL);
+}
+
+/**
+  * @brief  Console handler for the bridge commands
+  * @retval Console status, CONSOLE_ERR_COMMAND for other commands
+  */
+uint8_t ICACHE_FLASH_ATTR BRIDGE_Command(uint8_t cmd, const uint8_t *data, uint16_t len, uint8_t *reply, uint16_t *replyLen)
+{
+	if(bridgeClient == NULL)
+		return CONSOLE_ERR_COMMAND;
+
+	switch(cmd){
+	case BRIDGE_CMD_REGISTER:
+		return bridge_register(data, len, reply, replyLen);
+	case BRIDGE_CMD_PUBLISH:
+		return bridge_publish(data, len, reply, replyLen);
+	}
+	return CONSOLE_ERR_COMMAND;
+}
+
+/**
+  * @brief  Route an inbound message to the nodes
+  * @param  topic: topic, not NUL terminated
+  * @retval TRUE if the topic belongs to a node
+  */
+BOOL ICACHE_FLASH_ATTR BRIDGE_Data(const char *topic, uint32_t topicLen, const char *data, uint32_t dataLen)
+{
+	uint8_t id;
+
+	for(id = 0; id < bridgeTopicCount; id++){
+		if((bridgeTopics[id].flags & BRIDGE_FLAG_SUBSCRIBE) &&
+				os_strlen(bridgeTopics[id].topic) == topicLen && os_memcmp(bridgeTopics[id].topic, topic, topicLen) == 0)
+			break;
+	}
+	if(id == bridgeTopicCount)
+		return FALSE;
+
+	if(dataLen > BRIDGE_BATCH_SIZE - BRIDGE_RECORD_HEAD){
+		bridgeDropped++;
+		LOG_W("BRIDGE: %d bytes for topic %d don't fit a frame, %d dropped\r\n", dataLen, id, bridgeDropped);
+		return TRUE;
+	}
+	if(bridgeBatchLen + BRIDGE_RECORD_HEAD + dataLen > BRIDGE_BATCH_SIZE)
+		bridge_flush(NULL);
+
+	bridgeBatch[bridgeBatchLen++] = id;
+	bridgeBatch[bridgeBatchLen++] = dataLen;
+	os_memcpy(bridgeBatch + bridgeBatchLen, data, dataLen);
+	bridgeBatchLen += dataLen;
+
+	// the first record starts the window
+	if(bridgeBatchLen == BRIDGE_RECORD_HEAD + dataLen)
+		os_timer_arm(&bridgeTimer, BRIDGE_BATCH_MS, 0);
+	return TRUE;
+}
+
+/**
+  * @brief  Subscribe the node topics once the broker connection is up
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR BRIDGE_Connected(void)
+{
+	uint8_t id;
+
+	for(id = 0; id < bridgeTopicCount; id++){
+		if(bridgeTopics[id].flags & BRIDGE_FLAG_SUBSCRIBE)
+			bridge_subscribe(&bridgeTopics[id]);
+	}
+}
+
+#endif /* BRIDGE_ENABLE */
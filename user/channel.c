@@ -0,0 +1,106 @@
+/*
+ * channel.c
+ *
+ * Relay channel table and command handling. Commands are Home Assistant
+ * JSON schema payloads ({"state":"ON",...}) or the bare strings on/off.
+ * They are parsed in place, straight from the MQTT receive buffer.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "gpio.h"
+#define LOG_MODULE CHANNEL
+#include "debug.h"
+#include "config.h"
+#include "channel.h"
+#include "json_lite.h"
+#include "trace.h"
+
+CHANNEL channels[CHANNEL_COUNT] = {
+	{ SWITCH01_GPIO, TOGGLE01_GPIO, config.mqtt_topic_s01, CHANNEL_STATUS_UNKNOWN },
+	{ SWITCH02_GPIO, TOGGLE02_GPIO, config.mqtt_topic_s02, CHANNEL_STATUS_UNKNOWN },
+	{ SWITCH03_GPIO, TOGGLE03_GPIO, config.mqtt_topic_s03, CHANNEL_STATUS_UNKNOWN },
+};
+
+static ChannelCallback channelCb = NULL;
+
+void ICACHE_FLASH_ATTR CHANNEL_OnChange(ChannelCallback cb)
+{
+	channelCb = cb;
+}
+
+CHANNEL* ICACHE_FLASH_ATTR CHANNEL_ByGpio(uint8_t gpio)
+{
+	int i;
+	for(i = 0; i < CHANNEL_COUNT; i++){
+		if(channels[i].gpio == gpio)
+			return &channels[i];
+	}
+	return NULL;
+}
+
+/* First channel whose toggle input is set in a GPIO status word */
+CHANNEL* ICACHE_FLASH_ATTR CHANNEL_ByInput(uint32_t gpio_status)
+{
+	int i;
+	for(i = 0; i < CHANNEL_COUNT; i++){
+		if(gpio_status & BIT(channels[i].input))
+			return &channels[i];
+	}
+	return NULL;
+}
+
+/* The topic is not NUL terminated, it points into the receive buffer */
+CHANNEL* ICACHE_FLASH_ATTR CHANNEL_ByTopic(const char *topic, uint32_t topic_len)
+{
+	int i;
+	for(i = 0; i < CHANNEL_COUNT; i++){
+		if(os_strlen(channels[i].topic) == topic_len && os_memcmp(channels[i].topic, topic, topic_len) == 0)
+			return &channels[i];
+	}
+	return NULL;
+}
+
+/**
+  * @brief  Drive a relay
+  * @param  channel: channel to switch
+  * @param  status: 0 = off, 1 = on
+  * @retval TRUE if the state changed
+  */
+BOOL ICACHE_FLASH_ATTR CHANNEL_Set(CHANNEL *channel, uint8_t status)
+{
+	if(channel == NULL || status == channel->status)
+		return FALSE;
+
+	TRACE_POINT(TRACE_SET);
+	GPIO_OUTPUT_SET(channel->gpio, status);
+	TRACE_POINT(TRACE_GPIO_WRITE);
+	INFO("SWITCH: Set switch %d %d\n", channel->gpio, status);
+	channel->status = status;
+	if(channelCb)
+		channelCb(channel);
+	return TRUE;
+}
+
+/**
+  * @brief  Apply a command payload to a channel
+  * @param  channel: target channel
+  * @param  data: payload, not NUL terminated
+  * @param  data_len: payload length
+  * @retval TRUE if the state changed
+  */
+BOOL ICACHE_FLASH_ATTR CHANNEL_Command(CHANNEL *channel, const char *data, uint32_t data_len)
+{
+	json_ha_cmd_t cmd;
+
+	if(data_len > 0xFFFF || json_ha_parse(data, data_len, &cmd) != 0){
+		LOG_W("SWITCH: Bad command for switch %d\n", channel->gpio);
+		return FALSE;
+	}
+
+	// A relay has no brightness, anything above zero means on
+	if(cmd.fields & JSON_HA_STATE)
+		return CHANNEL_Set(channel, cmd.state);
+	if(cmd.fields & JSON_HA_BRIGHTNESS)
+		return CHANNEL_Set(channel, cmd.brightness != 0);
+	return FALSE;
+}
@@ -0,0 +1,204 @@
+/*
+ * discovery.c
+ *
+ * Home Assistant MQTT discovery. The config payload of every channel is
+ * expanded from a template that stays in flash and is streamed to the
+ * broker chunk by chunk after connecting, one channel after the other.
+ * Only the cursor below lives in RAM, whatever the number of channels.
+ *
+ * Template markers:
+ *   DISCOVERY_CHIP_ID	chip ID, 8 hex digits
+ *   DISCOVERY_INDEX	channel number, starting at 1
+ *   DISCOVERY_TOPIC	channel command topic
+ *   DISCOVERY_BIT		channel bit in the state report mask
+ *   DISCOVERY_STATE_TOPIC aggregated state topic
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#define LOG_MODULE DISCOVERY
+#include "debug.h"
+#include "mqtt.h"
+#include "channel.h"
+#include "discovery.h"
+#include "report.h"
+
+#define DISCOVERY_CHIP_ID	"\x01"
+#define DISCOVERY_INDEX		"\x02"
+#define DISCOVERY_TOPIC		"\x03"
+#define DISCOVERY_BIT		"\x04"
+#define DISCOVERY_STATE_TOPIC	"\x05"
+#define DISCOVERY_MARKERS	6		// bytes below this are markers
+
+// Template schema lights: commands in the JSON schema the command handler
+// speaks, state picked out of the aggregated report mask
+static const char discoveryTemplate[] ICACHE_RODATA_ATTR STORE_ATTR =
+	"{\"name\":\"Relay " DISCOVERY_INDEX "\","
+	"\"unique_id\":\"" DISCOVERY_CHIP_ID "_" DISCOVERY_INDEX "\","
+	"\"schema\":\"template\","
+	"\"command_topic\":\"" DISCOVERY_TOPIC "\","
+	"\"command_on_template\":\"{\\\"state\\\":\\\"ON\\\"}\","
+	"\"command_off_template\":\"{\\\"state\\\":\\\"OFF\\\"}\","
+	"\"state_topic\":\"" DISCOVERY_STATE_TOPIC "\","
+	"\"state_template\":\"{{ 'on' if value_json.mask|int|bitwise_and(" DISCOVERY_BIT ") else 'off' }}\","
+	"\"device\":{\"identifiers\":[\"" DISCOVERY_CHIP_ID "\"],"
+	"\"name\":\"ESP MQTT Light " DISCOVERY_CHIP_ID "\","
+	"\"manufacturer\":\"Espressif\",\"model\":\"ESP8266\"}}";
+
+typedef struct {
+	uint8_t channel;			// channel being announced
+	uint16_t pos;				// next template byte
+	char exp[24];				// current marker expansion
+	uint8_t expLen;
+	uint8_t expPos;
+	uint32_t offset;			// payload bytes produced
+	uint32_t word;				// last flash word read
+	uint16_t wordPos;
+	char topic[64];
+} DISCOVERY_STATE;
+
+static DISCOVERY_STATE discovery;
+
+static void ICACHE_FLASH_ATTR discovery_next(uint32_t *args);
+
+/* Flash can only be read 32 bits at a time */
+static uint8_t ICACHE_FLASH_ATTR discovery_byte(uint16_t pos)
+{
+	if((pos & ~3) != discovery.wordPos){
+		discovery.wordPos = pos & ~3;
+		discovery.word = *(const uint32_t *)(discoveryTemplate + discovery.wordPos);
+	}
+	return discovery.word >> ((pos & 3) * 8);
+}
+
+/* A string expansion, cut to the expansion buffer */
+static uint8_t ICACHE_FLASH_ATTR discovery_copy(char *buf, const char *str)
+{
+	uint32_t len = os_strlen(str);
+
+	if(len > sizeof(discovery.exp))
+		len = sizeof(discovery.exp);
+	os_memcpy(buf, str, len);
+	return len;
+}
+
+static uint8_t ICACHE_FLASH_ATTR discovery_expand(uint8_t marker, uint8_t channel, char *buf)
+{
+	switch(marker){
+	case 1:
+		return os_sprintf(buf, "%08X", system_get_chip_id());
+	case 2:
+		return os_sprintf(buf, "%d", channel + 1);
+	case 3:
+		return discovery_copy(buf, (const char *)channels[channel].topic);
+	case 4:
+		return os_sprintf(buf, "%d", 1 << channel);
+	case 5:
+		return discovery_copy(buf, REPORT_GetTopic());
+	}
+	return 0;
+}
+
+/* Payload length of a channel, one pass over the template */
+static uint32_t ICACHE_FLASH_ATTR discovery_length(uint8_t channel)
+{
+	char buf[sizeof(discovery.exp) + 1];
+	uint32_t len = 0;
+	uint16_t pos;
+	uint8_t c;
+
+	for(pos = 0; (c = discovery_byte(pos)) != 0; pos++){
+		if(c < DISCOVERY_MARKERS)
+			len += discovery_expand(c, channel, buf);
+		else
+			len++;
+	}
+	return len;
+}
+
+static void ICACHE_FLASH_ATTR discovery_rewind(void)
+{
+	discovery.pos = 0;
+	discovery.expLen = discovery.expPos = 0;
+	discovery.offset = 0;
+}
+
+/* Next payload byte of the channel being announced, FALSE at its end */
+static BOOL ICACHE_FLASH_ATTR discovery_take(uint8_t *out)
+{
+	uint8_t c;
+
+	while(discovery.expPos >= discovery.expLen){
+		c = discovery_byte(discovery.pos);
+		if(c == 0)
+			return FALSE;
+		discovery.pos++;
+		if(c >= DISCOVERY_MARKERS){
+			*out = c;
+			discovery.offset++;
+			return TRUE;
+		}
+		discovery.expLen = discovery_expand(c, discovery.channel, discovery.exp);
+		discovery.expPos = 0;
+	}
+	*out = discovery.exp[discovery.expPos++];
+	discovery.offset++;
+	return TRUE;
+}
+
+static uint16_t ICACHE_FLASH_ATTR discovery_fill(void *arg, uint32_t offset, uint8_t *buf, uint16_t len)
+{
+	uint16_t n = 0;
+	uint8_t c;
+
+	// Chunks normally follow each other, anything else walks the template
+	// again up to offset
+	if(offset < discovery.offset)
+		discovery_rewind();
+	while(discovery.offset < offset && discovery_take(&c))
+		;
+	while(n < len && discovery_take(buf + n))
+		n++;
+	return n;
+}
+
+static void ICACHE_FLASH_ATTR discovery_publish(MQTT_Client *client)
+{
+	uint32_t length;
+
+	if(discovery.channel >= CHANNEL_COUNT){
+		INFO("DISCOVERY: Done\r\n");
+		return;
+	}
+
+	os_sprintf(discovery.topic, DISCOVERY_PREFIX "/light/%08X_%d/config", system_get_chip_id(), discovery.channel + 1);
+	length = discovery_length(discovery.channel);
+	discovery_rewind();
+	if(!MQTT_PublishStream(client, discovery.topic, length, 1, discovery_fill, discovery_next, NULL)){
+		LOG_W("DISCOVERY: Stream busy\r\n");
+		discovery.channel = CHANNEL_COUNT;
+	}
+}
+
+static void ICACHE_FLASH_ATTR discovery_next(uint32_t *args)
+{
+	discovery.channel++;
+	discovery_publish((MQTT_Client *)args);
+}
+
+/**
+  * @brief  Announce all channels, call after the MQTT connection is up
+  * @param  client: MQTT_Client reference
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR DISCOVERY_Start(MQTT_Client *client)
+{
+	discovery.channel = 0;
+	discovery.wordPos = 0xFFFF;
+	discovery_publish(client);
+}
+
+BOOL ICACHE_FLASH_ATTR DISCOVERY_IsDone(void)
+{
+	return discovery.channel >= CHANNEL_COUNT;
+}
@@ -0,0 +1,774 @@
+/******************************************************************************
+ * FileName: json_lite.c
+ *
+ * Description: Allocation free JSON tokenizer and bounded writer.
+ *              The tokenizer follows the jsmn model: one pass over the
+ *              input, producing a flat array of tokens that point back into
+ *              it. The writer emits into a fixed buffer with bulk copies.
+*******************************************************************************/
+#include "c_types.h"
+#include "osapi.h"
+
+#include "json_lite.h"
+
+/******************************************************************************
+ * FunctionName : json_alloc_token
+ * Description  : take the next free token from the array
+ * Parameters   : parser -- tokenizer state
+ *                tokens -- token array
+ *                num_tokens -- size of the token array
+ * Returns      : the token or NULL if the array is full
+*******************************************************************************/
+LOCAL json_token_t *ICACHE_FLASH_ATTR
+json_alloc_token(json_tokenizer_t *parser, json_token_t *tokens, uint16 num_tokens)
+{
+    json_token_t *tok;
+
+    if (parser->toknext >= num_tokens) {
+        return NULL;
+    }
+
+    tok = &tokens[parser->toknext++];
+    tok->type = JSON_TOK_UNDEFINED;
+    tok->start = tok->end = 0;
+    tok->size = 0;
+    tok->parent = -1;
+    return tok;
+}
+
+/******************************************************************************
+ * FunctionName : json_parse_primitive
+ * Description  : scan a number, true, false or null
+ * Returns      : 0 or a JSON_ERROR_* code
+*******************************************************************************/
+LOCAL int ICACHE_FLASH_ATTR
+json_parse_primitive(json_tokenizer_t *parser, const char *js, uint16 len,
+                     json_token_t *tokens, uint16 num_tokens)
+{
+    json_token_t *tok;
+    uint16 start = parser->pos;
+
+    for (; parser->pos < len; parser->pos++) {
+        switch (js[parser->pos]) {
+            case ':':
+            case '\t':
+            case '\r':
+            case '\n':
+            case ' ':
+            case ',':
+            case ']':
+            case '}':
+                goto found;
+
+            default:
+                if (js[parser->pos] < 32 || js[parser->pos] >= 127) {
+                    parser->pos = start;
+                    return JSON_ERROR_INVAL;
+                }
+        }
+    }
+
+    parser->pos = start;
+    return JSON_ERROR_PART;
+
+found:
+    tok = json_alloc_token(parser, tokens, num_tokens);
+
+    if (tok == NULL) {
+        parser->pos = start;
+        return JSON_ERROR_NOMEM;
+    }
+
+    tok->type = JSON_TOK_PRIMITIVE;
+    tok->start = start;
+    tok->end = parser->pos;
+    tok->parent = parser->toksuper;
+    parser->pos--;
+    return 0;
+}
+
+/******************************************************************************
+ * FunctionName : json_parse_string
+ * Description  : scan a string, the token excludes the quotes and escapes
+ *                are left in place
+ * Returns      : 0 or a JSON_ERROR_* code
+*******************************************************************************/
+LOCAL int ICACHE_FLASH_ATTR
+json_parse_string(json_tokenizer_t *parser, const char *js, uint16 len,
+                  json_token_t *tokens, uint16 num_tokens)
+{
+    json_token_t *tok;
+    uint16 start = parser->pos;
+    char c;
+
+    parser->pos++;
+
+    for (; parser->pos < len; parser->pos++) {
+        c = js[parser->pos];
+
+        if (c == '\"') {
+            tok = json_alloc_token(parser, tokens, num_tokens);
+
+            if (tok == NULL) {
+                parser->pos = start;
+                return JSON_ERROR_NOMEM;
+            }
+
+            tok->type = JSON_TOK_STRING;
+            tok->start = start + 1;
+            tok->end = parser->pos;
+            tok->parent = parser->toksuper;
+            return 0;
+        }
+
+        if (c == '\\' && parser->pos + 1 < len) {
+            parser->pos++;
+        }
+    }
+
+    parser->pos = start;
+    return JSON_ERROR_PART;
+}
+
+/******************************************************************************
+ * FunctionName : json_tok_init
+ * Description  : reset a tokenizer before a new input
+ * Parameters   : parser -- tokenizer state
+ * Returns      : none
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+json_tok_init(json_tokenizer_t *parser)
+{
+    parser->pos = 0;
+    parser->toknext = 0;
+    parser->toksuper = -1;
+}
+
+/******************************************************************************
+ * FunctionName : json_tokenize
+ * Description  : split a JSON text into tokens in a single pass
+ * Parameters   : parser -- tokenizer state, see json_tok_init
+ *                js -- input, does not need to be NUL terminated
+ *                len -- input length
+ *                tokens -- token array to fill
+ *                num_tokens -- size of the token array
+ * Returns      : number of tokens used or a JSON_ERROR_* code
+*******************************************************************************/
+int ICACHE_FLASH_ATTR
+json_tokenize(json_tokenizer_t *parser, const char *js, uint16 len,
+              json_token_t *tokens, uint16 num_tokens)
+{
+    int r;
+    int i;
+    json_token_t *tok;
+    char c;
+    uint8 type;
+
+    for (; parser->pos < len; parser->pos++) {
+        c = js[parser->pos];
+
+        switch (c) {
+            case '{':
+            case '[':
+                tok = json_alloc_token(parser, tokens, num_tokens);
+
+                if (tok == NULL) {
+                    return JSON_ERROR_NOMEM;
+                }
+
+                if (parser->toksuper != -1) {
+                    tokens[parser->toksuper].size++;
+                    tok->parent = parser->toksuper;
+                }
+
+                tok->type = (c == '{' ? JSON_TOK_OBJECT : JSON_TOK_ARRAY);
+                tok->start = parser->pos;
+                parser->toksuper = parser->toknext - 1;
+                break;
+
+            case '}':
+            case ']':
+                type = (c == '}' ? JSON_TOK_OBJECT : JSON_TOK_ARRAY);
+
+                if (parser->toknext < 1) {
+                    return JSON_ERROR_INVAL;
+                }
+
+                /* close the innermost container that is still open */
+                for (i = parser->toknext - 1; i >= 0; i--) {
+                    tok = &tokens[i];
+
+                    if ((tok->type == JSON_TOK_OBJECT || tok->type == JSON_TOK_ARRAY) && tok->end == 0) {
+                        break;
+                    }
+                }
+
+                if (i < 0 || tok->type != type) {
+                    return JSON_ERROR_INVAL;
+                }
+
+                tok->end = parser->pos + 1;
+                parser->toksuper = tok->parent;
+                break;
+
+            case '\"':
+                r = json_parse_string(parser, js, len, tokens, num_tokens);
+
+                if (r < 0) {
+                    return r;
+                }
+
+                if (parser->toksuper != -1) {
+                    tokens[parser->toksuper].size++;
+                }
+
+                break;
+
+            case '\t':
+            case '\r':
+            case '\n':
+            case ' ':
+                break;
+
+            case ':':
+                /* values belong to the key in front of them */
+                parser->toksuper = parser->toknext - 1;
+                break;
+
+            case ',':
+                if (parser->toksuper != -1 &&
+                        tokens[parser->toksuper].type != JSON_TOK_ARRAY &&
+                        tokens[parser->toksuper].type != JSON_TOK_OBJECT) {
+                    parser->toksuper = tokens[parser->toksuper].parent;
+                }
+
+                break;
+
+            default:
+                r = json_parse_primitive(parser, js, len, tokens, num_tokens);
+
+                if (r < 0) {
+                    return r;
+                }
+
+                if (parser->toksuper != -1) {
+                    tokens[parser->toksuper].size++;
+                }
+
+                break;
+        }
+    }
+
+    for (i = parser->toknext - 1; i >= 0; i--) {
+        if ((tokens[i].type == JSON_TOK_OBJECT || tokens[i].type == JSON_TOK_ARRAY) && tokens[i].end == 0) {
+            return JSON_ERROR_PART;
+        }
+    }
+
+    return parser->toknext;
+}
+
+/******************************************************************************
+ * FunctionName : json_tok_eq
+ * Description  : compare a string token with a NUL terminated string
+ * Returns      : 1 if equal, 0 otherwise
+*******************************************************************************/
+int ICACHE_FLASH_ATTR
+json_tok_eq(const char *js, const json_token_t *tok, const char *s)
+{
+    uint16 len = tok->end - tok->start;
+
+    return os_strncmp(js + tok->start, s, len) == 0 && s[len] == '\0';
+}
+
+/******************************************************************************
+ * FunctionName : json_tok_next
+ * Description  : skip a token and everything nested in it
+ * Parameters   : index -- token to skip
+ * Returns      : index of the next sibling (or count)
+*******************************************************************************/
+int ICACHE_FLASH_ATTR
+json_tok_next(const json_token_t *tokens, int count, int index)
+{
+    uint16 end = tokens[index].end;
+
+    index++;
+
+    while (index < count && tokens[index].start < end) {
+        index++;
+    }
+
+    return index;
+}
+
+/******************************************************************************
+ * FunctionName : json_tok_find
+ * Description  : look up a key in an object
+ * Parameters   : object -- index of the object token
+ *                key -- key to look for
+ * Returns      : index of the value token or -1
+*******************************************************************************/
+int ICACHE_FLASH_ATTR
+json_tok_find(const char *js, const json_token_t *tokens, int count, int object, const char *key)
+{
+    int i;
+    int n;
+
+    if (object < 0 || object >= count || tokens[object].type != JSON_TOK_OBJECT) {
+        return -1;
+    }
+
+    i = object + 1;
+
+    for (n = 0; n < tokens[object].size && i + 1 < count; n++) {
+        if (tokens[i].type == JSON_TOK_STRING && json_tok_eq(js, &tokens[i], key)) {
+            return i + 1;
+        }
+
+        i = json_tok_next(tokens, count, i + 1);
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+ * FunctionName : json_tok_int
+ * Description  : convert a primitive token to an integer
+ * Returns      : the value, 0 if the token is not a number
+*******************************************************************************/
+sint32 ICACHE_FLASH_ATTR
+json_tok_int(const char *js, const json_token_t *tok)
+{
+    uint16 i = tok->start;
+    sint32 value = 0;
+    uint8 neg = 0;
+
+    if (i < tok->end && js[i] == '-') {
+        neg = 1;
+        i++;
+    }
+
+    for (; i < tok->end && js[i] >= '0' && js[i] <= '9'; i++) {
+        value = value * 10 + (js[i] - '0');
+    }
+
+    return neg ? -value : value;
+}
+
+/******************************************************************************
+ * FunctionName : json_writer_init
+ * Description  : start writing into buf
+ * Parameters   : buf -- output buffer
+ *                size -- size of buf, one byte is kept for the terminator
+ * Returns      : none
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+json_writer_init(json_writer_t *w, char *buf, uint16 size)
+{
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->overflow = (size == 0);
+    w->depth = 0;
+    w->first = 0;
+}
+
+/******************************************************************************
+ * FunctionName : json_write_raw
+ * Description  : append bytes as they are, no separator is added
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+json_write_raw(json_writer_t *w, const char *s, uint16 len)
+{
+    if (w->overflow || w->len + len >= w->size) {
+        w->overflow = 1;
+        return;
+    }
+
+    os_memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+/* comma before every member but the first one of the current container */
+LOCAL void ICACHE_FLASH_ATTR
+json_write_separator(json_writer_t *w)
+{
+    if (w->depth == 0) {
+        return;
+    }
+
+    if (w->first & (1 << (w->depth - 1))) {
+        w->first &= ~(1 << (w->depth - 1));
+    } else {
+        json_write_raw(w, ",", 1);
+    }
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+json_write_open(json_writer_t *w, const char *c)
+{
+    json_write_raw(w, c, 1);
+
+    if (w->depth >= JSON_WRITER_MAX_DEPTH) {
+        w->overflow = 1;
+        return;
+    }
+
+    w->depth++;
+    w->first |= 1 << (w->depth - 1);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+json_write_close(json_writer_t *w, const char *c)
+{
+    if (w->depth > 0) {
+        w->depth--;
+    }
+
+    json_write_raw(w, c, 1);
+}
+
+void ICACHE_FLASH_ATTR
+json_write_object_start(json_writer_t *w)
+{
+    json_write_separator(w);
+    json_write_open(w, "{");
+}
+
+void ICACHE_FLASH_ATTR
+json_write_object_end(json_writer_t *w)
+{
+    json_write_close(w, "}");
+}
+
+void ICACHE_FLASH_ATTR
+json_write_array_start(json_writer_t *w)
+{
+    json_write_separator(w);
+    json_write_open(w, "[");
+}
+
+void ICACHE_FLASH_ATTR
+json_write_array_end(json_writer_t *w)
+{
+    json_write_close(w, "]");
+}
+
+/******************************************************************************
+ * FunctionName : json_write_key
+ * Description  : append "key": (the key is not escaped)
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+json_write_key(json_writer_t *w, const char *key)
+{
+    json_write_separator(w);
+    json_write_raw(w, "\"", 1);
+    json_write_raw(w, key, os_strlen(key));
+    json_write_raw(w, "\":", 2);
+    /* the value that follows must not get a separator of its own */
+    if (w->depth > 0) {
+        w->first |= 1 << (w->depth - 1);
+    }
+}
+
+/******************************************************************************
+ * FunctionName : json_write_string
+ * Description  : append a quoted string, runs without characters that need
+ *                escaping are copied in one go
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+json_write_string(json_writer_t *w, const char *s, uint16 len)
+{
+    uint16 i;
+    uint16 run = 0;
+    char esc[2] = { '\\', 0 };
+
+    json_write_separator(w);
+    json_write_raw(w, "\"", 1);
+
+    for (i = 0; i < len; i++) {
+        char c = s[i];
+
+        if (c == '\"' || c == '\\' || (uint8)c < 0x20) {
+            json_write_raw(w, s + run, i - run);
+            run = i + 1;
+
+            switch (c) {
+                case '\n': esc[1] = 'n'; break;
+                case '\r': esc[1] = 'r'; break;
+                case '\t': esc[1] = 't'; break;
+                case '\"':
+                case '\\': esc[1] = c; break;
+                default: continue; /* other control characters are dropped */
+            }
+
+            json_write_raw(w, esc, 2);
+        }
+    }
+
+    json_write_raw(w, s + run, len - run);
+    json_write_raw(w, "\"", 1);
+}
+
+/******************************************************************************
+ * FunctionName : json_write_int
+ * Description  : append a decimal number
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+json_write_int(json_writer_t *w, sint32 value)
+{
+    char tmp[12];
+    uint8 pos = sizeof(tmp);
+    uint32 v = value < 0 ? -(uint32)value : (uint32)value;
+
+    do {
+        tmp[--pos] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (value < 0) {
+        tmp[--pos] = '-';
+    }
+
+    json_write_separator(w);
+    json_write_raw(w, tmp + pos, sizeof(tmp) - pos);
+}
+
+void ICACHE_FLASH_ATTR
+json_write_pair_string(json_writer_t *w, const char *key, const char *value)
+{
+    json_write_key(w, key);
+    json_write_string(w, value, os_strlen(value));
+}
+
+void ICACHE_FLASH_ATTR
+json_write_pair_int(json_writer_t *w, const char *key, sint32 value)
+{
+    json_write_key(w, key);
+    json_write_int(w, value);
+}
+
+/******************************************************************************
+ * FunctionName : json_writer_finish
+ * Description  : terminate the output
+ * Returns      : output length, or -1 if it did not fit
+*******************************************************************************/
+int ICACHE_FLASH_ATTR
+json_writer_finish(json_writer_t *w)
+{
+    if (w->overflow) {
+        if (w->size > 0) {
+            w->buf[0] = '\0';
+        }
+
+        return -1;
+    }
+
+    w->buf[w->len] = '\0';
+    return w->len;
+}
+
+/******************************************************************************
+ * FunctionName : json_ha_fixed_ms
+ * Description  : convert a number of seconds ("2", "0.5") to milliseconds
+*******************************************************************************/
+LOCAL uint32 ICACHE_FLASH_ATTR
+json_ha_fixed_ms(const char *js, const json_token_t *tok)
+{
+    uint16 i = tok->start;
+    uint32 ms = 0;
+    uint32 scale = 100;
+
+    for (; i < tok->end && js[i] >= '0' && js[i] <= '9'; i++) {
+        ms = ms * 10 + (js[i] - '0');
+    }
+
+    ms *= 1000;
+
+    if (i < tok->end && js[i] == '.') {
+        for (i++; i < tok->end && js[i] >= '0' && js[i] <= '9' && scale; i++) {
+            ms += (js[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+
+    return ms;
+}
+
+LOCAL uint8 ICACHE_FLASH_ATTR
+json_ha_byte(const char *js, const json_token_t *tok)
+{
+    sint32 v = json_tok_int(js, tok);
+
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* 1 for "ON", 0 for "OFF" in any case, -1 for anything else */
+LOCAL int ICACHE_FLASH_ATTR
+json_ha_onoff(const char *s, int len)
+{
+    if (len == 2 && (s[0] | 0x20) == 'o' && (s[1] | 0x20) == 'n') {
+        return 1;
+    }
+
+    if (len == 3 && (s[0] | 0x20) == 'o' && (s[1] | 0x20) == 'f' && (s[2] | 0x20) == 'f') {
+        return 0;
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+ * FunctionName : json_ha_parse
+ * Description  : parse a Home Assistant JSON schema command in one pass over
+ *                the top level keys. Unknown keys are skipped, strings stay
+ *                in the payload (effect is returned as offset + length).
+ *                "state" must be the string "ON" or "OFF" (any case), a
+ *                bare ON/OFF is accepted as well.
+ * Parameters   : js -- payload, does not need to be NUL terminated
+ *                len -- payload length
+ *                cmd -- parsed command
+ * Returns      : 0 or a JSON_ERROR_* code
+*******************************************************************************/
+int ICACHE_FLASH_ATTR
+json_ha_parse(const char *js, uint16 len, json_ha_cmd_t *cmd)
+{
+    json_tokenizer_t parser;
+    json_token_t tokens[JSON_HA_MAX_TOKENS];
+    const json_token_t *key;
+    const json_token_t *val;
+    int count;
+    int state;
+    int i;
+    int n;
+
+    os_memset(cmd, 0, sizeof(json_ha_cmd_t));
+
+    while (len > 0 && (js[len - 1] == ' ' || js[len - 1] == '\r' || js[len - 1] == '\n')) {
+        len--;
+    }
+
+    if (len > 0 && js[0] != '{') {
+        state = json_ha_onoff(js, len);
+
+        if (state < 0) {
+            return JSON_ERROR_INVAL;
+        }
+
+        cmd->fields = JSON_HA_STATE;
+        cmd->state = state;
+        return 0;
+    }
+
+    json_tok_init(&parser);
+    count = json_tokenize(&parser, js, len, tokens, JSON_HA_MAX_TOKENS);
+
+    if (count < 0) {
+        return count;
+    }
+
+    if (count == 0 || tokens[0].type != JSON_TOK_OBJECT) {
+        return JSON_ERROR_INVAL;
+    }
+
+    i = 1;
+
+    for (n = 0; n < tokens[0].size && i + 1 < count; n++) {
+        key = &tokens[i];
+        val = &tokens[i + 1];
+
+        if (json_tok_eq(js, key, "state")) {
+            state = val->type == JSON_TOK_STRING ? json_ha_onoff(js + val->start, val->end - val->start) : -1;
+
+            if (state < 0) {
+                return JSON_ERROR_INVAL;
+            }
+
+            cmd->fields |= JSON_HA_STATE;
+            cmd->state = state;
+        } else if (json_tok_eq(js, key, "brightness")) {
+            cmd->fields |= JSON_HA_BRIGHTNESS;
+            cmd->brightness = json_ha_byte(js, val);
+        } else if (json_tok_eq(js, key, "transition")) {
+            cmd->fields |= JSON_HA_TRANSITION;
+            cmd->transition_ms = json_ha_fixed_ms(js, val);
+        } else if (json_tok_eq(js, key, "color_temp")) {
+            cmd->fields |= JSON_HA_COLOR_TEMP;
+            cmd->color_temp = json_tok_int(js, val);
+        } else if (json_tok_eq(js, key, "effect")) {
+            cmd->fields |= JSON_HA_EFFECT;
+            cmd->effect = val->start;
+            cmd->effect_len = val->end - val->start;
+        } else if (json_tok_eq(js, key, "color") && val->type == JSON_TOK_OBJECT) {
+            int c = i + 2;
+            int m;
+
+            cmd->fields |= JSON_HA_COLOR;
+
+            for (m = 0; m < val->size && c + 1 < count; m++) {
+                if (tokens[c].end - tokens[c].start == 1) {
+                    switch (js[tokens[c].start]) {
+                        case 'r': cmd->color[0] = json_ha_byte(js, &tokens[c + 1]); break;
+                        case 'g': cmd->color[1] = json_ha_byte(js, &tokens[c + 1]); break;
+                        case 'b': cmd->color[2] = json_ha_byte(js, &tokens[c + 1]); break;
+                    }
+                }
+
+                c = json_tok_next(tokens, count, c + 1);
+            }
+        }
+
+        i = json_tok_next(tokens, count, i + 1);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+ * FunctionName : json_ha_write
+ * Description  : emit a Home Assistant JSON schema state with the fields
+ *                set in cmd
+ * Parameters   : buf -- output buffer
+ *                size -- size of buf
+ *                cmd -- state to report
+ *                js -- payload the effect offset refers to (may be NULL)
+ * Returns      : output length, or -1 if it did not fit
+*******************************************************************************/
+int ICACHE_FLASH_ATTR
+json_ha_write(char *buf, uint16 size, const json_ha_cmd_t *cmd, const char *js)
+{
+    json_writer_t w;
+
+    json_writer_init(&w, buf, size);
+    json_write_object_start(&w);
+
+    if (cmd->fields & JSON_HA_STATE) {
+        json_write_key(&w, "state");
+        json_write_string(&w, cmd->state ? "ON" : "OFF", cmd->state ? 2 : 3);
+    }
+
+    if (cmd->fields & JSON_HA_BRIGHTNESS) {
+        json_write_pair_int(&w, "brightness", cmd->brightness);
+    }
+
+    if (cmd->fields & JSON_HA_COLOR_TEMP) {
+        json_write_pair_int(&w, "color_temp", cmd->color_temp);
+    }
+
+    if (cmd->fields & JSON_HA_COLOR) {
+        json_write_key(&w, "color");
+        json_write_object_start(&w);
+        json_write_pair_int(&w, "r", cmd->color[0]);
+        json_write_pair_int(&w, "g", cmd->color[1]);
+        json_write_pair_int(&w, "b", cmd->color[2]);
+        json_write_object_end(&w);
+    }
+
+    if ((cmd->fields & JSON_HA_EFFECT) && js != NULL) {
+        json_write_key(&w, "effect");
+        json_write_string(&w, js + cmd->effect, cmd->effect_len);
+    }
+
+    json_write_object_end(&w);
+    return json_writer_finish(&w);
+}
@@ -0,0 +1,178 @@
+/*
+ * report.c
+ *
+ * Channel state changes are merged into one report per window. The first
+ * change after a quiet window goes out immediately, later ones wait for
+ * the window to end. Nothing is sent before the broker connection is up;
+ * the full state is reported on every connect instead.
+ *
+ * Channels also change from the GPIO interrupt, so REPORT_Changed only
+ * notes the channel and defers the report to task context.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#define LOG_MODULE REPORT
+#include "debug.h"
+#include "mqtt.h"
+#include "config.h"
+#include "channel.h"
+#include "json_lite.h"
+#include "intlevel.h"
+#include "defer.h"
+#include "report.h"
+
+#define REPORT_SEPARATOR	"/"
+#define REPORT_UPDATE		"set"
+
+static MQTT_Client *reportClient = NULL;
+static ETSTimer reportTimer;
+static char reportTopic[20];
+static uint16_t reportSeq = 0;
+static volatile uint8_t reportChanged = 0;	// channel bits changed since the last report
+static volatile BOOL reportPosted = FALSE;	// report_changed deferred, not run yet
+static BOOL reportArmed = FALSE;
+
+static uint8_t ICACHE_FLASH_ATTR report_mask(void)
+{
+	uint8_t mask = 0;
+	int i;
+
+	for(i = 0; i < CHANNEL_COUNT; i++){
+		if(channels[i].status == 1)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+#if STATE_REPORT_PER_CHANNEL
+static void ICACHE_FLASH_ATTR report_channel(CHANNEL *channel)
+{
+	char topic[sizeof(config.mqtt_topic_s01) + sizeof(REPORT_SEPARATOR REPORT_UPDATE)];
+	char payload[16];
+	json_ha_cmd_t state = { JSON_HA_STATE, channel->status };
+	int len;
+
+	os_sprintf(topic, "%s" REPORT_SEPARATOR REPORT_UPDATE, channel->topic);
+	len = json_ha_write(payload, sizeof(payload), &state, NULL);
+	if(len > 0)
+		MQTT_Publish(reportClient, topic, payload, len, 0, 1);
+}
+#endif
+
+static void ICACHE_FLASH_ATTR report_send(void)
+{
+	json_writer_t w;
+	char payload[48];
+	uint8_t changed;
+	uint32_t ps;
+	int len;
+#if STATE_REPORT_PER_CHANNEL
+	int i;
+#endif
+
+	ps = xt_rsil(15);
+	changed = reportChanged;
+	reportChanged = 0;
+	xt_wsr_ps(ps);
+
+#if STATE_REPORT_PER_CHANNEL
+	for(i = 0; i < CHANNEL_COUNT; i++){
+		if(changed & (1 << i))
+			report_channel(&channels[i]);
+	}
+#endif
+
+	json_writer_init(&w, payload, sizeof(payload));
+	json_write_object_start(&w);
+	json_write_pair_int(&w, "seq", ++reportSeq);
+	json_write_pair_int(&w, "mask", report_mask());
+	json_write_pair_int(&w, "changed", changed);
+	json_write_object_end(&w);
+	len = json_writer_finish(&w);
+
+	INFO("REPORT: %s\r\n", payload);
+	if(len > 0)
+		MQTT_Publish(reportClient, reportTopic, payload, len, 0, 1);
+}
+
+static void ICACHE_FLASH_ATTR report_window(void *arg)
+{
+	if(reportChanged == 0 || reportClient->connState != MQTT_DATA){
+		reportArmed = FALSE;
+		return;
+	}
+	report_send();
+	os_timer_arm(&reportTimer, STATE_REPORT_WINDOW_MS, 0);
+}
+
+void ICACHE_FLASH_ATTR REPORT_Init(MQTT_Client *client)
+{
+	reportClient = client;
+	os_sprintf(reportTopic, STATE_REPORT_TOPIC, system_get_chip_id());
+	os_timer_disarm(&reportTimer);
+	os_timer_setfn(&reportTimer, (os_timer_func_t *)report_window, NULL);
+}
+
+/* Deferred from REPORT_Changed */
+static void ICACHE_FLASH_ATTR report_changed(void)
+{
+	reportPosted = FALSE;
+	if(reportArmed || reportClient == NULL || reportClient->connState != MQTT_DATA)
+		return;
+	report_send();
+	reportArmed = TRUE;
+	os_timer_arm(&reportTimer, STATE_REPORT_WINDOW_MS, 0);
+}
+
+/**
+  * @brief  Channel change callback, see CHANNEL_OnChange. Safe to call
+  *         from an interrupt handler.
+  * @param  channel: the channel that changed
+  * @retval None
+  */
+void REPORT_Changed(CHANNEL *channel)
+{
+	uint32_t ps;
+	BOOL post;
+
+	ps = xt_rsil(15);
+	reportChanged |= 1 << (channel - channels);
+	post = !reportPosted;
+	reportPosted = TRUE;
+	xt_wsr_ps(ps);
+
+	if(post)
+		DEFER_Post(report_changed);
+}
+
+/**
+  * @brief  Report every channel once the broker connection is up
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR REPORT_Connected(void)
+{
+	uint32_t ps;
+
+	ps = xt_rsil(15);
+	reportChanged = (1 << CHANNEL_COUNT) - 1;
+	xt_wsr_ps(ps);
+	os_timer_disarm(&reportTimer);
+	report_send();
+	reportArmed = TRUE;
+	os_timer_arm(&reportTimer, STATE_REPORT_WINDOW_MS, 0);
+}
+
+/**
+  * @brief  Whether a change still waits for its report to be queued
+  * @retval TRUE until report_send has queued every change noted so far
+  */
+BOOL ICACHE_FLASH_ATTR REPORT_Pending(void)
+{
+	return reportChanged != 0 || reportPosted;
+}
+
+const char* ICACHE_FLASH_ATTR REPORT_GetTopic(void)
+{
+	return reportTopic;
+}
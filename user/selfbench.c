@@ -0,0 +1,315 @@
+/*
+ * selfbench.c
+ *
+ * The self-benchmark scenario, see selfbench.h. Phases are driven from
+ * the MQTT callbacks and one timer, which starts the next phase after a
+ * gap and ends a phase that takes too long. Echoes carry a sequence
+ * number, so a late one from a timed out phase is not taken for the
+ * current one.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#define LOG_MODULE BENCH
+#include "debug.h"
+#include "mqtt.h"
+#include "channel.h"
+#include "power.h"
+#include "ccount.h"
+#include "json_lite.h"
+#include "selfbench.h"
+
+#if SELFBENCH
+
+#define SELFBENCH_TOPIC_MAX	40
+
+typedef enum {
+	SELFBENCH_BURST_PHASE,
+	SELFBENCH_RTT_PHASE,
+	SELFBENCH_SUBSCRIBE_PHASE,
+	SELFBENCH_TOGGLE_PHASE,
+	SELFBENCH_PHASES
+} tSelfbenchPhase;
+
+typedef struct {
+	const char *name;
+	uint16_t count;				// operations to run
+	uint16_t done;				// operations completed
+	uint32_t start;				// system_get_time at the start
+	uint32_t us;				// wall time of the phase
+	uint32_t cycles;			// spent in the calls into the firmware
+	uint32_t cyclesMax;			// slowest single call
+	uint32_t rttMin;			// echo round trips, us
+	uint32_t rttMax;
+	uint32_t rttSum;
+	uint32_t drops;				// queueDrops during the phase
+	BOOL timedOut;
+} SELFBENCH_PHASE;
+
+static MQTT_Client *benchClient = NULL;
+static SelfbenchDoneCallback benchDoneCb = NULL;
+static ETSTimer benchTimer;
+static char benchTopic[SELFBENCH_TOPIC_MAX - 12];
+static char benchEcho[SELFBENCH_TOPIC_MAX];
+static uint8_t benchPhase = SELFBENCH_PHASES;
+static BOOL benchStarted = FALSE;
+static BOOL benchRunning = FALSE;	// a phase is waiting for its end
+static uint16_t benchSeq = 0;		// of the echo in flight
+static uint32_t benchEchoSent = 0;
+static uint32_t benchDrops = 0;
+
+static SELFBENCH_PHASE benchPhases[SELFBENCH_PHASES] = {
+	{ "burst", SELFBENCH_BURST },
+	{ "rtt", SELFBENCH_RTT },
+	{ "subscribe", SELFBENCH_SUBSCRIBE },
+	{ "toggle", SELFBENCH_TOGGLE }
+};
+
+static void selfbench_next(void *arg);
+
+/* Account one call into the firmware that started at c0 */
+static void ICACHE_FLASH_ATTR selfbench_charge(SELFBENCH_PHASE *p, uint32_t c0)
+{
+	uint32_t cycles = ccount_read() - c0;
+
+	p->cycles += cycles;
+	if(cycles > p->cyclesMax)
+		p->cyclesMax = cycles;
+}
+
+/* QoS 1 to the echo topic, it comes back through SELFBENCH_Data */
+static void ICACHE_FLASH_ATTR selfbench_echo(SELFBENCH_PHASE *p)
+{
+	char payload[8];
+	uint32_t c0;
+	int len;
+
+	len = os_sprintf(payload, "%d", ++benchSeq);
+	benchEchoSent = system_get_time();
+	c0 = ccount_read();
+	MQTT_Publish(benchClient, benchEcho, payload, len, 1, 0);
+	selfbench_charge(p, c0);
+}
+
+static void ICACHE_FLASH_ATTR selfbench_end(SELFBENCH_PHASE *p, BOOL timedOut)
+{
+	os_timer_disarm(&benchTimer);
+	benchRunning = FALSE;
+	p->us = system_get_time() - p->start;
+	p->drops = benchClient->stats.queueDrops - benchDrops;
+	p->timedOut = timedOut;
+	INFO("BENCH: %s %d/%d in %d us, %d cycles%s\r\n", p->name, p->done, p->count, p->us, p->cycles,
+			timedOut ? ", timed out" : "");
+
+	benchPhase++;
+	os_timer_setfn(&benchTimer, selfbench_next, NULL);
+	os_timer_arm(&benchTimer, SELFBENCH_GAP_MS, 0);
+}
+
+static void ICACHE_FLASH_ATTR selfbench_timeout(void *arg)
+{
+	selfbench_end(&benchPhases[benchPhase], TRUE);
+}
+
+static void ICACHE_FLASH_ATTR selfbench_burst(SELFBENCH_PHASE *p)
+{
+	char topic[SELFBENCH_TOPIC_MAX];
+	char payload[SELFBENCH_PAYLOAD];
+	uint32_t c0;
+
+	os_sprintf(topic, "%s/burst", benchTopic);
+	os_memset(payload, 'x', sizeof(payload));
+	for(p->done = 0; p->done < p->count; p->done++){
+		c0 = ccount_read();
+		MQTT_Publish(benchClient, topic, payload, sizeof(payload), 0, 0);
+		selfbench_charge(p, c0);
+	}
+	// ends in SELFBENCH_Published once the queue is empty
+}
+
+static void ICACHE_FLASH_ATTR selfbench_subscribe(SELFBENCH_PHASE *p)
+{
+	char topic[SELFBENCH_TOPIC_MAX];
+	uint32_t c0;
+
+	for(p->done = 0; p->done < p->count; p->done++){
+		os_sprintf(topic, "%s/s/%d", benchTopic, p->done);
+		c0 = ccount_read();
+		MQTT_Subscribe(benchClient, topic, 0);
+		selfbench_charge(p, c0);
+	}
+	// the broker handles them in order, so the echo ends the phase
+	selfbench_echo(p);
+}
+
+static void ICACHE_FLASH_ATTR selfbench_toggle(SELFBENCH_PHASE *p)
+{
+	CHANNEL *channel = &channels[0];
+	uint32_t c0;
+
+	for(p->done = 0; p->done < p->count; p->done++){
+		c0 = ccount_read();
+		CHANNEL_Set(channel, channel->status == 0 ? 1 : 0);
+		selfbench_charge(p, c0);
+	}
+	selfbench_echo(p);
+}
+
+static void ICACHE_FLASH_ATTR selfbench_summary(void)
+{
+	static char payload[384];
+	char topic[SELFBENCH_TOPIC_MAX];
+	json_writer_t w;
+	SELFBENCH_PHASE *p;
+	BOOL ok = TRUE;
+	int i, len;
+
+	json_writer_init(&w, payload, sizeof(payload));
+	json_write_object_start(&w);
+	json_write_pair_int(&w, "mhz", CCOUNT_MHZ);
+	json_write_pair_int(&w, "heap", system_get_free_heap_size());
+	for(i = 0; i < SELFBENCH_PHASES; i++){
+		p = &benchPhases[i];
+		json_write_key(&w, p->name);
+		json_write_object_start(&w);
+		json_write_pair_int(&w, "n", p->done);
+		json_write_pair_int(&w, "us", p->us);
+		json_write_pair_int(&w, "cyc", p->cycles);
+		json_write_pair_int(&w, "max", p->cyclesMax);
+		json_write_pair_int(&w, "drop", p->drops);
+		if(i == SELFBENCH_RTT_PHASE && p->done > 0){
+			json_write_pair_int(&w, "min", p->rttMin);
+			json_write_pair_int(&w, "avg", p->rttSum / p->done);
+			json_write_pair_int(&w, "rmax", p->rttMax);
+		}
+		if(p->timedOut){
+			json_write_pair_int(&w, "to", 1);
+			ok = FALSE;
+		}
+		json_write_object_end(&w);
+	}
+	json_write_object_end(&w);
+	len = json_writer_finish(&w);
+
+	INFO("BENCH: %s\r\n", payload);
+	os_sprintf(topic, "%s/summary", benchTopic);
+	if(len > 0)
+		MQTT_Publish(benchClient, topic, payload, len, 0, 0);
+
+	POWER_Release(POWER_HOLD_BENCH);
+	if(benchDoneCb)
+		benchDoneCb(ok);
+}
+
+static void ICACHE_FLASH_ATTR selfbench_next(void *arg)
+{
+	SELFBENCH_PHASE *p;
+
+	if(benchPhase >= SELFBENCH_PHASES){
+		selfbench_summary();
+		return;
+	}
+
+	p = &benchPhases[benchPhase];
+	INFO("BENCH: %s, %d operations\r\n", p->name, p->count);
+	os_timer_disarm(&benchTimer);
+	os_timer_setfn(&benchTimer, selfbench_timeout, NULL);
+	os_timer_arm(&benchTimer, SELFBENCH_TIMEOUT_MS, 0);
+	benchRunning = TRUE;
+	benchDrops = benchClient->stats.queueDrops;
+	p->rttMin = 0xFFFFFFFF;
+	p->start = system_get_time();
+
+	switch(benchPhase){
+	case SELFBENCH_BURST_PHASE:
+		selfbench_burst(p);
+		break;
+	case SELFBENCH_RTT_PHASE:
+		selfbench_echo(p);
+		break;
+	case SELFBENCH_SUBSCRIBE_PHASE:
+		selfbench_subscribe(p);
+		break;
+	case SELFBENCH_TOGGLE_PHASE:
+		selfbench_toggle(p);
+		break;
+	}
+}
+
+void ICACHE_FLASH_ATTR SELFBENCH_Init(MQTT_Client *client)
+{
+	benchClient = client;
+	os_sprintf(benchTopic, SELFBENCH_TOPIC, system_get_chip_id());
+	os_sprintf(benchEcho, "%s/echo", benchTopic);
+}
+
+void ICACHE_FLASH_ATTR SELFBENCH_OnDone(SelfbenchDoneCallback cb)
+{
+	benchDoneCb = cb;
+}
+
+/**
+  * @brief  Subscribe to the echo topic and, on the first connect only,
+  *         start the scenario SELFBENCH_START_MS later
+  */
+void ICACHE_FLASH_ATTR SELFBENCH_Connected(void)
+{
+	MQTT_Subscribe(benchClient, benchEcho, 0);
+	if(benchStarted)
+		return;
+
+	benchStarted = TRUE;
+	benchPhase = 0;
+	POWER_Hold(POWER_HOLD_BENCH);
+	os_timer_disarm(&benchTimer);
+	os_timer_setfn(&benchTimer, selfbench_next, NULL);
+	os_timer_arm(&benchTimer, SELFBENCH_START_MS, 0);
+}
+
+/* A publish went out, the burst is done when nothing is left queued */
+void ICACHE_FLASH_ATTR SELFBENCH_Published(void)
+{
+	if(benchRunning && benchPhase == SELFBENCH_BURST_PHASE && QUEUE_IsEmpty(&benchClient->msgQueue))
+		selfbench_end(&benchPhases[benchPhase], FALSE);
+}
+
+/**
+  * @brief  Take the echoes of the scenario
+  * @param  topic, data: not NUL terminated
+  * @retval TRUE if the message was on the echo topic
+  */
+BOOL ICACHE_FLASH_ATTR SELFBENCH_Data(const char *topic, uint32_t topicLen, const char *data, uint32_t dataLen)
+{
+	SELFBENCH_PHASE *p;
+	uint32_t rtt;
+	uint16_t seq = 0;
+	uint32_t i;
+
+	if(benchClient == NULL || topicLen != os_strlen(benchEcho) || os_strncmp(topic, benchEcho, topicLen) != 0)
+		return FALSE;
+
+	for(i = 0; i < dataLen && data[i] >= '0' && data[i] <= '9'; i++)
+		seq = seq * 10 + data[i] - '0';
+	if(!benchRunning || seq != benchSeq)
+		return TRUE;
+
+	p = &benchPhases[benchPhase];
+	if(benchPhase != SELFBENCH_RTT_PHASE){
+		selfbench_end(p, FALSE);
+		return TRUE;
+	}
+
+	rtt = system_get_time() - benchEchoSent;
+	p->rttSum += rtt;
+	if(rtt < p->rttMin)
+		p->rttMin = rtt;
+	if(rtt > p->rttMax)
+		p->rttMax = rtt;
+	if(++p->done < p->count)
+		selfbench_echo(p);
+	else
+		selfbench_end(p, FALSE);
+	return TRUE;
+}
+
+#endif
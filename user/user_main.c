@@ -5,11 +5,10 @@
  *  through MQTT.
  *
  *  The ESP8266 will register itself with the MQTT server and will listen to topic
- *  /DeviceX/<chip-ID>. Inbound message are expected to be formatted as JSON messages
- *  and will be parsed for switching instruction. Please find a valid JSON instruction
- *  below:
+ *  /DeviceX/<chip-ID>. Inbound messages are Home Assistant JSON schema commands
+ *  or the bare strings on/off, e.g.:
  *
- *  {"switch":"off"}
+ *  {"state":"OFF","transition":2}
  *
  *  The relay is supposed to be connected to ESP Pin GPIO2
  *  To experiment with the firmware, a LED will of course also do.
@@ -30,85 +29,104 @@
 #include "mqtt.h"
 #include "wifi.h"
 #include "config.h"
+#define LOG_MODULE MAIN
 #include "debug.h"
 #include "gpio.h"
 #include "user_interface.h"
 #include "mem.h"
-#include "user_json.h"
+#include "channel.h"
+#include "discovery.h"
+#include "report.h"
+#include "power.h"
+#include "defer.h"
+#include "console.h"
+#include "bridge.h"
+#include "memtrack.h"
+#include "selfbench.h"
+#include "trace.h"
+
+/* Application commands of the serial console */
+#define CONSOLE_CMD_SWITCH	(CONSOLE_CMD_APP + 0)	// channel index, 0/1
+#define CONSOLE_CMD_STATE	(CONSOLE_CMD_APP + 1)	// -> one status byte per channel
+
+typedef enum {
+	BOOT_INIT,
+	BOOT_CONFIG,
+	BOOT_WIFI,
+	BOOT_GOT_IP,
+	BOOT_MQTT,
+	BOOT_PUBLISHED,
+	BOOT_PHASES
+} tBootPhase;
+
+static const char *bootPhaseName[BOOT_PHASES] = { "init", "config", "wifi", "got ip", "mqtt", "published" };
+static uint32_t bootTime[BOOT_PHASES];
 
-//TODO: Move all this to real configuration
-#define MQTT_TOPIC_UPDATE		"set"
-#define MQTT_SEPARATOR			"/"
-
-#define TOGGLE01_GPIO 5
-#define TOGGLE01_GPIO_MUX PERIPHS_IO_MUX_GPIO5_U
-#define TOGGLE01_GPIO_FUNC FUNC_GPIO5
-
-#define TOGGLE02_GPIO 4
-#define TOGGLE02_GPIO_MUX PERIPHS_IO_MUX_GPIO4_U
-#define TOGGLE02_GPIO_FUNC FUNC_GPIO4
+MQTT_Client mqttClient;
+#if MQTT_ARENA
+static uint8_t mqttArena[MQTT_ARENA_SIZE] __attribute__((aligned(4)));
+#endif
+#if TRACE
+static char traceTopic[20];
+static char traceGetTopic[24];
+#endif
+
+/* Record when a boot phase is first reached, in us since reset */
+void ICACHE_FLASH_ATTR
+boot_mark(tBootPhase phase)
+{
+	int i;
 
-#define TOGGLE03_GPIO 15
-#define TOGGLE03_GPIO_MUX PERIPHS_IO_MUX_MTDO_U
-#define TOGGLE03_GPIO_FUNC FUNC_GPIO15
+	if(bootTime[phase] != 0)
+		return;
+	bootTime[phase] = system_get_time();
 
-int switch01Status = 3;
-int switch02Status = 3;
-int switch03Status = 3;
+	if(phase == BOOT_MQTT || phase == BOOT_PUBLISHED){
+		INFO("BOOT: %s boot\r\n", WIFI_IsFastBoot() ? "Fast" : "Full");
+		for(i = 0; i <= phase; i++){
+			if(bootTime[i] != 0)
+				INFO("BOOT: %s at %d us\r\n", bootPhaseName[i], bootTime[i]);
+		}
+	}
+}
 
-MQTT_Client mqttClient;
+#if TRACE
+static char traceJson[TRACE_JSON_MAX];
 
-LOCAL int ICACHE_FLASH_ATTR
-json_get(struct jsontree_context *js_ctx)
+/* The summary is longer than the out buffer, it goes out as a stream */
+static uint16_t ICACHE_FLASH_ATTR
+trace_fill(void *arg, uint32_t offset, uint8_t *buf, uint16_t len)
 {
-    const char *path = jsontree_path_name(js_ctx, js_ctx->depth - 1);
-    if (os_strncmp(path, "switch", 6) == 0) {
-        jsontree_write_string(js_ctx, GPIO_REG_READ(BUTTON_GPIO) & BIT2 ? "on" : "off");
-    }
-    return 0;
+	os_memcpy(buf, traceJson + offset, len);
+	return len;
 }
 
-LOCAL int ICACHE_FLASH_ATTR
-json_set(struct jsontree_context *js_ctx, struct jsonparse_state *parser)
+/* A message on <trace topic>/get publishes the latency summary */
+BOOL ICACHE_FLASH_ATTR
+trace_request(const char *topic, uint32_t topic_len)
 {
-	int type;
-	INFO("Json set/n");
-	INFO(parser);
-	INFO("/n");
-    while ((type = jsonparse_next(parser)) != 0) {
-    	INFO (parser);
-    	INFO("/n");
-        if (type == JSON_TYPE_PAIR_NAME) {
-            char buffer[64];
-            os_bzero(buffer, 64);
-            if (jsonparse_strcmp_value(parser, "switch") == 0) {
-                jsonparse_next(parser);
-                jsonparse_next(parser);
-                jsonparse_copy_value(parser, buffer, sizeof(buffer));
-                if (!strcoll(buffer, "on")) {
-                	INFO("JSON: Switch on\n", buffer);
-        			GPIO_OUTPUT_SET(SWITCH03_GPIO, 1);
-                } else if (!strcoll(buffer, "off")) {
-                	INFO("JSON: Switch off\n", buffer);
-        			GPIO_OUTPUT_SET(SWITCH03_GPIO, 0);
-                }
-            }
-        }
-    }
-    return 0;
+	int len;
+
+	if(topic_len != os_strlen(traceGetTopic) || os_strncmp(topic, traceGetTopic, topic_len) != 0)
+		return FALSE;
+	// traceJson still feeds the stream in flight
+	if(mqttClient.stream.fill != NULL){
+		LOG_W("TRACE: Stream busy\r\n");
+		return TRUE;
+	}
+	len = TRACE_Json(traceJson, sizeof(traceJson));
+	if(len > 0)
+		MQTT_PublishStream(&mqttClient, traceTopic, len, 0, trace_fill, NULL, NULL);
+	return TRUE;
 }
-
-LOCAL struct jsontree_callback switch_callback =
-    JSONTREE_CALLBACK(json_get, json_set);
-JSONTREE_OBJECT(switch_tree,
-                JSONTREE_PAIR("switch", &switch_callback));
-JSONTREE_OBJECT(device_tree,
-				JSONTREE_PAIR("device", &switch_tree));
+#endif
 
 void ICACHE_FLASH_ATTR
 wifi_connect_cb(uint8_t status)
 {
 	if(status == STATION_GOT_IP){
+		boot_mark(BOOT_GOT_IP);
+		POWER_Hold(POWER_HOLD_CONNECT);
 		MQTT_Connect(&mqttClient);
 	} else {
 		MQTT_Disconnect(&mqttClient);
@@ -120,16 +138,29 @@ mqtt_connected_cb(uint32_t *args)
 {
 	MQTT_Client* client = (MQTT_Client*)args;
 	INFO("MQTT: Connected\r\n");
-	INFO("MQTT: Subscribe Topic: %s\n", config.mqtt_topic_s01);
-	MQTT_Subscribe(client, config.mqtt_topic_s01, 0);
-	MQTT_Subscribe(client, config.mqtt_topic_s02, 0);
-	MQTT_Subscribe(client, config.mqtt_topic_s03, 0);
+	boot_mark(BOOT_MQTT);
+	POWER_Release(POWER_HOLD_CONNECT);
+	int i;
+	for(i = 0; i < CHANNEL_COUNT; i++){
+		INFO("MQTT: Subscribe Topic: %s\n", channels[i].topic);
+		MQTT_Subscribe(client, (char *)channels[i].topic, 0);
+	}
+#if TRACE
+	MQTT_Subscribe(client, traceGetTopic, 0);
+#endif
+	REPORT_Connected();
+#if BRIDGE_ENABLE
+	BRIDGE_Connected();
+#endif
+	DISCOVERY_Start(client);
+#if SELFBENCH
+	SELFBENCH_Connected();
+#endif
 }
 
 void ICACHE_FLASH_ATTR
 mqtt_disconnected_cb(uint32_t *args)
 {
-	MQTT_Client* client = (MQTT_Client*)args;
 	INFO("MQTT: Disconnected\r\n");
 }
 
@@ -138,239 +169,67 @@ mqtt_published_cb(uint32_t *args)
 {
 	MQTT_Client* client = (MQTT_Client*)args;
 	INFO("MQTT: Published\r\n");
-}
-
-void ICACHE_FLASH_ATTR
-notify_switch_status(int gpio, int status) {
-
-	char *payload;
-	char *topic;
-
-	//Set topic
-	switch (gpio) {
-		case SWITCH01_GPIO:
-			topic = (char*)os_zalloc(strlen(config.mqtt_topic_s01)+strlen(MQTT_SEPARATOR)+strlen(MQTT_TOPIC_UPDATE)+1);
-			strcpy(topic, config.mqtt_topic_s01);
-			strcat(topic, MQTT_SEPARATOR);
-			strcat(topic, MQTT_TOPIC_UPDATE);
-			//strcpy(topic, '\0');
-			//topic = (char*)os_zalloc(strlen(config.mqtt_topic_s01));
-			//topic = config.mqtt_topic_s01;
-			break;
-		case SWITCH02_GPIO:
-			topic = (char*)os_zalloc(strlen(config.mqtt_topic_s02)+strlen(MQTT_SEPARATOR)+strlen(MQTT_TOPIC_UPDATE)+1);
-			strcpy(topic, config.mqtt_topic_s02);
-			strcat(topic, MQTT_SEPARATOR);
-			strcat(topic, MQTT_TOPIC_UPDATE);
-			//strcpy(topic, '\0');
-			//topic = (char*)os_zalloc(strlen(config.mqtt_topic_s02));
-			//topic = config.mqtt_topic_s02;
-			break;
-		case SWITCH03_GPIO:
-			topic = (char*)os_zalloc(strlen(config.mqtt_topic_s03)+strlen(MQTT_SEPARATOR)+strlen(MQTT_TOPIC_UPDATE)+1);
-			strcpy(topic, config.mqtt_topic_s03);
-			strcat(topic, MQTT_SEPARATOR);
-			strcat(topic, MQTT_TOPIC_UPDATE);
-			//strcpy(topic, '\0');
-			//topic = (char*)os_zalloc(strlen(config.mqtt_topic_s03));
-			//topic = config.mqtt_topic_s03;
-			break;
-		default:
-			INFO("Notification: No topic for switch %d\n", gpio);
-			return;
-	}
-
-	//Set payoad
-	switch (status) {
-		case 0:
-			payload = (char*)os_zalloc(strlen("off\0"));
-			payload = "off\0";
-			break;
-		case 1:
-			payload = (char*)os_zalloc(strlen("on\0"));
-			payload = "on\0";
-			break;
-		default:
-			INFO("Notification: Status %d not identified\n", status);
-			return;
-	}
-
-	INFO("NOTIFICATION: Sending switch status\nTopic: %s\nPayload: %s\n",topic ,payload);
-	MQTT_Publish(&mqttClient, topic, payload, strlen(payload), 0, 0);
-}
-
-void ICACHE_FLASH_ATTR
-set_switch(int gpio, int status) {
-	//TODO: Send Notification
-
-	INFO("SWITCH: Set switch request:\nSwitch:%d\nStatus: %d\n", SWITCH01_GPIO, status);
-
-	//Change status
-	switch (gpio)
-	{
-	case SWITCH01_GPIO:
-		if (status != switch01Status)
-		{
-			INFO("SWITCH: Set switch %d %d\n", SWITCH01_GPIO, status);
-			GPIO_OUTPUT_SET(SWITCH01_GPIO, status);
-			switch01Status = status;
-			notify_switch_status(SWITCH01_GPIO, status);
-		}
-		break;
-	case SWITCH02_GPIO:
-		if (status != switch02Status)
-		{
-			INFO("SWITCH: Set switch %d %d\n", SWITCH02_GPIO, status);
-			GPIO_OUTPUT_SET(SWITCH02_GPIO, status);
-			switch02Status = status;
-			notify_switch_status(SWITCH02_GPIO, status);
-		}
-		break;
-	case SWITCH03_GPIO:
-		if (status != switch03Status)
-		{
-			INFO("SWITCH: Set switch %d %d\n", SWITCH03_GPIO, status);
-			GPIO_OUTPUT_SET(SWITCH03_GPIO, status);
-			switch03Status = status;
-			notify_switch_status(SWITCH03_GPIO, status);
-		}
-		break;
-	}
+	boot_mark(BOOT_PUBLISHED);
+#if SELFBENCH
+	SELFBENCH_Published();
+#endif
+	// The queue is sent in order: once it is empty, the report of every
+	// change that made it into the queue has left as well
+	if(QUEUE_IsEmpty(&client->msgQueue) && !REPORT_Pending())
+		POWER_Release(POWER_HOLD_COMMAND | POWER_HOLD_INPUT);
 }
 
 void ICACHE_FLASH_ATTR
 mqtt_data_cb(uint32_t *args, const char* topic, uint32_t topic_len, const char *data, uint32_t data_len)
 {
-	char *topic_buf = (char*)os_zalloc(topic_len+1),
-		 *data_buf  = (char*)os_zalloc(data_len+1);
-
-	MQTT_Client* client = (MQTT_Client*)args;
-
-	os_memcpy(topic_buf, topic, topic_len);
-	topic_buf[topic_len] = 0;
-
-	os_memcpy(data_buf, data, data_len);
-	data_buf[data_len] = 0;
-
-	INFO("MQTT: Received data on topic: \n%s\r\n", topic_buf);
-
-	char strData[data_len + 1];
-		os_memcpy(strData, data, data_len);
-		strData[data_len] = '\0';
-
-	int statusCommand = -1;
-
-	INFO("MQTT: Data: %s\n", strData);
-
-	if (!strcoll(strData, "on")) {
-		statusCommand = 1;
-	}
-	else if (!strcoll(strData, "off")) {
-		statusCommand = 0;
-	}
-
-	if (statusCommand == -1)
+	// topic and data point into the receive buffer and are not NUL terminated
+	CHANNEL *channel = CHANNEL_ByTopic(topic, topic_len);
+
+	// Commands are actuated before anything else, the log comes after
+	if (channel != NULL){
+		TRACE_POINT(TRACE_DISPATCH);
+		// Stay awake until the new state has been reported
+		POWER_Hold(POWER_HOLD_COMMAND);
+		if (!CHANNEL_Command(channel, data, data_len))
+			POWER_Release(POWER_HOLD_COMMAND);
+		INFO("MQTT: Command for switch %d\r\n", channel->gpio);
 		return;
-
-	if (!strcoll(topic_buf, config.mqtt_topic_s01))
-	{
-		INFO("Switch %d %s\n", SWITCH01_GPIO, strData);
-		set_switch(SWITCH01_GPIO, statusCommand);
-		//GPIO_OUTPUT_SET(SWITCH01_GPIO, statusCommand);
-	}
-	else if (!strcoll(topic_buf, config.mqtt_topic_s02))
-	{
-		INFO("Switch %d %s\n", SWITCH02_GPIO, strData);
-		set_switch(SWITCH02_GPIO, statusCommand);
-		//GPIO_OUTPUT_SET(SWITCH02_GPIO, statusCommand);
-	}
-	else if (!strcoll(topic_buf, config.mqtt_topic_s03))
-	{
-		INFO("Switch %d %s\n", SWITCH03_GPIO, strData);
-		set_switch(SWITCH03_GPIO, statusCommand);
-		//GPIO_OUTPUT_SET(SWITCH03_GPIO, statusCommand);
 	}
 
-		//!strcoll(topic_buf, config.mqtt_topic_s02) ||
-		//!strcoll(topic_buf, config.mqtt_topic_s03)) {
-		//struct jsontree_context js;
-		//jsontree_setup(&js, (struct jsontree_value *)&device_tree, json_putchar);
-		//json_parse(&js, data_buf);
-
-	os_free(topic_buf);
-	os_free(data_buf);
+#if SELFBENCH
+	if (SELFBENCH_Data(topic, topic_len, data, data_len))
+		return;
+#endif
+#if TRACE
+	if (trace_request(topic, topic_len))
+		return;
+#endif
+#if BRIDGE_ENABLE
+	BRIDGE_Data(topic, topic_len, data, data_len);
+#endif
 }
 
 void ICACHE_FLASH_ATTR
 toggle_changed() {
 	//TODO: Refactor this shit
+	TRACE_POINT(TRACE_GPIO_ISR);
 	ETS_GPIO_INTR_DISABLE(); // Disable gpio interrupts
 
 	uint32 gpio_status;
+	CHANNEL *channel;
 	gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
 
-	//INFO("TOGGLE: Toggle Switch %d pressed\n", index);
+	// Stay awake until the new state has been published
+	POWER_HoldFromISR(POWER_HOLD_INPUT);
 
-	if (gpio_status & BIT(TOGGLE01_GPIO))
-	{
-		INFO("TOGGLE: Toggle Switch %d pressed\n", TOGGLE01_GPIO);
-		if (switch01Status == 0)
-		{
-			set_switch(SWITCH01_GPIO, 1);
-		}
-		else
-		{
-			set_switch(SWITCH01_GPIO, 0);
-		}
-	}
-	else if (gpio_status & BIT(TOGGLE02_GPIO))
-	{
-		INFO("TOGGLE: Toggle Switch %d pressed\n", TOGGLE02_GPIO);
-		if (switch02Status == 0)
-		{
-			set_switch(SWITCH02_GPIO, 1);
-		}
-		else
-		{
-			set_switch(SWITCH02_GPIO, 0);
-		}
-	}
-	else if (gpio_status & BIT(TOGGLE03_GPIO))
+	channel = CHANNEL_ByInput(gpio_status);
+	if (channel != NULL)
 	{
-		INFO("TOGGLE: Toggle Switch %d pressed\n", TOGGLE03_GPIO);
-		if (switch03Status == 0)
-		{
-			set_switch(SWITCH03_GPIO,1);
-		}
-		else
-		{
-			set_switch(SWITCH03_GPIO,0);
-		}
-	}
-
-	//Flip Status
-/*
-	// Button interrupt received
-	INFO("BUTTON: Button pressed\r\n");
-
-	// Button pressed, flip switch
-	if (GPIO_REG_READ(BUTTON_GPIO) & BIT2) {
-		INFO("BUTTON: Switch off\r\n");
-		GPIO_OUTPUT_SET(SWITCH03_GPIO, 0);
-	} else  {
-		INFO("BUTTON: Switch on\r\n");
-		GPIO_OUTPUT_SET(SWITCH03_GPIO, 1);
+		TRACE_POINT(TRACE_DEBOUNCE);
+		INFO("TOGGLE: Toggle Switch %d pressed\n", channel->input);
+		CHANNEL_Set(channel, channel->status == 0 ? 1 : 0);
 	}
 
-	// Send new status to the MQTT broker
-	char *json_buf = NULL;
-	json_buf = (char *)os_zalloc(jsonSize);
-	json_ws_send((struct jsontree_value *)&device_tree, "device", json_buf);
-	INFO("BUTTON: Sending current switch status\r\n");
-	MQTT_Publish(&mqttClient, config.mqtt_topic_s01, json_buf, strlen(json_buf), 0, 0);
-	os_free(json_buf);
-	json_buf = NULL;
-*/
 	// Debounce
 	os_delay_us(200000);
 
@@ -384,28 +243,15 @@ toggle_changed() {
 
 void ICACHE_FLASH_ATTR
 button_press() {
+	TRACE_POINT(TRACE_GPIO_ISR);
 	ETS_GPIO_INTR_DISABLE(); // Disable gpio interrupts
 
 	// Button interrupt received
 	INFO("BUTTON: Button pressed\r\n");
 
-	// Button pressed, flip switch
-	if (GPIO_REG_READ(BUTTON_GPIO) & BIT2) {
-		INFO("BUTTON: Switch off\r\n");
-		GPIO_OUTPUT_SET(SWITCH03_GPIO, 0);
-	} else  {
-		INFO("BUTTON: Switch on\r\n");
-		GPIO_OUTPUT_SET(SWITCH03_GPIO, 1);
-	}
-
-	// Send new status to the MQTT broker
-	char *json_buf = NULL;
-	json_buf = (char *)os_zalloc(jsonSize);
-	json_ws_send((struct jsontree_value *)&device_tree, "device", json_buf);
-	INFO("BUTTON: Sending current switch status\r\n");
-	MQTT_Publish(&mqttClient, config.mqtt_topic_s01, json_buf, strlen(json_buf), 0, 0);
-	os_free(json_buf);
-	json_buf = NULL;
+	// Button pressed, flip switch, the new status is sent to the MQTT broker
+	TRACE_POINT(TRACE_DEBOUNCE);
+	CHANNEL_Set(CHANNEL_ByGpio(SWITCH03_GPIO), (GPIO_REG_READ(BUTTON_GPIO) & BIT2) ? 0 : 1);
 
 	// Debounce
 	os_delay_us(200000);
@@ -420,20 +266,22 @@ button_press() {
 
 void ICACHE_FLASH_ATTR
 gpio_init() {
+	CHANNEL_OnChange(REPORT_Changed);
+
 	// Configure switch (relays)
 	INFO("Configure Switch 1 %d\n", SWITCH01_GPIO );
 	PIN_FUNC_SELECT(SWITCH01_GPIO_MUX, SWITCH01_GPIO_FUNC);
-	set_switch(SWITCH01_GPIO, 0);
+	CHANNEL_Set(CHANNEL_ByGpio(SWITCH01_GPIO), 0);
 	//GPIO_OUTPUT_SET(SWITCH01_GPIO, 0);
 
 	INFO("Configure Switch 2 %d\n", SWITCH02_GPIO );
 	PIN_FUNC_SELECT(SWITCH02_GPIO_MUX, SWITCH02_GPIO_FUNC);
-	set_switch(SWITCH02_GPIO, 0);
+	CHANNEL_Set(CHANNEL_ByGpio(SWITCH02_GPIO), 0);
 	//GPIO_OUTPUT_SET(SWITCH02_GPIO, 0);
 
 	INFO("Configure Switch 3 %d\n", SWITCH03_GPIO );
 	PIN_FUNC_SELECT(SWITCH03_GPIO_MUX, SWITCH03_GPIO_FUNC);
-	set_switch(SWITCH03_GPIO, 0);
+	CHANNEL_Set(CHANNEL_ByGpio(SWITCH03_GPIO), 0);
 	//GPIO_OUTPUT_SET(SWITCH03_GPIO, 0);
 
 	//Configure Toggle switches
@@ -462,6 +310,10 @@ gpio_init() {
 	gpio_pin_intr_state_set(GPIO_ID_PIN(TOGGLE03_GPIO), GPIO_PIN_INTR_ANYEDGE); // Interrupt on any edge
 	ETS_GPIO_INTR_ENABLE(); // Enable gpio interrupts
 
+	POWER_WakeOnGpio(TOGGLE01_GPIO);
+	POWER_WakeOnGpio(TOGGLE02_GPIO);
+	POWER_WakeOnGpio(TOGGLE03_GPIO);
+
 
 	// Configure push button
 //	INFO("Confgiure push button %d\n", BUTTON_GPIO );
@@ -475,32 +327,96 @@ gpio_init() {
 
 void ICACHE_FLASH_ATTR
 mqtt_init() {
+	char statsTopic[20];
+
+#if MQTT_ARENA
+	MQTT_InitConnectionArena(&mqttClient, config.mqtt_host, config.mqtt_port, config.security, mqttArena, sizeof(mqttArena));
+#else
 	MQTT_InitConnection(&mqttClient, config.mqtt_host, config.mqtt_port, config.security);
+#endif
 	MQTT_InitClient(&mqttClient, config.device_id, config.mqtt_user, config.mqtt_pass, config.mqtt_keepalive, 1);
-	MQTT_InitLWT(&mqttClient, "/lwt", "offline", 0, 0);
+	MQTT_InitLWT(&mqttClient, (uint8_t *)"/lwt", (uint8_t *)"offline", 0, 0);
 	MQTT_OnConnected(&mqttClient, mqtt_connected_cb);
 	MQTT_OnDisconnected(&mqttClient, mqtt_disconnected_cb);
 	MQTT_OnPublished(&mqttClient, mqtt_published_cb);
 	MQTT_OnData(&mqttClient, mqtt_data_cb);
+	REPORT_Init(&mqttClient);
+#if BRIDGE_ENABLE
+	BRIDGE_Init(&mqttClient);
+#endif
+#if SELFBENCH
+	SELFBENCH_Init(&mqttClient);
+#endif
+
+#if TRACE
+	os_sprintf(traceTopic, TRACE_TOPIC, system_get_chip_id());
+	os_sprintf(traceGetTopic, "%s/get", traceTopic);
+#endif
+
+	os_sprintf(statsTopic, "/%08X/diag", system_get_chip_id());
+	MQTT_InitStats(&mqttClient, (uint8_t *)statsTopic, MQTT_STATS_INTERVAL);
+#if MEMTRACK
+	MQTT_OnStats(&mqttClient, MEMTRACK_Json);
+#endif
+}
+
+uint8_t ICACHE_FLASH_ATTR
+console_cb(uint8_t cmd, const uint8_t *data, uint16_t len, uint8_t *reply, uint16_t *replyLen)
+{
+	int i;
+
+	switch(cmd){
+	case CONSOLE_CMD_SWITCH:
+		if(len != 2 || data[0] >= CHANNEL_COUNT || data[1] > 1)
+			return CONSOLE_ERR_ARG;
+		INFO("CONSOLE: Set switch %d %d\r\n", channels[data[0]].gpio, data[1]);
+		CHANNEL_Set(&channels[data[0]], data[1]);
+		*replyLen = 0;
+		return CONSOLE_OK;
+	case CONSOLE_CMD_STATE:
+		for(i = 0; i < CHANNEL_COUNT; i++)
+			reply[i] = channels[i].status;
+		*replyLen = CHANNEL_COUNT;
+		return CONSOLE_OK;
+	}
+#if BRIDGE_ENABLE
+	return BRIDGE_Command(cmd, data, len, reply, replyLen);
+#else
+	return CONSOLE_ERR_COMMAND;
+#endif
 }
 
 void ICACHE_FLASH_ATTR
 user_init(void)
 {
+	boot_mark(BOOT_INIT);
 	uart_init(BIT_RATE_115200, BIT_RATE_115200);
+#if LOG_DEFERRED
+	LOG_Init();
+#endif
 	INFO("\r\nSDK version: %s\n", system_get_sdk_version());
 	INFO("System init...\r\n");
 	system_set_os_print(1);
-	os_delay_us(1000000);
 
 	INFO("Load Config\n");
 	config_load();
+	boot_mark(BOOT_CONFIG);
+	DEFER_Init();
 	INFO("GPIO Init\n");
 	gpio_init();
+	CONSOLE_Init(console_cb);
 	INFO("MQTT Init");
 	mqtt_init();
+	POWER_Init(POWER_SLEEP_MODE);
 
 	INFO("Connect wifi %s\n", config.sta_ssid);
+	boot_mark(BOOT_WIFI);
+#ifdef STA_SSID2
+	WIFI_AddAP(STA_SSID2, STA_PASS2);
+#endif
+#ifdef STA_SSID3
+	WIFI_AddAP(STA_SSID3, STA_PASS3);
+#endif
 	WIFI_Connect(config.sta_ssid, config.sta_pwd, wifi_connect_cb);
 	//WIFI_Connect("Wirelessabata", "TaLi100305", wifi_connect_cb);
 